@@ -15,14 +15,24 @@
 	details and are subject to change. Users should use the accessor
 	functions in preference.
 */
-typedef struct
+typedef struct fz_buffer fz_buffer;
+
+/**
+	Function type to release storage that a buffer does not own,
+	for buffers made by fz_new_buffer_from_external_data.
+*/
+typedef void (fz_buffer_drop_data_fn)(fz_context *ctx, unsigned char *data, size_t size);
+
+struct fz_buffer
 {
 	int refs;
 	unsigned char *data;
 	size_t cap, len;
 	int unused_bits;
 	int shared;
-} fz_buffer;
+	fz_buffer *parent; /* The buffer whose storage a slice shares. */
+	fz_buffer_drop_data_fn *drop_data; /* Releases external storage. */
+};
 
 /**
 	Take an additional reference to the buffer. The same pointer
@@ -77,6 +87,34 @@ fz_buffer *fz_new_buffer_from_data(fz_context *ctx, unsigned char *data, size_t
 */
 fz_buffer *fz_new_buffer_from_shared_data(fz_context *ctx, const unsigned char *data, size_t size);
 
+/**
+	Like fz_new_buffer_from_shared_data, but the buffer takes
+	ownership of the data, and calls drop_data to release it when
+	the buffer is destroyed. This lets buffers wrap storage that
+	was not allocated by fz_malloc, such as a memory mapped file.
+	As with shared data, the buffer cannot be resized.
+*/
+fz_buffer *fz_new_buffer_from_external_data(fz_context *ctx, const unsigned char *data, size_t size, fz_buffer_drop_data_fn *drop_data);
+
+/**
+	Create a buffer for a range of the data in another buffer,
+	without copying it.
+
+	The slice keeps a reference to the buffer it shares storage
+	with, so it remains valid after the caller drops parent.
+	Slices are read only; the first operation that needs to change
+	the size of a slice (appending to it, for instance) quietly
+	gives it a private copy of its data first. The same goes for
+	parent itself once it has been sliced, so growing or refilling
+	it never invalidates its slices.
+
+	Buffers made by fz_new_buffer_from_shared_data do not control
+	the lifetime of their data, so for those the range is copied.
+
+	Throws if the range does not lie within the parent.
+*/
+fz_buffer *fz_new_buffer_slice(fz_context *ctx, fz_buffer *parent, size_t offset, size_t len);
+
 /**
 	Create a new buffer containing a copy of the passed data.
 */
@@ -52,6 +52,76 @@
 */
 /* #define FZ_ENABLE_JS 1 */
 
+/**
+	Choose whether to use atomic operations for reference counting.
+	By default, reference counts are protected by the FZ_LOCK_ALLOC
+	lock. Enabling this makes fz_keep_imp/fz_drop_imp (and their 8 and
+	16 bit variants) use lock-free atomic compare-and-swap operations
+	instead, which avoids contention on the allocation lock when many
+	threads share resources. Requires GCC/Clang style __atomic
+	builtins or MSVC interlocked intrinsics.
+*/
+/* #define FZ_ENABLE_ATOMIC_REFS 1 */
+
+/**
+	Choose the number of shards the resource store is split into.
+	Each shard has its own lock, LRU list and hash table, so that
+	lookups from different threads rarely contend with one another.
+	Clients must supply FZ_LOCK_MAX locks, which grows with this.
+*/
+/* #define FZ_STORE_SHARDS 8 */
+
+/**
+	Choose the number of shards the glyph cache is split into.
+	As with the store, each shard has its own lock and LRU list.
+	Clients must supply FZ_LOCK_MAX locks, which grows with this.
+*/
+/* #define FZ_GLYPH_CACHE_SHARDS 4 */
+
+/**
+	Choose whether each context renders glyphs with its own
+	FreeType library and faces. Each context then creates, as it
+	needs them, its own FT_Face for each font it draws, sharing the
+	font's data, so that glyph loading, rendering and outlining take
+	no global lock and scale across threads. This costs memory for
+	each face in each context; FZ_FT_CONTEXT_FACES sets how many
+	faces a context keeps before it drops the least recently used.
+*/
+/* #define FZ_ENABLE_FT_CONTEXT_FACES 1 */
+/* #define FZ_FT_CONTEXT_FACES 32 */
+
+/**
+	Choose whether each context keeps a cache of small memory blocks.
+	When enabled, fz_malloc/fz_free of blocks up to 2048 bytes are
+	served from per-context free lists without taking FZ_LOCK_ALLOC;
+	the lock is only taken to refill or trim the lists in batches.
+	Every block carries a small header as a result. The memory held
+	by these caches is reported by fz_debug_store, but is not counted
+	against the store's maximum size. FZ_ALLOC_CACHE_MAX sets the number of bytes a single context may
+	hold before it returns blocks to the allocator.
+*/
+/* #define FZ_ENABLE_ALLOC_CACHE 1 */
+/* #define FZ_ALLOC_CACHE_MAX (256<<10) */
+
+/**
+	Choose whether fz_open_file_mmap maps files into memory.
+	By default this is enabled on Linux only; elsewhere (or if
+	the mapping fails) it reads the file through stdio, just as
+	fz_open_file does. fz_open_document uses fz_open_file_mmap.
+	A mapped file that is truncated while open raises SIGBUS on
+	access, so applications that cannot rule that out should
+	build with FZ_ENABLE_MMAP set to 0.
+*/
+/* #define FZ_ENABLE_MMAP 0 */
+
+/**
+	Choose whether the draw device uses SSE4.1/AVX2 versions of its
+	inner loops when the CPU supports them. The choice is made at
+	runtime, and the results are identical to those of the plain C
+	versions. Only available on x86 with GCC or Clang.
+*/
+/* #define FZ_ENABLE_SIMD 1 */
+
 /**
 	Choose which fonts to include.
 	By default we include the base 14 PDF fonts,
@@ -164,6 +234,74 @@
 #define FZ_ENABLE_ICC 1
 #endif /* FZ_ENABLE_ICC */
 
+#ifndef FZ_ENABLE_ATOMIC_REFS
+#define FZ_ENABLE_ATOMIC_REFS 0
+#endif /* FZ_ENABLE_ATOMIC_REFS */
+
+#ifndef FZ_STORE_SHARDS
+#define FZ_STORE_SHARDS 8
+#endif /* FZ_STORE_SHARDS */
+
+#ifndef FZ_GLYPH_CACHE_SHARDS
+#define FZ_GLYPH_CACHE_SHARDS 4
+#endif /* FZ_GLYPH_CACHE_SHARDS */
+
+#ifndef FZ_ENABLE_FT_CONTEXT_FACES
+#define FZ_ENABLE_FT_CONTEXT_FACES 0
+#endif /* FZ_ENABLE_FT_CONTEXT_FACES */
+
+#ifndef FZ_FT_CONTEXT_FACES
+#define FZ_FT_CONTEXT_FACES 32
+#endif /* FZ_FT_CONTEXT_FACES */
+
+#ifndef FZ_ENABLE_ALLOC_CACHE
+#define FZ_ENABLE_ALLOC_CACHE 0
+#endif /* FZ_ENABLE_ALLOC_CACHE */
+
+/* Memento must see every block, so never cache them. */
+#ifdef MEMENTO
+#undef FZ_ENABLE_ALLOC_CACHE
+#define FZ_ENABLE_ALLOC_CACHE 0
+#endif
+
+#ifndef FZ_ALLOC_CACHE_MAX
+#define FZ_ALLOC_CACHE_MAX (256<<10)
+#endif /* FZ_ALLOC_CACHE_MAX */
+
+#ifndef FZ_ENABLE_MMAP
+#ifdef __linux__
+#define FZ_ENABLE_MMAP 1
+#else
+#define FZ_ENABLE_MMAP 0
+#endif
+#endif /* FZ_ENABLE_MMAP */
+
+/* Mapping files is only implemented for POSIX systems. */
+#ifdef _WIN32
+#undef FZ_ENABLE_MMAP
+#define FZ_ENABLE_MMAP 0
+#endif
+
+#ifndef FZ_ENABLE_SIMD
+#define FZ_ENABLE_SIMD 1
+#endif /* FZ_ENABLE_SIMD */
+
+/* The SIMD code relies on GCC style target attributes. */
+#if !(defined(__x86_64__) || defined(__i386__)) || !defined(__GNUC__)
+#undef FZ_ENABLE_SIMD
+#define FZ_ENABLE_SIMD 0
+#endif
+
+#if FZ_STORE_SHARDS < 1
+#error "FZ_STORE_SHARDS must be at least 1"
+#endif
+
+#if FZ_ENABLE_ATOMIC_REFS
+#if !defined(__GNUC__) && !defined(__clang__) && !defined(_MSC_VER)
+#error "FZ_ENABLE_ATOMIC_REFS requires atomic builtins"
+#endif
+#endif /* FZ_ENABLE_ATOMIC_REFS */
+
 /* If Epub and HTML are both disabled, disable SIL fonts */
 #if FZ_ENABLE_HTML == 0 && FZ_ENABLE_EPUB == 0
 #undef TOFU_SIL
@@ -2,6 +2,7 @@
 #define MUPDF_FITZ_CONTEXT_H
 
 #include "mupdf/fitz/version.h"
+#include "mupdf/fitz/config.h"
 #include "mupdf/fitz/system.h"
 #include "mupdf/fitz/geometry.h"
 
@@ -11,6 +12,8 @@ typedef struct fz_style_context fz_style_context;
 typedef struct fz_tuning_context fz_tuning_context;
 typedef struct fz_store fz_store;
 typedef struct fz_glyph_cache fz_glyph_cache;
+typedef struct fz_ft_context fz_ft_context;
+typedef struct fz_spill_context fz_spill_context;
 typedef struct fz_document_handler_context fz_document_handler_context;
 typedef struct fz_output fz_output;
 typedef struct fz_context fz_context;
@@ -87,6 +90,11 @@ void fz_flush_warnings(fz_context *ctx);
 	when we already hold any lock i, where 0 <= i <= n. In order
 	to verify this, we have some debugging code, that can be
 	enabled by defining FITZ_DEBUG_LOCKING.
+
+	The resource store uses FZ_STORE_SHARDS locks, from
+	FZ_LOCK_STORE upwards; one for each shard of the store.
+	Likewise the glyph cache uses FZ_GLYPH_CACHE_SHARDS locks,
+	from FZ_LOCK_GLYPHCACHE upwards.
 */
 
 typedef struct
@@ -98,9 +106,10 @@ typedef struct
 
 enum {
 	FZ_LOCK_ALLOC = 0,
-	FZ_LOCK_FREETYPE,
+	FZ_LOCK_STORE,
+	FZ_LOCK_FREETYPE = FZ_LOCK_STORE + FZ_STORE_SHARDS,
 	FZ_LOCK_GLYPHCACHE,
-	FZ_LOCK_MAX
+	FZ_LOCK_MAX = FZ_LOCK_GLYPHCACHE + FZ_GLYPH_CACHE_SHARDS
 };
 
 #if defined(MEMENTO) || !defined(NDEBUG)
@@ -309,6 +318,38 @@ void fz_tune_image_decode(fz_context *ctx, fz_tune_image_decode_fn *image_decode
 */
 void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, void *arg);
 
+/**
+	Run a number of independent jobs, possibly in parallel.
+
+	arg: The caller supplied opaque argument.
+
+	ctx: The calling context. Jobs run on other threads must be
+	given contexts cloned from this one.
+
+	count: The number of jobs.
+
+	job: The function to call once for each job, with the context
+	to use, job_arg, and the index of the job (0 to count-1). Jobs
+	do not throw.
+
+	Must not return until all the jobs have finished.
+*/
+typedef void (fz_tune_parallel_fn)(void *arg, fz_context *ctx, int count, void (*job)(fz_context *ctx, void *job_arg, int index), void *job_arg);
+
+/**
+	Set the function to use to split large image scales into
+	bands of rows that are worked on in parallel. The results are
+	the same as when scaling on a single thread.
+
+	parallel: Function to use, or NULL to always scale on the
+	calling thread (the default).
+
+	arg: Opaque argument to be passed to the function.
+
+	threads: The most bands to split a scale into.
+*/
+void fz_tune_image_scale_threads(fz_context *ctx, fz_tune_parallel_fn *parallel, void *arg, int threads);
+
 /**
 	Get the number of bits of antialiasing we are
 	using (for graphics). Between 0 and 8.
@@ -487,6 +528,16 @@ void *fz_realloc(fz_context *ctx, void *p, size_t size);
 */
 void fz_free(fz_context *ctx, void *p);
 
+/**
+	Return any small blocks cached by this context to the
+	allocator. Only useful when built with FZ_ENABLE_ALLOC_CACHE;
+	threads that are about to go idle for a while may call this
+	to release their memory early.
+
+	Never throws exceptions.
+*/
+void fz_flush_alloc_cache(fz_context *ctx);
+
 /**
 	fz_malloc equivalent that returns NULL rather than throwing
 	exceptions.
@@ -560,6 +611,20 @@ typedef struct
 	float min_line_width;
 } fz_aa_context;
 
+#if FZ_ENABLE_ALLOC_CACHE
+enum { FZ_ALLOC_CACHE_CLASSES = 28 };
+
+/* Per-context free lists of small blocks, one per size class. */
+typedef struct
+{
+	void *list[FZ_ALLOC_CACHE_CLASSES];
+	int count[FZ_ALLOC_CACHE_CLASSES];
+	size_t bytes;
+	size_t reported;
+	int enabled;
+} fz_alloc_cache;
+#endif
+
 struct fz_context
 {
 	void *user;
@@ -571,6 +636,12 @@ struct fz_context
 	/* unshared contexts */
 	fz_aa_context aa;
 	uint16_t seed48[7];
+#if FZ_ENABLE_ALLOC_CACHE
+	fz_alloc_cache alloc_cache;
+#endif
+#if FZ_ENABLE_FT_CONTEXT_FACES
+	fz_ft_context *ft;
+#endif
 #if FZ_ENABLE_ICC
 	int icc_enabled;
 #endif
@@ -586,6 +657,7 @@ struct fz_context
 	fz_colorspace_context *colorspace;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_spill_context *spill;
 };
 
 fz_context *fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks, size_t max_store, const char *version);
@@ -610,8 +682,179 @@ fz_unlock(fz_context *ctx, int lock)
 	ctx->locks.unlock(ctx->locks.user, lock);
 }
 
+/*
+	Atomic primitives, for the compilers that have them, in which case
+	FZ_HAVE_ATOMICS is defined.
+
+	FZ_ATOMIC_LOAD_ACQUIRE_PTR and FZ_ATOMIC_STORE_RELEASE_PTR read and
+	publish a pointer without a lock: whatever was written before the
+	pointer was stored is seen by anyone who loads it.
+
+	FZ_ATOMIC_LOAD_REFS and FZ_ATOMIC_CAS_REFS_<type> are what the
+	atomic reference counts below are made of.
+*/
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define FZ_HAVE_ATOMICS 1
+#define FZ_ATOMIC_LOAD_ACQUIRE_PTR(P) _InterlockedCompareExchangePointer((void * volatile *)(P), NULL, NULL)
+#define FZ_ATOMIC_STORE_RELEASE_PTR(P, V) ((void)_InterlockedExchangePointer((void * volatile *)(P), (V)))
+#define FZ_ATOMIC_LOAD_REFS(T, P) (*(volatile T *)(P))
+#define FZ_ATOMIC_CAS_REFS_int(P, O, N) (_InterlockedCompareExchange((volatile long *)(P), (long)(N), (long)(O)) == (long)(O))
+#define FZ_ATOMIC_CAS_REFS_int16_t(P, O, N) (_InterlockedCompareExchange16((volatile short *)(P), (short)(N), (short)(O)) == (short)(O))
+#define FZ_ATOMIC_CAS_REFS_int8_t(P, O, N) (_InterlockedCompareExchange8((volatile char *)(P), (char)(N), (char)(O)) == (char)(O))
+#elif defined(__GNUC__) || defined(__clang__)
+#define FZ_HAVE_ATOMICS 1
+#define FZ_ATOMIC_LOAD_ACQUIRE_PTR(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define FZ_ATOMIC_STORE_RELEASE_PTR(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#define FZ_ATOMIC_LOAD_REFS(T, P) __atomic_load_n((P), __ATOMIC_RELAXED)
+#define FZ_ATOMIC_CAS_REFS_int(P, O, N) __atomic_compare_exchange_n((P), &(O), (N), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#define FZ_ATOMIC_CAS_REFS_int16_t FZ_ATOMIC_CAS_REFS_int
+#define FZ_ATOMIC_CAS_REFS_int8_t FZ_ATOMIC_CAS_REFS_int
+#endif
+
 /* Lock-safe reference counting functions */
 
+#if FZ_ENABLE_ATOMIC_REFS
+
+/*
+	Atomic reference count primitives. Each function returns the
+	value of the count before the operation. Counts that are 0 or
+	negative (statically allocated objects) are never changed.
+*/
+
+#define FZ_ATOMIC_REFS_IMP(T) \
+static inline T fz_atomic_keep_refs_##T(T *refs) \
+{ \
+	T old = FZ_ATOMIC_LOAD_REFS(T, refs); \
+	while (old > 0 && !FZ_ATOMIC_CAS_REFS_##T(refs, old, (T)(old + 1))) \
+		old = FZ_ATOMIC_LOAD_REFS(T, refs); \
+	return old; \
+} \
+static inline T fz_atomic_drop_refs_##T(T *refs) \
+{ \
+	T old = FZ_ATOMIC_LOAD_REFS(T, refs); \
+	while (old > 0 && !FZ_ATOMIC_CAS_REFS_##T(refs, old, (T)(old - 1))) \
+		old = FZ_ATOMIC_LOAD_REFS(T, refs); \
+	return old; \
+}
+
+FZ_ATOMIC_REFS_IMP(int)
+FZ_ATOMIC_REFS_IMP(int16_t)
+FZ_ATOMIC_REFS_IMP(int8_t)
+
+#undef FZ_ATOMIC_REFS_IMP
+
+static inline void *
+fz_keep_imp(fz_context *ctx, void *p, int *refs)
+{
+	if (p)
+	{
+		(void)Memento_checkIntPointerOrNull(refs);
+		if (fz_atomic_keep_refs_int(refs) > 0)
+			(void)Memento_takeRef(p);
+	}
+	return p;
+}
+
+static inline void *
+fz_keep_imp8(fz_context *ctx, void *p, int8_t *refs)
+{
+	if (p)
+	{
+		(void)Memento_checkBytePointerOrNull(refs);
+		if (fz_atomic_keep_refs_int8_t(refs) > 0)
+			(void)Memento_takeRef(p);
+	}
+	return p;
+}
+
+static inline void *
+fz_keep_imp16(fz_context *ctx, void *p, int16_t *refs)
+{
+	if (p)
+	{
+		(void)Memento_checkShortPointerOrNull(refs);
+		if (fz_atomic_keep_refs_int16_t(refs) > 0)
+			(void)Memento_takeRef(p);
+	}
+	return p;
+}
+
+static inline int
+fz_drop_imp(fz_context *ctx, void *p, int *refs)
+{
+	if (p)
+	{
+		int old;
+		(void)Memento_checkIntPointerOrNull(refs);
+		old = fz_atomic_drop_refs_int(refs);
+		if (old > 0)
+			(void)Memento_dropIntRef(p);
+		return old == 1;
+	}
+	return 0;
+}
+
+static inline int
+fz_drop_imp8(fz_context *ctx, void *p, int8_t *refs)
+{
+	if (p)
+	{
+		int8_t old;
+		(void)Memento_checkBytePointerOrNull(refs);
+		old = fz_atomic_drop_refs_int8_t(refs);
+		if (old > 0)
+			(void)Memento_dropByteRef(p);
+		return old == 1;
+	}
+	return 0;
+}
+
+static inline int
+fz_drop_imp16(fz_context *ctx, void *p, int16_t *refs)
+{
+	if (p)
+	{
+		int16_t old;
+		(void)Memento_checkShortPointerOrNull(refs);
+		old = fz_atomic_drop_refs_int16_t(refs);
+		if (old > 0)
+			(void)Memento_dropShortRef(p);
+		return old == 1;
+	}
+	return 0;
+}
+
+/*
+	Variants for use by code that already holds FZ_LOCK_ALLOC for
+	other reasons (such as the store). These must still be atomic,
+	as other threads may be adjusting the same count without the
+	lock. Both return the number of references remaining, or -1 for
+	statically allocated objects.
+*/
+static inline int
+fz_keep_imp_locked(fz_context *ctx, void *p, int *refs)
+{
+	int old = fz_atomic_keep_refs_int(refs);
+	if (old <= 0)
+		return -1;
+	(void)Memento_takeRef(p);
+	return old + 1;
+}
+
+static inline int
+fz_drop_imp_locked(fz_context *ctx, void *p, int *refs)
+{
+	int old = fz_atomic_drop_refs_int(refs);
+	if (old <= 0)
+		return -1;
+	(void)Memento_dropRef(p);
+	return old - 1;
+}
+
+#else /* FZ_ENABLE_ATOMIC_REFS */
+
 static inline void *
 fz_keep_imp(fz_context *ctx, void *p, int *refs)
 {
@@ -726,4 +969,31 @@ fz_drop_imp16(fz_context *ctx, void *p, int16_t *refs)
 	return 0;
 }
 
+/*
+	Variants for use by code that already holds FZ_LOCK_ALLOC for
+	other reasons (such as the store). Both return the number of
+	references remaining, or -1 for statically allocated objects.
+*/
+static inline int
+fz_keep_imp_locked(fz_context *ctx, void *p, int *refs)
+{
+	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	if (*refs <= 0)
+		return -1;
+	(void)Memento_takeRef(p);
+	return ++*refs;
+}
+
+static inline int
+fz_drop_imp_locked(fz_context *ctx, void *p, int *refs)
+{
+	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	if (*refs <= 0)
+		return -1;
+	(void)Memento_dropRef(p);
+	return --*refs;
+}
+
+#endif /* FZ_ENABLE_ATOMIC_REFS */
+
 #endif
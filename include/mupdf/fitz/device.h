@@ -427,6 +427,21 @@ fz_device *fz_new_draw_device_with_bbox_proof(fz_context *ctx, fz_matrix transfo
 
 fz_device *fz_new_draw_device_type3(fz_context *ctx, fz_matrix transform, fz_pixmap *dest);
 
+/**
+	Create a device to draw a quick, rough preview on a pixmap.
+
+	As fz_new_draw_device, but trading quality for speed: there is
+	no anti-aliasing, images are decoded at an eighth of the
+	resolution they would otherwise be (so that JPEG and other
+	decoders can subsample as they go) and drawn without smooth
+	scaling, and glyphs are greeked.
+
+	greek: Text whose em square is smaller than this many pixels is
+	drawn as boxes of about the right weight instead of glyphs. 0
+	draws all text normally.
+*/
+fz_device *fz_new_draw_device_preview(fz_context *ctx, fz_matrix transform, fz_pixmap *dest, float greek);
+
 /**
 	struct fz_draw_options: Options for creating a pixmap and draw
 	device.
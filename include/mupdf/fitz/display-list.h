@@ -49,6 +49,18 @@ fz_display_list *fz_new_display_list(fz_context *ctx, fz_rect mediabox);
 */
 fz_device *fz_new_list_device(fz_context *ctx, fz_display_list *list);
 
+/**
+	Build a spatial index for a display list, so that
+	fz_run_display_list with a small scissor can skip over the parts
+	of the list that fall outside it. This is worth doing for lists
+	that will be run many times in bands or tiles.
+
+	Lists too short to benefit are left unindexed. Adding more to the
+	list afterwards discards the index. As this changes the list, do
+	it before sharing the list between threads.
+*/
+void fz_index_display_list(fz_context *ctx, fz_display_list *list);
+
 /**
 	(Re)-run a display list through a device.
 
@@ -117,4 +129,81 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 */
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+/**
+	Return an estimate of the memory used by a display list, for
+	use when accounting for it in the store. Paths, images, shades
+	and other objects shared with the list are not included.
+*/
+size_t fz_display_list_size(fz_context *ctx, const fz_display_list *list);
+
+/**
+	Remove the parts of a display list that are hidden beneath later
+	opaque content, such as page backgrounds covered by a full page
+	scanned image.
+
+	Content is only removed if it lies entirely within a single
+	later rectangle fill or axis-aligned image that paints straight
+	onto the page (outside any clip, mask or tile, and only within
+	plain groups), with full alpha, overprint off, a process
+	colorspace, and (for images) no mask, color key or alpha
+	channel. Clips, masks, groups and tiles are kept or removed as
+	a whole.
+
+	Rendering the optimized list gives the same result, except for
+	the anti-aliased pixels along the edges of the covering fills,
+	where hidden content can no longer show through. Text that is
+	hidden is removed too, so use the original list for text
+	extraction; invisible text is always kept.
+
+	The list is changed in place, so it must not be run by another
+	thread at the same time.
+
+	Returns the number of nodes removed.
+*/
+int fz_optimize_display_list(fz_context *ctx, fz_display_list *list);
+
+/**
+	Write a display list to an output stream, in a versioned binary
+	format that can be read back with fz_read_display_list. This
+	allows interpreted pages to be cached on disk or handed to
+	another process.
+
+	Paths, text, images, shades, clips, masks, groups, tiles and
+	layers are all recorded. Fonts, images, shades and colorspaces
+	are embedded in the output the first time they are used, and
+	are referenced after that; font files are stored once per
+	digest. Images are stored in their compressed form where
+	possible, otherwise (for example for JBIG2 images with global
+	data) as decoded pixmaps.
+
+	Separation and DeviceN colorspaces cannot be written, as their
+	tint transforms are code that cannot be recorded without
+	changing the colors they produce. Lists that use them (for
+	drawing, in images, shades or groups) must be kept live, or the
+	page interpreted again.
+
+	Throws exceptions on failure to write, or if the list contains
+	something that cannot be represented. The output is then
+	incomplete and should be discarded.
+*/
+void fz_write_display_list(fz_context *ctx, fz_output *out, fz_display_list *list);
+
+/**
+	Read a display list written by fz_write_display_list.
+
+	Returns a new display list, or throws if the data is truncated,
+	corrupt or written in an unsupported version of the format.
+*/
+fz_display_list *fz_read_display_list(fz_context *ctx, fz_stream *stm);
+
+/**
+	Write a display list to a file, as fz_write_display_list.
+*/
+void fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename);
+
+/**
+	Read a display list from a file, as fz_read_display_list.
+*/
+fz_display_list *fz_load_display_list(fz_context *ctx, const char *filename);
+
 #endif
@@ -688,8 +688,8 @@ struct fz_font
 	short width_default; /* in 1000 units */
 	short *width_table; /* in 1000 units */
 
-	/* cached glyph metrics */
-	float *advance_cache;
+	/* cached glyph advances, per wmode, in lazily filled pages */
+	float **advance_cache[2];
 
 	/* cached encoding lookup */
 	uint16_t *encoding_cache[256];
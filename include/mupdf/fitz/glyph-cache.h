@@ -11,6 +11,21 @@
 */
 void fz_purge_glyph_cache(fz_context *ctx);
 
+/**
+	Set the limits of the glyph cache, which is shared by all the
+	contexts cloned from this one.
+
+	max_size: The most bytes of rendered glyphs to keep. When this
+	is exceeded, the least recently used glyphs are dropped. 0
+	means the default (4MB).
+
+	max_glyph_size: Glyphs whose em square is larger than this many
+	pixels are not cached, and FreeType glyphs larger than this are
+	drawn as outlines instead of bitmaps. 0 means the default
+	(256).
+*/
+void fz_set_glyph_cache_limits(fz_context *ctx, size_t max_size, int max_glyph_size);
+
 /**
 	Create a pixmap containing a rendered glyph.
 
@@ -47,7 +62,9 @@ void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, i
 void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid);
 
 /**
-	Dump debug statistics for the glyph cache.
+	Dump statistics for the glyph cache: its size and limits, and
+	the number of hits, misses and evictions so far, in total and
+	for each shard.
 */
 void fz_dump_glyph_cache_stats(fz_context *ctx, fz_output *out);
 
@@ -36,7 +36,8 @@ typedef void (fz_hash_table_drop_fn)(fz_context *ctx, void *val);
 	keylen: byte length for each key.
 
 	lock: -1 for no lock, otherwise the FZ_LOCK to use to protect
-	this table.
+	this table. The lock is momentarily dropped whenever the table
+	needs to allocate memory.
 
 	drop_val: Function to use to destroy values on table drop.
 */
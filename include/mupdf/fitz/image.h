@@ -49,6 +49,41 @@ fz_pixmap *fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_i
 */
 fz_pixmap *fz_get_unscaled_pixmap_from_image(fz_context *ctx, fz_image *image);
 
+/**
+	Enable (or disable) spilling of decoded image tiles to disk.
+
+	When enabled, decoded tiles that are evicted from the store to
+	make room for others are written to files in the given directory,
+	and read back from there (rather than being decoded again) the
+	next time they are needed. The files are identified by a digest
+	of the compressed image data and decoding parameters.
+
+	Evicted tiles are not written straight away, but are kept until
+	fz_flush_image_spill is called, and are taken back from there if
+	they are wanted again first. At most 16MB of tiles (and no more
+	than the store's own limit) are kept; beyond that, the oldest are
+	written as more are evicted.
+
+	dir: The directory to write files to, or NULL to disable
+	spilling. The directory must already exist.
+
+	max: The maximum number of bytes to keep on disk. Once this is
+	exceeded, the least recently used files are deleted.
+
+	Any files spilled previously (or waiting to be) are deleted
+	whenever this is called, and when the context (and all its
+	clones) are dropped. Spilling is disabled by default.
+*/
+void fz_set_image_spill(fz_context *ctx, const char *dir, size_t max);
+
+/**
+	Write out the image tiles that have been evicted from the store
+	since the last call, if spilling is enabled. Call this at any
+	convenient time (such as between pages) when waiting for the
+	disk is least likely to hold anything up.
+*/
+void fz_flush_image_spill(fz_context *ctx);
+
 /**
 	Increment the (normal) reference count for an image. Returns the
 	same pointer.
@@ -341,6 +341,15 @@ void fz_transform_path(fz_context *ctx, fz_path *path, fz_matrix transform);
 */
 fz_rect fz_bound_path(fz_context *ctx, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm);
 
+/**
+	Find the area filled by a path, if it is a single rectangle
+	with edges along the axes once transformed by ctm.
+
+	Returns the rectangle, or an empty rectangle if the path is
+	anything else.
+*/
+fz_rect fz_path_fill_rect(fz_context *ctx, const fz_path *path, fz_matrix ctm);
+
 /**
 	Given a rectangle (assumed to be the bounding box for a path),
 	expand it to allow for the expansion of the bbox that would be
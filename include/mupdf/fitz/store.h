@@ -195,6 +195,12 @@ typedef struct
 			fz_irect r;
 		} pir; /* 24 or 28 bytes */
 		struct
+		{
+			const void *ptr;
+			int i;
+			unsigned char digest[16];
+		} pid; /* 24 or 28 bytes */
+		struct
 		{
 			int id;
 			char has_shape;
@@ -222,6 +228,20 @@ typedef struct
 	Every type of object to be placed into the store defines an
 	fz_store_type. This contains the pointers to functions to
 	make hashes, manipulate keys, and check for needing reaping.
+
+	cost is optional. If supplied, it is given the key, value and
+	item size, and returns an estimate of the work needed to
+	regenerate the value should it be evicted, measured in the same
+	units as the item size (so a value that is as cheap to recreate
+	as it is to copy costs its size). If
+	NULL, the cost of every item is taken to be its size. Only
+	the FZ_STORE_COST eviction policy uses this.
+
+	evicted is optional. If supplied, it is called (with no locks
+	held) for each item that is evicted from the store to make room
+	for new ones, just before the store drops its reference to the
+	value, so that the value can be saved elsewhere. It must not
+	throw.
 */
 typedef struct
 {
@@ -232,6 +252,8 @@ typedef struct
 	int (*cmp_key)(fz_context *ctx, void *a, void *b);
 	void (*format_key)(fz_context *ctx, char *buf, size_t size, void *key);
 	int (*needs_reap)(fz_context *ctx, void *key);
+	size_t (*cost)(fz_context *ctx, void *key, void *val, size_t size);
+	void (*evicted)(fz_context *ctx, void *key, void *val);
 } fz_store_type;
 
 /**
@@ -314,12 +336,51 @@ void fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz
 */
 void fz_empty_store(fz_context *ctx);
 
+/**
+	Eviction policies for the store.
+
+	FZ_STORE_LRU: Evict the least recently used items first.
+	This is the default.
+
+	FZ_STORE_ARC: Adaptive replacement. Items that have been used
+	more than once are kept apart from those that have only been
+	used once, and the balance between the two is tuned according
+	to which kind of recently evicted item is asked for again. This
+	stops a single pass over many large items (such as images on
+	a long document) from flushing everything else.
+
+	FZ_STORE_COST: Evict the items with the lowest regeneration cost
+	per byte first (as reported by the cost function of their
+	fz_store_type), aged so that items that are not used again
+	eventually go too (the GreedyDual-Size algorithm).
+*/
+enum
+{
+	FZ_STORE_LRU,
+	FZ_STORE_ARC,
+	FZ_STORE_COST
+};
+
+/**
+	Set the eviction policy used when the store needs to make space.
+	May be changed at any time.
+*/
+void fz_set_store_policy(fz_context *ctx, int policy);
+
+/**
+	Get the eviction policy in use by the store.
+*/
+int fz_store_policy(fz_context *ctx);
+
 /**
 	Internal function used as part of the scavenging
 	allocator; when we fail to allocate memory, before returning a
 	failure to the caller, we try to scavenge space within the store
 	by evicting at least 'size' bytes. The allocator then retries.
 
+	Must be called without FZ_LOCK_ALLOC (or any of the store
+	locks) held.
+
 	size: The number of bytes we are trying to have free.
 
 	phase: What phase of the scavenge we are in. Updated on exit.
@@ -330,7 +391,8 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase);
 
 /**
 	External function for callers to use
-	to scavenge while trying allocations.
+	to scavenge while trying allocations. Equivalent to
+	fz_store_scavenge.
 
 	size: The number of bytes we are trying to have free.
 
@@ -374,6 +436,78 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const f
 */
 void fz_debug_store(fz_context *ctx, fz_output *out);
 
+/**
+	Store statistics for a single type of item (or for several types,
+	if they share a name).
+
+	lookups, hits, misses: Calls to fz_find_item, and their outcome.
+
+	inserts: Items added by fz_store_item.
+
+	evictions, evicted_bytes: Items (and their total size) evicted to
+	make space in the store.
+
+	reaped: Items removed because their keys could no longer be
+	used.
+
+	items, size: The number (and total size) of the items of this
+	type in the store at the time of the snapshot.
+*/
+typedef struct
+{
+	const char *name;
+	int64_t lookups;
+	int64_t hits;
+	int64_t misses;
+	int64_t inserts;
+	int64_t evictions;
+	int64_t evicted_bytes;
+	int64_t reaped;
+	int64_t items;
+	int64_t size;
+} fz_store_type_stats;
+
+enum { FZ_STORE_STATS_TYPES = 16 };
+
+/**
+	A snapshot of the store statistics.
+
+	max, size: The maximum and current size of the store.
+
+	reaps: The number of passes made over the store to reap items.
+
+	num_types: The number of entries used in types. If there are more
+	types of item than fit, the remainder are counted together in the
+	last entry, under the name "(other)".
+*/
+typedef struct
+{
+	size_t max;
+	size_t size;
+	int64_t reaps;
+	int num_types;
+	fz_store_type_stats types[FZ_STORE_STATS_TYPES];
+} fz_store_stats;
+
+/**
+	Take a snapshot of the store statistics. This is cheap enough to
+	call regularly; the counters are gathered as the store is used,
+	under the locks that the store takes anyway.
+*/
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+
+/**
+	Reset the counters in the store statistics to zero. The
+	number and size of the items in the store are unaffected.
+*/
+void fz_reset_store_stats(fz_context *ctx);
+
+/**
+	Output a summary of the store statistics to the given output
+	channel.
+*/
+void fz_print_store_stats(fz_context *ctx, fz_output *out);
+
 /**
 	Increment the defer reap count.
 
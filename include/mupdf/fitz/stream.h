@@ -33,6 +33,20 @@ typedef struct fz_stream fz_stream;
 */
 fz_stream *fz_open_file(fz_context *ctx, const char *filename);
 
+/**
+	Open the named file and map it into memory as a stream.
+
+	The whole file is available at once, so seeking is free and
+	fz_available returns everything from the current position to
+	the end of the file without copying. If the file cannot be
+	mapped (or FZ_ENABLE_MMAP is disabled, as it is by default
+	everywhere but Linux), this falls back to fz_open_file.
+
+	The file must not be truncated while the stream is open; reading
+	a mapped page past the new end of the file raises SIGBUS.
+*/
+fz_stream *fz_open_file_mmap(fz_context *ctx, const char *filename);
+
 #ifdef _WIN32
 /**
 	Open the named file and wrap it in a stream.
@@ -69,6 +83,17 @@ fz_stream *fz_open_memory(fz_context *ctx, const unsigned char *data, size_t len
 */
 fz_stream *fz_open_buffer(fz_context *ctx, fz_buffer *buf);
 
+/**
+	Retrieve the buffer underlying a stream.
+
+	Returns the buffer that a stream opened by fz_open_buffer,
+	fz_open_memory or fz_open_file_mmap reads from, or NULL for any
+	other kind of stream. The stream keeps its reference to the
+	buffer; use fz_keep_buffer or fz_new_buffer_slice to hold on to
+	the data for longer than the stream.
+*/
+fz_buffer *fz_stream_buffer(fz_context *ctx, fz_stream *stm);
+
 /**
 	Attach a filter to a stream that will store any
 	characters read from the stream into the supplied buffer.
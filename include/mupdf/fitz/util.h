@@ -33,6 +33,72 @@ fz_pixmap *fz_new_pixmap_from_display_list(fz_context *ctx, fz_display_list *lis
 fz_pixmap *fz_new_pixmap_from_page(fz_context *ctx, fz_page *page, fz_matrix ctm, fz_colorspace *cs, int alpha);
 fz_pixmap *fz_new_pixmap_from_page_number(fz_context *ctx, fz_document *doc, int number, fz_matrix ctm, fz_colorspace *cs, int alpha);
 
+/**
+	Render a display list into an existing pixmap, splitting the
+	work into jobs that may be run in parallel.
+
+	As with a draw device, the pixmap is not cleared first, and
+	anything outside of it is clipped away.
+
+	The pixmap is drawn as a series of horizontal strips. The result
+	does not depend on the number of jobs, but (as with banded
+	rendering) antialiased edges that cross from one strip to the
+	next may come out very slightly differently from drawing the
+	whole pixmap in one go.
+
+	jobs: The number of jobs to split the work into. Each job draws
+	its own set of the strips.
+
+	parallel, arg: The function to run the jobs with (for instance
+	mu_run_parallel from the mu-threads helper, which gives each
+	job a thread of its own), and its opaque argument. If NULL, the
+	jobs are run one after another on the calling thread.
+
+	Throws once all the jobs have finished if any of them failed,
+	in which case parts of the pixmap may not have been drawn.
+*/
+void fz_render_display_list_parallel(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, int jobs, fz_tune_parallel_fn *parallel, void *arg);
+
+/**
+	Callback for fz_render_display_list_progressive, with the area
+	of the pixmap that has just been drawn. preview is 1 for the
+	quick preview of the whole pixmap, and 0 for each band of the
+	full quality rendering that replaces it.
+*/
+typedef void (fz_progressive_fn)(fz_context *ctx, void *arg, fz_irect area, int preview);
+
+/**
+	Render a display list into an existing pixmap in two passes: a
+	quick preview of the whole pixmap first (as drawn by
+	fz_new_draw_device_preview), and then at full quality, a band
+	at a time, each band replacing the preview as it is finished.
+
+	As with a draw device, the pixmap is not cleared first. What it
+	holds to begin with is the background for both passes. As with
+	fz_render_display_list_parallel, antialiased edges that cross
+	from one band to the next may come out very slightly
+	differently from drawing the whole pixmap in one go.
+
+	The bands are drawn over the original background. If every
+	pixel of the background is the same, as it is for a pixmap
+	that has just been cleared, each band is filled with that
+	pixel, and only a band's worth of memory is needed besides the
+	pixmap. Any other background is saved in a copy of the whole
+	pixmap for the duration, which doubles the memory used.
+
+	greek: Text whose em square is smaller than this many pixels is
+	drawn as boxes in the preview. 0 turns greeking off.
+
+	cookie: Passed to each run of the display list, for the preview
+	and for each band, so progress starts over for each of them.
+	Setting abort stops the rendering, leaving the pixmap with the
+	preview and whichever bands have been finished. May be NULL.
+
+	fn, arg: Called after the preview and after each band, so that
+	the caller can show the pixmap as it improves. May be NULL.
+*/
+void fz_render_display_list_progressive(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, float greek, fz_cookie *cookie, fz_progressive_fn *fn, void *arg);
+
 /**
 	Render the page contents without annotations.
 
@@ -96,6 +96,21 @@ fz_document_writer *fz_new_document_writer(fz_context *ctx, const char *path, co
 fz_document_writer *
 fz_new_document_writer_with_output(fz_context *ctx, fz_output *out, const char *format, const char *options);
 
+/**
+	Find the format that fz_new_document_writer would write for the
+	given path and format, either of which may be NULL. Throws if
+	there is none. Without a format, the extensions of the path are
+	tried from the last one back, so "out.stext.json" is written as
+	stext.json, but "out.ocr.pdf" as pdf.
+
+	with_output: If not NULL, set to whether
+	fz_new_document_writer_with_output can write the format (some
+	write a file per page instead).
+
+	Returns the name of the format, as taken by both functions.
+*/
+const char *fz_resolve_document_writer_format(fz_context *ctx, const char *path, const char *format, int *with_output);
+
 /**
 	Document writers for various possible output formats.
 */
@@ -168,6 +168,79 @@ void mu_lock_mutex(mu_mutex *mutex);
 */
 void mu_unlock_mutex(mu_mutex *mutex);
 
+/*
+	Locking contexts
+
+	These need "mupdf/fitz.h" to have been included first.
+*/
+
+/*
+	Create a locking context with a mutex for each of the
+	FZ_LOCK_MAX locks, to pass to fz_new_context.
+
+	Returns NULL if the mutexes cannot be created (or this
+	library was built without threads).
+*/
+fz_locks_context *mu_new_locks(void);
+
+/*
+	Destroy a locking context made by mu_new_locks, once the
+	contexts using it have been dropped. NULL is ignored.
+*/
+void mu_drop_locks(fz_locks_context *locks);
+
+/*
+	Write-behind output
+
+	These need "mupdf/fitz.h" to have been included first.
+*/
+
+/*
+	Wrap an output so that the data written to it is passed on
+	to the underlying output by a background thread, letting the
+	caller get on with producing more.
+
+	Data is gathered into a bounded ring of nbufs buffers of
+	bufsize bytes each (0 for either picks a default). When the
+	ring is full, writes block until the background thread has
+	emptied a buffer.
+
+	Seeking, telling, truncating and reading back are passed on
+	to the underlying output (if it supports them) once all
+	queued data has been written.
+
+	An error from the underlying output is thrown from the next
+	write to the wrapper, or from fz_close_output, which waits for
+	all queued data to be written. Always close the output to be
+	sure that everything reached its destination.
+
+	The background thread uses a clone of ctx, so ctx must have
+	locking functions. If it does not, or the thread cannot be
+	started, the underlying output is returned unwrapped.
+
+	Takes ownership of out (even in the event of an error).
+*/
+fz_output *mu_new_async_output(fz_context *ctx, fz_output *out, int nbufs, size_t bufsize);
+
+/*
+	Run count jobs in parallel, the first on the calling thread and
+	each of the others on a thread of its own, with a clone of ctx.
+	Returns once they have all finished. Jobs that cannot be given
+	a thread (for instance when ctx has no locking functions) are
+	run on the calling thread instead.
+
+	This has the signature of fz_tune_parallel_fn, so it can be
+	passed to fz_tune_image_scale_threads. arg is unused.
+*/
+void mu_run_parallel(void *arg, fz_context *ctx, int count, void (*job)(fz_context *ctx, void *job_arg, int index), void *job_arg);
+
+/*
+	Render a display list into a pixmap using up to the given
+	number of threads (including the calling one). See
+	fz_render_display_list_parallel.
+*/
+void mu_render_display_list(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, int threads);
+
 /*
 	Everything under this point is implementation specific.
 	Only people looking to extend the capabilities of this
@@ -67,6 +67,82 @@ fz_new_buffer_from_shared_data(fz_context *ctx, const unsigned char *data, size_
 	return b;
 }
 
+fz_buffer *
+fz_new_buffer_from_external_data(fz_context *ctx, const unsigned char *data, size_t size, fz_buffer_drop_data_fn *drop_data)
+{
+	fz_buffer *b = NULL;
+
+	fz_try(ctx)
+		b = fz_new_buffer_from_shared_data(ctx, data, size);
+	fz_catch(ctx)
+	{
+		drop_data(ctx, (unsigned char *)data, size);
+		fz_rethrow(ctx);
+	}
+	b->drop_data = drop_data;
+
+	return b;
+}
+
+fz_buffer *
+fz_new_buffer_slice(fz_context *ctx, fz_buffer *parent, size_t offset, size_t len)
+{
+	fz_buffer *b;
+
+	if (offset > parent->len || len > parent->len - offset)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "buffer slice out of range");
+
+	/* Nobody is keeping borrowed data alive for us. */
+	if (parent->shared && !parent->parent && !parent->drop_data)
+		return fz_new_buffer_from_copied_data(ctx, parent->data + offset, len);
+
+	/* The first time a buffer that owns its storage is sliced, hand
+	 * the storage over to a new buffer that nobody else can change,
+	 * and make the parent a slice of it. Resizing or appending to the
+	 * parent then gives it a private copy, rather than moving the
+	 * storage out from under the slices. */
+	if (!parent->shared && !parent->parent && !parent->drop_data)
+	{
+		fz_buffer *owner = fz_malloc_struct(ctx, fz_buffer);
+		owner->refs = 1;
+		owner->data = parent->data;
+		owner->cap = parent->cap;
+		owner->len = parent->len;
+		parent->parent = owner;
+		parent->shared = 1;
+		parent->cap = parent->len;
+	}
+
+	b = fz_new_buffer_from_shared_data(ctx, parent->data + offset, len);
+
+	/* Always refer to the buffer that owns the storage, so that slices
+	 * of slices don't build up chains. */
+	if (parent->parent)
+		parent = parent->parent;
+	b->parent = fz_keep_buffer(ctx, parent);
+
+	return b;
+}
+
+/*
+	Give a slice a private copy of its data, of the given capacity, so
+	that it can be changed.
+*/
+static void
+fz_unshare_buffer(fz_context *ctx, fz_buffer *buf, size_t size)
+{
+	unsigned char *data = Memento_label(fz_malloc(ctx, size), "fz_buffer_data");
+
+	memcpy(data, buf->data, fz_minz(buf->len, size));
+	fz_drop_buffer(ctx, buf->parent);
+	buf->parent = NULL;
+	buf->shared = 0;
+	buf->data = data;
+	buf->cap = size;
+	if (buf->len > buf->cap)
+		buf->len = buf->cap;
+}
+
 fz_buffer *
 fz_new_buffer_from_copied_data(fz_context *ctx, const unsigned char *data, size_t size)
 {
@@ -118,7 +194,11 @@ fz_drop_buffer(fz_context *ctx, fz_buffer *buf)
 {
 	if (fz_drop_imp(ctx, buf, &buf->refs))
 	{
-		if (!buf->shared)
+		if (buf->parent)
+			fz_drop_buffer(ctx, buf->parent);
+		else if (buf->drop_data)
+			buf->drop_data(ctx, buf->data, buf->cap);
+		else if (!buf->shared)
 			fz_free(ctx, buf->data);
 		fz_free(ctx, buf);
 	}
@@ -127,6 +207,11 @@ fz_drop_buffer(fz_context *ctx, fz_buffer *buf)
 void
 fz_resize_buffer(fz_context *ctx, fz_buffer *buf, size_t size)
 {
+	if (buf->parent)
+	{
+		fz_unshare_buffer(ctx, buf, size);
+		return;
+	}
 	if (buf->shared)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot resize a buffer with shared storage");
 	buf->data = fz_realloc(ctx, buf->data, size);
@@ -167,6 +252,15 @@ fz_trim_buffer(fz_context *ctx, fz_buffer *buf)
 void
 fz_clear_buffer(fz_context *ctx, fz_buffer *buf)
 {
+	/* Refilling a slice must not write into the storage it shares. */
+	if (buf->parent)
+	{
+		fz_drop_buffer(ctx, buf->parent);
+		buf->parent = NULL;
+		buf->shared = 0;
+		buf->data = NULL;
+		buf->cap = 0;
+	}
 	buf->len = 0;
 }
 
@@ -199,7 +293,13 @@ fz_string_from_buffer(fz_context *ctx, fz_buffer *buf)
 size_t
 fz_buffer_extract(fz_context *ctx, fz_buffer *buf, unsigned char **datap)
 {
-	size_t len = buf ? buf->len : 0;
+	size_t len;
+
+	/* The caller will fz_free the data, so it must be ours. */
+	if (buf && buf->parent)
+		fz_unshare_buffer(ctx, buf, buf->len);
+
+	len = buf ? buf->len : 0;
 	*datap = (buf ? buf->data : NULL);
 
 	if (buf)
@@ -214,10 +314,7 @@ void
 fz_append_buffer(fz_context *ctx, fz_buffer *buf, fz_buffer *extra)
 {
 	if (buf->cap - buf->len < extra->len)
-	{
-		buf->data = fz_realloc(ctx, buf->data, buf->len + extra->len);
-		buf->cap = buf->len + extra->len;
-	}
+		fz_resize_buffer(ctx, buf, buf->len + extra->len);
 
 	memcpy(buf->data + buf->len, extra->data, extra->len);
 	buf->len += extra->len;
@@ -17,11 +17,20 @@ void fz_lcong48(fz_context *ctx, uint16_t param[7]);
 uint16_t *fz_seed48(fz_context *ctx, uint16_t seed16v[3]);
 void fz_srand48(fz_context *ctx, int32_t seedval);
 
+#if FZ_ENABLE_ALLOC_CACHE
+void fz_init_alloc_cache(fz_context *ctx);
+void fz_drop_alloc_cache(fz_context *ctx);
+void fz_store_account_alloc_cache_locked(fz_context *ctx, size_t old_size, size_t new_size);
+#endif
+
 void fz_new_colorspace_context(fz_context *ctx);
 fz_colorspace_context *fz_keep_colorspace_context(fz_context *ctx);
 void fz_drop_colorspace_context(fz_context *ctx);
 
 void fz_new_font_context(fz_context *ctx);
+#if FZ_ENABLE_FT_CONTEXT_FACES
+void fz_drop_ft_context(fz_context *ctx);
+#endif
 
 fz_font_context *fz_keep_font_context(fz_context *ctx);
 void fz_drop_font_context(fz_context *ctx);
@@ -33,6 +42,9 @@ struct fz_tuning_context
 	void *image_decode_arg;
 	fz_tune_image_scale_fn *image_scale;
 	void *image_scale_arg;
+	fz_tune_parallel_fn *image_scale_parallel;
+	void *image_scale_parallel_arg;
+	int image_scale_threads;
 };
 
 void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *subarea);
@@ -44,6 +56,48 @@ void fz_new_glyph_cache_context(fz_context *ctx);
 fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 
+void fz_new_spill_context(fz_context *ctx);
+fz_spill_context *fz_keep_spill_context(fz_context *ctx);
+void fz_drop_spill_context(fz_context *ctx);
+
+/*
+	The spill is a second level cache, on disk, for decoded data that
+	is expensive to regenerate. Items are identified by a 16 byte
+	digest of their contents.
+
+	fz_new_spill_output returns an output to write a new item to, or
+	NULL if spilling is disabled or the item is already spilled (or
+	being spilled). The item is committed by fz_close_output; dropping
+	the output without closing it discards the item.
+
+	fz_open_spilled returns a stream to read an item back from, or NULL
+	if it is not (or no longer) in the spill. If the contents turn out
+	to be unusable, fz_forget_spilled discards the item.
+
+	fz_defer_spill queues an item to be written later, by
+	fz_flush_image_spill (or once the queue is full), so that whoever
+	evicts it does not have to wait for the disk. fn is called (with
+	no locks held) either to write the item with fz_new_spill_output,
+	or, if spilling is turned off first, just to free arg. It must not
+	throw. size is the memory held by the queued item.
+
+	fz_take_deferred_spill takes an item that is still queued off the
+	queue, and returns its arg (which the caller must then free), or
+	NULL if there is no such item.
+*/
+typedef void (fz_spill_fn)(fz_context *ctx, void *arg, int write);
+
+int fz_spill_enabled(fz_context *ctx);
+fz_output *fz_new_spill_output(fz_context *ctx, const unsigned char digest[16]);
+fz_stream *fz_open_spilled(fz_context *ctx, const unsigned char digest[16]);
+void fz_forget_spilled(fz_context *ctx, const unsigned char digest[16]);
+void fz_defer_spill(fz_context *ctx, const unsigned char digest[16], size_t size, fz_spill_fn *fn, void *arg);
+void *fz_take_deferred_spill(fz_context *ctx, const unsigned char digest[16]);
+
+/* The store's size limit, or FZ_STORE_UNLIMITED. Entered with the
+ * alloc lock held. */
+size_t fz_store_max_locked(fz_context *ctx);
+
 void fz_new_document_handler_context(fz_context *ctx);
 void fz_drop_document_handler_context(fz_context *ctx);
 fz_document_handler_context *fz_keep_document_handler_context(fz_context *ctx);
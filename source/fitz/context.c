@@ -104,6 +104,13 @@ void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, v
 	ctx->tuning->image_scale_arg = arg;
 }
 
+void fz_tune_image_scale_threads(fz_context *ctx, fz_tune_parallel_fn *parallel, void *arg, int threads)
+{
+	ctx->tuning->image_scale_parallel = parallel;
+	ctx->tuning->image_scale_parallel_arg = arg;
+	ctx->tuning->image_scale_threads = parallel ? threads : 0;
+}
+
 static void fz_init_random_context(fz_context *ctx)
 {
 	if (!ctx)
@@ -128,11 +135,18 @@ fz_drop_context(fz_context *ctx)
 
 	/* Other finalisation calls go here (in reverse order) */
 	fz_drop_document_handler_context(ctx);
+	fz_drop_spill_context(ctx);
 	fz_drop_glyph_cache_context(ctx);
+#if FZ_ENABLE_ALLOC_CACHE
+	fz_drop_alloc_cache(ctx);
+#endif
 	fz_drop_store_context(ctx);
 	fz_drop_style_context(ctx);
 	fz_drop_tuning_context(ctx);
 	fz_drop_colorspace_context(ctx);
+#if FZ_ENABLE_FT_CONTEXT_FACES
+	fz_drop_ft_context(ctx);
+#endif
 	fz_drop_font_context(ctx);
 
 	fz_flush_warnings(ctx);
@@ -189,12 +203,16 @@ fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks,
 	fz_init_error_context(ctx);
 	fz_init_aa_context(ctx);
 	fz_init_random_context(ctx);
+#if FZ_ENABLE_ALLOC_CACHE
+	fz_init_alloc_cache(ctx);
+#endif
 
 	/* Now initialise sections that are shared */
 	fz_try(ctx)
 	{
 		fz_new_store_context(ctx, max_store);
 		fz_new_glyph_cache_context(ctx);
+		fz_new_spill_context(ctx);
 		fz_new_colorspace_context(ctx);
 		fz_new_font_context(ctx);
 		fz_new_document_handler_context(ctx);
@@ -230,6 +248,15 @@ fz_clone_context(fz_context *ctx)
 	/* Reset error context to initial state. */
 	fz_init_error_context(new_ctx);
 
+#if FZ_ENABLE_ALLOC_CACHE
+	/* Each context caches its own small blocks. */
+	fz_init_alloc_cache(new_ctx);
+#endif
+#if FZ_ENABLE_FT_CONTEXT_FACES
+	/* Each context makes its own FreeType faces as it needs them. */
+	new_ctx->ft = NULL;
+#endif
+
 	/* Then keep lock checking happy by keeping shared contexts with new context */
 	fz_keep_document_handler_context(new_ctx);
 	fz_keep_style_context(new_ctx);
@@ -238,6 +265,7 @@ fz_clone_context(fz_context *ctx)
 	fz_keep_colorspace_context(new_ctx);
 	fz_keep_store_context(new_ctx);
 	fz_keep_glyph_cache(new_ctx);
+	fz_keep_spill_context(new_ctx);
 
 	return new_ctx;
 }
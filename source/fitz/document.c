@@ -195,14 +195,14 @@ fz_open_accelerated_document(fz_context *ctx, const char *filename, const char *
 	if (!accel && handler->open)
 		return handler->open(ctx, filename);
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_file_mmap(ctx, filename);
 
 	fz_try(ctx)
 	{
 		if (accel || handler->open_with_stream == NULL)
 		{
 			if (accel)
-				afile = fz_open_file(ctx, accel);
+				afile = fz_open_file_mmap(ctx, accel);
 			doc = handler->open_accel_with_stream(ctx, file, afile);
 		}
 		else
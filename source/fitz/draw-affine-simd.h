@@ -0,0 +1,429 @@
+/*
+	SIMD versions of the affine image painters. This file is included
+	by draw-affine.c once for each instruction set we support, with:
+
+	SIMD_FN(x): The name to give to this version of x.
+	SIMD_TARGET: The attribute to compile these functions with.
+	SIMD_AVX2: 1 to do the arithmetic in 256 bit registers, and to
+	use gathers to fetch 4 byte source pixels.
+
+	These handle the cases where both source and destination pixels
+	fit in 4 bytes: 1 to 4 colorants with or without alpha (so not
+	CMYK with alpha), and gray to rgb. They work on 4 destination
+	pixels at a time. Each pixel is held as a 32 bit word, with its
+	colorants in the low bytes, and its alpha (if there is room for
+	it) in the byte after them; 'canonical' layout below.
+
+	All the arithmetic is done as the plain C templates do it, so the
+	results match them bit for bit.
+*/
+
+#ifndef SIMD_INLINE
+/* Everything here must be inlined for the pixel sizes to be constants. */
+#define SIMD_INLINE inline __attribute__((always_inline))
+#endif
+
+#if SIMD_AVX2
+typedef __m256i SIMD_FN(simd_v16);
+#else
+typedef struct { __m128i lo, hi; } SIMD_FN(simd_v16);
+#endif
+
+/* Widen 16 bytes to 16 bit values. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(widen)(__m128i x)
+{
+	SIMD_FN(simd_v16) r;
+#if SIMD_AVX2
+	r = _mm256_cvtepu8_epi16(x);
+#else
+	r.lo = _mm_cvtepu8_epi16(x);
+	r.hi = _mm_unpackhi_epi8(x, _mm_setzero_si128());
+#endif
+	return r;
+}
+
+/* Narrow 16 bit values to 16 bytes, keeping the low byte of each (as
+ * storing an int to a byte does). */
+static SIMD_INLINE SIMD_TARGET __m128i
+SIMD_FN(narrow)(SIMD_FN(simd_v16) x)
+{
+#if SIMD_AVX2
+	x = _mm256_and_si256(x, _mm256_set1_epi16(0xff));
+	return _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+#else
+	__m128i lo = _mm_and_si128(x.lo, _mm_set1_epi16(0xff));
+	__m128i hi = _mm_and_si128(x.hi, _mm_set1_epi16(0xff));
+	return _mm_packus_epi16(lo, hi);
+#endif
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(splat)(int x)
+{
+	SIMD_FN(simd_v16) r;
+#if SIMD_AVX2
+	r = _mm256_set1_epi16(x);
+#else
+	r.lo = r.hi = _mm_set1_epi16(x);
+#endif
+	return r;
+}
+
+/*
+	Spread a value per pixel (held in the low 16 bits of each 32 bit
+	lane of x) across the 4 values for that pixel.
+*/
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(per_pixel)(__m128i x)
+{
+	SIMD_FN(simd_v16) r;
+	__m128i lo = _mm_shuffle_epi8(x, _mm_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5));
+	__m128i hi = _mm_shuffle_epi8(x, _mm_setr_epi8(8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13));
+#if SIMD_AVX2
+	r = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+#else
+	r.lo = lo;
+	r.hi = hi;
+#endif
+	return r;
+}
+
+/* Copy the value at position slot of each pixel to all 4 of its values. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(broadcast_slot)(SIMD_FN(simd_v16) x, int slot)
+{
+	__m128i pat = _mm_add_epi8(_mm_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 8, 9, 8, 9, 8, 9, 8, 9), _mm_set1_epi8(slot * 2));
+#if SIMD_AVX2
+	return _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(pat));
+#else
+	x.lo = _mm_shuffle_epi8(x.lo, pat);
+	x.hi = _mm_shuffle_epi8(x.hi, pat);
+	return x;
+#endif
+}
+
+/* lerp(a, b, t): a + (((b - a) * t) >> PREC), for 0 <= t < ONE. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(lerp)(SIMD_FN(simd_v16) a, SIMD_FN(simd_v16) b, SIMD_FN(simd_v16) t)
+{
+	/* The high half of ((b-a)<<2) * t is exactly ((b-a) * t) >> 14. */
+#if SIMD_AVX2
+	return _mm256_add_epi16(a, _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(b, a), 16 - PREC), t));
+#else
+	a.lo = _mm_add_epi16(a.lo, _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(b.lo, a.lo), 16 - PREC), t.lo));
+	a.hi = _mm_add_epi16(a.hi, _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(b.hi, a.hi), 16 - PREC), t.hi));
+	return a;
+#endif
+}
+
+/* fz_mul255(a, b). */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(mul255)(SIMD_FN(simd_v16) a, SIMD_FN(simd_v16) b)
+{
+#if SIMD_AVX2
+	__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(a, b), _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+#else
+	__m128i lo = _mm_add_epi16(_mm_mullo_epi16(a.lo, b.lo), _mm_set1_epi16(128));
+	__m128i hi = _mm_add_epi16(_mm_mullo_epi16(a.hi, b.hi), _mm_set1_epi16(128));
+	a.lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	a.hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+	return a;
+#endif
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(add)(SIMD_FN(simd_v16) a, SIMD_FN(simd_v16) b)
+{
+#if SIMD_AVX2
+	return _mm256_add_epi16(a, b);
+#else
+	a.lo = _mm_add_epi16(a.lo, b.lo);
+	a.hi = _mm_add_epi16(a.hi, b.hi);
+	return a;
+#endif
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_v16)
+SIMD_FN(sub)(SIMD_FN(simd_v16) a, SIMD_FN(simd_v16) b)
+{
+#if SIMD_AVX2
+	return _mm256_sub_epi16(a, b);
+#else
+	a.lo = _mm_sub_epi16(a.lo, b.lo);
+	a.hi = _mm_sub_epi16(a.hi, b.hi);
+	return a;
+#endif
+}
+
+static SIMD_INLINE SIMD_TARGET int
+SIMD_FN(load_pixel)(const byte * FZ_RESTRICT p, const int bpp)
+{
+	int x;
+	switch (bpp)
+	{
+	case 1: return p[0];
+	case 2: return p[0] | (p[1] << 8);
+	case 3: return p[0] | (p[1] << 8) | (p[2] << 16);
+	}
+	memcpy(&x, p, 4);
+	return x;
+}
+
+/* Fetch the 4 source pixels at the given byte offsets. */
+static SIMD_INLINE SIMD_TARGET __m128i
+SIMD_FN(fetch)(const byte * FZ_RESTRICT sp, __m128i offs, const int sbpp)
+{
+#if SIMD_AVX2
+	if (sbpp == 4)
+		return _mm_i32gather_epi32((const int *)sp, offs, 1);
+#endif
+	return _mm_setr_epi32(
+		SIMD_FN(load_pixel)(sp + _mm_cvtsi128_si32(offs), sbpp),
+		SIMD_FN(load_pixel)(sp + _mm_extract_epi32(offs, 1), sbpp),
+		SIMD_FN(load_pixel)(sp + _mm_extract_epi32(offs, 2), sbpp),
+		SIMD_FN(load_pixel)(sp + _mm_extract_epi32(offs, 3), sbpp));
+}
+
+/* Load m (1 to 4) pixels of bpp bytes from p. */
+static SIMD_INLINE SIMD_TARGET __m128i
+SIMD_FN(load_pixels)(const byte * FZ_RESTRICT p, int m, const int bpp)
+{
+	byte tmp[16];
+	if (m == 4)
+	{
+		switch (bpp)
+		{
+		case 4: return _mm_loadu_si128((const __m128i *)p);
+		case 3: return _mm_insert_epi32(_mm_loadl_epi64((const __m128i *)p), SIMD_FN(load_pixel)(p + 8, 4), 2);
+		case 2: return _mm_loadl_epi64((const __m128i *)p);
+		case 1: return _mm_cvtsi32_si128(SIMD_FN(load_pixel)(p, 4));
+		}
+	}
+	memcpy(tmp, p, m * bpp);
+	return _mm_loadu_si128((const __m128i *)tmp);
+}
+
+/* Store m (1 to 4) pixels of bpp bytes from x to p. */
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(store_pixels)(byte * FZ_RESTRICT p, __m128i x, int m, const int bpp)
+{
+	byte tmp[16];
+	int y;
+	if (m == 4)
+	{
+		switch (bpp)
+		{
+		case 4:
+			_mm_storeu_si128((__m128i *)p, x);
+			return;
+		case 3:
+			_mm_storel_epi64((__m128i *)p, x);
+			y = _mm_extract_epi32(x, 2);
+			memcpy(p + 8, &y, 4);
+			return;
+		case 2:
+			_mm_storel_epi64((__m128i *)p, x);
+			return;
+		case 1:
+			y = _mm_cvtsi128_si32(x);
+			memcpy(p, &y, 4);
+			return;
+		}
+	}
+	_mm_storeu_si128((__m128i *)tmp, x);
+	memcpy(p, tmp, m * bpp);
+}
+
+static SIMD_INLINE SIMD_TARGET __m128i
+SIMD_FN(clamp)(__m128i x, __m128i hi)
+{
+	return _mm_min_epi32(_mm_max_epi32(x, _mm_setzero_si128()), hi);
+}
+
+/* Fetch the source at the given offsets, in canonical layout. */
+static SIMD_INLINE SIMD_TARGET __m128i
+SIMD_FN(source)(const byte * FZ_RESTRICT sp, __m128i offs, const simd_affine_setup *setup, const int sbpp)
+{
+	__m128i x = SIMD_FN(fetch)(sp, offs, sbpp);
+	x = _mm_shuffle_epi8(x, _mm_loadu_si128((const __m128i *)setup->src_map));
+	return _mm_or_si128(x, _mm_loadu_si128((const __m128i *)setup->src_or));
+}
+
+/*
+	Paint m (1 to 4) pixels, starting at texture position u, v.
+*/
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(affine)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int m, int alpha, byte * FZ_RESTRICT hp, byte * FZ_RESTRICT gp, const simd_affine_setup *setup, const int lerp, const int sbpp, const int dbpp)
+{
+	const int slot = setup->slot;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i uu = _mm_add_epi32(_mm_set1_epi32(u), _mm_setr_epi32(0, fa, 2 * fa, 3 * fa));
+	__m128i vv = _mm_add_epi32(_mm_set1_epi32(v), _mm_setr_epi32(0, fb, 2 * fb, 3 * fb));
+	__m128i ui = _mm_srai_epi32(uu, PREC);
+	__m128i vi = _mm_srai_epi32(vv, PREC);
+	__m128i inside, x8, raw8, d8, out8, sel;
+	SIMD_FN(simd_v16) x, xa, d;
+
+	if (lerp)
+	{
+		/* u + HALF >= 0 && u + ONE < sw, and the same for v. */
+		inside = _mm_and_si128(
+			_mm_and_si128(_mm_cmpgt_epi32(uu, _mm_set1_epi32(-HALF - 1)), _mm_cmplt_epi32(uu, _mm_set1_epi32(sw - ONE))),
+			_mm_and_si128(_mm_cmpgt_epi32(vv, _mm_set1_epi32(-HALF - 1)), _mm_cmplt_epi32(vv, _mm_set1_epi32(sh - ONE))));
+	}
+	else
+	{
+		/* 0 <= (u >> PREC) < sw, and the same for v. */
+		inside = _mm_and_si128(
+			_mm_and_si128(_mm_cmpgt_epi32(ui, _mm_set1_epi32(-1)), _mm_cmplt_epi32(ui, _mm_set1_epi32(sw))),
+			_mm_and_si128(_mm_cmpgt_epi32(vi, _mm_set1_epi32(-1)), _mm_cmplt_epi32(vi, _mm_set1_epi32(sh))));
+	}
+	if (m < 4)
+		inside = _mm_and_si128(inside, _mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(m)));
+	if (_mm_testz_si128(inside, inside))
+		return;
+
+	/* Fetch the source, and filter it. Pixels outside the image
+	 * fetch from offset 0, and are ignored. */
+	if (lerp)
+	{
+		__m128i umax = _mm_set1_epi32((sw >> PREC) - 1);
+		__m128i vmax = _mm_set1_epi32((sh >> PREC) - 1);
+		__m128i one = _mm_set1_epi32(1);
+		__m128i u0 = _mm_mullo_epi32(SIMD_FN(clamp)(ui, umax), _mm_set1_epi32(sbpp));
+		__m128i u1 = _mm_mullo_epi32(SIMD_FN(clamp)(_mm_add_epi32(ui, one), umax), _mm_set1_epi32(sbpp));
+		__m128i v0 = _mm_and_si128(_mm_mullo_epi32(SIMD_FN(clamp)(vi, vmax), _mm_set1_epi32(ss)), inside);
+		__m128i v1 = _mm_and_si128(_mm_mullo_epi32(SIMD_FN(clamp)(_mm_add_epi32(vi, one), vmax), _mm_set1_epi32(ss)), inside);
+		SIMD_FN(simd_v16) uf = SIMD_FN(per_pixel)(_mm_and_si128(uu, _mm_set1_epi32(MASK)));
+		SIMD_FN(simd_v16) vf = SIMD_FN(per_pixel)(_mm_and_si128(vv, _mm_set1_epi32(MASK)));
+		u0 = _mm_and_si128(u0, inside);
+		u1 = _mm_and_si128(u1, inside);
+		x = SIMD_FN(lerp)(
+			SIMD_FN(lerp)(SIMD_FN(widen)(SIMD_FN(source)(sp, _mm_add_epi32(v0, u0), setup, sbpp)), SIMD_FN(widen)(SIMD_FN(source)(sp, _mm_add_epi32(v0, u1), setup, sbpp)), uf),
+			SIMD_FN(lerp)(SIMD_FN(widen)(SIMD_FN(source)(sp, _mm_add_epi32(v1, u0), setup, sbpp)), SIMD_FN(widen)(SIMD_FN(source)(sp, _mm_add_epi32(v1, u1), setup, sbpp)), uf),
+			vf);
+		x8 = SIMD_FN(narrow)(x);
+	}
+	else
+	{
+		__m128i offs = _mm_add_epi32(_mm_mullo_epi32(vi, _mm_set1_epi32(ss)), _mm_mullo_epi32(ui, _mm_set1_epi32(sbpp)));
+		x8 = SIMD_FN(source)(sp, _mm_and_si128(offs, inside), setup, sbpp);
+	}
+	raw8 = x8;
+	d8 = _mm_shuffle_epi8(SIMD_FN(load_pixels)(dp, m, dbpp), _mm_loadu_si128((const __m128i *)setup->dst_expand));
+
+	if (setup->opaque)
+	{
+		/* Opaque source at full alpha: dp = x. */
+		out8 = x8;
+	}
+	else
+	{
+		/* Scale by the constant alpha. With no slot for the
+		 * source alpha, it is opaque, and so xa is simply alpha. */
+		if (!lerp)
+			x = SIMD_FN(widen)(x8);
+		if (alpha != 255)
+		{
+			x = SIMD_FN(mul255)(x, SIMD_FN(splat)(alpha));
+			x8 = SIMD_FN(narrow)(x);
+		}
+		xa = slot < 4 ? SIMD_FN(broadcast_slot)(x, slot) : SIMD_FN(splat)(alpha);
+
+		/* dp = x + fz_mul255(dp, 255 - xa) */
+		d = SIMD_FN(mul255)(SIMD_FN(widen)(d8), SIMD_FN(sub)(SIMD_FN(splat)(255), xa));
+		out8 = SIMD_FN(narrow)(SIMD_FN(add)(x, d));
+	}
+
+	/* Only touch the pixels that are inside, with xa != 0. */
+	sel = inside;
+	if (slot < 4)
+		sel = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(_mm_srli_epi32(x8, slot * 8), _mm_set1_epi32(0xff)), zero), sel);
+	out8 = _mm_blendv_epi8(d8, out8, _mm_and_si128(sel, _mm_loadu_si128((const __m128i *)setup->write)));
+	SIMD_FN(store_pixels)(dp, _mm_shuffle_epi8(out8, _mm_loadu_si128((const __m128i *)setup->dst_compress)), m, dbpp);
+
+	if (hp || gp)
+	{
+		/* hp = raw + fz_mul255(hp, 255 - raw), gp = xa + fz_mul255(gp, 255 - xa) */
+		int s[4], r[4], a[4];
+		int i;
+		_mm_storeu_si128((__m128i *)s, sel);
+		if (slot < 4)
+		{
+			_mm_storeu_si128((__m128i *)r, _mm_and_si128(_mm_srli_epi32(raw8, slot * 8), _mm_set1_epi32(0xff)));
+			_mm_storeu_si128((__m128i *)a, _mm_and_si128(_mm_srli_epi32(x8, slot * 8), _mm_set1_epi32(0xff)));
+		}
+		else
+		{
+			r[0] = r[1] = r[2] = r[3] = 255;
+			a[0] = a[1] = a[2] = a[3] = alpha;
+		}
+		for (i = 0; i < m; i++)
+		{
+			if (!s[i])
+				continue;
+			if (hp)
+				hp[i] = r[i] + fz_mul255(hp[i], 255 - r[i]);
+			if (gp)
+				gp[i] = a[i] + fz_mul255(gp[i], 255 - a[i]);
+		}
+	}
+}
+
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(affine_span)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int alpha, byte * FZ_RESTRICT hp, byte * FZ_RESTRICT gp, const simd_affine_setup *setup, const int lerp, const int sbpp, const int dbpp)
+{
+	for (; w > 0; w -= 4)
+	{
+		SIMD_FN(affine)(dp, sp, sw, sh, ss, u, v, fa, fb, w < 4 ? w : 4, alpha, hp, gp, setup, lerp, sbpp, dbpp);
+		dp += 4 * dbpp;
+		if (hp)
+			hp += 4;
+		if (gp)
+			gp += 4;
+		u += 4 * fa;
+		v += 4 * fb;
+	}
+}
+
+/* Instantiate the span painter for each pixel size, so that the
+ * fetches and stores are all of constant size. */
+#define SIMD_AFFINE_SIZES(LERP) \
+	switch ((sn + sa) * 8 + dn + da) \
+	{ \
+	case 1*8+1: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 1, 1); break; \
+	case 1*8+2: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 1, 2); break; \
+	case 1*8+3: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 1, 3); break; \
+	case 1*8+4: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 1, 4); break; \
+	case 2*8+1: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 2, 1); break; \
+	case 2*8+2: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 2, 2); break; \
+	case 2*8+3: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 2, 3); break; \
+	case 2*8+4: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 2, 4); break; \
+	case 3*8+2: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 3, 2); break; \
+	case 3*8+3: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 3, 3); break; \
+	case 3*8+4: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 3, 4); break; \
+	case 4*8+3: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 4, 3); break; \
+	case 4*8+4: SIMD_FN(affine_span)(dp, sp, sw, sh, ss, u, v, fa, fb, w, alpha, hp, gp, &setup, LERP, 4, 4); break; \
+	}
+
+static SIMD_TARGET void
+SIMD_FN(paint_affine_lerp)(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * FZ_RESTRICT color, byte * FZ_RESTRICT hp, byte * FZ_RESTRICT gp, const fz_overprint * FZ_RESTRICT eop)
+{
+	simd_affine_setup setup;
+	TRACK_FN();
+	simd_affine_prepare(&setup, da, sa, dn, sn, alpha, eop);
+	SIMD_AFFINE_SIZES(1)
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_affine_near)(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * FZ_RESTRICT color, byte * FZ_RESTRICT hp, byte * FZ_RESTRICT gp, const fz_overprint * FZ_RESTRICT eop)
+{
+	simd_affine_setup setup;
+	TRACK_FN();
+	simd_affine_prepare(&setup, da, sa, dn, sn, alpha, eop);
+	SIMD_AFFINE_SIZES(0)
+}
+
+#undef SIMD_AFFINE_SIZES
@@ -1,10 +1,15 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
 
+#include <string.h>
 #include <math.h>
 #include <float.h>
 #include <assert.h>
 
+#if FZ_ENABLE_SIMD
+#include <immintrin.h>
+#endif
+
 /* Number of fraction bits for fixed point math */
 #define PREC 14
 #define MASK ((1<<PREC)-1)
@@ -1478,9 +1483,104 @@ paint_affine_lerp_alpha_N_op(byte * FZ_RESTRICT dp, int da, const byte * FZ_REST
 }
 #endif /* FZ_ENABLE_SPOT_RENDERING */
 
+#if FZ_ENABLE_SIMD
+
+/*
+	Byte shuffles used by the SIMD painters to move between the
+	source and destination pixel layouts and the canonical layout
+	(one pixel per 32 bit word, alpha in the byte after the colorants).
+*/
+typedef struct
+{
+	int slot; /* byte of the alpha in canonical layout, or 4 for none */
+	int opaque; /* source has no alpha, and we paint it at full alpha */
+	byte src_map[16]; /* source pixels (one per word) to canonical */
+	byte src_or[16]; /* 255 in the alpha slot for sources without alpha */
+	byte dst_expand[16]; /* packed destination pixels to canonical */
+	byte dst_compress[16]; /* canonical to packed destination pixels */
+	byte write[16]; /* 255 for each byte we may change */
+} simd_affine_setup;
+
+static void
+simd_affine_prepare(simd_affine_setup *s, int da, int sa, int dn, int sn, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	int dbpp = dn + da;
+	int op = fz_overprint_required(eop);
+	int i, k;
+
+	s->slot = dn < 4 ? dn : 4;
+	s->opaque = !sa && alpha == 255;
+	for (i = 0; i < 4; i++)
+	{
+		for (k = 0; k < 4; k++)
+		{
+			int j = i * 4 + k;
+			if (k < dn)
+				s->src_map[j] = i * 4 + (sn == 1 ? 0 : k);
+			else if (k == dn && sa)
+				s->src_map[j] = i * 4 + sn;
+			else
+				s->src_map[j] = 0x80;
+			s->src_or[j] = (k == dn && !sa) ? 255 : 0;
+			s->dst_expand[j] = k < dbpp ? i * dbpp + k : 0x80;
+			s->dst_compress[j] = j < 4 * dbpp ? 4 * (j / dbpp) + j % dbpp : 0x80;
+			s->write[j] = (k < dn && op && !fz_overprint_component(eop, k)) ? 0 : 255;
+		}
+	}
+}
+
+#define SIMD_FN(x) x##_sse41
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+#define SIMD_AVX2 0
+#include "draw-affine-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+#define SIMD_FN(x) x##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_AVX2 1
+#include "draw-affine-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+/*
+	The SIMD painters handle sources and destinations of up to 4 bytes
+	a pixel, with matching colorants or gray to rgb, with or without
+	overprint. Nearest neighbour painting of opaque or single byte
+	sources is little more than a copy per pixel, which the plain
+	painters do just as quickly.
+*/
+static paintfn_t *
+simd_affine_painter(int dolerp, int da, int sa, int dn, int sn, int alpha)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return NULL;
+	if (alpha <= 0 || sn + sa < 1 || sn + sa > 4 || dn + da < 1 || dn + da > 4)
+		return NULL;
+	if (sn != dn && !(sn == 1 && dn == 3))
+		return NULL;
+	if (!dolerp && (sn + sa < 3 || (!sa && alpha == 255)))
+		return NULL;
+	if (dolerp)
+		return avx2 ? paint_affine_lerp_avx2 : paint_affine_lerp_sse41;
+	return avx2 ? paint_affine_near_avx2 : paint_affine_near_sse41;
+}
+
+#endif /* FZ_ENABLE_SIMD */
+
 static paintfn_t *
 fz_paint_affine_lerp(int da, int sa, int fa, int fb, int n, int alpha, const fz_overprint * FZ_RESTRICT eop)
 {
+#if FZ_ENABLE_SIMD
+	{
+		paintfn_t *fn = simd_affine_painter(1, da, sa, n, n, alpha);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 #if FZ_ENABLE_SPOT_RENDERING
 	if (fz_overprint_required(eop))
 	{
@@ -1788,6 +1888,13 @@ paint_affine_lerp_g2rgb_alpha(byte * FZ_RESTRICT dp, int da, const byte * FZ_RES
 static paintfn_t *
 fz_paint_affine_g2rgb_lerp(int da, int sa, int fa, int fb, int n, int alpha)
 {
+#if FZ_ENABLE_SIMD
+	{
+		paintfn_t *fn = simd_affine_painter(1, da, sa, n, 1, alpha);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 	if (da)
 	{
 		if (sa)
@@ -2609,6 +2716,13 @@ paint_affine_near_alpha_N_op(byte * FZ_RESTRICT dp, int da, const byte * FZ_REST
 static paintfn_t *
 fz_paint_affine_near(int da, int sa, int fa, int fb, int n, int alpha, const fz_overprint * FZ_RESTRICT eop)
 {
+#if FZ_ENABLE_SIMD
+	{
+		paintfn_t *fn = simd_affine_painter(0, da, sa, n, n, alpha);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 #if FZ_ENABLE_SPOT_RENDERING
 	if (fz_overprint_required(eop))
 	{
@@ -3335,6 +3449,13 @@ paint_affine_near_alpha_g2rgb(byte * FZ_RESTRICT dp, int da, const byte * FZ_RES
 static paintfn_t *
 fz_paint_affine_g2rgb_near(int da, int sa, int fa, int fb, int n, int alpha)
 {
+#if FZ_ENABLE_SIMD
+	{
+		paintfn_t *fn = simd_affine_painter(0, da, sa, n, 1, alpha);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 	if (da)
 	{
 		if (sa)
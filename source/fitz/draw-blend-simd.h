@@ -0,0 +1,680 @@
+/*
+	SIMD versions of the separable blend modes. This file is included
+	by draw-blend.c once for each instruction set we support, with:
+
+	SIMD_FN(x): The name to give to this version of x.
+	SIMD_TARGET: The attribute to compile these functions with.
+	SIMD_AVX2: 1 to work on 8 pixels at a time in 256 bit registers,
+	0 to work on 4 at a time in 128 bit ones.
+
+	These handle gray, rgb and cmyk pixels (1, 3 or 4 colorants, with
+	or without alpha) without spots. The pixels are unpacked so that
+	each 32 bit lane holds one colorant of one pixel, and all the
+	arithmetic is done as the plain C does it, so the results match it
+	bit for bit, even for badly premultiplied input. Whatever is left
+	over at the end of a span goes to the plain C.
+*/
+
+#ifndef SIMD_INLINE
+/* Everything here must be inlined for the pixel sizes to be constants. */
+#define SIMD_INLINE inline __attribute__((always_inline))
+#endif
+
+#if SIMD_AVX2
+typedef __m256i SIMD_FN(vi);
+#define SIMD_OP(x) _mm256_##x
+#define SIMD_LANES 8
+#else
+typedef __m128i SIMD_FN(vi);
+#define SIMD_OP(x) _mm_##x
+#define SIMD_LANES 4
+#endif
+
+/* The raw bytes of SIMD_LANES pixels. Pixels of 5 bytes need a second
+ * register for the last 4 bytes of each group of 4. */
+typedef struct
+{
+	SIMD_FN(vi) a, b;
+} SIMD_FN(simd_raw);
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(splat)(int x)
+{
+	return SIMD_OP(set1_epi32)(x);
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(or)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+#if SIMD_AVX2
+	return _mm256_or_si256(a, b);
+#else
+	return _mm_or_si128(a, b);
+#endif
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(and)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+#if SIMD_AVX2
+	return _mm256_and_si256(a, b);
+#else
+	return _mm_and_si128(a, b);
+#endif
+}
+
+/* mask ? a : b */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(select)(SIMD_FN(vi) mask, SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	return SIMD_OP(blendv_epi8)(b, a, mask);
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(is_zero)(SIMD_FN(vi) a)
+{
+	return SIMD_OP(cmpeq_epi32)(a, SIMD_FN(splat)(0));
+}
+
+/* a < b */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(less)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	return SIMD_OP(cmpgt_epi32)(b, a);
+}
+
+static SIMD_INLINE SIMD_TARGET int
+SIMD_FN(all)(SIMD_FN(vi) mask)
+{
+#if SIMD_AVX2
+	return _mm256_movemask_epi8(mask) == -1;
+#else
+	return _mm_movemask_epi8(mask) == 0xffff;
+#endif
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(add)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	return SIMD_OP(add_epi32)(a, b);
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(sub)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	return SIMD_OP(sub_epi32)(a, b);
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(mul)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	return SIMD_OP(mullo_epi32)(a, b);
+}
+
+/* fz_mul255(a, b), with C's arithmetic shifts for negative values. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(mul255)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	SIMD_FN(vi) x = SIMD_FN(add)(SIMD_FN(mul)(a, b), SIMD_FN(splat)(128));
+	x = SIMD_FN(add)(x, SIMD_OP(srai_epi32)(x, 8));
+	return SIMD_OP(srai_epi32)(x, 8);
+}
+
+/*
+	a / b, truncating, for 0 <= a < (1<<26), 0 < b and a / b < (1<<20).
+	The float quotient is then within one of the answer, and the
+	remainder tells us which way to correct it. Lanes outside that
+	range give garbage, but nothing traps.
+*/
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(div)(SIMD_FN(vi) a, SIMD_FN(vi) b)
+{
+	SIMD_FN(vi) q, r;
+	b = SIMD_OP(max_epi32)(b, SIMD_FN(splat)(1));
+	q = SIMD_OP(cvttps_epi32)(SIMD_OP(div_ps)(SIMD_OP(cvtepi32_ps)(a), SIMD_OP(cvtepi32_ps)(b)));
+	r = SIMD_FN(sub)(a, SIMD_FN(mul)(q, b));
+	q = SIMD_FN(add)(q, SIMD_FN(less)(r, SIMD_FN(splat)(0)));
+	r = SIMD_FN(sub)(a, SIMD_FN(mul)(q, b));
+	return SIMD_FN(sub)(q, SIMD_FN(less)(SIMD_FN(sub)(b, SIMD_FN(splat)(1)), r));
+}
+
+
+/* a ? 255 * 256 / a : 0, as used to unpremultiply. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(inv)(SIMD_FN(vi) a)
+{
+	return SIMD_FN(select)(SIMD_FN(is_zero)(a), a, SIMD_FN(div)(SIMD_FN(splat)(255 * 256), a));
+}
+
+/* Load 4 pixels of bpp bytes, reading nothing beyond them. */
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(load_quad)(const byte * FZ_RESTRICT p, int bpp, __m128i *a, __m128i *b)
+{
+	int x;
+	*b = _mm_setzero_si128();
+	switch (bpp)
+	{
+	case 1:
+		memcpy(&x, p, 4);
+		*a = _mm_cvtsi32_si128(x);
+		break;
+	case 2:
+		*a = _mm_loadl_epi64((const __m128i *)p);
+		break;
+	case 3:
+		memcpy(&x, p + 8, 4);
+		*a = _mm_insert_epi32(_mm_loadl_epi64((const __m128i *)p), x, 2);
+		break;
+	case 4:
+		*a = _mm_loadu_si128((const __m128i *)p);
+		break;
+	case 5:
+		*a = _mm_loadu_si128((const __m128i *)p);
+		*b = _mm_loadu_si128((const __m128i *)(p + 4));
+		break;
+	}
+}
+
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(store_quad)(byte * FZ_RESTRICT p, int bpp, __m128i a, __m128i b)
+{
+	int x;
+	switch (bpp)
+	{
+	case 1:
+		x = _mm_cvtsi128_si32(a);
+		memcpy(p, &x, 4);
+		break;
+	case 2:
+		_mm_storel_epi64((__m128i *)p, a);
+		break;
+	case 3:
+		_mm_storel_epi64((__m128i *)p, a);
+		x = _mm_extract_epi32(a, 2);
+		memcpy(p + 8, &x, 4);
+		break;
+	case 4:
+		_mm_storeu_si128((__m128i *)p, a);
+		break;
+	case 5:
+		_mm_storeu_si128((__m128i *)p, a);
+		x = _mm_cvtsi128_si32(b);
+		memcpy(p + 16, &x, 4);
+		break;
+	}
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(simd_raw)
+SIMD_FN(load)(const byte * FZ_RESTRICT p, int bpp)
+{
+	SIMD_FN(simd_raw) r;
+#if SIMD_AVX2
+	__m128i a0, b0, a1, b1;
+	SIMD_FN(load_quad)(p, bpp, &a0, &b0);
+	SIMD_FN(load_quad)(p + 4 * bpp, bpp, &a1, &b1);
+	r.a = _mm256_inserti128_si256(_mm256_castsi128_si256(a0), a1, 1);
+	r.b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+#else
+	SIMD_FN(load_quad)(p, bpp, &r.a, &r.b);
+#endif
+	return r;
+}
+
+/* The shape (or any other one byte per pixel plane). */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(load_plane)(const byte * FZ_RESTRICT p)
+{
+#if SIMD_AVX2
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+#else
+	int x;
+	memcpy(&x, p, 4);
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(x));
+#endif
+}
+
+/* A byte shuffle applied to each group of 4 pixels. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(shuffle)(SIMD_FN(vi) x, __m128i m)
+{
+#if SIMD_AVX2
+	return _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(m));
+#else
+	return _mm_shuffle_epi8(x, m);
+#endif
+}
+
+/* Colorant (or alpha) k of each pixel, one per lane. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(component)(SIMD_FN(simd_raw) r, int bpp, int k)
+{
+#define LANES(i0, i1, i2, i3) _mm_setr_epi8(i0, -1, -1, -1, i1, -1, -1, -1, i2, -1, -1, -1, i3, -1, -1, -1)
+	if (bpp == 5)
+		return SIMD_FN(or)(SIMD_FN(shuffle)(r.a, LANES(k, 5 + k, 10 + k, -1)), SIMD_FN(shuffle)(r.b, LANES(-1, -1, -1, 11 + k)));
+	return SIMD_FN(shuffle)(r.a, LANES(k, bpp + k, 2 * bpp + k, 3 * bpp + k));
+#undef LANES
+}
+
+/* Put the low byte of each lane of c back as colorant k of its pixel,
+ * in the 16 bytes starting at byte base of each group of 4 pixels. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(place)(SIMD_FN(vi) c, int bpp, int k, int base)
+{
+#define PLACE(i) (((base + i) % bpp == k && (base + i) / bpp < 4) ? (base + i) / bpp * 4 : -1)
+	return SIMD_FN(shuffle)(c, _mm_setr_epi8(
+		PLACE(0), PLACE(1), PLACE(2), PLACE(3), PLACE(4), PLACE(5), PLACE(6), PLACE(7),
+		PLACE(8), PLACE(9), PLACE(10), PLACE(11), PLACE(12), PLACE(13), PLACE(14), PLACE(15)));
+#undef PLACE
+}
+
+/* Store the low byte of each lane of c[0] to c[bpp-1] as the pixels. */
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(store)(byte * FZ_RESTRICT p, int bpp, const SIMD_FN(vi) *c)
+{
+	SIMD_FN(vi) a = SIMD_FN(place)(c[0], bpp, 0, 0);
+	SIMD_FN(vi) b = SIMD_FN(place)(c[0], bpp, 0, 16);
+	int k;
+	for (k = 1; k < bpp; k++)
+	{
+		a = SIMD_FN(or)(a, SIMD_FN(place)(c[k], bpp, k, 0));
+		if (bpp == 5)
+			b = SIMD_FN(or)(b, SIMD_FN(place)(c[k], bpp, k, 16));
+	}
+#if SIMD_AVX2
+	SIMD_FN(store_quad)(p, bpp, _mm256_castsi256_si128(a), _mm256_castsi256_si128(b));
+	SIMD_FN(store_quad)(p + 4 * bpp, bpp, _mm256_extracti128_si256(a, 1), _mm256_extracti128_si256(b, 1));
+#else
+	SIMD_FN(store_quad)(p, bpp, a, b);
+#endif
+}
+
+/* Separable blend modes */
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(screen)(SIMD_FN(vi) b, SIMD_FN(vi) s)
+{
+	return SIMD_FN(sub)(SIMD_FN(add)(b, s), SIMD_FN(mul255)(b, s));
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(hard_light)(SIMD_FN(vi) b, SIMD_FN(vi) s)
+{
+	SIMD_FN(vi) s2 = SIMD_OP(slli_epi32)(s, 1);
+	return SIMD_FN(select)(SIMD_FN(less)(s, SIMD_FN(splat)(128)),
+		SIMD_FN(mul255)(b, s2),
+		SIMD_FN(screen)(b, SIMD_FN(sub)(s2, SIMD_FN(splat)(255))));
+}
+
+/* (0x1fe * b + s) / (s << 1), for 0 < b < s. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(dodge_div)(SIMD_FN(vi) b, SIMD_FN(vi) s)
+{
+	return SIMD_FN(div)(SIMD_FN(add)(SIMD_FN(mul)(b, SIMD_FN(splat)(0x1fe)), s), SIMD_OP(slli_epi32)(s, 1));
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(color_dodge)(SIMD_FN(vi) b, SIMD_FN(vi) s)
+{
+	SIMD_FN(vi) r;
+	s = SIMD_FN(sub)(SIMD_FN(splat)(255), s);
+	r = SIMD_FN(select)(SIMD_FN(less)(b, s), SIMD_FN(dodge_div)(b, s), SIMD_FN(splat)(255));
+	return SIMD_FN(select)(SIMD_FN(less)(b, SIMD_FN(splat)(1)), SIMD_FN(splat)(0), r);
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(color_burn)(SIMD_FN(vi) b, SIMD_FN(vi) s)
+{
+	SIMD_FN(vi) r;
+	b = SIMD_FN(sub)(SIMD_FN(splat)(255), b);
+	r = SIMD_FN(select)(SIMD_FN(less)(b, s), SIMD_FN(sub)(SIMD_FN(splat)(0xff), SIMD_FN(dodge_div)(b, s)), SIMD_FN(splat)(0));
+	return SIMD_FN(select)(SIMD_FN(less)(b, SIMD_FN(splat)(1)), SIMD_FN(splat)(255), r);
+}
+
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(soft_light)(SIMD_FN(vi) b, SIMD_FN(vi) s)
+{
+	SIMD_FN(vi) c255 = SIMD_FN(splat)(255);
+	SIMD_FN(vi) s2 = SIMD_OP(slli_epi32)(s, 1);
+	SIMD_FN(vi) lo, hi, dbd, dbd_sqrt;
+
+	lo = SIMD_FN(sub)(b, SIMD_FN(mul255)(SIMD_FN(mul255)(SIMD_FN(sub)(c255, s2), b), SIMD_FN(sub)(c255, b)));
+
+	dbd = SIMD_FN(mul255)(SIMD_FN(add)(SIMD_FN(mul255)(SIMD_FN(sub)(SIMD_OP(slli_epi32)(b, 4), SIMD_FN(splat)(3060)), b), SIMD_FN(splat)(1020)), b);
+	dbd_sqrt = SIMD_OP(cvttps_epi32)(SIMD_OP(sqrt_ps)(SIMD_OP(mul_ps)(SIMD_OP(set1_ps)(255.0f), SIMD_OP(cvtepi32_ps)(b))));
+	dbd = SIMD_FN(select)(SIMD_FN(less)(b, SIMD_FN(splat)(64)), dbd, dbd_sqrt);
+	hi = SIMD_FN(add)(b, SIMD_FN(mul255)(SIMD_FN(sub)(s2, c255), SIMD_FN(sub)(dbd, b)));
+
+	return SIMD_FN(select)(SIMD_FN(less)(s, SIMD_FN(splat)(128)), lo, hi);
+}
+
+/* The result of blending s onto b, as the fz_*_byte functions. */
+static SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(blend)(SIMD_FN(vi) b, SIMD_FN(vi) s, int blendmode)
+{
+	switch (blendmode)
+	{
+	default:
+	case FZ_BLEND_NORMAL: return s;
+	case FZ_BLEND_MULTIPLY: return SIMD_FN(mul255)(b, s);
+	case FZ_BLEND_SCREEN: return SIMD_FN(screen)(b, s);
+	case FZ_BLEND_OVERLAY: return SIMD_FN(hard_light)(s, b); /* note swapped order */
+	case FZ_BLEND_DARKEN: return SIMD_OP(min_epi32)(b, s);
+	case FZ_BLEND_LIGHTEN: return SIMD_OP(max_epi32)(b, s);
+	case FZ_BLEND_COLOR_DODGE: return SIMD_FN(color_dodge)(b, s);
+	case FZ_BLEND_COLOR_BURN: return SIMD_FN(color_burn)(b, s);
+	case FZ_BLEND_HARD_LIGHT: return SIMD_FN(hard_light)(b, s);
+	case FZ_BLEND_SOFT_LIGHT: return SIMD_FN(soft_light)(b, s);
+	case FZ_BLEND_DIFFERENCE: return SIMD_OP(abs_epi32)(SIMD_FN(sub)(b, s));
+	case FZ_BLEND_EXCLUSION: return SIMD_FN(sub)(SIMD_FN(add)(b, s), SIMD_OP(slli_epi32)(SIMD_FN(mul255)(b, s), 1));
+	}
+}
+
+/* Unpremultiply colorant c by the inverse alpha from inv. */
+static SIMD_INLINE SIMD_TARGET SIMD_FN(vi)
+SIMD_FN(unmul)(SIMD_FN(vi) c, SIMD_FN(vi) inv)
+{
+	return SIMD_OP(srai_epi32)(SIMD_FN(mul)(c, inv), 8);
+}
+
+/* As fz_blend_separable, with first_spot == n1. */
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(separable_span)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, int blendmode, int complement)
+{
+	const int sn = n1 + sal;
+	const int bn = n1 + bal;
+	SIMD_FN(vi) c255 = SIMD_FN(splat)(255);
+	SIMD_FN(vi) out[5];
+	int k;
+
+	/* The plain code has its own way of filling in the alpha of a
+	 * backdrop pixel that a source without alpha is copied onto. */
+	if (bal && !sal)
+	{
+		fz_blend_separable(bp, bal, sp, sal, n1, w, blendmode, complement, n1);
+		return;
+	}
+
+	for (; w >= SIMD_LANES; w -= SIMD_LANES, sp += SIMD_LANES * sn, bp += SIMD_LANES * bn)
+	{
+		SIMD_FN(simd_raw) s = SIMD_FN(load)(sp, sn);
+		SIMD_FN(simd_raw) b = SIMD_FN(load)(bp, bn);
+		SIMD_FN(vi) sa = sal ? SIMD_FN(component)(s, sn, n1) : c255;
+		SIMD_FN(vi) ba = bal ? SIMD_FN(component)(b, bn, n1) : c255;
+		SIMD_FN(vi) skip = SIMD_FN(is_zero)(sa);
+		SIMD_FN(vi) copy, saba, invsa, invba;
+
+		if (SIMD_FN(all)(skip))
+			continue;
+
+		copy = SIMD_FN(is_zero)(ba);
+		saba = SIMD_FN(mul255)(sa, ba);
+		invsa = SIMD_FN(inv)(sa);
+		invba = SIMD_FN(inv)(ba);
+
+		for (k = 0; k < n1; k++)
+		{
+			SIMD_FN(vi) sk = SIMD_FN(component)(s, sn, k);
+			SIMD_FN(vi) bk = SIMD_FN(component)(b, bn, k);
+			SIMD_FN(vi) sc = SIMD_FN(unmul)(sk, invsa);
+			SIMD_FN(vi) bc = SIMD_FN(unmul)(bk, invba);
+			SIMD_FN(vi) rc;
+
+			if (complement)
+			{
+				sc = SIMD_FN(sub)(c255, sc);
+				bc = SIMD_FN(sub)(c255, bc);
+			}
+
+			rc = SIMD_FN(blend)(bc, sc, blendmode);
+
+			if (complement)
+				rc = SIMD_FN(sub)(c255, rc);
+
+			rc = SIMD_FN(add)(SIMD_FN(add)(
+				SIMD_FN(mul255)(SIMD_FN(sub)(c255, sa), bk),
+				SIMD_FN(mul255)(SIMD_FN(sub)(c255, ba), sk)),
+				SIMD_FN(mul255)(saba, rc));
+			rc = SIMD_FN(select)(copy, sk, rc);
+			out[k] = SIMD_FN(select)(skip, bk, rc);
+		}
+
+		if (bal)
+		{
+			SIMD_FN(vi) ra = SIMD_FN(sub)(SIMD_FN(add)(ba, sa), saba);
+			ra = SIMD_FN(select)(copy, sa, ra);
+			out[n1] = SIMD_FN(select)(skip, ba, ra);
+		}
+
+		SIMD_FN(store)(bp, bn, out);
+	}
+
+	if (w)
+		fz_blend_separable(bp, bal, sp, sal, n1, w, blendmode, complement, n1);
+}
+
+/* As fz_blend_separable_nonisolated, with first_spot == n1. */
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(nonisolated_span)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, int blendmode, int complement, const byte * FZ_RESTRICT hp, int alpha)
+{
+	const int sn = n1 + sal;
+	const int bn = n1 + bal;
+	SIMD_FN(vi) c255 = SIMD_FN(splat)(255);
+	SIMD_FN(vi) out[5];
+	int k;
+
+	/* A simple copy, which the plain code does as quickly. */
+	if (sal == 0 && alpha == 255 && blendmode == FZ_BLEND_NORMAL)
+	{
+		fz_blend_separable_nonisolated(bp, bal, sp, sal, n1, w, blendmode, complement, hp, alpha, n1);
+		return;
+	}
+
+	for (; w >= SIMD_LANES; w -= SIMD_LANES, sp += SIMD_LANES * sn, bp += SIMD_LANES * bn, hp += SIMD_LANES)
+	{
+		SIMD_FN(vi) ha = SIMD_FN(load_plane)(hp);
+		SIMD_FN(vi) haa = SIMD_FN(mul255)(ha, SIMD_FN(splat)(alpha));
+		SIMD_FN(simd_raw) s, b;
+		SIMD_FN(vi) sa, ba, skip, copy, invsa, invba, scale, bahaa, ra0, ra, t;
+
+		if (SIMD_FN(all)(SIMD_FN(is_zero)(haa)))
+			continue;
+
+		s = SIMD_FN(load)(sp, sn);
+		b = SIMD_FN(load)(bp, bn);
+		sa = sal ? SIMD_FN(component)(s, sn, n1) : c255;
+		ba = bal ? SIMD_FN(component)(b, bn, n1) : c255;
+		skip = SIMD_FN(or)(SIMD_FN(is_zero)(haa), SIMD_FN(is_zero)(sa));
+		if (SIMD_FN(all)(skip))
+			continue;
+
+		copy = SIMD_FN(is_zero)(ba);
+		invsa = SIMD_FN(inv)(sa);
+		invba = SIMD_FN(inv)(ba);
+
+		/* scale = (512 * ba + ha) / (ha*2) - FZ_EXPAND(ba) */
+		scale = SIMD_FN(div)(SIMD_FN(add)(SIMD_OP(slli_epi32)(ba, 9), ha), SIMD_OP(slli_epi32)(ha, 1));
+		scale = SIMD_FN(sub)(scale, SIMD_FN(add)(ba, SIMD_OP(srai_epi32)(ba, 7)));
+
+		bahaa = SIMD_FN(mul255)(ba, haa);
+		ra0 = SIMD_FN(sub)(ba, bahaa);
+		ra = SIMD_FN(add)(ra0, haa); /* never 0, as haa isn't */
+		t = SIMD_FN(mul255)(SIMD_FN(sub)(c255, ba), haa);
+
+		for (k = 0; k < n1; k++)
+		{
+			SIMD_FN(vi) sk = SIMD_FN(component)(s, sn, k);
+			SIMD_FN(vi) bk = SIMD_FN(component)(b, bn, k);
+			SIMD_FN(vi) sc = SIMD_FN(unmul)(sk, invsa);
+			SIMD_FN(vi) bc = SIMD_FN(unmul)(bk, invba);
+			SIMD_FN(vi) rc, copied;
+
+			copied = SIMD_FN(mul255)(sc, haa);
+
+			if (complement)
+			{
+				sc = SIMD_FN(sub)(c255, sc);
+				bc = SIMD_FN(sub)(c255, bc);
+			}
+
+			/* Uncomposite */
+			sc = SIMD_FN(add)(sc, SIMD_OP(srai_epi32)(SIMD_FN(mul)(SIMD_FN(sub)(sc, bc), scale), 8));
+			sc = SIMD_OP(min_epi32)(SIMD_OP(max_epi32)(sc, SIMD_FN(splat)(0)), c255);
+
+			rc = SIMD_FN(blend)(bc, sc, blendmode);
+
+			/* Adding the last two terms when they are not needed adds 0. */
+			rc = SIMD_FN(select)(SIMD_OP(cmpeq_epi32)(bahaa, c255), rc, SIMD_FN(mul255)(bahaa, rc));
+			rc = SIMD_FN(add)(rc, SIMD_FN(mul255)(t, sc));
+			rc = SIMD_FN(add)(rc, SIMD_FN(mul255)(ra0, bc));
+
+			if (complement)
+				rc = SIMD_FN(sub)(ra, rc);
+
+			rc = SIMD_OP(min_epi32)(SIMD_OP(max_epi32)(rc, SIMD_FN(splat)(0)), ra);
+			rc = SIMD_FN(select)(copy, copied, rc);
+			out[k] = SIMD_FN(select)(skip, bk, rc);
+		}
+
+		if (bal)
+		{
+			SIMD_FN(vi) a = SIMD_FN(select)(copy, haa, ra);
+			out[n1] = SIMD_FN(select)(skip, ba, a);
+		}
+
+		SIMD_FN(store)(bp, bn, out);
+	}
+
+	if (w)
+		fz_blend_separable_nonisolated(bp, bal, sp, sal, n1, w, blendmode, complement, hp, alpha, n1);
+}
+
+/* As fz_blend_knockout. */
+static SIMD_INLINE SIMD_TARGET void
+SIMD_FN(knockout_span)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, const byte * FZ_RESTRICT hp)
+{
+	const int sn = n1 + sal;
+	const int bn = n1 + bal;
+	SIMD_FN(vi) c255 = SIMD_FN(splat)(255);
+	SIMD_FN(vi) out[5];
+	int k;
+
+	for (; w >= SIMD_LANES; w -= SIMD_LANES, sp += SIMD_LANES * sn, bp += SIMD_LANES * bn, hp += SIMD_LANES)
+	{
+		SIMD_FN(vi) ha = SIMD_FN(load_plane)(hp);
+		SIMD_FN(vi) skip = SIMD_FN(is_zero)(ha);
+		SIMD_FN(vi) iha = SIMD_FN(sub)(c255, ha);
+		SIMD_FN(simd_raw) s, b;
+		SIMD_FN(vi) sa, ba, copy, invsa, invba, ra;
+
+		if (SIMD_FN(all)(skip))
+			continue;
+
+		s = SIMD_FN(load)(sp, sn);
+		b = SIMD_FN(load)(bp, bn);
+		sa = sal ? SIMD_FN(component)(s, sn, n1) : c255;
+		ba = bal ? SIMD_FN(component)(b, bn, n1) : c255;
+		copy = SIMD_FN(and)(SIMD_FN(is_zero)(ba), SIMD_FN(is_zero)(iha));
+		invsa = SIMD_FN(inv)(sa);
+		invba = SIMD_FN(inv)(ba);
+		ra = SIMD_FN(add)(SIMD_FN(mul255)(ha, sa), SIMD_FN(mul255)(iha, ba));
+
+		for (k = 0; k < n1; k++)
+		{
+			SIMD_FN(vi) sk = SIMD_FN(component)(s, sn, k);
+			SIMD_FN(vi) bk = SIMD_FN(component)(b, bn, k);
+			SIMD_FN(vi) sc = SIMD_FN(unmul)(sk, invsa);
+			SIMD_FN(vi) bc = SIMD_FN(unmul)(bk, invba);
+			SIMD_FN(vi) rc = SIMD_FN(add)(SIMD_FN(mul255)(iha, bc), SIMD_FN(mul255)(ha, sc));
+
+			rc = SIMD_FN(mul255)(ra, rc);
+			rc = SIMD_FN(select)(copy, sk, rc);
+			out[k] = SIMD_FN(select)(skip, bk, rc);
+		}
+
+		if (bal)
+		{
+			SIMD_FN(vi) a = SIMD_FN(select)(copy, sa, ra);
+			out[n1] = SIMD_FN(select)(skip, ba, a);
+		}
+
+		SIMD_FN(store)(bp, bn, out);
+	}
+
+	if (w)
+		fz_blend_knockout(bp, bal, sp, sal, n1, w, hp);
+}
+
+/* As the group alpha loop at the start of fz_blend_pixmap. */
+static SIMD_TARGET void
+SIMD_FN(blend_scale_alpha)(byte * FZ_RESTRICT p, int len, int alpha)
+{
+#if SIMD_AVX2
+	__m256i a = _mm256_set1_epi16(alpha);
+	__m256i c128 = _mm256_set1_epi16(128);
+	for (; len >= 16; len -= 16, p += 16)
+	{
+		__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p)), a), c128);
+		x = _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+		_mm_storeu_si128((__m128i *)p, _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+	}
+#else
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(alpha);
+	__m128i c128 = _mm_set1_epi16(128);
+	for (; len >= 16; len -= 16, p += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)p);
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), a), c128);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), a), c128);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)p, _mm_packus_epi16(lo, hi));
+	}
+#endif
+	while (len--)
+	{
+		*p = fz_mul255(*p, alpha);
+		p++;
+	}
+}
+
+/* Instantiate the spans for each pixel size, so that the loads and
+ * stores are all of constant size. */
+#define SIMD_BLEND_SIZES(SPAN, ...) \
+	switch (n1 * 4 + sal * 2 + bal) \
+	{ \
+	case 1*4+0: SPAN(bp, 0, sp, 0, 1, __VA_ARGS__); break; \
+	case 1*4+1: SPAN(bp, 1, sp, 0, 1, __VA_ARGS__); break; \
+	case 1*4+2: SPAN(bp, 0, sp, 1, 1, __VA_ARGS__); break; \
+	case 1*4+3: SPAN(bp, 1, sp, 1, 1, __VA_ARGS__); break; \
+	case 3*4+0: SPAN(bp, 0, sp, 0, 3, __VA_ARGS__); break; \
+	case 3*4+1: SPAN(bp, 1, sp, 0, 3, __VA_ARGS__); break; \
+	case 3*4+2: SPAN(bp, 0, sp, 1, 3, __VA_ARGS__); break; \
+	case 3*4+3: SPAN(bp, 1, sp, 1, 3, __VA_ARGS__); break; \
+	case 4*4+0: SPAN(bp, 0, sp, 0, 4, __VA_ARGS__); break; \
+	case 4*4+1: SPAN(bp, 1, sp, 0, 4, __VA_ARGS__); break; \
+	case 4*4+2: SPAN(bp, 0, sp, 1, 4, __VA_ARGS__); break; \
+	case 4*4+3: SPAN(bp, 1, sp, 1, 4, __VA_ARGS__); break; \
+	}
+
+static SIMD_TARGET void
+SIMD_FN(blend_separable)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, int blendmode, int complement, const byte * FZ_RESTRICT hp, int alpha)
+{
+	SIMD_BLEND_SIZES(SIMD_FN(separable_span), w, blendmode, complement)
+}
+
+static SIMD_TARGET void
+SIMD_FN(blend_separable_nonisolated)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, int blendmode, int complement, const byte * FZ_RESTRICT hp, int alpha)
+{
+	SIMD_BLEND_SIZES(SIMD_FN(nonisolated_span), w, blendmode, complement, hp, alpha)
+}
+
+static SIMD_TARGET void
+SIMD_FN(blend_knockout)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, const byte * FZ_RESTRICT hp)
+{
+	SIMD_BLEND_SIZES(SIMD_FN(knockout_span), w, hp)
+}
+
+#undef SIMD_BLEND_SIZES
+#undef SIMD_OP
+#undef SIMD_LANES
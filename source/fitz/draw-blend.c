@@ -7,6 +7,10 @@
 #include <math.h>
 #include <assert.h>
 
+#if FZ_ENABLE_SIMD
+#include <immintrin.h>
+#endif
+
 /* PDF 1.4 blend modes. These are slow. */
 
 /* Define PARANOID_PREMULTIPLY to check premultiplied values are
@@ -1067,6 +1071,70 @@ verify_premultiply(fz_context *ctx, const fz_pixmap * FZ_RESTRICT dst)
 }
 #endif
 
+#if FZ_ENABLE_SIMD
+
+static inline void fz_blend_knockout(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, const byte * FZ_RESTRICT hp);
+
+#define SIMD_FN(x) x##_sse41
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+#define SIMD_AVX2 0
+#include "draw-blend-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+#define SIMD_FN(x) x##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_AVX2 1
+#include "draw-blend-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+typedef void (simd_blend_fn)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, int blendmode, int complement, const byte * FZ_RESTRICT hp, int alpha);
+typedef void (simd_knockout_fn)(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, int sal, int n1, int w, const byte * FZ_RESTRICT hp);
+typedef void (simd_scale_alpha_fn)(byte * FZ_RESTRICT p, int len, int alpha);
+
+/*
+	The SIMD blenders handle the separable modes for gray, rgb and
+	cmyk, with or without alpha, but not spots.
+*/
+static simd_blend_fn *
+simd_blend_separable(int isolated, int n1, int first_spot)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return NULL;
+	if (first_spot != n1 || (n1 != 1 && n1 != 3 && n1 != 4))
+		return NULL;
+	if (isolated)
+		return avx2 ? blend_separable_avx2 : blend_separable_sse41;
+	return avx2 ? blend_separable_nonisolated_avx2 : blend_separable_nonisolated_sse41;
+}
+
+static simd_scale_alpha_fn *
+simd_blend_scale_alpha(void)
+{
+	if (fz_simd_level() >= FZ_SIMD_AVX2)
+		return blend_scale_alpha_avx2;
+	if (fz_simd_level() >= FZ_SIMD_SSE4_1)
+		return blend_scale_alpha_sse41;
+	return NULL;
+}
+
+static simd_knockout_fn *
+simd_blend_knockout(int n1)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return NULL;
+	if (n1 != 1 && n1 != 3 && n1 != 4)
+		return NULL;
+	return avx2 ? blend_knockout_avx2 : blend_knockout_sse41;
+}
+
+#endif /* FZ_ENABLE_SIMD */
+
 void
 fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RESTRICT src, int alpha, int blendmode, int isolated, const fz_pixmap * FZ_RESTRICT shape)
 {
@@ -1076,22 +1144,38 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 	int x, y, w, h, n;
 	int da, sa;
 	int complement;
+#if FZ_ENABLE_SIMD
+	simd_blend_fn *simd = NULL;
+#endif
 
 	/* TODO: fix this hack! */
 	if (isolated && alpha < 255)
 	{
 		unsigned char *sp2;
 		int nn;
+#if FZ_ENABLE_SIMD
+		simd_scale_alpha_fn *scale_alpha = simd_blend_scale_alpha();
+#endif
 		h = src->h;
 		sp2 = src->samples;
 		nn = src->w * src->n;
 		while (h--)
 		{
-			n = nn;
-			while (n--)
+#if FZ_ENABLE_SIMD
+			if (scale_alpha)
 			{
-				*sp2 = fz_mul255(*sp2, alpha);
-				sp2++;
+				scale_alpha(sp2, nn, alpha);
+				sp2 += nn;
+			}
+			else
+#endif
+			{
+				n = nn;
+				while (n--)
+				{
+					*sp2 = fz_mul255(*sp2, alpha);
+					sp2++;
+				}
 			}
 			sp2 += src->stride - nn;
 		}
@@ -1126,6 +1210,11 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 	n -= sa;
 	assert(n == dst->n - da);
 
+#if FZ_ENABLE_SIMD
+	if (blendmode < FZ_BLEND_HUE)
+		simd = simd_blend_separable(isolated, n, n - src->s);
+#endif
+
 	if (!isolated)
 	{
 		const unsigned char *hp = shape->samples + (y - shape->y) * (size_t)shape->stride + (x - shape->x);
@@ -1163,6 +1252,10 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 							else
 								fz_blend_nonseparable_nonisolated(dp, 0, sp, 0, n, w, blendmode, complement, hp, alpha, n);
 			}
+#if FZ_ENABLE_SIMD
+			else if (simd)
+				simd(dp, da, sp, sa, n, w, blendmode, complement, hp, alpha);
+#endif
 			else
 			{
 				if (complement || src->s > 0)
@@ -1219,6 +1312,10 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 							else
 								fz_blend_nonseparable(dp, 0, sp, 0, n, w, blendmode, complement, n);
 			}
+#if FZ_ENABLE_SIMD
+			else if (simd)
+				simd(dp, da, sp, sa, n, w, blendmode, complement, NULL, alpha);
+#endif
 			else
 			{
 				if (complement || src->s > 0)
@@ -1301,6 +1398,9 @@ fz_blend_pixmap_knockout(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap
 	int x, y, w, h, n;
 	int da, sa;
 	const unsigned char *hp;
+#if FZ_ENABLE_SIMD
+	simd_knockout_fn *simd;
+#endif
 
 	dbox = fz_pixmap_bbox_no_ctx(dst);
 	sbox = fz_pixmap_bbox_no_ctx(src);
@@ -1330,9 +1430,18 @@ fz_blend_pixmap_knockout(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap
 	n -= sa;
 	assert(n == dst->n - da);
 
+#if FZ_ENABLE_SIMD
+	simd = simd_blend_knockout(n);
+#endif
+
 	while (h--)
 	{
-		fz_blend_knockout(dp, da, sp, sa, n, w, hp);
+#if FZ_ENABLE_SIMD
+		if (simd)
+			simd(dp, da, sp, sa, n, w, hp);
+		else
+#endif
+			fz_blend_knockout(dp, da, sp, sa, n, w, hp);
 		sp += src->stride;
 		dp += dst->stride;
 		hp += shape->stride;
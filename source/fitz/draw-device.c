@@ -13,6 +13,11 @@
 
 #define STACK_SIZE 96
 
+/* The most pixmaps, and the most bytes of samples, that the device keeps
+ * for reuse once it has finished with them. */
+#define POOL_SIZE 16
+#define POOL_MAX_BYTES (32 << 20)
+
 /* Enable the following to attempt to support knockout and/or isolated
  * blending groups. */
 #define ATTEMPT_KNOCKOUT_AND_ISOLATED
@@ -25,8 +30,13 @@
 
 enum {
 	FZ_DRAWDEV_FLAGS_TYPE3 = 1,
+	FZ_DRAWDEV_FLAGS_PREVIEW = 2,
 };
 
+/* In preview mode, images are fetched at this fraction of the size they
+ * are drawn at. */
+#define PREVIEW_IMAGE_SCALE 8
+
 typedef struct {
 	fz_irect scissor;
 	fz_pixmap *dest;
@@ -41,6 +51,11 @@ typedef struct {
 	fz_irect area;
 } fz_draw_state;
 
+typedef struct {
+	fz_pixmap *pix;
+	size_t size;
+} fz_draw_pooled;
+
 typedef struct fz_draw_device
 {
 	fz_device super;
@@ -49,6 +64,7 @@ typedef struct fz_draw_device
 	fz_default_colorspaces *default_cs;
 	fz_colorspace *proof_cs;
 	int flags;
+	float greek;
 	int resolve_spots;
 	int top;
 	fz_scale_cache *cache_x;
@@ -56,6 +72,9 @@ typedef struct fz_draw_device
 	fz_draw_state *stack;
 	int stack_cap;
 	fz_draw_state init_stack[STACK_SIZE];
+	int pool_len;
+	size_t pool_size;
+	fz_draw_pooled pool[POOL_SIZE];
 } fz_draw_device;
 
 #ifdef DUMP_GROUP_BLENDS
@@ -189,6 +208,96 @@ static fz_draw_state *convert_stack(fz_context *ctx, fz_draw_device *dev, const
 	return state;
 }
 
+/* Clips, masks, groups and knockouts each need scratch pixmaps, which
+ * are freed again when they are popped. Rather than go back to malloc
+ * for every one, the device keeps the last few it freed, and hands them
+ * out again for later ones of the same format and a similar size. */
+static fz_pixmap *
+new_pooled_pixmap(fz_context *ctx, fz_draw_device *dev, fz_colorspace *colorspace, fz_irect bbox, fz_separations *seps, int alpha)
+{
+	int w = fz_irect_width(bbox);
+	int h = fz_irect_height(bbox);
+	int n, i;
+	size_t size;
+	fz_pixmap *pix;
+
+	if (!colorspace && fz_count_active_separations(ctx, seps) == 0)
+		alpha = 1;
+	n = fz_colorspace_n(ctx, colorspace) + fz_count_active_separations(ctx, seps) + alpha;
+	size = (size_t)w * h * n;
+
+	/* Most recently freed first; don't waste more than half a buffer. */
+	for (i = dev->pool_len - 1; i >= 0; i--)
+	{
+		pix = dev->pool[i].pix;
+		if (pix->colorspace != colorspace || pix->seps != seps || pix->alpha != alpha)
+			continue;
+		if (dev->pool[i].size < size || dev->pool[i].size / 2 > size)
+			continue;
+
+		dev->pool_size -= dev->pool[i].size;
+		dev->pool_len--;
+		memmove(&dev->pool[i], &dev->pool[i + 1], (dev->pool_len - i) * sizeof(*dev->pool));
+
+		pix->x = bbox.x0;
+		pix->y = bbox.y0;
+		pix->w = w;
+		pix->h = h;
+		pix->stride = (ptrdiff_t)w * n;
+		pix->flags = FZ_PIXMAP_FLAG_INTERPOLATE | FZ_PIXMAP_FLAG_FREE_SAMPLES;
+		pix->xres = 96;
+		pix->yres = 96;
+		return pix;
+	}
+
+	return fz_new_pixmap_with_bbox(ctx, colorspace, bbox, seps, alpha);
+}
+
+/* Drop a pixmap, keeping it for reuse if nothing else holds on to it. */
+static void
+drop_pooled_pixmap(fz_context *ctx, fz_draw_device *dev, fz_pixmap *pix)
+{
+	size_t size;
+
+	if (pix == NULL)
+		return;
+
+	if (pix->storable.refs != 1 || pix->underlying || !(pix->flags & FZ_PIXMAP_FLAG_FREE_SAMPLES) || pix->stride <= 0)
+	{
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	size = (size_t)pix->stride * pix->h;
+	if (size == 0 || size > POOL_MAX_BYTES)
+	{
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	/* Make room by dropping the ones that have been waiting longest. */
+	while (dev->pool_len == POOL_SIZE || dev->pool_size + size > POOL_MAX_BYTES)
+	{
+		dev->pool_size -= dev->pool[0].size;
+		fz_drop_pixmap(ctx, dev->pool[0].pix);
+		dev->pool_len--;
+		memmove(&dev->pool[0], &dev->pool[1], dev->pool_len * sizeof(*dev->pool));
+	}
+
+	dev->pool[dev->pool_len].pix = pix;
+	dev->pool[dev->pool_len].size = size;
+	dev->pool_len++;
+	dev->pool_size += size;
+}
+
+static void
+empty_pool(fz_context *ctx, fz_draw_device *dev)
+{
+	while (dev->pool_len > 0)
+		fz_drop_pixmap(ctx, dev->pool[--dev->pool_len].pix);
+	dev->pool_size = 0;
+}
+
 static fz_draw_state *
 fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 {
@@ -203,12 +312,12 @@ fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 
 	bbox = fz_pixmap_bbox(ctx, state->dest);
 	bbox = fz_intersect_irect(bbox, state->scissor);
-	state[1].dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
+	state[1].dest = new_pooled_pixmap(ctx, dev, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
 	if (state[0].group_alpha)
 	{
 		ga_bbox = fz_pixmap_bbox(ctx, state->group_alpha);
 		ga_bbox = fz_intersect_irect(ga_bbox, state->scissor);
-		state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, state->group_alpha->colorspace, ga_bbox, state->group_alpha->seps, state->group_alpha->alpha);
+		state[1].group_alpha = new_pooled_pixmap(ctx, dev, state->group_alpha->colorspace, ga_bbox, state->group_alpha->seps, state->group_alpha->alpha);
 	}
 
 	if (isolated)
@@ -248,7 +357,7 @@ fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 	}
 
 	/* Knockout groups (and only knockout groups) rely on shape */
-	state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+	state[1].shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 	fz_clear_pixmap(ctx, state[1].shape);
 
 #ifdef DUMP_GROUP_BLENDS
@@ -302,14 +411,14 @@ static void fz_knockout_end(fz_context *ctx, fz_draw_device *dev)
 #endif
 
 	fz_blend_pixmap_knockout(ctx, state[0].dest, state[1].dest, state[1].shape);
-	fz_drop_pixmap(ctx, state[1].dest);
+	drop_pooled_pixmap(ctx, dev, state[1].dest);
 	state[1].dest = NULL;
 
 	if (state[1].group_alpha && state[0].group_alpha != state[1].group_alpha)
 	{
 		if (state[0].group_alpha)
 			fz_blend_pixmap_knockout(ctx, state[0].group_alpha, state[1].group_alpha, state[1].shape);
-		fz_drop_pixmap(ctx, state[1].group_alpha);
+		drop_pooled_pixmap(ctx, dev, state[1].group_alpha);
 		state[1].group_alpha = NULL;
 	}
 
@@ -317,7 +426,7 @@ static void fz_knockout_end(fz_context *ctx, fz_draw_device *dev)
 	{
 		if (state[0].shape)
 			fz_paint_pixmap(state[0].shape, state[1].shape, 255);
-		fz_drop_pixmap(ctx, state[1].shape);
+		drop_pooled_pixmap(ctx, dev, state[1].shape);
 		state[1].shape = NULL;
 	}
 
@@ -736,6 +845,31 @@ fz_draw_stroke_path(fz_context *ctx, fz_device *devp, const fz_path *path, const
 		fz_knockout_end(ctx, dev);
 }
 
+/* Whether the part of a rectangle within bbox lies on pixel boundaries,
+ * to within less than a level of 8 bit coverage. If so, *ir is set to
+ * the pixels it covers. */
+static int
+is_pixel_aligned_rect(fz_rect r, fz_irect bbox, fz_irect *ir)
+{
+	float x0, y0, x1, y1;
+
+	r = fz_intersect_rect(r, fz_rect_from_irect(bbox));
+	if (fz_is_empty_rect(r))
+	{
+		*ir = fz_empty_irect;
+		return 1;
+	}
+	x0 = roundf(r.x0);
+	y0 = roundf(r.y0);
+	x1 = roundf(r.x1);
+	y1 = roundf(r.y1);
+	if (fabsf(r.x0 - x0) >= 1/256.0f || fabsf(r.y0 - y0) >= 1/256.0f ||
+		fabsf(r.x1 - x1) >= 1/256.0f || fabsf(r.y1 - y1) >= 1/256.0f)
+		return 0;
+	*ir = fz_make_irect(x0, y0, x1, y1);
+	return 1;
+}
+
 static void
 fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int even_odd, fz_matrix in_ctm, fz_rect scissor)
 {
@@ -745,7 +879,8 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int eve
 
 	float expansion = fz_matrix_expansion(ctm);
 	float flatness;
-	fz_irect bbox;
+	fz_irect bbox, rbox;
+	fz_rect rect;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model;
 
@@ -773,6 +908,19 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int eve
 		bbox = fz_intersect_irect(fz_pixmap_bbox(ctx, state->dest), state->scissor);
 	}
 
+	/* A rectangle on pixel boundaries clips exactly as a scissor would,
+	 * so needs no mask, whichever rasterizer is in use. */
+	rect = fz_path_fill_rect(ctx, path, ctm);
+	if (!fz_is_empty_rect(rect) && is_pixel_aligned_rect(rect, bbox, &rbox))
+	{
+		state[1].scissor = rbox;
+		state[1].mask = NULL;
+#ifdef DUMP_GROUP_BLENDS
+		dump_spaces(dev->top-1, "Clip (pixel aligned rectangle) begin\n");
+#endif
+		return;
+	}
+
 	if (fz_flatten_fill_path(ctx, rast, path, ctm, flatness, bbox, &bbox) || fz_is_rect_rasterizer(ctx, rast))
 	{
 		state[1].scissor = bbox;
@@ -783,18 +931,18 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int eve
 		return;
 	}
 
-	state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+	state[1].mask = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 	fz_clear_pixmap(ctx, state[1].mask);
-	state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+	state[1].dest = new_pooled_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 	fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 	if (state[1].shape)
 	{
-		state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].shape, state[0].shape, bbox, dev->default_cs);
 	}
 	if (state[1].group_alpha)
 	{
-		state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].group_alpha, state[0].group_alpha, bbox, dev->default_cs);
 	}
 
@@ -861,25 +1009,25 @@ fz_draw_clip_stroke_path(fz_context *ctx, fz_device *devp, const fz_path *path,
 		return;
 	}
 
-	state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+	state[1].mask = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 	fz_clear_pixmap(ctx, state[1].mask);
 	/* When there is no alpha in the current destination (state[0].dest->alpha == 0)
 	 * we have a choice. We can either create the new destination WITH alpha, or
 	 * we can copy the old pixmap contents in. We opt for the latter here, but
 	 * may want to revisit this decision in the future. */
-	state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+	state[1].dest = new_pooled_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 	if (state[0].dest->alpha)
 		fz_clear_pixmap(ctx, state[1].dest);
 	else
 		fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 	if (state->shape)
 	{
-		state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].shape, state[0].shape, bbox, dev->default_cs);
 	}
 	if (state->group_alpha)
 	{
-		state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].group_alpha, state[0].group_alpha, bbox, dev->default_cs);
 	}
 
@@ -963,6 +1111,39 @@ draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_glyph *glyph,
 	}
 }
 
+/* Paint a box, in place of a glyph too small to be worth drawing. */
+static void
+draw_greek_box(const unsigned char *colorbv, fz_pixmap *dst, fz_irect bbox, const fz_irect *scissor, fz_overprint *eop)
+{
+	fz_solid_color_painter_t *fn;
+	unsigned char color[FZ_MAX_COLORS + 1];
+	unsigned char *dp;
+	int w, h, k;
+
+	bbox = fz_intersect_irect(bbox, *scissor);
+	bbox = fz_intersect_irect(bbox, fz_pixmap_bbox_no_ctx(dst));
+	if (fz_is_empty_irect(bbox))
+		return;
+
+	/* Half coverage, for about the same weight as the text. */
+	k = dst->n - dst->alpha;
+	memcpy(color, colorbv, k + 1);
+	color[k] = (color[k] + 1) >> 1;
+
+	fn = fz_get_solid_color_painter(dst->n, color, dst->alpha, eop);
+	assert(fn);
+	if (fn == NULL)
+		return;
+	w = bbox.x1 - bbox.x0;
+	h = bbox.y1 - bbox.y0;
+	dp = dst->samples + (bbox.y0 - dst->y) * (size_t)dst->stride + (bbox.x0 - dst->x) * (size_t)dst->n;
+	while (h--)
+	{
+		(*fn)(dp, dst->n, w, color, dst->alpha, eop);
+		dp += dst->stride;
+	}
+}
+
 static void
 fz_draw_fill_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matrix in_ctm,
 	fz_colorspace *colorspace_in, const float *color, float alpha, fz_color_params color_params)
@@ -1014,6 +1195,18 @@ fz_draw_fill_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matr
 			tm.f = span->items[i].y;
 			trm = fz_concat(tm, ctm);
 
+			if (fz_matrix_expansion(trm) < dev->greek)
+			{
+				/* Roughly where the x-height of the glyph would be. */
+				fz_irect box = fz_irect_from_rect(fz_transform_rect(fz_make_rect(0.05f, 0, 0.55f, 0.5f), trm));
+				draw_greek_box(colorbv, state->dest, box, &state->scissor, eop);
+				if (state->shape)
+					draw_greek_box(&shapebv, state->shape, box, &state->scissor, 0);
+				if (state->group_alpha)
+					draw_greek_box(&shapebva, state->group_alpha, box, &state->scissor, 0);
+				continue;
+			}
+
 			glyph = fz_render_glyph(ctx, span->font, gid, &trm, model, &state->scissor, state->dest->alpha, fz_rasterizer_text_aa_level(rast));
 			if (glyph)
 			{
@@ -1176,27 +1369,27 @@ fz_draw_clip_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matr
 		bbox = fz_intersect_irect(bbox, fz_irect_from_rect(tscissor));
 	}
 
-	state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+	state[1].mask = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 	fz_clear_pixmap(ctx, state[1].mask);
 	/* When there is no alpha in the current destination (state[0].dest->alpha == 0)
 	 * we have a choice. We can either create the new destination WITH alpha, or
 	 * we can copy the old pixmap contents in. We opt for the latter here, but
 	 * may want to revisit this decision in the future. */
-	state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+	state[1].dest = new_pooled_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 	if (state[0].dest->alpha)
 		fz_clear_pixmap(ctx, state[1].dest);
 	else
 		fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 	if (state->shape)
 	{
-		state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].shape, state[0].shape, bbox, dev->default_cs);
 	}
 	else
 		state[1].shape = NULL;
 	if (state->group_alpha)
 	{
-		state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].group_alpha, state[0].group_alpha, bbox, dev->default_cs);
 	}
 	else
@@ -1300,27 +1493,27 @@ fz_draw_clip_stroke_text(fz_context *ctx, fz_device *devp, const fz_text *text,
 		bbox = fz_intersect_irect(bbox, fz_irect_from_rect(tscissor));
 	}
 
-	state[1].mask = mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+	state[1].mask = mask = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 	fz_clear_pixmap(ctx, mask);
 	/* When there is no alpha in the current destination (state[0].dest->alpha == 0)
 	 * we have a choice. We can either create the new destination WITH alpha, or
 	 * we can copy the old pixmap contents in. We opt for the latter here, but
 	 * may want to revisit this decision in the future. */
-	state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+	state[1].dest = dest = new_pooled_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 	if (state[0].dest->alpha)
 		fz_clear_pixmap(ctx, state[1].dest);
 	else
 		fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 	if (state->shape)
 	{
-		state[1].shape = shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].shape = shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].shape, state[0].shape, bbox, dev->default_cs);
 	}
 	else
 		shape = state->shape;
 	if (state->group_alpha)
 	{
-		state[1].group_alpha = group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].group_alpha = group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_copy_pixmap_rect(ctx, state[1].group_alpha, state[0].group_alpha, bbox, dev->default_cs);
 	}
 	else
@@ -1442,19 +1635,19 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, fz_matrix
 	{
 		if (alpha < 1)
 		{
-			dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
+			dest = new_pooled_pixmap(ctx, dev, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
 			if (state->dest->alpha)
 				fz_clear_pixmap(ctx, dest);
 			else
 				fz_copy_pixmap_rect(ctx, dest, state[0].dest, bbox, dev->default_cs);
 			if (shape)
 			{
-				shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+				shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 				fz_clear_pixmap(ctx, shape);
 			}
 			if (group_alpha)
 			{
-				group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+				group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 				fz_clear_pixmap(ctx, group_alpha);
 			}
 		}
@@ -1544,20 +1737,20 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, fz_matrix
 		{
 			/* FIXME: eop */
 			fz_paint_pixmap(state->dest, dest, alpha * 255);
-			fz_drop_pixmap(ctx, dest);
+			drop_pooled_pixmap(ctx, dev, dest);
 			dest = NULL;
 
 			if (shape)
 			{
 				fz_paint_pixmap(state->shape, shape, 255);
-				fz_drop_pixmap(ctx, shape);
+				drop_pooled_pixmap(ctx, dev, shape);
 				shape = NULL;
 			}
 
 			if (group_alpha)
 			{
 				fz_paint_pixmap(state->group_alpha, group_alpha, alpha * 255);
-				fz_drop_pixmap(ctx, group_alpha);
+				drop_pooled_pixmap(ctx, dev, group_alpha);
 				group_alpha = NULL;
 			}
 		}
@@ -1567,9 +1760,9 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, fz_matrix
 	}
 	fz_catch(ctx)
 	{
-		if (dest != state[0].dest) fz_drop_pixmap(ctx, dest);
-		if (shape != state[0].shape) fz_drop_pixmap(ctx, shape);
-		if (group_alpha != state[0].group_alpha) fz_drop_pixmap(ctx, group_alpha);
+		if (dest != state[0].dest) drop_pooled_pixmap(ctx, dev, dest);
+		if (shape != state[0].shape) drop_pooled_pixmap(ctx, dev, shape);
+		if (group_alpha != state[0].group_alpha) drop_pooled_pixmap(ctx, dev, group_alpha);
 		fz_rethrow(ctx);
 	}
 }
@@ -1679,6 +1872,26 @@ convert_pixmap_for_painting(fz_context *ctx, fz_pixmap *pixmap, fz_colorspace *m
 	return converted;
 }
 
+/* As fz_get_pixmap_from_image, but in preview mode ask for a smaller
+ * image, so that decoders that can subsample as they go (such as JPEG)
+ * do so. The ctm is adjusted as usual, for drawing at full size. */
+static fz_pixmap *
+draw_get_pixmap_from_image(fz_context *ctx, fz_draw_device *dev, fz_image *image, const fz_irect *subarea, fz_matrix *ctm, int *dx, int *dy)
+{
+	fz_matrix small;
+	fz_pixmap *pixmap;
+
+	if (!(dev->flags & FZ_DRAWDEV_FLAGS_PREVIEW))
+		return fz_get_pixmap_from_image(ctx, image, subarea, ctm, dx, dy);
+
+	small = fz_post_scale(*ctm, 1.0f / PREVIEW_IMAGE_SCALE, 1.0f / PREVIEW_IMAGE_SCALE);
+	pixmap = fz_get_pixmap_from_image(ctx, image, subarea, &small, dx, dy);
+	*ctm = fz_post_scale(small, PREVIEW_IMAGE_SCALE, PREVIEW_IMAGE_SCALE);
+	*dx *= PREVIEW_IMAGE_SCALE;
+	*dy *= PREVIEW_IMAGE_SCALE;
+	return pixmap;
+}
+
 static void
 fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix in_ctm, float alpha, fz_color_params color_params)
 {
@@ -1746,7 +1959,7 @@ fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix
 			return;
 	}
 
-	pixmap = fz_get_pixmap_from_image(ctx, image, &src_area, &local_ctm, &dx, &dy);
+	pixmap = draw_get_pixmap_from_image(ctx, dev, image, &src_area, &local_ctm, &dx, &dy);
 	src_cs = fz_default_colorspace(ctx, dev->default_cs, pixmap->colorspace);
 
 	/* convert images with more components (cmyk->rgb) before scaling */
@@ -1781,7 +1994,8 @@ fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix
 		if (conversion_required && !after)
 			pixmap = convert_pixmap_for_painting(ctx, pixmap, model, src_cs, state->dest, color_params, dev, &eop);
 
-		if (!(devp->hints & FZ_DONT_INTERPOLATE_IMAGES) && ctx->tuning->image_scale(ctx->tuning->image_scale_arg, dx, dy, pixmap->w, pixmap->h))
+		/* In preview mode, leave the painter to do any scaling. */
+		if (!(devp->hints & FZ_DONT_INTERPOLATE_IMAGES) && !(dev->flags & FZ_DRAWDEV_FLAGS_PREVIEW) && ctx->tuning->image_scale(ctx->tuning->image_scale_arg, dx, dy, pixmap->w, pixmap->h))
 		{
 			int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
 			fz_pixmap *scaled = fz_transform_pixmap(ctx, dev, pixmap, &local_ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
@@ -1893,7 +2107,7 @@ fz_draw_fill_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_ma
 			return;
 	}
 
-	pixmap = fz_get_pixmap_from_image(ctx, image, &src_area, &local_ctm, &dx, &dy);
+	pixmap = draw_get_pixmap_from_image(ctx, dev, image, &src_area, &local_ctm, &dx, &dy);
 
 	fz_var(pixmap);
 
@@ -1902,7 +2116,8 @@ fz_draw_fill_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_ma
 		if (state->blendmode & FZ_BLEND_KNOCKOUT)
 			state = fz_knockout_begin(ctx, dev);
 
-		if (!(devp->hints & FZ_DONT_INTERPOLATE_IMAGES) && ctx->tuning->image_scale(ctx->tuning->image_scale_arg, dx, dy, pixmap->w, pixmap->h))
+		/* In preview mode, leave the painter to do any scaling. */
+		if (!(devp->hints & FZ_DONT_INTERPOLATE_IMAGES) && !(dev->flags & FZ_DRAWDEV_FLAGS_PREVIEW) && ctx->tuning->image_scale(ctx->tuning->image_scale_arg, dx, dy, pixmap->w, pixmap->h))
 		{
 			int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
 			scaled = fz_transform_pixmap(ctx, dev, pixmap, &local_ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
@@ -1990,19 +2205,19 @@ fz_draw_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_ma
 	{
 		pixmap = fz_get_pixmap_from_image(ctx, image, NULL, &local_ctm, &dx, &dy);
 
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].mask = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].mask);
 
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+		state[1].dest = new_pooled_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 		fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 		if (state[0].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		if (state[0].group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 
@@ -2090,18 +2305,18 @@ fz_draw_pop_clip(fz_context *ctx, fz_device *devp)
 		if (state[0].shape != state[1].shape)
 		{
 			fz_paint_pixmap_with_mask(state[0].shape, state[1].shape, state[1].mask);
-			fz_drop_pixmap(ctx, state[1].shape);
+			drop_pooled_pixmap(ctx, dev, state[1].shape);
 			state[1].shape = NULL;
 		}
 		if (state[0].group_alpha != state[1].group_alpha)
 		{
 			fz_paint_pixmap_with_mask(state[0].group_alpha, state[1].group_alpha, state[1].mask);
-			fz_drop_pixmap(ctx, state[1].group_alpha);
+			drop_pooled_pixmap(ctx, dev, state[1].group_alpha);
 			state[1].group_alpha = NULL;
 		}
-		fz_drop_pixmap(ctx, state[1].mask);
+		drop_pooled_pixmap(ctx, dev, state[1].mask);
 		state[1].mask = NULL;
-		fz_drop_pixmap(ctx, state[1].dest);
+		drop_pooled_pixmap(ctx, dev, state[1].dest);
 		state[1].dest = NULL;
 
 #ifdef DUMP_GROUP_BLENDS
@@ -2150,9 +2365,9 @@ fz_draw_begin_mask(fz_context *ctx, fz_device *devp, fz_rect area, int luminosit
 	 * If !luminosity, then we generate a mask from the alpha value of the shapes.
 	 */
 	if (luminosity)
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), bbox, NULL, 0);
+		state[1].dest = dest = new_pooled_pixmap(ctx, dev, fz_device_gray(ctx), bbox, NULL, 0);
 	else
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].dest = dest = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 	if (state->shape)
 	{
 		/* FIXME: If we ever want to support AIS true, then
@@ -2220,16 +2435,16 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 		/* convert to alpha mask */
 		temp = fz_alpha_from_gray(ctx, state[1].dest);
 		if (state[1].mask != state[0].mask)
-			fz_drop_pixmap(ctx, state[1].mask);
+			drop_pooled_pixmap(ctx, dev, state[1].mask);
 		state[1].mask = temp;
 		if (state[1].dest != state[0].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+			drop_pooled_pixmap(ctx, dev, state[1].dest);
 		state[1].dest = NULL;
 		if (state[1].shape != state[0].shape)
-			fz_drop_pixmap(ctx, state[1].shape);
+			drop_pooled_pixmap(ctx, dev, state[1].shape);
 		state[1].shape = NULL;
 		if (state[1].group_alpha != state[0].group_alpha)
-			fz_drop_pixmap(ctx, state[1].group_alpha);
+			drop_pooled_pixmap(ctx, dev, state[1].group_alpha);
 		state[1].group_alpha = NULL;
 
 #ifdef DUMP_GROUP_BLENDS
@@ -2239,7 +2454,7 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 
 		/* create new dest scratch buffer */
 		bbox = fz_pixmap_bbox(ctx, temp);
-		dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
+		dest = new_pooled_pixmap(ctx, dev, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
 		fz_copy_pixmap_rect(ctx, dest, state->dest, bbox, dev->default_cs);
 
 		/* push soft mask as clip mask */
@@ -2249,12 +2464,12 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 		 * clip mask when we pop. So create a new shape now. */
 		if (state[0].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		if (state[0].group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 		state[1].scissor = bbox;
@@ -2290,7 +2505,7 @@ fz_draw_begin_group(fz_context *ctx, fz_device *devp, fz_rect area, fz_colorspac
 	isolated = 1;
 #endif
 
-	state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha || isolated);
+	state[1].dest = dest = new_pooled_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha || isolated);
 
 	if (isolated)
 	{
@@ -2300,7 +2515,7 @@ fz_draw_begin_group(fz_context *ctx, fz_device *devp, fz_rect area, fz_colorspac
 	else
 	{
 		fz_copy_pixmap_rect(ctx, dest, state[0].dest, bbox, dev->default_cs);
-		state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].group_alpha = new_pooled_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].group_alpha);
 	}
 
@@ -2378,7 +2593,7 @@ fz_draw_end_group(fz_context *ctx, fz_device *devp)
 	if (state[0].dest->colorspace != state[1].dest->colorspace)
 	{
 		fz_pixmap *converted = fz_convert_pixmap(ctx, state[1].dest, state[0].dest->colorspace, NULL, dev->default_cs, fz_default_color_params, 1);
-		fz_drop_pixmap(ctx, state[1].dest);
+		drop_pooled_pixmap(ctx, dev, state[1].dest);
 		state[1].dest = converted;
 	}
 
@@ -2425,12 +2640,12 @@ fz_draw_end_group(fz_context *ctx, fz_device *devp)
 
 	if (state[0].shape != state[1].shape)
 	{
-		fz_drop_pixmap(ctx, state[1].shape);
+		drop_pooled_pixmap(ctx, dev, state[1].shape);
 		state[1].shape = NULL;
 	}
-	fz_drop_pixmap(ctx, state[1].group_alpha);
+	drop_pooled_pixmap(ctx, dev, state[1].group_alpha);
 	state[1].group_alpha = NULL;
-	fz_drop_pixmap(ctx, state[1].dest);
+	drop_pooled_pixmap(ctx, dev, state[1].dest);
 	state[1].dest = NULL;
 
 	if (state[0].blendmode & FZ_BLEND_KNOCKOUT)
@@ -2903,6 +3118,8 @@ fz_draw_close_device(fz_context *ctx, fz_device *devp)
 		fz_catch(ctx)
 			fz_rethrow(ctx);
 	}
+
+	empty_pool(ctx, dev);
 }
 
 static void
@@ -2927,6 +3144,7 @@ fz_draw_drop_device(fz_context *ctx, fz_device *devp)
 		if (state[1].group_alpha != state[0].group_alpha)
 			fz_drop_pixmap(ctx, state[1].group_alpha);
 	}
+	empty_pool(ctx, dev);
 
 	/* We never free the dest/mask/shape at level 0, as:
 	 * 1) dest is passed in and ownership remains with the caller.
@@ -2980,6 +3198,7 @@ new_draw_device(fz_context *ctx, fz_matrix transform, fz_pixmap *dest, const fz_
 	dev->proof_cs = fz_keep_colorspace(ctx, proof_cs);
 	dev->transform = transform;
 	dev->flags = 0;
+	dev->greek = 0;
 	dev->resolve_spots = 0;
 	dev->top = 0;
 	dev->stack = &dev->init_stack[0];
@@ -3077,6 +3296,22 @@ fz_new_draw_device_type3(fz_context *ctx, fz_matrix transform, fz_pixmap *dest)
 	return (fz_device*)dev;
 }
 
+fz_device *
+fz_new_draw_device_preview(fz_context *ctx, fz_matrix transform, fz_pixmap *dest, float greek)
+{
+	fz_aa_context aa = ctx->aa;
+	fz_draw_device *dev;
+
+#ifndef AA_BITS
+	fz_set_rasterizer_graphics_aa_level(ctx, &aa, 0);
+	fz_set_rasterizer_text_aa_level(ctx, &aa, 0);
+#endif
+	dev = (fz_draw_device*)new_draw_device(ctx, transform, dest, &aa, NULL, NULL);
+	dev->flags |= FZ_DRAWDEV_FLAGS_PREVIEW;
+	dev->greek = greek;
+	return (fz_device*)dev;
+}
+
 fz_irect *
 fz_bound_path_accurate(fz_context *ctx, fz_irect *bbox, fz_irect scissor, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
 {
@@ -7,7 +7,7 @@
 #include <math.h>
 
 #define MAX_GLYPH_SIZE 256
-#define MAX_CACHE_SIZE (1024*1024)
+#define MAX_CACHE_SIZE (4*1024*1024)
 
 #define GLYPH_HASH_LEN 509
 
@@ -32,17 +32,30 @@ typedef struct fz_glyph_cache_entry
 	fz_glyph *val;
 } fz_glyph_cache_entry;
 
-struct fz_glyph_cache
+/* Each shard is protected by its own lock, FZ_LOCK_GLYPHCACHE + n.
+ * We never hold two shard locks at once. Every shard has its own copy
+ * of the limits, so that they can be read under the same lock as the
+ * rest of the shard. */
+typedef struct
 {
-	int refs;
+	int lock;
+	size_t max_size; /* This shard's share of the cache. */
+	int max_glyph_size;
 	size_t total;
-#ifndef NDEBUG
+	int hits;
+	int misses;
 	int num_evictions;
-	ptrdiff_t evicted;
-#endif
+	size_t evicted;
 	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
 	fz_glyph_cache_entry *lru_head;
 	fz_glyph_cache_entry *lru_tail;
+} fz_glyph_cache_shard;
+
+/* refs is protected by FZ_LOCK_GLYPHCACHE (the lock of shard 0). */
+struct fz_glyph_cache
+{
+	int refs;
+	fz_glyph_cache_shard shard[FZ_GLYPH_CACHE_SHARDS];
 };
 
 static size_t
@@ -57,78 +70,128 @@ void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
+	int i;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
 	cache->refs = 1;
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		cache->shard[i].lock = FZ_LOCK_GLYPHCACHE + i;
+		cache->shard[i].max_size = MAX_CACHE_SIZE / FZ_GLYPH_CACHE_SHARDS;
+		cache->shard[i].max_glyph_size = MAX_GLYPH_SIZE;
+	}
 
 	ctx->glyph_cache = cache;
 }
 
 static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
-
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	if (entry->lru_prev)
 		entry->lru_prev->lru_next = entry->lru_next;
 	else
-		cache->lru_head = entry->lru_next;
-	cache->total -= fz_glyph_size(ctx, entry->val);
+		shard->lru_head = entry->lru_next;
+	shard->total -= fz_glyph_size(ctx, entry->val);
 	if (entry->bucket_next)
 		entry->bucket_next->bucket_prev = entry->bucket_prev;
 	if (entry->bucket_prev)
 		entry->bucket_prev->bucket_next = entry->bucket_next;
 	else
-		cache->entry[entry->hash] = entry->bucket_next;
+		shard->entry[entry->hash] = entry->bucket_next;
 	fz_drop_font(ctx, entry->key.font);
 	fz_drop_glyph(ctx, entry->val);
 	fz_free(ctx, entry);
 }
 
-/* The glyph cache lock is always held when this function is called. */
+/* The shard lock is always held when this function is called. */
 static void
-do_purge(fz_context *ctx)
+do_purge(fz_context *ctx, fz_glyph_cache_shard *shard)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
 	int i;
 
 	for (i = 0; i < GLYPH_HASH_LEN; i++)
 	{
-		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+		while (shard->entry[i])
+			drop_glyph_cache_entry(ctx, shard, shard->entry[i]);
 	}
 
-	cache->total = 0;
+	shard->total = 0;
+}
+
+/* Drop the least recently used glyphs until the shard is within its
+ * share of the cache. The shard lock is always held when this function
+ * is called. */
+static void
+do_evict(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+	while (shard->total > shard->max_size && shard->lru_tail)
+	{
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, shard->lru_tail->val);
+		drop_glyph_cache_entry(ctx, shard, shard->lru_tail);
+	}
 }
 
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_lock(ctx, cache->shard[i].lock);
+		do_purge(ctx, &cache->shard[i]);
+		fz_unlock(ctx, cache->shard[i].lock);
+	}
+}
+
+void
+fz_set_glyph_cache_limits(fz_context *ctx, size_t max_size, int max_glyph_size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	if (max_size == 0)
+		max_size = MAX_CACHE_SIZE;
+	if (max_glyph_size <= 0)
+		max_glyph_size = MAX_GLYPH_SIZE;
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+		fz_lock(ctx, shard->lock);
+		shard->max_size = max_size / FZ_GLYPH_CACHE_SHARDS;
+		shard->max_glyph_size = max_glyph_size;
+		do_evict(ctx, shard);
+		fz_unlock(ctx, shard->lock);
+	}
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
+	fz_glyph_cache *cache;
+	int i, refs;
+
 	if (!ctx || !ctx->glyph_cache)
 		return;
 
+	cache = ctx->glyph_cache;
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	refs = --cache->refs;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (refs == 0)
 	{
-		do_purge(ctx);
-		fz_free(ctx, ctx->glyph_cache);
-		ctx->glyph_cache = NULL;
+		for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+			do_purge(ctx, &cache->shard[i]);
+		fz_free(ctx, cache);
 	}
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache = NULL;
 }
 
 fz_glyph_cache *
@@ -215,7 +278,7 @@ static unsigned do_hash(unsigned char *s, int len)
 }
 
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -225,25 +288,41 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	/* Relink */
-	entry->lru_next = cache->lru_head;
+	entry->lru_next = shard->lru_head;
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry;
-	cache->lru_head = entry;
+	shard->lru_head = entry;
 	entry->lru_prev = NULL;
 }
 
+/* Find a glyph in a shard, with the shard lock held. */
+static fz_glyph_cache_entry *
+lookup_glyph(fz_glyph_cache_shard *shard, unsigned hash, const fz_glyph_key *key)
+{
+	fz_glyph_cache_entry *entry = shard->entry[hash];
+	while (entry)
+	{
+		if (memcmp(&entry->key, key, sizeof(*key)) == 0)
+			return entry;
+		entry = entry->bucket_next;
+	}
+	return NULL;
+}
+
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor, int alpha, int aa)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *shard;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
 	float size;
 	fz_glyph *val;
 	int do_cache, locked, caching;
+	int max_glyph_size;
 	fz_glyph_cache_entry *entry;
 	unsigned hash;
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
@@ -252,26 +331,10 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	fz_var(caching);
 	fz_var(val);
 
+	cache = ctx->glyph_cache;
+
 	memset(&key, 0, sizeof key);
 	size = fz_subpixel_adjust(ctx, ctm, &subpix_ctm, &key.e, &key.f);
-	if (size <= MAX_GLYPH_SIZE)
-	{
-		scissor = &fz_infinite_irect;
-		do_cache = 1;
-	}
-	else
-	{
-		if (is_ft_font)
-			return NULL;
-		subpix_scissor.x0 = scissor->x0 - floorf(ctm->e);
-		subpix_scissor.y0 = scissor->y0 - floorf(ctm->f);
-		subpix_scissor.x1 = scissor->x1 - floorf(ctm->e);
-		subpix_scissor.y1 = scissor->y1 - floorf(ctm->f);
-		scissor = &subpix_scissor;
-		do_cache = 0;
-	}
-
-	cache = ctx->glyph_cache;
 
 	key.font = font;
 	key.gid = gid;
@@ -281,22 +344,50 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = aa;
 
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	entry = cache->entry[hash];
-	while (entry)
+	hash = do_hash((unsigned char *)&key, sizeof(key));
+	shard = &cache->shard[hash % FZ_GLYPH_CACHE_SHARDS];
+	hash = (hash / FZ_GLYPH_CACHE_SHARDS) % GLYPH_HASH_LEN;
+
+	fz_lock(ctx, shard->lock);
+	max_glyph_size = shard->max_glyph_size;
+	do_cache = (size <= max_glyph_size);
+	if (do_cache)
 	{
-		if (memcmp(&entry->key, &key, sizeof(key)) == 0)
+		entry = lookup_glyph(shard, hash, &key);
+		if (entry)
 		{
-			move_to_front(cache, entry);
+			shard->hits++;
+			move_to_front(shard, entry);
 			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, shard->lock);
 			return val;
 		}
-		entry = entry->bucket_next;
+		shard->misses++;
 	}
 
-	locked = 1;
+	/* We drop the lock while we render the glyph, so that other
+	 * threads can use this shard meanwhile. The danger here is that
+	 * some other thread will come along, and want the same glyph
+	 * too. If it does, we may both end up rendering pixmaps. We cope
+	 * with this later on, by ensuring that only one gets inserted
+	 * into the cache. If we insert ours to find one already there,
+	 * we abandon ours, and use the one there already. */
+	fz_unlock(ctx, shard->lock);
+
+	if (do_cache)
+		scissor = &fz_infinite_irect;
+	else
+	{
+		if (is_ft_font)
+			return NULL;
+		subpix_scissor.x0 = scissor->x0 - floorf(ctm->e);
+		subpix_scissor.y0 = scissor->y0 - floorf(ctm->f);
+		subpix_scissor.x1 = scissor->x1 - floorf(ctm->e);
+		subpix_scissor.y1 = scissor->y1 - floorf(ctm->f);
+		scissor = &subpix_scissor;
+	}
+
+	locked = 0;
 	caching = 0;
 	val = NULL;
 
@@ -308,20 +399,7 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		}
 		else if (fz_font_t3_procs(ctx, font))
 		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 0;
 			val = fz_render_t3_glyph(ctx, font, gid, subpix_ctm, model, scissor, aa);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 1;
 		}
 		else
 		{
@@ -329,65 +407,51 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		}
 		if (val && do_cache)
 		{
-			if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
+			if (val->w < max_glyph_size && val->h < max_glyph_size)
 			{
 				/* If we throw an exception whilst caching,
 				 * just ignore the exception and carry on. */
 				caching = 1;
-				if (!is_ft_font)
+				fz_lock(ctx, shard->lock);
+				locked = 1;
+
+				/* Someone else might have rendered it in
+				 * the meantime. */
+				entry = lookup_glyph(shard, hash, &key);
+				if (entry)
 				{
-					/* We had to unlock. Someone else might
-					 * have rendered in the meantime */
-					entry = cache->entry[hash];
-					while (entry)
-					{
-						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-						{
-							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
-							val = fz_keep_glyph(ctx, entry->val);
-							goto unlock_and_return_val;
-						}
-						entry = entry->bucket_next;
-					}
+					fz_drop_glyph(ctx, val);
+					move_to_front(shard, entry);
+					val = fz_keep_glyph(ctx, entry->val);
+					break;
 				}
 
 				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
 				entry->key = key;
 				entry->hash = hash;
-				entry->bucket_next = cache->entry[hash];
+				entry->bucket_next = shard->entry[hash];
 				if (entry->bucket_next)
 					entry->bucket_next->bucket_prev = entry;
-				cache->entry[hash] = entry;
+				shard->entry[hash] = entry;
 				entry->val = fz_keep_glyph(ctx, val);
 				fz_keep_font(ctx, key.font);
 
-				entry->lru_next = cache->lru_head;
+				entry->lru_next = shard->lru_head;
 				if (entry->lru_next)
 					entry->lru_next->lru_prev = entry;
 				else
-					cache->lru_tail = entry;
-				cache->lru_head = entry;
+					shard->lru_tail = entry;
+				shard->lru_head = entry;
 
-				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
+				shard->total += fz_glyph_size(ctx, val);
+				do_evict(ctx, shard);
 			}
 		}
-unlock_and_return_val:
-		{
-		}
 	}
 	fz_always(ctx)
 	{
 		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, shard->lock);
 	}
 	fz_catch(ctx)
 	{
@@ -408,8 +472,14 @@ fz_render_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm,
 	fz_matrix subpix_ctm;
 	float size = fz_subpixel_adjust(ctx, ctm, &subpix_ctm, &qe, &qf);
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
+	fz_glyph_cache_shard *shard = &ctx->glyph_cache->shard[0];
+	int max_glyph_size;
 
-	if (size <= MAX_GLYPH_SIZE)
+	fz_lock(ctx, shard->lock);
+	max_glyph_size = shard->max_glyph_size;
+	fz_unlock(ctx, shard->lock);
+
+	if (size <= max_glyph_size)
 	{
 		scissor = &fz_infinite_irect;
 	}
@@ -440,8 +510,39 @@ void
 fz_dump_glyph_cache_stats(fz_context *ctx, fz_output *out)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
-	fz_write_printf(ctx, out, "Glyph Cache Size: %zu\n", cache->total);
-#ifndef NDEBUG
-	fz_write_printf(ctx, out, "Glyph Cache Evictions: %d (%zu bytes)\n", cache->num_evictions, cache->evicted);
-#endif
+	fz_glyph_cache_shard stats[FZ_GLYPH_CACHE_SHARDS];
+	size_t total = 0, evicted = 0, max_size = 0;
+	int hits = 0, misses = 0, num_evictions = 0;
+	int i;
+
+	/* Take a copy of the counters, so that we don't write to the
+	 * output with a shard locked. */
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+		fz_lock(ctx, shard->lock);
+		stats[i].max_size = shard->max_size;
+		stats[i].max_glyph_size = shard->max_glyph_size;
+		stats[i].total = shard->total;
+		stats[i].hits = shard->hits;
+		stats[i].misses = shard->misses;
+		stats[i].num_evictions = shard->num_evictions;
+		stats[i].evicted = shard->evicted;
+		fz_unlock(ctx, shard->lock);
+	}
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_write_printf(ctx, out, "Glyph Cache Shard %d: %zu bytes, %d hits, %d misses, %d evictions (%zu bytes)\n",
+			i, stats[i].total, stats[i].hits, stats[i].misses, stats[i].num_evictions, stats[i].evicted);
+		total += stats[i].total;
+		evicted += stats[i].evicted;
+		max_size += stats[i].max_size;
+		hits += stats[i].hits;
+		misses += stats[i].misses;
+		num_evictions += stats[i].num_evictions;
+	}
+	fz_write_printf(ctx, out, "Glyph Cache Size: %zu (max %zu, glyphs up to %d pixels)\n", total, max_size, stats[0].max_glyph_size);
+	fz_write_printf(ctx, out, "Glyph Cache Hits: %d Misses: %d\n", hits, misses);
+	fz_write_printf(ctx, out, "Glyph Cache Evictions: %d (%zu bytes)\n", num_evictions, evicted);
 }
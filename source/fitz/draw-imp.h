@@ -435,6 +435,22 @@ fz_solid_color_painter_t *fz_get_solid_color_painter(int n, const unsigned char
 fz_span_painter_t *fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RESTRICT eop);
 fz_span_color_painter_t *fz_get_span_color_painter(int n, int da, const unsigned char * FZ_RESTRICT color, const fz_overprint * FZ_RESTRICT eop);
 
+#if FZ_ENABLE_SIMD
+/*
+	The best x86 vector extension that this CPU supports, used to pick
+	between the plain C and SIMD versions of the inner loops.
+*/
+enum { FZ_SIMD_NONE, FZ_SIMD_SSE4_1, FZ_SIMD_AVX2 };
+int fz_simd_level(void);
+
+/*
+	Use no better extension than level, even if the CPU supports
+	one. Painters are picked as each span is drawn, so only call
+	this while nothing is being drawn. For testing.
+*/
+void fz_limit_simd_level(int level);
+#endif
+
 void fz_paint_image(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, const fz_irect * FZ_RESTRICT scissor, fz_pixmap * FZ_RESTRICT shape, fz_pixmap * FZ_RESTRICT group_alpha, fz_pixmap * FZ_RESTRICT img, fz_matrix ctm, int alpha, int lerp_allowed, int gridfit_as_tiled, const fz_overprint * FZ_RESTRICT eop);
 void fz_paint_image_with_color(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, const fz_irect * FZ_RESTRICT scissor, fz_pixmap * FZ_RESTRICT shape, fz_pixmap * FZ_RESTRICT group_alpha, fz_pixmap * FZ_RESTRICT img, fz_matrix ctm, const unsigned char * FZ_RESTRICT colorbv, int lerp_allowed, int gridfit_as_tiled, const fz_overprint * FZ_RESTRICT eop);
 
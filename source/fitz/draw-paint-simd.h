@@ -0,0 +1,418 @@
+/*
+	SIMD versions of the solid color, span with color and span with
+	mask painters. This file is included by draw-paint.c once for
+	each instruction set we support, with:
+
+	SIMD_FN(x): The name to give to this version of x.
+	SIMD_TARGET: The attribute to compile these functions with.
+	SIMD_AVX2: 1 to do the arithmetic in 256 bit registers.
+
+	The kernels work on groups of 16 pixels (so 16*bpp bytes of
+	destination, for 1 <= bpp <= 5) and return the number of pixels
+	they have done; the rest of the span is left to the plain C
+	templates. Every blend is worked as FZ_BLEND works it, so the
+	results match the plain C versions bit for bit.
+*/
+
+#if SIMD_AVX2
+typedef __m256i SIMD_FN(simd_alpha);
+#else
+typedef struct { __m128i lo, hi; } SIMD_FN(simd_alpha);
+#endif
+
+/* Widen 16 alpha bytes to 16 bits, optionally applying FZ_EXPAND. */
+static inline SIMD_TARGET SIMD_FN(simd_alpha)
+SIMD_FN(widen_alpha)(__m128i a, int expand)
+{
+	SIMD_FN(simd_alpha) r;
+#if SIMD_AVX2
+	r = _mm256_cvtepu8_epi16(a);
+	if (expand)
+		r = _mm256_add_epi16(r, _mm256_srli_epi16(r, 7));
+#else
+	r.lo = _mm_cvtepu8_epi16(a);
+	r.hi = _mm_unpackhi_epi8(a, _mm_setzero_si128());
+	if (expand)
+	{
+		r.lo = _mm_add_epi16(r.lo, _mm_srli_epi16(r.lo, 7));
+		r.hi = _mm_add_epi16(r.hi, _mm_srli_epi16(r.hi, 7));
+	}
+#endif
+	return r;
+}
+
+static inline SIMD_TARGET SIMD_FN(simd_alpha)
+SIMD_FN(splat_alpha)(int a)
+{
+	SIMD_FN(simd_alpha) r;
+#if SIMD_AVX2
+	r = _mm256_set1_epi16(a);
+#else
+	r.lo = r.hi = _mm_set1_epi16(a);
+#endif
+	return r;
+}
+
+/*
+	FZ_BLEND(s, d, a) for 16 bytes at once. (s-d)*a + (d<<8) always
+	lies in 0..65280, so we can work it modulo 2^16, and ignore any
+	wrapping in the intermediate steps.
+*/
+static inline SIMD_TARGET __m128i
+SIMD_FN(blend)(__m128i s, __m128i d, SIMD_FN(simd_alpha) a)
+{
+#if SIMD_AVX2
+	__m256i s16 = _mm256_cvtepu8_epi16(s);
+	__m256i d16 = _mm256_cvtepu8_epi16(d);
+	__m256i r = _mm256_mullo_epi16(_mm256_sub_epi16(s16, d16), a);
+	r = _mm256_srli_epi16(_mm256_add_epi16(r, _mm256_slli_epi16(d16, 8)), 8);
+	return _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+#else
+	__m128i z = _mm_setzero_si128();
+	__m128i slo = _mm_cvtepu8_epi16(s);
+	__m128i shi = _mm_unpackhi_epi8(s, z);
+	__m128i dlo = _mm_cvtepu8_epi16(d);
+	__m128i dhi = _mm_unpackhi_epi8(d, z);
+	__m128i lo = _mm_mullo_epi16(_mm_sub_epi16(slo, dlo), a.lo);
+	__m128i hi = _mm_mullo_epi16(_mm_sub_epi16(shi, dhi), a.hi);
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_slli_epi16(dlo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_slli_epi16(dhi, 8)), 8);
+	return _mm_packus_epi16(lo, hi);
+#endif
+}
+
+/*
+	FZ_COMBINE(FZ_EXPAND(m), sa) for 16 mask bytes. sa must be less
+	than 256, so the results still fit in bytes.
+*/
+static inline SIMD_TARGET __m128i
+SIMD_FN(combine_alpha)(__m128i m, int sa)
+{
+	__m128i s = _mm_set1_epi16(sa);
+	__m128i lo = _mm_cvtepu8_epi16(m);
+	__m128i hi = _mm_unpackhi_epi8(m, _mm_setzero_si128());
+	lo = _mm_add_epi16(lo, _mm_srli_epi16(lo, 7));
+	hi = _mm_add_epi16(hi, _mm_srli_epi16(hi, 7));
+	lo = _mm_srli_epi16(_mm_mullo_epi16(lo, s), 8);
+	hi = _mm_srli_epi16(_mm_mullo_epi16(hi, s), 8);
+	return _mm_packus_epi16(lo, hi);
+}
+
+static inline SIMD_TARGET int
+SIMD_FN(solid_color)(byte * FZ_RESTRICT dp, int n1, int da, int w, const byte * FZ_RESTRICT color)
+{
+	const int bpp = n1 + da;
+	byte pattern[16 * 5];
+	int sa = FZ_EXPAND(color[n1]);
+	int done = 0;
+	int j;
+
+	if (sa == 0)
+		return w;
+	if (w < 16)
+		return 0;
+	simd_color_pattern(pattern, color, n1, da);
+
+	if (sa == 256)
+	{
+		for (; done + 16 <= w; done += 16)
+		{
+			for (j = 0; j < bpp; j++)
+				_mm_storeu_si128((__m128i *)(dp + 16 * j), _mm_loadu_si128((const __m128i *)(pattern + 16 * j)));
+			dp += 16 * bpp;
+		}
+	}
+	else
+	{
+		SIMD_FN(simd_alpha) a = SIMD_FN(splat_alpha)(sa);
+		for (; done + 16 <= w; done += 16)
+		{
+			for (j = 0; j < bpp; j++)
+			{
+				__m128i s = _mm_loadu_si128((const __m128i *)(pattern + 16 * j));
+				__m128i d = _mm_loadu_si128((const __m128i *)(dp + 16 * j));
+				_mm_storeu_si128((__m128i *)(dp + 16 * j), SIMD_FN(blend)(s, d, a));
+			}
+			dp += 16 * bpp;
+		}
+	}
+	return done;
+}
+
+static inline SIMD_TARGET int
+SIMD_FN(span_with_color)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n1, int da, int w, const byte * FZ_RESTRICT color)
+{
+	const int bpp = n1 + da;
+	const byte (*spread)[16] = &simd_spread[SIMD_ROW(bpp)];
+	byte pattern[16 * 5];
+	int sa = FZ_EXPAND(color[n1]);
+	int done = 0;
+	int j;
+
+	if (sa == 0)
+		return w;
+	if (w < 16)
+		return 0;
+	simd_color_pattern(pattern, color, n1, da);
+
+	for (; done + 16 <= w; done += 16)
+	{
+		__m128i m = _mm_loadu_si128((const __m128i *)mp);
+		mp += 16;
+		if (_mm_testz_si128(m, m))
+		{
+			/* Nothing to do. */
+		}
+		else if (sa == 256 && _mm_test_all_ones(m))
+		{
+			for (j = 0; j < bpp; j++)
+				_mm_storeu_si128((__m128i *)(dp + 16 * j), _mm_loadu_si128((const __m128i *)(pattern + 16 * j)));
+		}
+		else
+		{
+			int expand = 1;
+			if (sa != 256)
+			{
+				m = SIMD_FN(combine_alpha)(m, sa);
+				expand = 0;
+			}
+			for (j = 0; j < bpp; j++)
+			{
+				__m128i s = _mm_loadu_si128((const __m128i *)(pattern + 16 * j));
+				__m128i d = _mm_loadu_si128((const __m128i *)(dp + 16 * j));
+				__m128i ma = _mm_shuffle_epi8(m, _mm_loadu_si128((const __m128i *)spread[j]));
+				_mm_storeu_si128((__m128i *)(dp + 16 * j), SIMD_FN(blend)(s, d, SIMD_FN(widen_alpha)(ma, expand)));
+			}
+		}
+		dp += 16 * bpp;
+	}
+	return done;
+}
+
+static inline SIMD_TARGET int
+SIMD_FN(span_with_mask)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, int a, const byte * FZ_RESTRICT mp, int n, int w)
+{
+	const int bpp = n + a;
+	const byte (*spread)[16] = &simd_spread[SIMD_ROW(bpp)];
+	const byte (*gather)[16] = &simd_gather[SIMD_ROW(bpp)];
+	int done = 0;
+	int j;
+
+	for (; done + 16 <= w; done += 16)
+	{
+		__m128i m = _mm_loadu_si128((const __m128i *)mp);
+		mp += 16;
+		if (a)
+		{
+			/* Pixels with a zero source alpha are left alone. */
+			__m128i sa = _mm_setzero_si128();
+			for (j = 0; j < bpp; j++)
+				sa = _mm_or_si128(sa, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(sp + 16 * j)), _mm_loadu_si128((const __m128i *)gather[j])));
+			m = _mm_andnot_si128(_mm_cmpeq_epi8(sa, _mm_setzero_si128()), m);
+		}
+		if (_mm_testz_si128(m, m))
+		{
+			/* Nothing to do. */
+		}
+		else if (_mm_test_all_ones(m))
+		{
+			for (j = 0; j < bpp; j++)
+				_mm_storeu_si128((__m128i *)(dp + 16 * j), _mm_loadu_si128((const __m128i *)(sp + 16 * j)));
+		}
+		else
+		{
+			for (j = 0; j < bpp; j++)
+			{
+				__m128i s = _mm_loadu_si128((const __m128i *)(sp + 16 * j));
+				__m128i d = _mm_loadu_si128((const __m128i *)(dp + 16 * j));
+				__m128i ma = _mm_shuffle_epi8(m, _mm_loadu_si128((const __m128i *)spread[j]));
+				_mm_storeu_si128((__m128i *)(dp + 16 * j), SIMD_FN(blend)(s, d, SIMD_FN(widen_alpha)(ma, 1)));
+			}
+		}
+		dp += 16 * bpp;
+		sp += 16 * bpp;
+	}
+	return done;
+}
+
+/* Solid color painters */
+
+#if FZ_PLOTTERS_G
+static SIMD_TARGET void
+SIMD_FN(paint_solid_color_1)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(solid_color)(dp, 1, 0, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_solid_color_N_sa(dp + k, 1, w - k, color, 0, FZ_EXPAND(color[1]));
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_solid_color_1_da)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(solid_color)(dp, 1, 1, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_solid_color_1_da(dp + k * 2, 2, w - k, color, 1);
+}
+#endif /* FZ_PLOTTERS_G */
+
+#if FZ_PLOTTERS_RGB
+static SIMD_TARGET void
+SIMD_FN(paint_solid_color_3)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(solid_color)(dp, 3, 0, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_solid_color_N_sa(dp + k * 3, 3, w - k, color, 0, FZ_EXPAND(color[3]));
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_solid_color_3_da)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(solid_color)(dp, 3, 1, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_solid_color_3_da(dp + k * 4, 4, w - k, color, 1);
+}
+#endif /* FZ_PLOTTERS_RGB */
+
+#if FZ_PLOTTERS_CMYK
+static SIMD_TARGET void
+SIMD_FN(paint_solid_color_4)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(solid_color)(dp, 4, 0, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_solid_color_N_sa(dp + k * 4, 4, w - k, color, 0, FZ_EXPAND(color[4]));
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_solid_color_4_da)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(solid_color)(dp, 4, 1, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_solid_color_4_da(dp + k * 5, 5, w - k, color, 1);
+}
+#endif /* FZ_PLOTTERS_CMYK */
+
+/* Span with color painters */
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_color_1)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_color)(dp, mp, 1, 0, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_color_N_general(dp + k, mp + k, 1, w - k, color, 0);
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_color_1_da)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_color)(dp, mp, 1, 1, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_color_1_da(dp + k * 2, mp + k, 2, w - k, color, 1);
+}
+
+#if FZ_PLOTTERS_RGB
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_color_3)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_color)(dp, mp, 3, 0, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_color_N_general(dp + k * 3, mp + k, 3, w - k, color, 0);
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_color_3_da)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_color)(dp, mp, 3, 1, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_color_3_da(dp + k * 4, mp + k, 4, w - k, color, 1);
+}
+#endif /* FZ_PLOTTERS_RGB */
+
+#if FZ_PLOTTERS_CMYK
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_color_4)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_color)(dp, mp, 4, 0, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_color_N_general(dp + k * 4, mp + k, 4, w - k, color, 0);
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_color_4_da)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_color)(dp, mp, 4, 1, w, color);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_color_4_da(dp + k * 5, mp + k, 5, w - k, color, 1);
+}
+#endif /* FZ_PLOTTERS_CMYK */
+
+/* Span with mask painters */
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_mask_1)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_mask)(dp, sp, 0, mp, 1, w);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_mask_1_general(dp + k, sp + k, 0, mp + k, w - k);
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_mask_1_a)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_mask)(dp, sp, 1, mp, 1, w);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_mask_1_general(dp + k * 2, sp + k * 2, 1, mp + k, w - k);
+}
+
+#if FZ_PLOTTERS_RGB
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_mask_3)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_mask)(dp, sp, 0, mp, 3, w);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_mask_3_general(dp + k * 3, sp + k * 3, 0, mp + k, w - k);
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_mask_3_a)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_mask)(dp, sp, 1, mp, 3, w);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_mask_3_general(dp + k * 4, sp + k * 4, 1, mp + k, w - k);
+}
+#endif /* FZ_PLOTTERS_RGB */
+
+#if FZ_PLOTTERS_CMYK
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_mask_4)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_mask)(dp, sp, 0, mp, 4, w);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_mask_4_general(dp + k * 4, sp + k * 4, 0, mp + k, w - k);
+}
+
+static SIMD_TARGET void
+SIMD_FN(paint_span_with_mask_4_a)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	int k = SIMD_FN(span_with_mask)(dp, sp, 1, mp, 4, w);
+	TRACK_FN();
+	if (k < w)
+		template_span_with_mask_4_general(dp + k * 5, sp + k * 5, 1, mp + k, w - k);
+}
+#endif /* FZ_PLOTTERS_CMYK */
@@ -7,6 +7,10 @@
 #include <string.h>
 #include <assert.h>
 
+#if FZ_ENABLE_SIMD
+#include <immintrin.h>
+#endif
+
 /*
 
 The functions in this file implement various flavours of Porter-Duff blending.
@@ -79,6 +83,11 @@ and stick to using the premultiplied form.
 
 typedef unsigned char byte;
 
+#if FZ_ENABLE_SIMD
+static fz_solid_color_painter_t *simd_solid_color_painter(int n, int da);
+static fz_span_color_painter_t *simd_span_color_painter(int n, int da);
+#endif
+
 /* These are used by the non-aa scan converter */
 
 static inline void
@@ -234,7 +243,7 @@ template_solid_color_4_da(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_R
 			dp[1] = FZ_BLEND(color[1], dp[1], sa);
 			dp[2] = FZ_BLEND(color[2], dp[2], sa);
 			dp[3] = FZ_BLEND(color[3], dp[3], sa);
-			dp[4] = FZ_BLEND(255, dp[5], sa);
+			dp[4] = FZ_BLEND(255, dp[4], sa);
 			dp += 5;
 		}
 		while (--w);
@@ -585,6 +594,13 @@ fz_get_solid_color_painter(int n, const byte * FZ_RESTRICT color, int da, const
 			return paint_solid_color_N_alpha_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+#if FZ_ENABLE_SIMD
+	{
+		fz_solid_color_painter_t *fn = simd_solid_color_painter(n, da);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 	switch (n-da)
 	{
 		case 0:
@@ -1002,6 +1018,13 @@ fz_get_span_color_painter(int n, int da, const byte * FZ_RESTRICT color, const f
 		return da ? paint_span_with_color_N_da_op : paint_span_with_color_N_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+#if FZ_ENABLE_SIMD
+	{
+		fz_span_color_painter_t *fn = simd_span_color_painter(n, da);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 	switch(n-da)
 	{
 	case 0: return da ? paint_span_with_color_0_da : NULL;
@@ -1288,9 +1311,214 @@ paint_span_with_mask_N(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const
 
 typedef void (fz_span_mask_painter_t)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop);
 
+#if FZ_ENABLE_SIMD
+
+static int simd_level = -1;
+
+static int
+simd_cpu_level(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FZ_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return FZ_SIMD_SSE4_1;
+	return FZ_SIMD_NONE;
+}
+
+int
+fz_simd_level(void)
+{
+	if (simd_level < 0)
+		simd_level = simd_cpu_level();
+	return simd_level;
+}
+
+void
+fz_limit_simd_level(int level)
+{
+	int cpu = simd_cpu_level();
+	simd_level = level < cpu ? level : cpu;
+}
+
+/* The rows of simd_spread and simd_gather for pixels of bpp bytes. */
+#define SIMD_ROW(bpp) ((bpp) * ((bpp) - 1) / 2)
+
+/*
+	For 16 pixels of bpp bytes, held in bpp registers: for each byte
+	of each register, the index of the pixel that it belongs to.
+	Used to spread one mask value per pixel across its bytes.
+*/
+static const byte simd_spread[15][16] =
+{
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7 },
+	{ 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 15 },
+	{ 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 },
+	{ 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 },
+	{ 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 },
+	{ 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7 },
+	{ 8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11 },
+	{ 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15 },
+	{ 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3 },
+	{ 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 6, 6 },
+	{ 6, 6, 6, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 9, 9, 9 },
+	{ 9, 9, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 12, 12, 12, 12 },
+	{ 12, 13, 13, 13, 13, 13, 14, 14, 14, 14, 14, 15, 15, 15, 15, 15 },};
+
+/*
+	For 16 pixels of bpp bytes, held in bpp registers: for each pixel,
+	the index of its last (alpha) byte within each register, or 0x80
+	if it is in a different register. Used to pull out the alphas.
+*/
+static const byte simd_gather[15][16] =
+{
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 1, 3, 5, 7, 9, 11, 13, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 3, 5, 7, 9, 11, 13, 15 },
+	{ 2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15 },
+	{ 3, 7, 11, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 3, 7, 11, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 3, 7, 11, 15, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 3, 7, 11, 15 },
+	{ 4, 9, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 3, 8, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 7, 12, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 6, 11, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 5, 10, 15 },
+};
+
+/* Fill pattern with 16 pixels of color, with opaque alpha if da. */
+static void
+simd_color_pattern(byte * FZ_RESTRICT pattern, const byte * FZ_RESTRICT color, int n1, int da)
+{
+	int i, k;
+	for (i = 0; i < 16; i++)
+	{
+		for (k = 0; k < n1; k++)
+			*pattern++ = color[k];
+		if (da)
+			*pattern++ = 255;
+	}
+}
+
+#define SIMD_FN(x) x##_sse41
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+#define SIMD_AVX2 0
+#include "draw-paint-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+#define SIMD_FN(x) x##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_AVX2 1
+#include "draw-paint-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+static fz_solid_color_painter_t *
+simd_solid_color_painter(int n, int da)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return NULL;
+	switch (n-da)
+	{
+#if FZ_PLOTTERS_G
+	case 1:
+		if (da)
+			return avx2 ? paint_solid_color_1_da_avx2 : paint_solid_color_1_da_sse41;
+		return avx2 ? paint_solid_color_1_avx2 : paint_solid_color_1_sse41;
+#endif /* FZ_PLOTTERS_G */
+#if FZ_PLOTTERS_RGB
+	case 3:
+		if (da)
+			return avx2 ? paint_solid_color_3_da_avx2 : paint_solid_color_3_da_sse41;
+		return avx2 ? paint_solid_color_3_avx2 : paint_solid_color_3_sse41;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		if (da)
+			return avx2 ? paint_solid_color_4_da_avx2 : paint_solid_color_4_da_sse41;
+		return avx2 ? paint_solid_color_4_avx2 : paint_solid_color_4_sse41;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+static fz_span_color_painter_t *
+simd_span_color_painter(int n, int da)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return NULL;
+	switch (n-da)
+	{
+	case 1:
+		if (da)
+			return avx2 ? paint_span_with_color_1_da_avx2 : paint_span_with_color_1_da_sse41;
+		return avx2 ? paint_span_with_color_1_avx2 : paint_span_with_color_1_sse41;
+#if FZ_PLOTTERS_RGB
+	case 3:
+		if (da)
+			return avx2 ? paint_span_with_color_3_da_avx2 : paint_span_with_color_3_da_sse41;
+		return avx2 ? paint_span_with_color_3_avx2 : paint_span_with_color_3_sse41;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		if (da)
+			return avx2 ? paint_span_with_color_4_da_avx2 : paint_span_with_color_4_da_sse41;
+		return avx2 ? paint_span_with_color_4_avx2 : paint_span_with_color_4_sse41;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+static fz_span_mask_painter_t *
+simd_span_mask_painter(int a, int n)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return NULL;
+	switch (n)
+	{
+	case 1:
+		if (a)
+			return avx2 ? paint_span_with_mask_1_a_avx2 : paint_span_with_mask_1_a_sse41;
+		return avx2 ? paint_span_with_mask_1_avx2 : paint_span_with_mask_1_sse41;
+#if FZ_PLOTTERS_RGB
+	case 3:
+		if (a)
+			return avx2 ? paint_span_with_mask_3_a_avx2 : paint_span_with_mask_3_a_sse41;
+		return avx2 ? paint_span_with_mask_3_avx2 : paint_span_with_mask_3_sse41;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		if (a)
+			return avx2 ? paint_span_with_mask_4_a_avx2 : paint_span_with_mask_4_a_sse41;
+		return avx2 ? paint_span_with_mask_4_avx2 : paint_span_with_mask_4_sse41;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+#endif /* FZ_ENABLE_SIMD */
+
 static fz_span_mask_painter_t *
 fz_get_span_mask_painter(int a, int n)
 {
+#if FZ_ENABLE_SIMD
+	{
+		fz_span_mask_painter_t *fn = simd_span_mask_painter(a, n);
+		if (fn)
+			return fn;
+	}
+#endif /* FZ_ENABLE_SIMD */
 	switch(n)
 	{
 		case 0:
@@ -0,0 +1,410 @@
+/*
+	SIMD versions of the row scalers. This file is included by
+	draw-scale-simple.c once for each instruction set we support, with:
+
+	SIMD_FN(x): The name to give to this version of x.
+	SIMD_TARGET: The attribute to compile these functions with.
+	SIMD_AVX2: 1 to use 256 bit registers where we can.
+
+	Every output value is (128 + sum(src * weight)) >> 8, truncated to
+	a byte, just as in the plain C versions. The weights are all within
+	+/-256, so we can form the sums exactly with pmaddwd, taking the
+	sources in pairs.
+*/
+
+/* The weights (w0, w1) repeated, ready for pmaddwd. */
+static inline SIMD_TARGET __m128i
+SIMD_FN(weight_pair)(int w0, int w1)
+{
+	return _mm_set1_epi32((w0 & 0xffff) | ((unsigned int)w1 << 16));
+}
+
+/* The low bytes of (x >> 8) for 16 sums. */
+static inline SIMD_TARGET __m128i
+SIMD_FN(sums_to_bytes)(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	const __m128i ff = _mm_set1_epi32(0xff);
+	a = _mm_and_si128(_mm_srai_epi32(a, 8), ff);
+	b = _mm_and_si128(_mm_srai_epi32(b, 8), ff);
+	c = _mm_and_si128(_mm_srai_epi32(c, 8), ff);
+	d = _mm_and_si128(_mm_srai_epi32(d, 8), ff);
+	return _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+}
+
+/*
+	dst[i] = (128 + sum over k < len of s[k * stride + i] * w[k]) >> 8
+	for i < count. This does the columns of the vertical scale, and the
+	channels of the generic horizontal scale.
+*/
+static SIMD_TARGET void
+SIMD_FN(scale_dot)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT s, int stride, const int * FZ_RESTRICT w, int len, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+	int i, k;
+
+#if SIMD_AVX2
+	for (; count >= 32; count -= 32)
+	{
+		const unsigned char *sp = s;
+		__m256i acc0 = _mm256_set1_epi32(128), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+		const __m256i ff = _mm256_set1_epi32(0xff);
+		const __m256i z = _mm256_setzero_si256();
+		for (k = 0; k < len; k += 2)
+		{
+			__m256i a = _mm256_loadu_si256((const __m256i *)sp);
+			__m256i b = k + 1 < len ? _mm256_loadu_si256((const __m256i *)(sp + stride)) : z;
+			__m256i wp = _mm256_set1_epi32((w[k] & 0xffff) | (k + 1 < len ? (unsigned int)w[k+1] << 16 : 0));
+			__m256i lo = _mm256_unpacklo_epi8(a, b);
+			__m256i hi = _mm256_unpackhi_epi8(a, b);
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, z), wp));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, z), wp));
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, z), wp));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, z), wp));
+			sp += 2 * stride;
+		}
+		/* The unpacks and packs both work within 128 bit lanes, so
+		 * the bytes come out in order. */
+		acc0 = _mm256_and_si256(_mm256_srai_epi32(acc0, 8), ff);
+		acc1 = _mm256_and_si256(_mm256_srai_epi32(acc1, 8), ff);
+		acc2 = _mm256_and_si256(_mm256_srai_epi32(acc2, 8), ff);
+		acc3 = _mm256_and_si256(_mm256_srai_epi32(acc3, 8), ff);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(_mm256_packus_epi32(acc0, acc1), _mm256_packus_epi32(acc2, acc3)));
+		dst += 32;
+		s += 32;
+	}
+#endif
+
+	for (; count >= 16; count -= 16)
+	{
+		const unsigned char *sp = s;
+		__m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+		for (k = 0; k < len; k += 2)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)sp);
+			__m128i b = k + 1 < len ? _mm_loadu_si128((const __m128i *)(sp + stride)) : zero;
+			__m128i wp = SIMD_FN(weight_pair)(w[k], k + 1 < len ? w[k+1] : 0);
+			__m128i lo = _mm_unpacklo_epi8(a, b);
+			__m128i hi = _mm_unpackhi_epi8(a, b);
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wp));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wp));
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wp));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wp));
+			sp += 2 * stride;
+		}
+		_mm_storeu_si128((__m128i *)dst, SIMD_FN(sums_to_bytes)(acc0, acc1, acc2, acc3));
+		dst += 16;
+		s += 16;
+	}
+
+	for (; count >= 8; count -= 8)
+	{
+		const unsigned char *sp = s;
+		__m128i acc0 = round, acc1 = round;
+		for (k = 0; k < len; k += 2)
+		{
+			__m128i a = _mm_loadl_epi64((const __m128i *)sp);
+			__m128i b = k + 1 < len ? _mm_loadl_epi64((const __m128i *)(sp + stride)) : zero;
+			__m128i wp = SIMD_FN(weight_pair)(w[k], k + 1 < len ? w[k+1] : 0);
+			__m128i ab = _mm_unpacklo_epi8(a, b);
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(ab, zero), wp));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(ab, zero), wp));
+			sp += 2 * stride;
+		}
+		_mm_storel_epi64((__m128i *)dst, SIMD_FN(sums_to_bytes)(acc0, acc1, zero, zero));
+		dst += 8;
+		s += 8;
+	}
+
+	for (; count >= 4; count -= 4)
+	{
+		const unsigned char *sp = s;
+		__m128i acc = round;
+		int x;
+		for (k = 0; k < len; k += 2)
+		{
+			__m128i a, b;
+			memcpy(&x, sp, 4);
+			a = _mm_cvtsi32_si128(x);
+			if (k + 1 < len)
+			{
+				memcpy(&x, sp + stride, 4);
+				b = _mm_cvtsi32_si128(x);
+			}
+			else
+				b = zero;
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero), SIMD_FN(weight_pair)(w[k], k + 1 < len ? w[k+1] : 0)));
+			sp += 2 * stride;
+		}
+		x = _mm_cvtsi128_si32(SIMD_FN(sums_to_bytes)(acc, zero, zero, zero));
+		memcpy(dst, &x, 4);
+		dst += 4;
+		s += 4;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		int val = 128;
+		for (k = 0; k < len; k++)
+			val += s[k * stride + i] * w[k];
+		dst[i] = (unsigned char)(val>>8);
+	}
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_to_temp)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int n = weights->n;
+	int step = n;
+	int i;
+
+	if (weights->flip)
+	{
+		dst += (weights->count-1)*n;
+		step = -n;
+	}
+	for (i = weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[n * *contrib++];
+		int len = *contrib++;
+		SIMD_FN(scale_dot)(dst, min, n, contrib, len, n);
+		contrib += len;
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_to_temp1)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int step = 1;
+	int i;
+
+	assert(weights->n == 1);
+	if (weights->flip)
+	{
+		dst += weights->count-1;
+		step = -1;
+	}
+	for (i = weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[*contrib++];
+		int len = *contrib++;
+		__m128i acc = _mm_setzero_si128();
+		int val;
+		for (; len >= 8; len -= 8)
+		{
+			__m128i s = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)min));
+			__m128i w = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), _mm_loadu_si128((const __m128i *)(contrib + 4)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, w));
+			min += 8;
+			contrib += 8;
+		}
+		if (len >= 4)
+		{
+			int x;
+			__m128i s, w;
+			memcpy(&x, min, 4);
+			s = _mm_cvtepu8_epi16(_mm_cvtsi32_si128(x));
+			w = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), _mm_setzero_si128());
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, w));
+			min += 4;
+			contrib += 4;
+			len -= 4;
+		}
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+		val = 128 + _mm_cvtsi128_si32(acc);
+		while (len-- > 0)
+			val += *min++ * *contrib++;
+		*dst = (unsigned char)(val>>8);
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_to_temp2)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	/* 4 pixels to (c1, c1, c2, c2) for pixels 0 and 1, then 2 and 3. */
+	const __m128i spread = _mm_setr_epi8(0, -1, 2, -1, 1, -1, 3, -1, 4, -1, 6, -1, 5, -1, 7, -1);
+	int step = 2;
+	int i;
+
+	assert(weights->n == 2);
+	if (weights->flip)
+	{
+		dst += 2*(weights->count-1);
+		step = -2;
+	}
+	for (i = weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[2 * *contrib++];
+		int len = *contrib++;
+		__m128i acc = _mm_setzero_si128();
+		int c[4];
+		for (; len >= 4; len -= 4)
+		{
+			__m128i s = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)min), spread);
+			__m128i w = _mm_loadu_si128((const __m128i *)contrib);
+			w = _mm_shuffle_epi32(_mm_packs_epi32(w, w), 0x50);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, w));
+			min += 8;
+			contrib += 4;
+		}
+		_mm_storeu_si128((__m128i *)c, acc);
+		c[0] += 128 + c[2];
+		c[1] += 128 + c[3];
+		while (len-- > 0)
+		{
+			c[0] += *min++ * *contrib;
+			c[1] += *min++ * *contrib++;
+		}
+		dst[0] = (unsigned char)(c[0]>>8);
+		dst[1] = (unsigned char)(c[1]>>8);
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_to_temp3)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	/* 4 pixels to (c1, c1, c2, c2, c3, c3) for pixels 0 and 1, then 2 and 3. */
+	const __m128i spread01 = _mm_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1);
+	const __m128i spread23 = _mm_setr_epi8(6, -1, 9, -1, 7, -1, 10, -1, 8, -1, 11, -1, -1, -1, -1, -1);
+	int step = 3;
+	int i;
+
+	assert(weights->n == 3);
+	if (weights->flip)
+	{
+		dst += 3*(weights->count-1);
+		step = -3;
+	}
+	for (i = weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[3 * *contrib++];
+		int len = *contrib++;
+		__m128i acc = _mm_setzero_si128();
+		int c[4];
+		for (; len >= 4; len -= 4)
+		{
+			int x;
+			__m128i s, w;
+			memcpy(&x, min + 8, 4);
+			s = _mm_insert_epi32(_mm_loadl_epi64((const __m128i *)min), x, 2);
+			w = _mm_loadu_si128((const __m128i *)contrib);
+			w = _mm_packs_epi32(w, w);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(s, spread01), _mm_shuffle_epi32(w, 0x00)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(s, spread23), _mm_shuffle_epi32(w, 0x55)));
+			min += 12;
+			contrib += 4;
+		}
+		_mm_storeu_si128((__m128i *)c, acc);
+		c[0] += 128;
+		c[1] += 128;
+		c[2] += 128;
+		while (len-- > 0)
+		{
+			int w = *contrib++;
+			c[0] += *min++ * w;
+			c[1] += *min++ * w;
+			c[2] += *min++ * w;
+		}
+		dst[0] = (unsigned char)(c[0]>>8);
+		dst[1] = (unsigned char)(c[1]>>8);
+		dst[2] = (unsigned char)(c[2]>>8);
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_to_temp4)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	/* 4 pixels to (c1, c1, c2, c2, c3, c3, c4, c4) for pixels 0 and 1, then 2 and 3. */
+	const __m128i spread01 = _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+	const __m128i spread23 = _mm_setr_epi8(8, -1, 12, -1, 9, -1, 13, -1, 10, -1, 14, -1, 11, -1, 15, -1);
+	int step = 4;
+	int i;
+
+	assert(weights->n == 4);
+	if (weights->flip)
+	{
+		dst += 4*(weights->count-1);
+		step = -4;
+	}
+	for (i = weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[4 * *contrib++];
+		int len = *contrib++;
+		__m128i acc = _mm_set1_epi32(128);
+		int c[4];
+		for (; len >= 4; len -= 4)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)min);
+			__m128i w = _mm_loadu_si128((const __m128i *)contrib);
+			w = _mm_packs_epi32(w, w);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(s, spread01), _mm_shuffle_epi32(w, 0x00)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(s, spread23), _mm_shuffle_epi32(w, 0x55)));
+			min += 16;
+			contrib += 4;
+		}
+		if (len > 0)
+		{
+			/* One pixel at a time, still 4 channels at once. */
+			const __m128i spread = _mm_setr_epi8(0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3, -1, -1, -1);
+			while (len-- > 0)
+			{
+				int x;
+				memcpy(&x, min, 4);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(_mm_cvtsi32_si128(x), spread), SIMD_FN(weight_pair)(*contrib++, 0)));
+				min += 4;
+			}
+		}
+		_mm_storeu_si128((__m128i *)c, _mm_srai_epi32(acc, 8));
+		dst[0] = (unsigned char)c[0];
+		dst[1] = (unsigned char)c[1];
+		dst[2] = (unsigned char)c[2];
+		dst[3] = (unsigned char)c[3];
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_from_temp)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int width = w * n;
+
+	contrib++; /* Skip min */
+	SIMD_FN(scale_dot)(dst, src, width, contrib + 1, *contrib, width);
+}
+
+static SIMD_TARGET void
+SIMD_FN(scale_row_from_temp_alpha)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int width = w * n;
+	int len, x;
+	unsigned char buf[256];
+	int chunk = sizeof(buf) / n;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	for (x = 0; x < w; x += chunk)
+	{
+		int m = w - x < chunk ? w - x : chunk;
+		unsigned char *b = buf;
+		SIMD_FN(scale_dot)(buf, src + x * n, width, contrib, len, m * n);
+		while (m-- > 0)
+		{
+			memcpy(dst, b, n);
+			dst += n;
+			b += n;
+			*dst++ = 255;
+		}
+	}
+}
@@ -14,12 +14,17 @@ intermediate results rather than ints.
 
 #include "draw-imp.h"
 #include "pixmap-imp.h"
+#include "context-imp.h"
 
 #include <math.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
 
+#if FZ_ENABLE_SIMD
+#include <immintrin.h>
+#endif
+
 /* Do we special case handling of single pixel high/wide images? The
  * 'purest' handling is given by not special casing them, but certain
  * files that use such images 'stack' them to give full images. Not
@@ -1257,6 +1262,169 @@ scale_row_from_temp_alpha(unsigned char * FZ_RESTRICT dst, const unsigned char *
 }
 #endif
 
+typedef void (row_scale_in_fn)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights);
+typedef void (row_scale_out_fn)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row);
+
+#if FZ_ENABLE_SIMD
+
+#define SIMD_FN(x) x##_sse41
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+#define SIMD_AVX2 0
+#include "draw-scale-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+#define SIMD_FN(x) x##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_AVX2 1
+#include "draw-scale-simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_AVX2
+
+static int
+simd_row_scalers(int n, int forcealpha, row_scale_in_fn **in, row_scale_out_fn **out)
+{
+	int avx2 = fz_simd_level() >= FZ_SIMD_AVX2;
+	if (fz_simd_level() < FZ_SIMD_SSE4_1)
+		return 0;
+	switch (n)
+	{
+	default:
+		*in = avx2 ? scale_row_to_temp_avx2 : scale_row_to_temp_sse41;
+		break;
+	case 1:
+		*in = avx2 ? scale_row_to_temp1_avx2 : scale_row_to_temp1_sse41;
+		break;
+	case 2:
+		*in = avx2 ? scale_row_to_temp2_avx2 : scale_row_to_temp2_sse41;
+		break;
+	case 3:
+		*in = avx2 ? scale_row_to_temp3_avx2 : scale_row_to_temp3_sse41;
+		break;
+	case 4:
+		*in = avx2 ? scale_row_to_temp4_avx2 : scale_row_to_temp4_sse41;
+		break;
+	}
+	if (forcealpha)
+		*out = avx2 ? scale_row_from_temp_alpha_avx2 : scale_row_from_temp_alpha_sse41;
+	else
+		*out = avx2 ? scale_row_from_temp_avx2 : scale_row_from_temp_sse41;
+	return 1;
+}
+
+#endif /* FZ_ENABLE_SIMD */
+
+static void
+get_row_scalers(int n, int forcealpha, row_scale_in_fn **in, row_scale_out_fn **out)
+{
+#if FZ_ENABLE_SIMD
+	if (simd_row_scalers(n, forcealpha, in, out))
+		return;
+#endif /* FZ_ENABLE_SIMD */
+	switch (n)
+	{
+	default:
+		*in = scale_row_to_temp;
+		break;
+	case 1: /* Image mask case or Greyscale case */
+		*in = scale_row_to_temp1;
+		break;
+	case 2: /* Greyscale with alpha case */
+		*in = scale_row_to_temp2;
+		break;
+	case 3: /* RGB case */
+		*in = scale_row_to_temp3;
+		break;
+	case 4: /* RGBA or CMYK case */
+		*in = scale_row_to_temp4;
+		break;
+	}
+	*out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
+}
+
+/* Everything needed to scale a range of output rows. */
+typedef struct
+{
+	const fz_pixmap *src;
+	fz_pixmap *output;
+	const fz_weights *rows;
+	const fz_weights *cols;
+	int flip_y;
+	row_scale_in_fn *in;
+	row_scale_out_fn *out;
+	unsigned char *temp;
+	int temp_span;
+	int temp_rows;
+	int bands;
+} scale_job;
+
+/*
+	Scale output rows row0 to row1-1, using the given temporary
+	buffer. Each band starts by filling the buffer with all the source
+	rows its first output row needs, so bands can run independently,
+	and give exactly the same results as a single pass.
+*/
+static void
+scale_rows(const scale_job *job, unsigned char *temp, int row0, int row1)
+{
+	const fz_weights *rows = job->rows;
+	const fz_pixmap *src = job->src;
+	int max_row = rows->index[rows->index[row0]];
+	int row;
+
+	for (row = row0; row < row1; row++)
+	{
+		/*
+		Which source rows do we need to have scaled into the
+		temporary buffer in order to be able to do the final
+		scale?
+		*/
+		int row_index = rows->index[row];
+		int row_min = rows->index[row_index++];
+		int row_len = rows->index[row_index];
+		while (max_row < row_min+row_len)
+		{
+			/* Scale another row */
+			assert(max_row < src->h);
+			job->in(&temp[job->temp_span*(max_row % job->temp_rows)], &src->samples[(job->flip_y ? (src->h-1-max_row): max_row)*src->stride], job->cols);
+			max_row++;
+		}
+
+		job->out(&job->output->samples[row*job->output->stride], temp, rows, job->cols->count, src->n, row);
+	}
+}
+
+static void
+scale_band(fz_context *ctx, void *arg, int band)
+{
+	const scale_job *job = arg;
+	int count = job->rows->count;
+	scale_rows(job, job->temp + (size_t)band * job->temp_span * job->temp_rows,
+		(int)((int64_t)count * band / job->bands),
+		(int)((int64_t)count * (band + 1) / job->bands));
+}
+
+/* Only split scales into bands when there is this much work to share. */
+#define MIN_PARALLEL_SCALE_WORK (1<<20)
+#define MIN_PARALLEL_SCALE_ROWS 16
+
+static int
+scale_bands(fz_context *ctx, const fz_pixmap *src, const fz_weights *rows, const fz_weights *cols)
+{
+	fz_tuning_context *tuning = ctx->tuning;
+	int bands = tuning->image_scale_threads;
+	if (!tuning->image_scale_parallel || bands < 2)
+		return 1;
+	if ((int64_t)src->w * src->h * src->n < MIN_PARALLEL_SCALE_WORK &&
+		(int64_t)cols->count * rows->count * src->n < MIN_PARALLEL_SCALE_WORK)
+		return 1;
+	if (bands > rows->count / MIN_PARALLEL_SCALE_ROWS)
+		bands = rows->count / MIN_PARALLEL_SCALE_ROWS;
+	return bands < 1 ? 1 : bands;
+}
+
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
 duplicate_single_pixel(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, int n, int forcealpha, int w, int h, int stride)
@@ -1537,7 +1705,7 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	fz_weights *contrib_cols = NULL;
 	fz_pixmap *output = NULL;
 	unsigned char *temp = NULL;
-	int max_row, temp_span, temp_rows, row;
+	int temp_span, temp_rows, bands;
 	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
 	int flip_x, flip_y, forcealpha;
 	fz_rect patch;
@@ -1751,16 +1919,19 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
-		void (*row_scale_in)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights);
-		void (*row_scale_out)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row);
+		scale_job job;
 
 		temp_span = contrib_cols->count * src->n;
 		temp_rows = contrib_rows->max_len;
 		if (temp_span <= 0 || temp_rows > INT_MAX / temp_span)
 			goto cleanup;
+		bands = scale_bands(ctx, src, contrib_rows, contrib_cols);
+		if ((size_t)temp_span * temp_rows > SIZE_MAX / bands)
+			bands = 1;
 		fz_try(ctx)
 		{
-			temp = fz_calloc(ctx, (size_t)temp_span*temp_rows, sizeof(unsigned char));
+			/* Each band needs a buffer of its own. */
+			temp = fz_calloc(ctx, (size_t)temp_span*temp_rows*bands, sizeof(unsigned char));
 		}
 		fz_catch(ctx)
 		{
@@ -1771,46 +1942,20 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 				fz_free(ctx, contrib_rows);
 			fz_rethrow(ctx);
 		}
-		switch (src->n)
-		{
-		default:
-			row_scale_in = scale_row_to_temp;
-			break;
-		case 1: /* Image mask case or Greyscale case */
-			row_scale_in = scale_row_to_temp1;
-			break;
-		case 2: /* Greyscale with alpha case */
-			row_scale_in = scale_row_to_temp2;
-			break;
-		case 3: /* RGB case */
-			row_scale_in = scale_row_to_temp3;
-			break;
-		case 4: /* RGBA or CMYK case */
-			row_scale_in = scale_row_to_temp4;
-			break;
-		}
-		row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
-		max_row = contrib_rows->index[contrib_rows->index[0]];
-		for (row = 0; row < contrib_rows->count; row++)
-		{
-			/*
-			Which source rows do we need to have scaled into the
-			temporary buffer in order to be able to do the final
-			scale?
-			*/
-			int row_index = contrib_rows->index[row];
-			int row_min = contrib_rows->index[row_index++];
-			int row_len = contrib_rows->index[row_index];
-			while (max_row < row_min+row_len)
-			{
-				/* Scale another row */
-				assert(max_row < src->h);
-				(*row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols);
-				max_row++;
-			}
-
-			(*row_scale_out)(&output->samples[row*output->stride], temp, contrib_rows, contrib_cols->count, src->n, row);
-		}
+		job.src = src;
+		job.output = output;
+		job.rows = contrib_rows;
+		job.cols = contrib_cols;
+		job.flip_y = flip_y;
+		job.temp = temp;
+		job.temp_span = temp_span;
+		job.temp_rows = temp_rows;
+		job.bands = bands;
+		get_row_scalers(src->n, forcealpha, &job.in, &job.out);
+		if (bands > 1)
+			ctx->tuning->image_scale_parallel(ctx->tuning->image_scale_parallel_arg, ctx, bands, scale_band, &job);
+		else
+			scale_rows(&job, temp, 0, contrib_rows->count);
 		fz_free(ctx, temp);
 
 		if (forcealpha)
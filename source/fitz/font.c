@@ -21,7 +21,20 @@
 #include FT_TRUETYPE_TAGS_H
 
 #define MAX_BBOX_TABLE_SIZE 4096
-#define MAX_ADVANCE_CACHE 4096
+
+/* Glyph advances are cached in pages of 256 glyphs. */
+#define ADVANCE_PAGE_BITS 8
+#define ADVANCE_PAGE_SIZE (1<<ADVANCE_PAGE_BITS)
+
+/* The pages are published with release stores, so that they can be read
+ * with acquire loads and no lock. Without atomics, they are read under
+ * the alloc lock instead. */
+#ifdef FZ_HAVE_ATOMICS
+#define ADVANCE_LOAD(P) FZ_ATOMIC_LOAD_ACQUIRE_PTR(P)
+#define ADVANCE_STORE(P, V) FZ_ATOMIC_STORE_RELEASE_PTR(P, V)
+#else
+#define ADVANCE_STORE(P, V) (*(P) = (V))
+#endif
 
 #ifndef FT_SFNT_OS2
 #define FT_SFNT_OS2 ft_sfnt_os2
@@ -189,7 +202,7 @@ void
 fz_drop_font(fz_context *ctx, fz_font *font)
 {
 	int fterr;
-	int i;
+	int i, k, n;
 
 	if (!fz_drop_imp(ctx, font, &font->refs))
 		return;
@@ -219,7 +232,16 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	fz_drop_buffer(ctx, font->buffer);
 	fz_free(ctx, font->bbox_table);
 	fz_free(ctx, font->width_table);
-	fz_free(ctx, font->advance_cache);
+	for (k = 0; k < 2; ++k)
+	{
+		if (font->advance_cache[k])
+		{
+			n = (font->glyph_count + ADVANCE_PAGE_SIZE - 1) >> ADVANCE_PAGE_BITS;
+			for (i = 0; i < n; ++i)
+				fz_free(ctx, font->advance_cache[k][i]);
+			fz_free(ctx, font->advance_cache[k]);
+		}
+	}
 	if (font->shaper_data.destroy && font->shaper_data.shaper_handle)
 	{
 		font->shaper_data.destroy(ctx, font->shaper_data.shaper_handle);
@@ -630,6 +652,166 @@ fz_drop_freetype(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_FREETYPE);
 }
 
+#if FZ_ENABLE_FT_CONTEXT_FACES
+
+/*
+ * Per-context FreeType faces.
+ *
+ * A FreeType face can only be used by one thread at a time, so normally
+ * every use of a font's face is done holding FZ_LOCK_FREETYPE. Instead,
+ * each context can have its own FreeType library, and its own face for
+ * each font it draws, opened from the same (shared, immutable) font data.
+ * These belong to the context alone, so need no locking at all.
+ *
+ * Faces are found by the font's buffer and face index, rather than by the
+ * font itself, as the font may be freed by another context at any time.
+ * Each face holds a reference to the buffer it was opened from, so the
+ * data outlives the face even if the font does not.
+ */
+
+typedef struct
+{
+	fz_buffer *buffer;
+	FT_Long index;
+	FT_Face face;
+} fz_ft_context_face;
+
+struct fz_ft_context
+{
+	FT_Library ftlib;
+	struct FT_MemoryRec_ ftmemory;
+	int failed;
+	int len;
+	fz_ft_context_face face[FZ_FT_CONTEXT_FACES]; /* Most recently used first. */
+};
+
+static void
+drop_ft_context_face(fz_context *ctx, fz_ft_context_face *entry)
+{
+	FT_Error fterr = FT_Done_Face(entry->face);
+	if (fterr)
+		fz_warn(ctx, "FT_Done_Face(): %s", ft_error_string(fterr));
+	fz_drop_buffer(ctx, entry->buffer);
+}
+
+void
+fz_drop_ft_context(fz_context *ctx)
+{
+	fz_ft_context *ft = ctx->ft;
+	FT_Error fterr;
+
+	if (!ft)
+		return;
+
+	while (ft->len > 0)
+		drop_ft_context_face(ctx, &ft->face[--ft->len]);
+	if (ft->ftlib)
+	{
+		fterr = FT_Done_Library(ft->ftlib);
+		if (fterr)
+			fz_warn(ctx, "FT_Done_Library(): %s", ft_error_string(fterr));
+	}
+	fz_free(ctx, ft);
+	ctx->ft = NULL;
+}
+
+/* This context's own face for a font, or NULL if it can't have one. */
+static FT_Face
+context_ft_face(fz_context *ctx, fz_font *font)
+{
+	fz_ft_context *ft = ctx->ft;
+	fz_ft_context_face entry;
+	FT_Long index;
+	FT_Error fterr;
+	int i;
+
+	if (!font->buffer)
+		return NULL;
+	index = ((FT_Face)font->ft_face)->face_index;
+
+	if (!ft)
+	{
+		ft = ctx->ft = fz_malloc_no_throw(ctx, sizeof(*ft));
+		if (!ft)
+			return NULL;
+		memset(ft, 0, sizeof(*ft));
+		ft->ftmemory.user = ctx;
+		ft->ftmemory.alloc = ft_alloc;
+		ft->ftmemory.free = ft_free;
+		ft->ftmemory.realloc = ft_realloc;
+	}
+	if (ft->failed)
+		return NULL;
+
+	for (i = 0; i < ft->len; i++)
+	{
+		if (ft->face[i].buffer == font->buffer && ft->face[i].index == index)
+		{
+			entry = ft->face[i];
+			memmove(&ft->face[1], &ft->face[0], i * sizeof(*ft->face));
+			ft->face[0] = entry;
+			return entry.face;
+		}
+	}
+
+	if (!ft->ftlib)
+	{
+		fterr = FT_New_Library(&ft->ftmemory, &ft->ftlib);
+		if (fterr)
+		{
+			fz_warn(ctx, "cannot init freetype for context: %s", ft_error_string(fterr));
+			ft->failed = 1;
+			return NULL;
+		}
+		FT_Add_Default_Modules(ft->ftlib);
+	}
+
+	fterr = FT_New_Memory_Face(ft->ftlib, font->buffer->data, (FT_Long)font->buffer->len, index, &entry.face);
+	if (fterr)
+	{
+		fz_warn(ctx, "FT_New_Memory_Face(%s): %s", font->name, ft_error_string(fterr));
+		return NULL;
+	}
+	/* Fonts that FreeType doesn't know are tricky may have been marked
+	 * as such on the shared face (see pdf_load_font_descriptor), and
+	 * must then be hinted here too. */
+	entry.face->face_flags |= ((FT_Face)font->ft_face)->face_flags & FT_FACE_FLAG_TRICKY;
+	entry.buffer = fz_keep_buffer(ctx, font->buffer);
+	entry.index = index;
+
+	if (ft->len == FZ_FT_CONTEXT_FACES)
+		drop_ft_context_face(ctx, &ft->face[--ft->len]);
+	memmove(&ft->face[1], &ft->face[0], ft->len * sizeof(*ft->face));
+	ft->face[0] = entry;
+	ft->len++;
+
+	return entry.face;
+}
+
+#endif
+
+/* Get a face to load glyphs from font with. This is the context's own
+ * face where it has one; otherwise it is the font's shared face, and the
+ * freetype lock is taken. Release it with unlock_ft_face. */
+static FT_Face
+lock_ft_face(fz_context *ctx, fz_font *font)
+{
+#if FZ_ENABLE_FT_CONTEXT_FACES
+	FT_Face face = context_ft_face(ctx, font);
+	if (face)
+		return face;
+#endif
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	return font->ft_face;
+}
+
+static void
+unlock_ft_face(fz_context *ctx, fz_font *font, FT_Face face)
+{
+	if (face == font->ft_face)
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+}
+
 fz_font *
 fz_new_font_from_buffer(fz_context *ctx, const char *name, fz_buffer *buffer, int index, int use_glyph_bbox)
 {
@@ -847,10 +1029,11 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm
 		FT_Fixed adv = 0;
 		float subw;
 		float realw;
+		FT_Face face;
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
-		fterr = FT_Get_Advance(font->ft_face, gid, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM, &adv);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		face = lock_ft_face(ctx, font);
+		fterr = FT_Get_Advance(face, gid, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM, &adv);
+		unlock_ft_face(ctx, font, face);
 		if (fterr && fterr != FT_Err_Invalid_Argument)
 			fz_warn(ctx, "FT_Get_Advance(%s,%d): %s", font->name, gid, ft_error_string(fterr));
 
@@ -888,11 +1071,11 @@ pixmap_from_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 		return fz_new_pixmap_from_8bpp_data(ctx, left, top - bitmap->rows, bitmap->width, bitmap->rows, bitmap->buffer + (bitmap->rows-1)*bitmap->pitch, -bitmap->pitch);
 }
 
-/* Takes the freetype lock, and returns with it held */
+/* Locks a face (see lock_ft_face), and returns with it held in *facep */
 static FT_GlyphSlot
-do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
+do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa, FT_Face *facep)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Matrix m;
 	FT_Vector v;
 	FT_Error fterr;
@@ -904,7 +1087,7 @@ do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	if (font->flags.fake_italic)
 		trm = fz_pre_shear(trm, SHEAR, 0);
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	*facep = face = lock_ft_face(ctx, font);
 
 	if (aa == 0)
 	{
@@ -984,12 +1167,13 @@ retry_unhinted:
 fz_pixmap *
 fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
 {
-	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa);
+	FT_Face face;
+	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa, &face);
 	fz_pixmap *pixmap = NULL;
 
 	if (slot == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -999,7 +1183,7 @@ fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -1009,16 +1193,16 @@ fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm
 	return pixmap;
 }
 
-/* The glyph cache lock is always taken when this is called. */
 fz_glyph *
 fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
 {
-	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa);
+	FT_Face face;
+	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa, &face);
 	fz_glyph *glyph = NULL;
 
 	if (slot == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -1028,7 +1212,7 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -1038,11 +1222,11 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	return glyph;
 }
 
-/* Takes the freetype lock, and returns with it held */
+/* Locks a face (see lock_ft_face), and returns with it held in *facep */
 static FT_Glyph
-do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa)
+do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa, FT_Face *facep)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	float expansion = fz_matrix_expansion(ctm);
 	int linewidth = state->linewidth * expansion * 64 / 2;
 	FT_Matrix m;
@@ -1065,7 +1249,7 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	*facep = face = lock_ft_face(ctx, font);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 	{
@@ -1082,7 +1266,7 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 		return NULL;
 	}
 
-	fterr = FT_Stroker_New(ctx->font->ftlib, &stroker);
+	fterr = FT_Stroker_New(face->glyph->library, &stroker);
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Stroker_New(): %s", ft_error_string(fterr));
@@ -1135,13 +1319,14 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 fz_glyph *
 fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa)
 {
-	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa);
+	FT_Face face;
+	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa, &face);
 	FT_BitmapGlyph bitmap = (FT_BitmapGlyph)glyph;
 	fz_glyph *result = NULL;
 
 	if (bitmap == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -1152,7 +1337,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	fz_always(ctx)
 	{
 		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -1165,7 +1350,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 static fz_rect *
 fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Error fterr;
 	FT_BBox cbox;
 	FT_Matrix m;
@@ -1175,7 +1360,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	// TODO: refactor loading into fz_load_ft_glyph
 	// TODO: cache results
 
-	const int scale = face->units_per_EM;
+	const int scale = ((FT_Face)font->ft_face)->units_per_EM;
 	const float recip = 1.0f / scale;
 	const float strength = 0.02f;
 	fz_matrix trm = fz_identity;
@@ -1192,7 +1377,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	v.x = trm.e * 65536;
 	v.y = trm.f * 65536;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	face = lock_ft_face(ctx, font);
 	/* Set the char size to scale=face->units_per_EM to effectively give
 	 * us unscaled results. This avoids quantisation. We then apply the
 	 * scale ourselves below. */
@@ -1205,7 +1390,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Load_Glyph(%s,%d,FT_LOAD_NO_HINTING): %s", font->name, gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 		bounds->x0 = bounds->x1 = trm.e;
 		bounds->y0 = bounds->y1 = trm.f;
 		return bounds;
@@ -1218,7 +1403,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	}
 
 	FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	unlock_ft_face(ctx, font, face);
 	bounds->x0 = cbox.xMin * recip;
 	bounds->y0 = cbox.yMin * recip;
 	bounds->x1 = cbox.xMax * recip;
@@ -1298,33 +1483,113 @@ static const FT_Outline_Funcs outline_funcs = {
 	move_to, line_to, conic_to, cubic_to, 0, 0
 };
 
-fz_path *
-fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
+/*
+	Unscaled glyph outlines are kept in the store, keyed on the font,
+	glyph id and fake bolding, so that repeated stroking, clipping and
+	drawing of glyphs too large for the glyph cache does not have to
+	decompose the FreeType outline (and take the FreeType lock) every
+	time.
+	The stored path is in unit em space with any fake bolding
+	applied; callers get a transformed copy.
+*/
+
+typedef struct
+{
+	int refs;
+	fz_font *font;
+	int gid;
+	int bold;
+} fz_outline_key;
+
+typedef struct
+{
+	fz_storable storable;
+	fz_path *path;
+} fz_outline_record;
+
+static int
+fz_make_hash_outline_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_outline_key *key = (fz_outline_key *)key_;
+	hash->u.pi.ptr = key->font;
+	hash->u.pi.i = key->gid * 2 + key->bold;
+	return 1;
+}
+
+static void *
+fz_keep_outline_key(fz_context *ctx, void *key_)
+{
+	fz_outline_key *key = (fz_outline_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_outline_key(fz_context *ctx, void *key_)
+{
+	fz_outline_key *key = (fz_outline_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+	{
+		fz_drop_font(ctx, key->font);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_outline_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_outline_key *k0 = (fz_outline_key *)k0_;
+	fz_outline_key *k1 = (fz_outline_key *)k1_;
+	return k0->font == k1->font && k0->gid == k1->gid && k0->bold == k1->bold;
+}
+
+static void
+fz_format_outline_key(fz_context *ctx, char *s, size_t n, void *key_)
+{
+	fz_outline_key *key = (fz_outline_key *)key_;
+	fz_snprintf(s, n, "(outline font=%s, gid=%d%s)", key->font->name, key->gid, key->bold ? ", bold" : "");
+}
+
+static const fz_store_type fz_outline_store_type =
+{
+	"fz_outline_record",
+	fz_make_hash_outline_key,
+	fz_keep_outline_key,
+	fz_drop_outline_key,
+	fz_cmp_outline_key,
+	fz_format_outline_key,
+	NULL
+};
+
+static void
+fz_drop_outline_record_imp(fz_context *ctx, fz_storable *storable)
+{
+	fz_outline_record *rec = (fz_outline_record *)storable;
+	fz_drop_path(ctx, rec->path);
+	fz_free(ctx, rec);
+}
+
+static fz_path *
+decompose_ft_outline(fz_context *ctx, fz_font *font, int gid, int bold)
 {
 	struct closure cc;
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	int fterr;
 
-	const int scale = face->units_per_EM;
+	const int scale = ((FT_Face)font->ft_face)->units_per_EM;
 	const float recip = 1.0f / scale;
 	const float strength = 0.02f;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &trm);
-
-	if (font->flags.fake_italic)
-		trm = fz_pre_shear(trm, SHEAR, 0);
-
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	face = lock_ft_face(ctx, font);
 
 	fterr = FT_Load_Glyph(face, gid, FT_LOAD_NO_SCALE | FT_LOAD_IGNORE_TRANSFORM);
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Load_Glyph(%s,%d,FT_LOAD_NO_SCALE|FT_LOAD_IGNORE_TRANSFORM): %s", font->name, gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
-	if (font->flags.fake_bold)
+	if (bold)
 	{
 		FT_Outline_Embolden(&face->glyph->outline, strength * scale);
 		FT_Outline_Translate(&face->glyph->outline, -strength * 0.5f * scale, -strength * 0.5f * scale);
@@ -1335,14 +1600,15 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	{
 		cc.ctx = ctx;
 		cc.path = fz_new_path(ctx);
-		cc.trm = fz_concat(fz_scale(recip, recip), trm);
-		fz_moveto(ctx, cc.path, cc.trm.e, cc.trm.f);
+		cc.trm = fz_scale(recip, recip);
+		fz_moveto(ctx, cc.path, 0, 0);
 		FT_Outline_Decompose(&face->glyph->outline, &outline_funcs, &cc);
 		fz_closepath(ctx, cc.path);
+		fz_trim_path(ctx, cc.path);
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -1354,6 +1620,99 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	return cc.path;
 }
 
+static fz_path *
+find_ft_outline(fz_context *ctx, fz_font *font, int gid)
+{
+	fz_outline_key key;
+	fz_outline_key *new_key = NULL;
+	fz_outline_record *rec, *other;
+	fz_path *path;
+
+	key.refs = 1;
+	key.font = font;
+	key.gid = gid;
+	key.bold = font->flags.fake_bold;
+	rec = fz_find_item(ctx, fz_drop_outline_record_imp, &key, &fz_outline_store_type);
+	if (rec)
+	{
+		path = fz_keep_path(ctx, rec->path);
+		fz_drop_storable(ctx, &rec->storable);
+		return path;
+	}
+
+	path = decompose_ft_outline(ctx, font, gid, key.bold);
+	if (!path)
+		return NULL;
+
+	rec = NULL;
+	fz_var(rec);
+	fz_var(new_key);
+	fz_try(ctx)
+	{
+		rec = fz_malloc_struct(ctx, fz_outline_record);
+		FZ_INIT_STORABLE(rec, 1, fz_drop_outline_record_imp);
+		rec->path = fz_keep_path(ctx, path);
+		new_key = fz_malloc_struct(ctx, fz_outline_key);
+		new_key->refs = 1;
+		new_key->font = fz_keep_font(ctx, font);
+		new_key->gid = gid;
+		new_key->bold = key.bold;
+		other = fz_store_item(ctx, new_key, rec, sizeof(*rec) + fz_packed_path_size(path), &fz_outline_store_type);
+		if (other)
+		{
+			/* Someone else got there first; use theirs. */
+			fz_drop_path(ctx, path);
+			path = fz_keep_path(ctx, other->path);
+			fz_drop_storable(ctx, &other->storable);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_outline_key(ctx, new_key);
+		if (rec)
+			fz_drop_storable(ctx, &rec->storable);
+	}
+	fz_catch(ctx)
+	{
+		/* Failing to cache the outline is not fatal. */
+		fz_warn(ctx, "cannot cache glyph outline");
+	}
+
+	return path;
+}
+
+fz_path *
+fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
+{
+	fz_path *unscaled, *path = NULL;
+
+	fz_adjust_ft_glyph_width(ctx, font, gid, &trm);
+
+	if (font->flags.fake_italic)
+		trm = fz_pre_shear(trm, SHEAR, 0);
+
+	unscaled = find_ft_outline(ctx, font, gid);
+	if (!unscaled)
+		return NULL;
+
+	fz_var(path);
+	fz_try(ctx)
+	{
+		path = fz_clone_path(ctx, unscaled);
+		fz_transform_path(ctx, path, trm);
+	}
+	fz_always(ctx)
+		fz_drop_path(ctx, unscaled);
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot transform glyph outline");
+		fz_drop_path(ctx, path);
+		return NULL;
+	}
+
+	return path;
+}
+
 /*
 	Type 3 fonts...
  */
@@ -1685,15 +2044,29 @@ int fz_glyph_cacheable(fz_context *ctx, fz_font *font, int gid)
 }
 
 static float
-fz_advance_ft_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
+ft_units_per_em(fz_font *font)
+{
+	int scale = ((FT_Face)font->ft_face)->units_per_EM;
+	return scale ? scale : 2048;
+}
+
+static float
+fz_advance_ft_glyph_imp(fz_context *ctx, fz_font *font, int gid, int wmode)
 {
 	FT_Error fterr;
 	FT_Fixed adv = 0;
+	FT_Face face;
 	int mask;
 
-	/* PDF and substitute font widths. */
-	if (font->flags.ft_stretch)
+	mask = FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM;
+	if (wmode)
+		mask |= FT_LOAD_VERTICAL_LAYOUT;
+	face = lock_ft_face(ctx, font);
+	fterr = FT_Get_Advance(face, gid, mask, &adv);
+	unlock_ft_face(ctx, font, face);
+	if (fterr && fterr != FT_Err_Invalid_Argument)
 	{
+		fz_warn(ctx, "FT_Get_Advance(%s,%d): %s", font->name, gid, ft_error_string(fterr));
 		if (font->width_table)
 		{
 			if (gid < font->width_count)
@@ -1701,16 +2074,15 @@ fz_advance_ft_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
 			return font->width_default / 1000.0f;
 		}
 	}
+	return (float) adv / ft_units_per_em(font);
+}
 
-	mask = FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM;
-	if (wmode)
-		mask |= FT_LOAD_VERTICAL_LAYOUT;
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
-	fterr = FT_Get_Advance(font->ft_face, gid, mask, &adv);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
-	if (fterr && fterr != FT_Err_Invalid_Argument)
+static float
+fz_advance_ft_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
+{
+	/* PDF and substitute font widths. */
+	if (font->flags.ft_stretch)
 	{
-		fz_warn(ctx, "FT_Get_Advance(%s,%d): %s", font->name, gid, ft_error_string(fterr));
 		if (font->width_table)
 		{
 			if (gid < font->width_count)
@@ -1718,7 +2090,114 @@ fz_advance_ft_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
 			return font->width_default / 1000.0f;
 		}
 	}
-	return (float) adv / ((FT_Face)font->ft_face)->units_per_EM;
+
+	return fz_advance_ft_glyph_imp(ctx, font, gid, wmode);
+}
+
+static float **
+load_advance_dir(fz_context *ctx, fz_font *font, int wmode)
+{
+#ifdef ADVANCE_LOAD
+	return ADVANCE_LOAD(&font->advance_cache[wmode]);
+#else
+	float **dir;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	dir = font->advance_cache[wmode];
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return dir;
+#endif
+}
+
+static float *
+load_advance_page(fz_context *ctx, float **dir, int page)
+{
+#ifdef ADVANCE_LOAD
+	return ADVANCE_LOAD(&dir[page]);
+#else
+	float *adv;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	adv = dir[page];
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return adv;
+#endif
+}
+
+/*
+	Return the page of cached FreeType advances holding gid, filling
+	it in if needed. Pages (and the per-wmode page directory) are
+	only ever written once, under the alloc lock, and are read with
+	load_advance_dir and load_advance_page. Only pages that are
+	actually used are allocated, which keeps this cheap for large CJK
+	fonts.
+*/
+static float *
+fz_advance_ft_page(fz_context *ctx, fz_font *font, int gid, int wmode)
+{
+	int page = gid >> ADVANCE_PAGE_BITS;
+	float **dir, **new_dir;
+	float *adv, *new_adv;
+	FT_Fixed fixed[ADVANCE_PAGE_SIZE];
+	FT_Face face;
+	FT_Error fterr;
+	int i, n, start, count, mask;
+	float scale;
+
+	dir = load_advance_dir(ctx, font, wmode);
+	if (!dir)
+	{
+		n = (font->glyph_count + ADVANCE_PAGE_SIZE - 1) >> ADVANCE_PAGE_BITS;
+		new_dir = Memento_label(fz_calloc(ctx, n, sizeof(float *)), "font_advance_dir");
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		dir = font->advance_cache[wmode];
+		if (!dir)
+		{
+			dir = new_dir;
+			ADVANCE_STORE(&font->advance_cache[wmode], new_dir);
+		}
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (dir != new_dir)
+			fz_free(ctx, new_dir);
+	}
+
+	adv = load_advance_page(ctx, dir, page);
+	if (adv)
+		return adv;
+
+	start = page << ADVANCE_PAGE_BITS;
+	count = fz_mini(ADVANCE_PAGE_SIZE, font->glyph_count - start);
+	new_adv = Memento_label(fz_malloc_array(ctx, count, float), "font_advance_cache");
+
+	mask = FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM;
+	if (wmode)
+		mask |= FT_LOAD_VERTICAL_LAYOUT;
+	face = lock_ft_face(ctx, font);
+	fterr = FT_Get_Advances(face, start, count, mask, fixed);
+	unlock_ft_face(ctx, font, face);
+	if (fterr)
+	{
+		/* Do them one at a time so a single bad glyph doesn't spoil the page. */
+		for (i = 0; i < count; ++i)
+			new_adv[i] = fz_advance_ft_glyph_imp(ctx, font, start + i, wmode);
+	}
+	else
+	{
+		scale = ft_units_per_em(font);
+		for (i = 0; i < count; ++i)
+			new_adv[i] = (float) fixed[i] / scale;
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	adv = dir[page];
+	if (!adv)
+	{
+		adv = new_adv;
+		ADVANCE_STORE(&dir[page], new_adv);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (adv != new_adv)
+		fz_free(ctx, new_adv);
+
+	return adv;
 }
 
 static float
@@ -1755,21 +2234,13 @@ fz_advance_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
 {
 	if (font->ft_face)
 	{
-		if (wmode)
-			return fz_advance_ft_glyph(ctx, font, gid, 1);
-		if (gid >= 0 && gid < font->glyph_count && gid < MAX_ADVANCE_CACHE)
-		{
-			if (!font->advance_cache)
-			{
-				int i;
-				font->advance_cache = Memento_label(fz_malloc_array(ctx, font->glyph_count, float), "font_advance_cache");
-				for (i = 0; i < font->glyph_count; ++i)
-					font->advance_cache[i] = fz_advance_ft_glyph(ctx, font, i, 0);
-			}
-			return font->advance_cache[gid];
-		}
-
-		return fz_advance_ft_glyph(ctx, font, gid, 0);
+		/* PDF and substitute font widths are a table lookup anyway. */
+		if (font->flags.ft_stretch && font->width_table)
+			return fz_advance_ft_glyph(ctx, font, gid, wmode);
+		wmode = !!wmode;
+		if (gid >= 0 && gid < font->glyph_count)
+			return fz_advance_ft_page(ctx, font, gid, wmode)[gid & (ADVANCE_PAGE_SIZE-1)];
+		return fz_advance_ft_glyph(ctx, font, gid, wmode);
 	}
 	if (font->t3procs)
 		return fz_advance_t3_glyph(ctx, font, gid);
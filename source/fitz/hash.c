@@ -127,8 +127,9 @@ do_hash_insert(fz_context *ctx, fz_hash_table *table, const void *key, void *val
 	}
 }
 
-/* Entered with the lock taken, held throughout and at exit, UNLESS the lock
- * is the alloc lock in which case it may be momentarily dropped. */
+/* Entered with the lock taken, held throughout and at exit, except that
+ * it is momentarily dropped around allocations (so that a scavenging
+ * allocator can take it, or the alloc lock itself). */
 static void
 fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 {
@@ -144,21 +145,18 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		return;
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_unlock(ctx, table->lock);
 	newents = fz_malloc_no_throw(ctx, newsize * sizeof (fz_hash_entry));
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_lock(ctx, table->lock);
 	if (table->lock >= 0)
 	{
+		fz_lock(ctx, table->lock);
 		if (table->size >= newsize)
 		{
 			/* Someone else fixed it before we could lock! */
-			if (table->lock == FZ_LOCK_ALLOC)
-				fz_unlock(ctx, table->lock);
+			fz_unlock(ctx, table->lock);
 			fz_free(ctx, newents);
-			if (table->lock == FZ_LOCK_ALLOC)
-				fz_lock(ctx, table->lock);
+			fz_lock(ctx, table->lock);
 			return;
 		}
 	}
@@ -177,10 +175,10 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		}
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_unlock(ctx, table->lock);
 	fz_free(ctx, oldents);
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_lock(ctx, table->lock);
 }
 
@@ -24,6 +24,12 @@ struct fz_compressed_image
 {
 	fz_image super;
 	fz_compressed_buffer *buffer;
+
+	/* Digest of everything that goes into decoding the image, for
+	 * naming spilled tiles. Computed on first use; protected by the
+	 * alloc lock. */
+	int has_digest;
+	unsigned char digest[16];
 };
 
 struct fz_pixmap_image
@@ -109,6 +115,409 @@ fz_needs_reap_image_key(fz_context *ctx, void *key_)
 	return fz_key_storable_needs_reaping(ctx, &key->image->key_storable);
 }
 
+static size_t
+fz_image_key_cost(fz_context *ctx, void *key_, void *val, size_t size)
+{
+	fz_image_key *key = (fz_image_key *)key_;
+	fz_compressed_buffer *buf = fz_compressed_image_buffer(ctx, key->image);
+	size_t weight;
+
+	if (buf == NULL || buf->buffer == NULL)
+		return size;
+
+	/* Regenerating the pixmap means decoding the image again. Use the
+	 * length of the compressed data, weighted by a rough guess at how
+	 * slow the format is to decode, as a measure of the work involved. */
+	switch (buf->params.type)
+	{
+	case FZ_IMAGE_JBIG2:
+	case FZ_IMAGE_JPX:
+	case FZ_IMAGE_JXR:
+		weight = 64;
+		break;
+	case FZ_IMAGE_FAX:
+	case FZ_IMAGE_JPEG:
+		weight = 16;
+		break;
+	case FZ_IMAGE_FLATE:
+	case FZ_IMAGE_LZW:
+	case FZ_IMAGE_GIF:
+	case FZ_IMAGE_PNG:
+	case FZ_IMAGE_TIFF:
+		weight = 4;
+		break;
+	default:
+		weight = 1;
+		break;
+	}
+	if (buf->buffer->len > (SIZE_MAX - size) / weight)
+		return SIZE_MAX;
+	return size + buf->buffer->len * weight;
+}
+
+/*
+	Tiles that are evicted from the store can be spilled to disk (see
+	fz_set_image_spill), from where they can be read back much more
+	quickly than the image can be decoded again. Spilled tiles are
+	named by a digest of the compressed data, everything else that
+	affects decoding, and the subarea and subsampling of the tile.
+	The colorspace of the tile is recorded as that of the image (or the
+	base of its indexed colorspace), so images whose decoders pick
+	their own colorspaces are not spilled.
+*/
+
+#define SPILL_MAGIC 0x4c495053 /* "SPIL" */
+#define SPILL_VERSION 1
+
+enum
+{
+	SPILL_CS_NONE,
+	SPILL_CS_IMAGE,
+	SPILL_CS_BASE
+};
+
+static void
+md5_int(fz_md5 *md5, int v)
+{
+	unsigned char b[4];
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+	fz_md5_update(md5, b, 4);
+}
+
+static int
+fz_compressed_image_digest(fz_context *ctx, fz_image *image, unsigned char digest[16])
+{
+	fz_compressed_image *cimg = (fz_compressed_image *)image;
+	fz_compressed_buffer *buf;
+	fz_compression_params *params;
+	fz_colorspace *cs = image->colorspace;
+	fz_md5 md5;
+	int i, have;
+
+	buf = fz_compressed_image_buffer(ctx, image);
+	if (buf == NULL || buf->buffer == NULL)
+		return 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	have = cimg->has_digest;
+	if (have)
+		memcpy(digest, cimg->digest, 16);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (have)
+		return 1;
+
+	/* Images with a matte depend on their mask, and JBIG2 images may
+	 * depend on globals shared with other images; don't try to name
+	 * them. */
+	params = &buf->params;
+	if (image->use_colorkey && image->mask)
+		return 0;
+	if (params->type == FZ_IMAGE_JBIG2 && params->u.jbig2.globals)
+		return 0;
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, buf->buffer->data, buf->buffer->len);
+	md5_int(&md5, buf->buffer->len);
+	md5_int(&md5, params->type);
+	switch (params->type)
+	{
+	case FZ_IMAGE_JPEG:
+		md5_int(&md5, params->u.jpeg.color_transform);
+		break;
+	case FZ_IMAGE_JPX:
+		md5_int(&md5, params->u.jpx.smask_in_data);
+		break;
+	case FZ_IMAGE_JBIG2:
+		md5_int(&md5, params->u.jbig2.embedded);
+		break;
+	case FZ_IMAGE_FAX:
+		md5_int(&md5, params->u.fax.columns);
+		md5_int(&md5, params->u.fax.rows);
+		md5_int(&md5, params->u.fax.k);
+		md5_int(&md5, params->u.fax.end_of_line);
+		md5_int(&md5, params->u.fax.encoded_byte_align);
+		md5_int(&md5, params->u.fax.end_of_block);
+		md5_int(&md5, params->u.fax.black_is_1);
+		md5_int(&md5, params->u.fax.damaged_rows_before_error);
+		break;
+	case FZ_IMAGE_FLATE:
+		md5_int(&md5, params->u.flate.columns);
+		md5_int(&md5, params->u.flate.colors);
+		md5_int(&md5, params->u.flate.predictor);
+		md5_int(&md5, params->u.flate.bpc);
+		break;
+	case FZ_IMAGE_LZW:
+		md5_int(&md5, params->u.lzw.columns);
+		md5_int(&md5, params->u.lzw.colors);
+		md5_int(&md5, params->u.lzw.predictor);
+		md5_int(&md5, params->u.lzw.bpc);
+		md5_int(&md5, params->u.lzw.early_change);
+		break;
+	}
+
+	md5_int(&md5, image->w);
+	md5_int(&md5, image->h);
+	md5_int(&md5, image->n);
+	md5_int(&md5, image->bpc);
+	md5_int(&md5, image->imagemask);
+	md5_int(&md5, image->invert_cmyk_jpeg);
+	md5_int(&md5, image->use_colorkey);
+	if (image->use_colorkey)
+		for (i = 0; i < image->n * 2; i++)
+			md5_int(&md5, image->colorkey[i]);
+	md5_int(&md5, image->use_decode);
+	if (image->use_decode)
+		fz_md5_update(&md5, (unsigned char *)image->decode, image->n * 2 * sizeof(float));
+
+	/* Indexed images are expanded through their palettes. */
+	if (cs)
+	{
+		md5_int(&md5, cs->type);
+		md5_int(&md5, cs->n);
+		if (fz_colorspace_is_indexed(ctx, cs))
+		{
+			md5_int(&md5, cs->u.indexed.high);
+			fz_md5_update(&md5, cs->u.indexed.lookup, (cs->u.indexed.high + 1) * (size_t)cs->u.indexed.base->n);
+		}
+	}
+	fz_md5_final(&md5, digest);
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	memcpy(cimg->digest, digest, 16);
+	cimg->has_digest = 1;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return 1;
+}
+
+static int
+fz_image_tile_digest(fz_context *ctx, fz_image *image, int l2factor, const fz_irect *rect, unsigned char digest[16])
+{
+	unsigned char image_digest[16];
+	fz_md5 md5;
+
+	if (!fz_compressed_image_digest(ctx, image, image_digest))
+		return 0;
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, image_digest, 16);
+	md5_int(&md5, l2factor);
+	md5_int(&md5, rect->x0);
+	md5_int(&md5, rect->y0);
+	md5_int(&md5, rect->x1);
+	md5_int(&md5, rect->y1);
+	fz_md5_final(&md5, digest);
+	return 1;
+}
+
+static int
+spill_colorspace(fz_context *ctx, fz_image *image, fz_colorspace *cs)
+{
+	if (cs == NULL)
+		return SPILL_CS_NONE;
+	if (cs == image->colorspace)
+		return SPILL_CS_IMAGE;
+	if (fz_colorspace_is_indexed(ctx, image->colorspace) && cs == image->colorspace->u.indexed.base)
+		return SPILL_CS_BASE;
+	return -1;
+}
+
+/* A tile waiting to be spilled. */
+typedef struct
+{
+	unsigned char digest[16];
+	int cs;
+	fz_pixmap *tile;
+} fz_pending_tile;
+
+static void
+fz_write_spilled_tile(fz_context *ctx, fz_pending_tile *pending)
+{
+	fz_pixmap *tile = pending->tile;
+	fz_output *out = NULL;
+	unsigned char *s;
+	int y;
+
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		out = fz_new_spill_output(ctx, pending->digest);
+		if (out)
+		{
+			fz_write_int32_le(ctx, out, SPILL_MAGIC);
+			fz_write_int32_le(ctx, out, SPILL_VERSION);
+			fz_write_int32_le(ctx, out, tile->x);
+			fz_write_int32_le(ctx, out, tile->y);
+			fz_write_int32_le(ctx, out, tile->w);
+			fz_write_int32_le(ctx, out, tile->h);
+			fz_write_int32_le(ctx, out, tile->n);
+			fz_write_int32_le(ctx, out, tile->alpha);
+			fz_write_int32_le(ctx, out, tile->xres);
+			fz_write_int32_le(ctx, out, tile->yres);
+			fz_write_int32_le(ctx, out, tile->flags & FZ_PIXMAP_FLAG_INTERPOLATE);
+			fz_write_int32_le(ctx, out, pending->cs);
+			s = tile->samples;
+			for (y = 0; y < tile->h; y++)
+			{
+				fz_write_data(ctx, out, s, tile->w * (size_t)tile->n);
+				s += tile->stride;
+			}
+			fz_close_output(ctx, out);
+		}
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+		fz_warn(ctx, "cannot spill image tile");
+}
+
+static void
+fz_spill_pending_tile(fz_context *ctx, void *arg, int write)
+{
+	fz_pending_tile *pending = arg;
+
+	if (write)
+		fz_write_spilled_tile(ctx, pending);
+	fz_drop_pixmap(ctx, pending->tile);
+	fz_free(ctx, pending);
+}
+
+/* Called by the store, with no locks held, for tiles it evicts. Writing
+ * them out is left for later, so as not to hold up whatever is being
+ * stored. The digest is worked out now, so that the tile can be found
+ * while it waits; the image's part of it is only worked out once, and
+ * would be needed to look for the tile on disk anyway. */
+static void
+fz_image_key_evicted(fz_context *ctx, void *key_, void *val)
+{
+	fz_image_key *key = (fz_image_key *)key_;
+	fz_pixmap *tile = (fz_pixmap *)val;
+	fz_pending_tile *pending;
+	unsigned char digest[16];
+	int cs;
+
+	/* Tiles are spilled even if their image is being reaped, as the
+	 * same image may well be loaded again later, and the digest will
+	 * find the tile for it. */
+	if (tile->s || tile->seps)
+		return;
+	cs = spill_colorspace(ctx, key->image, tile->colorspace);
+	if (cs < 0 || !fz_spill_enabled(ctx))
+		return;
+	fz_try(ctx)
+		cs = fz_image_tile_digest(ctx, key->image, key->l2factor, &key->rect, digest) ? cs : -1;
+	fz_catch(ctx)
+		cs = -1;
+	if (cs < 0)
+		return;
+
+	pending = fz_malloc_no_throw(ctx, sizeof *pending);
+	if (pending == NULL)
+		return;
+	memcpy(pending->digest, digest, 16);
+	pending->cs = cs;
+	pending->tile = fz_keep_pixmap(ctx, tile);
+	fz_defer_spill(ctx, digest, fz_pixmap_size(ctx, tile), fz_spill_pending_tile, pending);
+}
+
+/* Take a tile that is still waiting to be spilled back off the queue. */
+static fz_pixmap *
+fz_take_pending_tile(fz_context *ctx, const unsigned char digest[16])
+{
+	fz_pending_tile *pending = fz_take_deferred_spill(ctx, digest);
+	fz_pixmap *tile;
+
+	if (pending == NULL)
+		return NULL;
+	tile = fz_keep_pixmap(ctx, pending->tile);
+	fz_spill_pending_tile(ctx, pending, 0);
+	return tile;
+}
+
+static fz_pixmap *
+fz_read_spilled_tile(fz_context *ctx, fz_image *image, int l2factor, const fz_irect *rect, const unsigned char digest[16])
+{
+	fz_stream *stm;
+	fz_pixmap *tile = NULL;
+	fz_colorspace *cs;
+	int x, y, w, h, n, alpha, xres, yres, flags, kind, f;
+	unsigned char *s;
+	size_t len;
+
+	stm = fz_open_spilled(ctx, digest);
+	if (stm == NULL)
+		return NULL;
+
+	fz_var(tile);
+
+	fz_try(ctx)
+	{
+		if (fz_read_int32_le(ctx, stm) != SPILL_MAGIC || fz_read_int32_le(ctx, stm) != SPILL_VERSION)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad spilled tile header");
+		x = fz_read_int32_le(ctx, stm);
+		y = fz_read_int32_le(ctx, stm);
+		w = fz_read_int32_le(ctx, stm);
+		h = fz_read_int32_le(ctx, stm);
+		n = fz_read_int32_le(ctx, stm);
+		alpha = fz_read_int32_le(ctx, stm);
+		xres = fz_read_int32_le(ctx, stm);
+		yres = fz_read_int32_le(ctx, stm);
+		flags = fz_read_int32_le(ctx, stm);
+		kind = fz_read_int32_le(ctx, stm);
+
+		if (kind == SPILL_CS_NONE)
+			cs = NULL;
+		else if (kind == SPILL_CS_IMAGE)
+			cs = image->colorspace;
+		else if (kind == SPILL_CS_BASE && fz_colorspace_is_indexed(ctx, image->colorspace))
+			cs = image->colorspace->u.indexed.base;
+		else
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad spilled tile colorspace");
+
+		/* Only trust a tile of the size that decoding would give, so
+		 * that a stale or damaged file can neither misplace it nor
+		 * make us allocate more than the image could need. */
+		f = 1 << l2factor;
+		if (x != 0 || y != 0 ||
+			w != (rect->x1 - rect->x0 + f - 1) >> l2factor ||
+			h != (rect->y1 - rect->y0 + f - 1) >> l2factor)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad spilled tile size");
+
+		tile = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+		if (tile->n != n)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad spilled tile components");
+		tile->x = x;
+		tile->y = y;
+		tile->xres = xres;
+		tile->yres = yres;
+		tile->flags |= flags & FZ_PIXMAP_FLAG_INTERPOLATE;
+
+		len = w * (size_t)n;
+		s = tile->samples;
+		for (y = 0; y < h; y++)
+		{
+			if (fz_read(ctx, stm, s, len) != len)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "truncated spilled tile");
+			s += tile->stride;
+		}
+	}
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+		fz_forget_spilled(ctx, digest);
+		fz_warn(ctx, "cannot read spilled image tile");
+		return NULL;
+	}
+
+	return tile;
+}
+
 static const fz_store_type fz_image_store_type =
 {
 	"fz_image",
@@ -117,7 +526,9 @@ static const fz_store_type fz_image_store_type =
 	fz_drop_image_key,
 	fz_cmp_image_key,
 	fz_format_image_key,
-	fz_needs_reap_image_key
+	fz_needs_reap_image_key,
+	fz_image_key_cost,
+	fz_image_key_evicted
 };
 
 void
@@ -660,6 +1071,56 @@ drop_pixmap_image(fz_context *ctx, fz_image *image_)
 	fz_drop_pixmap(ctx, image->tile);
 }
 
+/* Scan JPEG stream for missing height values in the header, and
+ * return a patched copy of the stream if there are any. The data may
+ * be shared with the document (or mapped read-only), so never patch
+ * it in place. */
+static fz_buffer *
+patch_jpeg_height(fz_context *ctx, fz_buffer *buf, int h)
+{
+	fz_buffer *patched = NULL;
+	unsigned char *s = buf->data;
+	unsigned char *e = s + buf->len;
+	unsigned char *d;
+	for (d = s + 2; s < d && d < e - 9 && d[0] == 0xFF; d += (d[2] << 8 | d[3]) + 2)
+	{
+		if (d[1] < 0xC0 || (0xC3 < d[1] && d[1] < 0xC9) || 0xCB < d[1])
+			continue;
+		if ((d[5] == 0 && d[6] == 0) || ((d[5] << 8) | d[6]) > h)
+		{
+			if (!patched)
+				patched = fz_new_buffer_from_copied_data(ctx, buf->data, buf->len);
+			patched->data[d - s + 5] = (h >> 8) & 0xFF;
+			patched->data[d - s + 6] = h & 0xFF;
+		}
+	}
+	return patched;
+}
+
+static fz_stream *
+open_compressed_image_stream(fz_context *ctx, fz_compressed_image *image, int *l2factor)
+{
+	fz_compressed_buffer patched;
+	fz_stream *stm;
+
+	if (image->buffer->params.type != FZ_IMAGE_JPEG)
+		return fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
+
+	patched = *image->buffer;
+	patched.buffer = patch_jpeg_height(ctx, image->buffer->buffer, image->super.h);
+	if (!patched.buffer)
+		return fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
+
+	fz_try(ctx)
+		stm = fz_open_image_decomp_stream_from_buffer(ctx, &patched, l2factor);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, patched.buffer);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return stm;
+}
+
 static fz_pixmap *
 compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea, int w, int h, int *l2factor)
 {
@@ -705,28 +1166,9 @@ compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea
 	case FZ_IMAGE_JPX:
 		tile = fz_load_jpx(ctx, image->buffer->buffer->data, image->buffer->buffer->len, NULL);
 		break;
-	case FZ_IMAGE_JPEG:
-		/* Scan JPEG stream and patch missing height values in header */
-		{
-			unsigned char *s = image->buffer->buffer->data;
-			unsigned char *e = s + image->buffer->buffer->len;
-			unsigned char *d;
-			for (d = s + 2; s < d && d < e - 9 && d[0] == 0xFF; d += (d[2] << 8 | d[3]) + 2)
-			{
-				if (d[1] < 0xC0 || (0xC3 < d[1] && d[1] < 0xC9) || 0xCB < d[1])
-					continue;
-				if ((d[5] == 0 && d[6] == 0) || ((d[5] << 8) | d[6]) > image->super.h)
-				{
-					d[5] = (image->super.h >> 8) & 0xFF;
-					d[6] = image->super.h & 0xFF;
-				}
-			}
-		}
-		/* fall through */
-
 	default:
 		native_l2factor = l2factor ? *l2factor : 0;
-		stm = fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
+		stm = open_compressed_image_stream(ctx, image, l2factor);
 		fz_try(ctx)
 		{
 			if (l2factor)
@@ -837,18 +1279,78 @@ fz_find_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matri
 	return NULL;
 }
 
+static fz_pixmap *
+fz_store_image_tile(fz_context *ctx, fz_image *image, int l2factor, const fz_irect *rect, fz_pixmap *tile)
+{
+	fz_image_key *keyp = NULL;
+
+	fz_var(keyp);
+
+	fz_try(ctx)
+	{
+		fz_pixmap *existing_tile;
+
+		/* Now we try to cache the pixmap. Any failure here will just result
+		 * in us not caching. */
+		keyp = fz_malloc_struct(ctx, fz_image_key);
+		keyp->refs = 1;
+		keyp->image = fz_keep_image_store_key(ctx, image);
+		keyp->l2factor = l2factor;
+		keyp->rect = *rect;
+
+		existing_tile = fz_store_item(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type);
+		if (existing_tile)
+		{
+			/* We already have a tile. This must have been produced by a
+			 * racing thread. We'll throw away ours and use that one. */
+			fz_drop_pixmap(ctx, tile);
+			tile = existing_tile;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_image_key(ctx, keyp);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+
+	return tile;
+}
+
+static fz_pixmap *
+fz_find_spilled_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matrix *ctm)
+{
+	unsigned char digest[16];
+	fz_pixmap *tile;
+	do
+	{
+		if (!fz_image_tile_digest(ctx, image, key->l2factor, &key->rect, digest))
+			return NULL;
+		tile = fz_take_pending_tile(ctx, digest);
+		if (!tile)
+			tile = fz_read_spilled_tile(ctx, image, key->l2factor, &key->rect, digest);
+		if (tile)
+		{
+			update_ctm_for_subarea(ctm, &key->rect, image->w, image->h);
+			return fz_store_image_tile(ctx, image, key->l2factor, &key->rect, tile);
+		}
+		key->l2factor--;
+	}
+	while (key->l2factor >= 0);
+	return NULL;
+}
+
 fz_pixmap *
 fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subarea, fz_matrix *ctm, int *dw, int *dh)
 {
 	fz_pixmap *tile;
 	int l2factor, l2factor_remaining;
 	fz_image_key key;
-	fz_image_key *keyp = NULL;
 	int w;
 	int h;
 
-	fz_var(keyp);
-
 	if (!image)
 		return NULL;
 
@@ -918,6 +1420,23 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	if (tile)
 		return tile;
 
+	/* Not in the store; see whether either is waiting to be spilled,
+	 * or was spilled to disk */
+	if (fz_spill_enabled(ctx))
+	{
+		if (subarea)
+		{
+			fz_compute_image_key(ctx, image, ctm, &key, subarea, l2factor, &w, &h, dw, dh);
+			tile = fz_find_spilled_image_tile(ctx, image, &key, ctm);
+			if (tile)
+				return tile;
+		}
+		fz_compute_image_key(ctx, image, ctm, &key, NULL, l2factor, &w, &h, dw, dh);
+		tile = fz_find_spilled_image_tile(ctx, image, &key, ctm);
+		if (tile)
+			return tile;
+	}
+
 	/* Neither subarea nor full image tile found; prepare the subarea key again */
 	if (subarea)
 		fz_compute_image_key(ctx, image, ctm, &key, subarea, l2factor, &w, &h, dw, dh);
@@ -942,37 +1461,7 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 		}
 	}
 
-	fz_try(ctx)
-	{
-		fz_pixmap *existing_tile;
-
-		/* Now we try to cache the pixmap. Any failure here will just result
-		 * in us not caching. */
-		keyp = fz_malloc_struct(ctx, fz_image_key);
-		keyp->refs = 1;
-		keyp->image = fz_keep_image_store_key(ctx, image);
-		keyp->l2factor = l2factor;
-		keyp->rect = key.rect;
-
-		existing_tile = fz_store_item(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type);
-		if (existing_tile)
-		{
-			/* We already have a tile. This must have been produced by a
-			 * racing thread. We'll throw away ours and use that one. */
-			fz_drop_pixmap(ctx, tile);
-			tile = existing_tile;
-		}
-	}
-	fz_always(ctx)
-	{
-		fz_drop_image_key(ctx, keyp);
-	}
-	fz_catch(ctx)
-	{
-		/* Do nothing */
-	}
-
-	return tile;
+	return fz_store_image_tile(ctx, image, l2factor, &key.rect, tile);
 }
 
 fz_pixmap *
@@ -1138,6 +1627,7 @@ void fz_set_compressed_image_buffer(fz_context *ctx, fz_compressed_image *image,
 {
 	assert(image != NULL && image->super.get_pixmap == compressed_image_get_pixmap);
 	((fz_compressed_image *)image)->buffer = buf; /* Note: compressed buffers are not reference counted */
+	((fz_compressed_image *)image)->has_digest = 0;
 }
 
 fz_pixmap *fz_pixmap_image_tile(fz_context *ctx, fz_pixmap_image *image)
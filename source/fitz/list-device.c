@@ -1,6 +1,7 @@
 #include "mupdf/fitz.h"
 
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 
 #define STACK_SIZE 96
@@ -112,6 +113,41 @@ enum {
 	MAX_NODE_SIZE = (1<<9)-sizeof(fz_display_node)
 };
 
+/* The graphics state as unpacked from the list. The pointers are
+ * borrowed from the list itself. */
+typedef struct
+{
+	fz_rect rect;
+	fz_path *path;
+	float alpha;
+	fz_matrix ctm;
+	fz_stroke_state *stroke;
+	fz_colorspace *colorspace;
+	float color[FZ_MAX_COLORS];
+} fz_list_state;
+
+/* A span of nodes from start up to (but not including) end, whose
+ * clips, masks, groups and tiles are all balanced within it. Every node
+ * in it has a rect within bbox, so if that is outside the scissor, we
+ * can jump straight to the end and pick up the graphics state there. */
+typedef struct
+{
+	fz_rect bbox;
+	size_t start;
+	size_t end;
+	int state;
+} fz_list_index_entry;
+
+/* Spans of each level of nesting are indexed in two tiers: runs of
+ * nodes, and groups of runs. The entries are sorted by start, with the
+ * outermost first. */
+typedef struct
+{
+	int len;
+	fz_list_index_entry *entries;
+	fz_list_state *states;
+} fz_list_index;
+
 struct fz_display_list
 {
 	fz_storable storable;
@@ -119,6 +155,7 @@ struct fz_display_list
 	fz_rect mediabox;
 	size_t max;
 	size_t len;
+	fz_list_index *index;
 };
 
 typedef struct
@@ -185,6 +222,406 @@ static void align_node_for_pointer(fz_display_node **node)
 		(*node) = (fz_display_node *)((ptr + FZ_POINTER_ALIGN_MOD - 1) & ~(FZ_POINTER_ALIGN_MOD-1));
 }
 
+/* Lists shorter than this are not worth indexing. */
+#define INDEX_MIN_NODES 1024
+/* The limits on the number of nodes (counting everything inside clips,
+ * masks and groups) in a run, and on the number of runs in a group of
+ * runs. Between the two, we start a new one when the next thing to go
+ * in is somewhere else on the page. */
+#define INDEX_RUN_MIN 8
+#define INDEX_RUN_MAX 64
+#define INDEX_GROUP_MIN 4
+#define INDEX_GROUP_MAX 32
+
+static void
+fz_drop_list_index(fz_context *ctx, fz_list_index *index)
+{
+	if (index)
+	{
+		fz_free(ctx, index->entries);
+		fz_free(ctx, index->states);
+		fz_free(ctx, index);
+	}
+}
+
+typedef struct
+{
+	fz_rect bbox;
+	size_t start;
+	size_t end;
+	int count;
+} index_span;
+
+typedef struct
+{
+	index_span tree; /* Everything from the clip, mask, group or tile that opened this level. */
+	fz_list_state before; /* The state before that node. */
+	index_span run;
+	index_span group;
+	int group_runs;
+	int group_state;
+} index_level;
+
+typedef struct
+{
+	fz_list_index *index;
+	int max_entries;
+	int max_states;
+	int num_states;
+} index_builder;
+
+static void
+index_add_span(index_span *span, const index_span *item)
+{
+	if (span->count == 0)
+		*span = *item;
+	else
+	{
+		span->bbox = fz_union_rect(span->bbox, item->bbox);
+		span->end = item->end;
+		span->count += item->count;
+	}
+}
+
+static void
+index_add_entry(fz_context *ctx, index_builder *ib, const index_span *span, int state)
+{
+	fz_list_index *index = ib->index;
+	fz_list_index_entry *entry;
+
+	if (index->len == ib->max_entries)
+	{
+		int newmax = ib->max_entries ? ib->max_entries * 2 : 64;
+		index->entries = fz_realloc_array(ctx, index->entries, newmax, fz_list_index_entry);
+		ib->max_entries = newmax;
+	}
+	entry = &index->entries[index->len++];
+	entry->bbox = span->bbox;
+	entry->start = span->start;
+	entry->end = span->end;
+	entry->state = state;
+}
+
+static int
+index_add_state(fz_context *ctx, index_builder *ib, const fz_list_state *state)
+{
+	fz_list_index *index = ib->index;
+
+	if (ib->num_states == ib->max_states)
+	{
+		int newmax = ib->max_states ? ib->max_states * 2 : 64;
+		index->states = fz_realloc_array(ctx, index->states, newmax, fz_list_state);
+		ib->max_states = newmax;
+	}
+	index->states[ib->num_states] = *state;
+	return ib->num_states++;
+}
+
+/* Whether a and b are far enough apart that a span covering both would
+ * be a poor fit for either. */
+static int
+index_far_apart(fz_rect a, fz_rect b)
+{
+	fz_rect u;
+
+	if (!fz_is_valid_rect(a) || !fz_is_valid_rect(b))
+		return 0;
+	u = fz_union_rect(a, b);
+	return (u.x1 - u.x0) + (u.y1 - u.y0) > (a.x1 - a.x0) + (a.y1 - a.y0) + (b.x1 - b.x0) + (b.y1 - b.y0);
+}
+
+static void
+index_end_group(fz_context *ctx, index_builder *ib, index_level *level)
+{
+	if (level->group_runs > 1)
+		index_add_entry(ctx, ib, &level->group, level->group_state);
+	level->group.count = 0;
+	level->group_runs = 0;
+}
+
+/* state must be the state at the end of the run. */
+static void
+index_end_run(fz_context *ctx, index_builder *ib, index_level *level, const fz_list_state *state)
+{
+	if (level->run.count == 0)
+		return;
+	if (level->group_runs >= INDEX_GROUP_MIN && index_far_apart(level->group.bbox, level->run.bbox))
+		index_end_group(ctx, ib, level);
+	level->group_state = index_add_state(ctx, ib, state);
+	index_add_entry(ctx, ib, &level->run, level->group_state);
+	index_add_span(&level->group, &level->run);
+	level->run.count = 0;
+	if (++level->group_runs == INDEX_GROUP_MAX)
+		index_end_group(ctx, ib, level);
+}
+
+/* before is the state before the item, and after the state after it. */
+static void
+index_add_item(fz_context *ctx, index_builder *ib, index_level *level, const index_span *item, const fz_list_state *before, const fz_list_state *after)
+{
+	if (level->run.count >= INDEX_RUN_MIN && index_far_apart(level->run.bbox, item->bbox))
+		index_end_run(ctx, ib, level, before);
+	index_add_span(&level->run, item);
+	if (level->run.count >= INDEX_RUN_MAX)
+		index_end_run(ctx, ib, level, after);
+}
+
+static int
+cmp_index_entries(const void *a_, const void *b_)
+{
+	const fz_list_index_entry *a = a_;
+	const fz_list_index_entry *b = b_;
+
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	if (a->end != b->end)
+		return a->end > b->end ? -1 : 1;
+	return 0;
+}
+
+/* Unpack the changes to the graphics state made by a node, leaving
+ * node pointing at its private data. The state borrows its pointers
+ * from the list. */
+static void
+unpack_node_state(fz_context *ctx, fz_display_node **nodep, fz_display_node n, fz_list_state *state)
+{
+	fz_display_node *node = *nodep + 1;
+	int i, nc;
+
+	if (n.rect)
+	{
+		state->rect = *(fz_rect *)node;
+		node += SIZE_IN_NODES(sizeof(fz_rect));
+	}
+	switch (n.cs)
+	{
+	case CS_UNCHANGED:
+		break;
+	default:
+	case CS_GRAY_0:
+	case CS_GRAY_1:
+		state->colorspace = fz_device_gray(ctx);
+		state->color[0] = n.cs == CS_GRAY_1 ? 1.0f : 0.0f;
+		break;
+	case CS_RGB_0:
+	case CS_RGB_1:
+		state->colorspace = fz_device_rgb(ctx);
+		state->color[0] = state->color[1] = state->color[2] = n.cs == CS_RGB_1 ? 1.0f : 0.0f;
+		break;
+	case CS_CMYK_0:
+	case CS_CMYK_1:
+		state->colorspace = fz_device_cmyk(ctx);
+		state->color[0] = state->color[1] = state->color[2] = 0.0f;
+		state->color[3] = n.cs == CS_CMYK_1 ? 1.0f : 0.0f;
+		break;
+	case CS_OTHER_0:
+		align_node_for_pointer(&node);
+		state->colorspace = *(fz_colorspace **)node;
+		node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+		nc = fz_colorspace_n(ctx, state->colorspace);
+		for (i = 0; i < nc; i++)
+			state->color[i] = 0.0f;
+		break;
+	}
+	if (n.color)
+	{
+		nc = fz_colorspace_n(ctx, state->colorspace);
+		memcpy(state->color, (float *)node, nc * sizeof(float));
+		node += SIZE_IN_NODES(nc * sizeof(float));
+	}
+	switch (n.alpha)
+	{
+	case ALPHA_UNCHANGED:
+		break;
+	default:
+	case ALPHA_0:
+		state->alpha = 0.0f;
+		break;
+	case ALPHA_1:
+		state->alpha = 1.0f;
+		break;
+	case ALPHA_PRESENT:
+		state->alpha = *(float *)node;
+		node += SIZE_IN_NODES(sizeof(float));
+		break;
+	}
+	if (n.ctm & CTM_CHANGE_AD)
+	{
+		state->ctm.a = ((float *)node)[0];
+		state->ctm.d = ((float *)node)[1];
+		node += SIZE_IN_NODES(2*sizeof(float));
+	}
+	if (n.ctm & CTM_CHANGE_BC)
+	{
+		state->ctm.b = ((float *)node)[0];
+		state->ctm.c = ((float *)node)[1];
+		node += SIZE_IN_NODES(2*sizeof(float));
+	}
+	if (n.ctm & CTM_CHANGE_EF)
+	{
+		state->ctm.e = ((float *)node)[0];
+		state->ctm.f = ((float *)node)[1];
+		node += SIZE_IN_NODES(2*sizeof(float));
+	}
+	if (n.stroke)
+	{
+		align_node_for_pointer(&node);
+		state->stroke = *(fz_stroke_state **)node;
+		node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+	}
+	if (n.path)
+	{
+		align_node_for_pointer(&node);
+		state->path = (fz_path *)node;
+		node += SIZE_IN_NODES(fz_packed_path_size(state->path));
+	}
+	*nodep = node;
+}
+
+/*
+	Build an index of the spans of nodes that fz_run_display_list can
+	skip over when they lie outside the scissor.
+
+	Nodes are gathered into runs of siblings at the same level of
+	nesting, and runs into groups, with the contents of each clip,
+	mask, group and tile forming a level of its own. The nodes that
+	close a level, and end mask nodes, are left out of the runs at
+	their own level, as they may need to be run even when they are
+	outside the scissor.
+*/
+void
+fz_index_display_list(fz_context *ctx, fz_display_list *list)
+{
+	index_builder ib = { 0 };
+	index_level *levels = NULL;
+	int depth = 0;
+	int max_depth = 16;
+	fz_list_state state = { 0 };
+	fz_list_state before;
+	fz_display_node *node, *next;
+	fz_display_node *node_end = list->list + list->len;
+
+	if (list->index || list->len < INDEX_MIN_NODES)
+		return;
+
+	state.alpha = 1.0f;
+	state.ctm = fz_identity;
+	state.colorspace = fz_device_gray(ctx);
+
+	fz_var(levels);
+
+	ib.index = fz_malloc_struct(ctx, fz_list_index);
+	fz_try(ctx)
+	{
+		levels = fz_calloc(ctx, max_depth, sizeof *levels);
+		for (node = list->list; node != node_end; node = next)
+		{
+			fz_display_node n = *node;
+			const fz_list_state *item_before = &before;
+			index_span item;
+
+			next = node + n.size;
+
+			/* Finish the runs before any node that must be left
+			 * out of them, while we still have the state at their
+			 * end. */
+			switch (n.cmd)
+			{
+			case FZ_CMD_POP_CLIP:
+			case FZ_CMD_END_MASK:
+			case FZ_CMD_END_GROUP:
+			case FZ_CMD_END_TILE:
+				index_end_run(ctx, &ib, &levels[depth], &state);
+				index_end_group(ctx, &ib, &levels[depth]);
+				break;
+			default:
+				break;
+			}
+
+			before = state;
+			unpack_node_state(ctx, &node, n, &state);
+
+			item.start = (next - n.size) - list->list;
+			item.end = next - list->list;
+			item.count = 1;
+			switch (n.cmd)
+			{
+			case FZ_CMD_BEGIN_TILE:
+			case FZ_CMD_END_TILE:
+			case FZ_CMD_RENDER_FLAGS:
+			case FZ_CMD_DEFAULT_COLORSPACES:
+			case FZ_CMD_BEGIN_LAYER:
+			case FZ_CMD_END_LAYER:
+				/* Never culled. */
+				item.bbox = fz_infinite_rect;
+				break;
+			default:
+				item.bbox = state.rect;
+				break;
+			}
+
+			switch (n.cmd)
+			{
+			case FZ_CMD_CLIP_PATH:
+			case FZ_CMD_CLIP_STROKE_PATH:
+			case FZ_CMD_CLIP_TEXT:
+			case FZ_CMD_CLIP_STROKE_TEXT:
+			case FZ_CMD_CLIP_IMAGE_MASK:
+			case FZ_CMD_BEGIN_MASK:
+			case FZ_CMD_BEGIN_GROUP:
+			case FZ_CMD_BEGIN_TILE:
+				if (++depth == max_depth)
+				{
+					levels = fz_realloc_array(ctx, levels, max_depth * 2, index_level);
+					max_depth *= 2;
+				}
+				memset(&levels[depth], 0, sizeof *levels);
+				levels[depth].tree = item;
+				levels[depth].before = before;
+				continue;
+			case FZ_CMD_END_MASK:
+				if (depth > 0)
+					index_add_span(&levels[depth].tree, &item);
+				continue;
+			case FZ_CMD_POP_CLIP:
+			case FZ_CMD_END_GROUP:
+			case FZ_CMD_END_TILE:
+				/* An unbalanced end can't be skipped at all. */
+				if (depth == 0)
+					continue;
+				index_add_span(&levels[depth].tree, &item);
+				item_before = &levels[depth].before;
+				item = levels[depth--].tree;
+				break;
+			default:
+				break;
+			}
+
+			if (depth > 0)
+				index_add_span(&levels[depth].tree, &item);
+			index_add_item(ctx, &ib, &levels[depth], &item, item_before, &state);
+		}
+
+		/* Only the innermost open run ends with the list. Those
+		 * outside it ended before the unclosed clips, masks or groups
+		 * that follow them, and we no longer know the state there. */
+		index_end_run(ctx, &ib, &levels[depth], &state);
+		for (; depth >= 0; depth--)
+			index_end_group(ctx, &ib, &levels[depth]);
+
+		qsort(ib.index->entries, ib.index->len, sizeof *ib.index->entries, cmp_index_entries);
+	}
+	fz_always(ctx)
+		fz_free(ctx, levels);
+	fz_catch(ctx)
+	{
+		fz_drop_list_index(ctx, ib.index);
+		fz_rethrow(ctx);
+	}
+
+	list->index = ib.index;
+}
+
 static void
 fz_append_display_node(
 	fz_context *ctx,
@@ -220,6 +657,10 @@ fz_append_display_node(
 	fz_rect local_rect;
 	size_t path_size = 0;
 
+	/* The index no longer covers the whole list. */
+	fz_drop_list_index(ctx, list->index);
+	list->index = NULL;
+
 	switch (cmd)
 	{
 	case FZ_CMD_CLIP_PATH:
@@ -1491,6 +1932,7 @@ fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 		}
 		node = next;
 	}
+	fz_drop_list_index(ctx, list->index);
 	fz_free(ctx, list->list);
 	fz_free(ctx, list);
 }
@@ -1504,6 +1946,7 @@ fz_new_display_list(fz_context *ctx, fz_rect mediabox)
 	list->mediabox = mediabox;
 	list->max = 0;
 	list->len = 0;
+	list->index = NULL;
 	return list;
 }
 
@@ -1532,8 +1975,35 @@ int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list)
 	return !list || list->len == 0;
 }
 
-void
-fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_matrix top_ctm, fz_rect scissor, fz_cookie *cookie)
+size_t fz_display_list_size(fz_context *ctx, const fz_display_list *list)
+{
+	if (!list)
+		return 0;
+	return sizeof(*list) + list->max * sizeof(fz_display_node);
+}
+
+/* Find an indexed span starting at node offset off that we can skip
+ * over, either because it is outside the scissor, or because we are
+ * inside a clip that is. */
+static const fz_list_index_entry *
+cull_index_entries(const fz_list_index *index, int *next, size_t off, int clipped, fz_matrix ctm, fz_rect scissor)
+{
+	while (*next < index->len && index->entries[*next].start < off)
+		(*next)++;
+	for (; *next < index->len && index->entries[*next].start == off; (*next)++)
+	{
+		const fz_list_index_entry *entry = &index->entries[*next];
+		if (clipped)
+			return entry;
+		/* Infinite spans hold nodes that are never culled. */
+		if (!fz_is_infinite_rect(entry->bbox) && !fz_is_valid_rect(fz_intersect_rect(fz_transform_rect(entry->bbox, ctm), scissor)))
+			return entry;
+	}
+	return NULL;
+}
+
+static void
+run_display_list(fz_context *ctx, fz_display_list *list, const fz_list_index *index, fz_device *dev, fz_matrix top_ctm, fz_rect scissor, fz_cookie *cookie)
 {
 	fz_display_node *node;
 	fz_display_node *node_end;
@@ -1543,26 +2013,25 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 	int progress = 0;
 
 	/* Current graphics state as unpacked from list */
-	fz_path *path = NULL;
-	float alpha = 1.0f;
-	fz_matrix ctm = fz_identity;
-	fz_stroke_state *stroke = NULL;
-	float color[FZ_MAX_COLORS] = { 0 };
-	fz_colorspace *colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	fz_list_state state = { 0 };
 	fz_color_params color_params;
-	fz_rect rect = { 0 };
 
 	/* Transformed versions of graphic state entries */
 	fz_rect trans_rect;
 	fz_matrix trans_ctm;
 	int tile_skip_depth = 0;
 
+	int next_entry = 0;
+
 	if (cookie)
 	{
 		cookie->progress_max = list->len;
 		cookie->progress = 0;
 	}
 
+	state.alpha = 1.0f;
+	state.ctm = fz_identity;
+	state.colorspace = fz_device_gray(ctx);
 	color_params = fz_default_color_params;
 
 	node = list->list;
@@ -1572,6 +2041,26 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 		int empty;
 		fz_display_node n = *node;
 
+		/* Skip whole spans of nodes that can't be seen. */
+		if (index && !tiled)
+		{
+			const fz_list_index_entry *skip = cull_index_entries(index, &next_entry, node - list->list, clipped, top_ctm, scissor);
+			if (skip)
+			{
+				if (cookie)
+				{
+					if (cookie->abort)
+						break;
+					cookie->progress = progress;
+					progress += (int)(skip->end - skip->start);
+				}
+
+				state = index->states[skip->state];
+				next_node = &list->list[skip->end];
+				continue;
+			}
+		}
+
 		next_node = node + n.size;
 
 		/* Check the cookie for aborting */
@@ -1583,123 +2072,7 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 			progress += n.size;
 		}
 
-		node++;
-		if (n.rect)
-		{
-			rect = *(fz_rect *)node;
-			node += SIZE_IN_NODES(sizeof(fz_rect));
-		}
-		if (n.cs)
-		{
-			int i, en;
-
-			fz_drop_colorspace(ctx, colorspace);
-			switch (n.cs)
-			{
-			default:
-			case CS_GRAY_0:
-				colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
-				color[0] = 0.0f;
-				break;
-			case CS_GRAY_1:
-				colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
-				color[0] = 1.0f;
-				break;
-			case CS_RGB_0:
-				colorspace = fz_keep_colorspace(ctx, fz_device_rgb(ctx));
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				break;
-			case CS_RGB_1:
-				colorspace = fz_keep_colorspace(ctx, fz_device_rgb(ctx));
-				color[0] = 1.0f;
-				color[1] = 1.0f;
-				color[2] = 1.0f;
-				break;
-			case CS_CMYK_0:
-				colorspace = fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 0.0f;
-				break;
-			case CS_CMYK_1:
-				colorspace = fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 1.0f;
-				break;
-			case CS_OTHER_0:
-				align_node_for_pointer(&node);
-				colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
-				node += SIZE_IN_NODES(sizeof(fz_colorspace *));
-				en = fz_colorspace_n(ctx, colorspace);
-				for (i = 0; i < en; i++)
-					color[i] = 0.0f;
-				break;
-			}
-		}
-		if (n.color)
-		{
-			int nc = fz_colorspace_n(ctx, colorspace);
-			memcpy(color, (float *)node, nc * sizeof(float));
-			node += SIZE_IN_NODES(nc * sizeof(float));
-		}
-		if (n.alpha)
-		{
-			switch(n.alpha)
-			{
-			default:
-			case ALPHA_0:
-				alpha = 0.0f;
-				break;
-			case ALPHA_1:
-				alpha = 1.0f;
-				break;
-			case ALPHA_PRESENT:
-				alpha = *(float *)node;
-				node += SIZE_IN_NODES(sizeof(float));
-				break;
-			}
-		}
-		if (n.ctm != 0)
-		{
-			float *packed_ctm = (float *)node;
-			if (n.ctm & CTM_CHANGE_AD)
-			{
-				ctm.a = *packed_ctm++;
-				ctm.d = *packed_ctm++;
-				node += SIZE_IN_NODES(2*sizeof(float));
-			}
-			if (n.ctm & CTM_CHANGE_BC)
-			{
-				ctm.b = *packed_ctm++;
-				ctm.c = *packed_ctm++;
-				node += SIZE_IN_NODES(2*sizeof(float));
-			}
-			if (n.ctm & CTM_CHANGE_EF)
-			{
-				ctm.e = *packed_ctm++;
-				ctm.f = *packed_ctm;
-				node += SIZE_IN_NODES(2*sizeof(float));
-			}
-		}
-		if (n.stroke)
-		{
-			align_node_for_pointer(&node);
-			fz_drop_stroke_state(ctx, stroke);
-			stroke = fz_keep_stroke_state(ctx, *(fz_stroke_state **)node);
-			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
-		}
-		if (n.path)
-		{
-			align_node_for_pointer(&node);
-			fz_drop_path(ctx, path);
-			path = fz_keep_path(ctx, (fz_path *)node);
-			node += SIZE_IN_NODES(fz_packed_path_size(path));
-		}
+		unpack_node_state(ctx, &node, n, &state);
 
 		if (tile_skip_depth > 0)
 		{
@@ -1711,7 +2084,7 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 				continue;
 		}
 
-		trans_rect = fz_transform_rect(rect, top_ctm);
+		trans_rect = fz_transform_rect(state.rect, top_ctm);
 
 		/* cull objects to draw using a quick visibility test */
 
@@ -1769,7 +2142,7 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 		}
 
 visible:
-		trans_ctm = fz_concat(ctm, top_ctm);
+		trans_ctm = fz_concat(state.ctm, top_ctm);
 
 		fz_try(ctx)
 		{
@@ -1777,27 +2150,27 @@ visible:
 			{
 			case FZ_CMD_FILL_PATH:
 				fz_unpack_color_params(&color_params, n.flags);
-				fz_fill_path(ctx, dev, path, n.flags & 1, trans_ctm, colorspace, color, alpha, color_params);
+				fz_fill_path(ctx, dev, state.path, n.flags & 1, trans_ctm, state.colorspace, state.color, state.alpha, color_params);
 				break;
 			case FZ_CMD_STROKE_PATH:
 				fz_unpack_color_params(&color_params, n.flags);
-				fz_stroke_path(ctx, dev, path, stroke, trans_ctm, colorspace, color, alpha, color_params);
+				fz_stroke_path(ctx, dev, state.path, state.stroke, trans_ctm, state.colorspace, state.color, state.alpha, color_params);
 				break;
 			case FZ_CMD_CLIP_PATH:
-				fz_clip_path(ctx, dev, path, n.flags, trans_ctm, trans_rect);
+				fz_clip_path(ctx, dev, state.path, n.flags, trans_ctm, trans_rect);
 				break;
 			case FZ_CMD_CLIP_STROKE_PATH:
-				fz_clip_stroke_path(ctx, dev, path, stroke, trans_ctm, trans_rect);
+				fz_clip_stroke_path(ctx, dev, state.path, state.stroke, trans_ctm, trans_rect);
 				break;
 			case FZ_CMD_FILL_TEXT:
 				fz_unpack_color_params(&color_params, n.flags);
 				align_node_for_pointer(&node);
-				fz_fill_text(ctx, dev, *(fz_text **)node, trans_ctm, colorspace, color, alpha, color_params);
+				fz_fill_text(ctx, dev, *(fz_text **)node, trans_ctm, state.colorspace, state.color, state.alpha, color_params);
 				break;
 			case FZ_CMD_STROKE_TEXT:
 				fz_unpack_color_params(&color_params, n.flags);
 				align_node_for_pointer(&node);
-				fz_stroke_text(ctx, dev, *(fz_text **)node, stroke, trans_ctm, colorspace, color, alpha, color_params);
+				fz_stroke_text(ctx, dev, *(fz_text **)node, state.stroke, trans_ctm, state.colorspace, state.color, state.alpha, color_params);
 				break;
 			case FZ_CMD_CLIP_TEXT:
 				align_node_for_pointer(&node);
@@ -1805,7 +2178,7 @@ visible:
 				break;
 			case FZ_CMD_CLIP_STROKE_TEXT:
 				align_node_for_pointer(&node);
-				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, stroke, trans_ctm, trans_rect);
+				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, state.stroke, trans_ctm, trans_rect);
 				break;
 			case FZ_CMD_IGNORE_TEXT:
 				align_node_for_pointer(&node);
@@ -1814,17 +2187,17 @@ visible:
 			case FZ_CMD_FILL_SHADE:
 				fz_unpack_color_params(&color_params, n.flags);
 				align_node_for_pointer(&node);
-				fz_fill_shade(ctx, dev, *(fz_shade **)node, trans_ctm, alpha, color_params);
+				fz_fill_shade(ctx, dev, *(fz_shade **)node, trans_ctm, state.alpha, color_params);
 				break;
 			case FZ_CMD_FILL_IMAGE:
 				fz_unpack_color_params(&color_params, n.flags);
 				align_node_for_pointer(&node);
-				fz_fill_image(ctx, dev, *(fz_image **)node, trans_ctm, alpha, color_params);
+				fz_fill_image(ctx, dev, *(fz_image **)node, trans_ctm, state.alpha, color_params);
 				break;
 			case FZ_CMD_FILL_IMAGE_MASK:
 				fz_unpack_color_params(&color_params, n.flags);
 				align_node_for_pointer(&node);
-				fz_fill_image_mask(ctx, dev, *(fz_image **)node, trans_ctm, colorspace, color, alpha, color_params);
+				fz_fill_image_mask(ctx, dev, *(fz_image **)node, trans_ctm, state.colorspace, state.color, state.alpha, color_params);
 				break;
 			case FZ_CMD_CLIP_IMAGE_MASK:
 				align_node_for_pointer(&node);
@@ -1835,14 +2208,14 @@ visible:
 				break;
 			case FZ_CMD_BEGIN_MASK:
 				fz_unpack_color_params(&color_params, n.flags);
-				fz_begin_mask(ctx, dev, trans_rect, n.flags & 1, colorspace, color, color_params);
+				fz_begin_mask(ctx, dev, trans_rect, n.flags & 1, state.colorspace, state.color, color_params);
 				break;
 			case FZ_CMD_END_MASK:
 				fz_end_mask(ctx, dev);
 				break;
 			case FZ_CMD_BEGIN_GROUP:
 				align_node_for_pointer(&node);
-				fz_begin_group(ctx, dev, trans_rect, *(fz_colorspace **)node, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), alpha);
+				fz_begin_group(ctx, dev, trans_rect, *(fz_colorspace **)node, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), state.alpha);
 				break;
 			case FZ_CMD_END_GROUP:
 				fz_end_group(ctx, dev);
@@ -1856,7 +2229,7 @@ visible:
 				data = (fz_list_tile_data *)node;
 				tiled++;
 				tile_rect = data->view;
-				cached = fz_begin_tile_id(ctx, dev, rect, tile_rect, data->xstep, data->ystep, trans_ctm, data->id);
+				cached = fz_begin_tile_id(ctx, dev, state.rect, tile_rect, data->xstep, data->ystep, trans_ctm, data->id);
 				if (cached)
 					tile_skip_depth = 1;
 				break;
@@ -1894,9 +2267,450 @@ visible:
 			fz_warn(ctx, "Ignoring error during interpretation");
 		}
 	}
-	fz_drop_colorspace(ctx, colorspace);
-	fz_drop_stroke_state(ctx, stroke);
-	fz_drop_path(ctx, path);
 	if (cookie)
 		cookie->progress = progress;
 }
+
+void
+fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_matrix top_ctm, fz_rect scissor, fz_cookie *cookie)
+{
+	run_display_list(ctx, list, list->index, dev, top_ctm, scissor, cookie);
+}
+
+#define OCCLUDER_MAX 32
+
+/* What we know about each node of the list, for finding the ones that
+ * are hidden. A node that opens a clip, mask, group or tile stands for
+ * all of it, up to and including the node that closes it. */
+typedef struct
+{
+	fz_rect bbox;
+	fz_rect cover; /* Painted opaquely over everything before it, or empty. */
+	fz_rect area; /* Where it can paint, given the groups it is in. */
+	size_t start;
+	size_t end;
+	int parent;
+	unsigned int cmd : 5;
+	unsigned int cullable : 1;
+	unsigned int culled : 1;
+	unsigned int in_tile : 1;
+	unsigned int see_through : 1; /* Opaque content inside covers the page. */
+} occlusion_node;
+
+typedef struct
+{
+	fz_rect rect;
+	size_t start;
+} occluder;
+
+static int
+is_opaque_colorspace(fz_context *ctx, fz_colorspace *cs)
+{
+	switch (fz_colorspace_type(ctx, cs))
+	{
+	case FZ_COLORSPACE_GRAY:
+	case FZ_COLORSPACE_RGB:
+	case FZ_COLORSPACE_BGR:
+	case FZ_COLORSPACE_CMYK:
+	case FZ_COLORSPACE_LAB:
+		return 1;
+	case FZ_COLORSPACE_INDEXED:
+		return is_opaque_colorspace(ctx, cs->u.indexed.base);
+	default:
+		/* Separation and DeviceN colors may paint nothing at all
+		 * (for the None colorant), or only some plates. */
+		return 0;
+	}
+}
+
+/* Whether every sample of an image is opaque. We only trust images
+ * whose data we know cannot carry an alpha channel. */
+static int
+is_opaque_image(fz_context *ctx, fz_image *image)
+{
+	fz_compressed_buffer *buf;
+
+	if (image->mask || image->imagemask || image->use_colorkey)
+		return 0;
+	if (!image->colorspace || !is_opaque_colorspace(ctx, image->colorspace))
+		return 0;
+	if (image->n != fz_colorspace_n(ctx, image->colorspace))
+		return 0;
+	buf = fz_compressed_image_buffer(ctx, image);
+	if (!buf)
+		return 0;
+	switch (buf->params.type)
+	{
+	case FZ_IMAGE_RAW:
+	case FZ_IMAGE_FAX:
+	case FZ_IMAGE_FLATE:
+	case FZ_IMAGE_LZW:
+	case FZ_IMAGE_RLD:
+	case FZ_IMAGE_JPEG:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* The area that a top level node paints opaquely, replacing whatever
+ * was below it, or an empty rect if we can't be sure of any. node
+ * points at the private data of the node. */
+static fz_rect
+node_cover(fz_context *ctx, fz_display_node n, fz_display_node *node, const fz_list_state *state)
+{
+	fz_color_params color_params;
+	fz_image *image;
+
+	if (n.cmd != FZ_CMD_FILL_PATH && n.cmd != FZ_CMD_FILL_IMAGE)
+		return fz_empty_rect;
+	fz_unpack_color_params(&color_params, n.flags);
+	if (state->alpha != 1 || color_params.op)
+		return fz_empty_rect;
+
+	if (n.cmd == FZ_CMD_FILL_PATH)
+	{
+		if (!is_opaque_colorspace(ctx, state->colorspace))
+			return fz_empty_rect;
+		return fz_path_fill_rect(ctx, state->path, state->ctm);
+	}
+
+	align_node_for_pointer(&node);
+	image = *(fz_image **)node;
+	if ((state->ctm.b != 0 || state->ctm.c != 0) && (state->ctm.a != 0 || state->ctm.d != 0))
+		return fz_empty_rect;
+	if (!is_opaque_image(ctx, image))
+		return fz_empty_rect;
+	return state->rect;
+}
+
+/* The area that a tile can paint, in page space. The draw device paints
+ * whole cells over the tiled area, one more at either end when in doubt,
+ * so the cells at the edges may stick out of it by a cell and a step. */
+static fz_rect
+tile_bounds(fz_display_node *node, const fz_list_state *state)
+{
+	fz_list_tile_data *data;
+	fz_rect r = state->rect;
+	float dx, dy;
+
+	align_node_for_pointer(&node);
+	data = (fz_list_tile_data *)node;
+	dx = (data->view.x1 - data->view.x0) + 2 * fabsf(data->xstep);
+	dy = (data->view.y1 - data->view.y0) + 2 * fabsf(data->ystep);
+	r.x0 -= dx;
+	r.y0 -= dy;
+	r.x1 += dx;
+	r.y1 += dy;
+	return fz_expand_rect(fz_transform_rect(r, state->ctm), 2);
+}
+
+static void
+add_occluder(occluder *occluders, int *len, fz_rect r, size_t start)
+{
+	float area = (r.x1 - r.x0) * (r.y1 - r.y0);
+	float smallest_area = area;
+	int i, smallest = -1;
+
+	if (!fz_is_valid_rect(r) || area <= 0)
+		return;
+	for (i = 0; i < *len; i++)
+	{
+		fz_rect o = occluders[i].rect;
+		float a = (o.x1 - o.x0) * (o.y1 - o.y0);
+		/* Anything that r hides, o hides too, as it comes later. */
+		if (fz_contains_rect(o, r))
+			return;
+		if (a < smallest_area)
+		{
+			smallest_area = a;
+			smallest = i;
+		}
+	}
+	if (*len < OCCLUDER_MAX)
+		smallest = (*len)++;
+	if (smallest >= 0)
+	{
+		occluders[smallest].rect = r;
+		occluders[smallest].start = start;
+	}
+}
+
+/*
+	Find the nodes of the list that are hidden under later opaque
+	ones, and mark them as culled. Returns the number of nodes, or 0
+	if the list is not balanced.
+
+	The rect of every node is in page space (except within tiles), and
+	bounds all it can change, so a node or a whole clip, mask, group
+	or tile lying within the cover of a later node can't be seen, at
+	any level of nesting. Only nodes that paint directly onto the page,
+	or through plain groups, have a cover.
+*/
+static int
+find_hidden_nodes(fz_context *ctx, fz_display_list *list, occlusion_node **nodesp)
+{
+	occlusion_node *nodes = NULL;
+	int len = 0, max = 0;
+	int top = -1;
+	fz_list_state state = { 0 };
+	fz_display_node *node, *next;
+	fz_display_node *node_end = list->list + list->len;
+	occluder occluders[OCCLUDER_MAX];
+	int num_occluders = 0;
+	int i, k;
+
+	state.alpha = 1.0f;
+	state.ctm = fz_identity;
+	state.colorspace = fz_device_gray(ctx);
+
+	fz_var(nodes);
+
+	fz_try(ctx)
+	{
+		for (node = list->list; node != node_end; node = next)
+		{
+			fz_display_node n = *node;
+			occlusion_node *on;
+			int through = top < 0 || nodes[top].see_through;
+
+			next = node + n.size;
+			unpack_node_state(ctx, &node, n, &state);
+
+			if (len == max)
+			{
+				int newmax = max ? max * 2 : 1024;
+				nodes = fz_realloc_array(ctx, nodes, newmax, occlusion_node);
+				max = newmax;
+			}
+			on = &nodes[len];
+			on->start = (next - n.size) - list->list;
+			on->end = next - list->list;
+			on->parent = top;
+			on->cmd = n.cmd;
+			on->in_tile = top >= 0 && (nodes[top].in_tile || nodes[top].cmd == FZ_CMD_BEGIN_TILE);
+			on->cullable = !on->in_tile;
+			on->culled = 0;
+			on->see_through = 0;
+			on->bbox = state.rect;
+			on->cover = fz_empty_rect;
+			on->area = top >= 0 ? nodes[top].area : fz_infinite_rect;
+
+			switch (n.cmd)
+			{
+			case FZ_CMD_IGNORE_TEXT:
+				/* Invisible, so there is nothing to gain from
+				 * dropping it, and text extraction wants it. */
+			case FZ_CMD_RENDER_FLAGS:
+			case FZ_CMD_DEFAULT_COLORSPACES:
+			case FZ_CMD_BEGIN_LAYER:
+			case FZ_CMD_END_LAYER:
+				on->bbox = fz_infinite_rect;
+				on->cullable = 0;
+				break;
+			case FZ_CMD_BEGIN_TILE:
+				on->bbox = tile_bounds(node, &state);
+				break;
+			case FZ_CMD_BEGIN_GROUP:
+				/* Nothing in a group is drawn outside its area. */
+				on->area = fz_intersect_rect(on->area, state.rect);
+				on->see_through = through && state.alpha == 1 && (n.flags & KNOCKOUT) == 0 && (n.flags >> 2) == FZ_BLEND_NORMAL;
+				break;
+			case FZ_CMD_END_MASK:
+			case FZ_CMD_POP_CLIP:
+			case FZ_CMD_END_GROUP:
+			case FZ_CMD_END_TILE:
+				/* Something opened before the list started;
+				 * we can't tell what it does. */
+				if (top < 0)
+				{
+					len = 0;
+					goto unbalanced;
+				}
+				on->cullable = 0;
+				break;
+			default:
+				if (through && !on->in_tile)
+					on->cover = fz_intersect_rect(node_cover(ctx, n, node, &state), on->area);
+				break;
+			}
+			len++;
+
+			switch (n.cmd)
+			{
+			case FZ_CMD_CLIP_PATH:
+			case FZ_CMD_CLIP_STROKE_PATH:
+			case FZ_CMD_CLIP_TEXT:
+			case FZ_CMD_CLIP_STROKE_TEXT:
+			case FZ_CMD_CLIP_IMAGE_MASK:
+			case FZ_CMD_BEGIN_MASK:
+			case FZ_CMD_BEGIN_GROUP:
+			case FZ_CMD_BEGIN_TILE:
+				top = len - 1;
+				break;
+			case FZ_CMD_POP_CLIP:
+			case FZ_CMD_END_GROUP:
+			case FZ_CMD_END_TILE:
+				/* Close the level, and pass its bounds up. */
+				on = &nodes[top];
+				if (on->cmd != FZ_CMD_BEGIN_TILE)
+					on->bbox = fz_union_rect(on->bbox, nodes[len - 1].bbox);
+				on->end = nodes[len - 1].end;
+				top = on->parent;
+				if (top >= 0 && nodes[top].cmd != FZ_CMD_BEGIN_TILE)
+					nodes[top].bbox = fz_union_rect(nodes[top].bbox, on->bbox);
+				break;
+			default:
+				if (top >= 0 && nodes[top].cmd != FZ_CMD_BEGIN_TILE)
+					nodes[top].bbox = fz_union_rect(nodes[top].bbox, nodes[len - 1].bbox);
+				break;
+			}
+		}
+
+		/* Anything left open at the end is kept. */
+		for (; top >= 0; top = nodes[top].parent)
+			nodes[top].cullable = 0;
+unbalanced:
+		;
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, nodes);
+		fz_rethrow(ctx);
+	}
+
+	/* Walk backwards, gathering the covers of later nodes as we go. A
+	 * clip, mask, group or tile is reached after its contents, so only
+	 * covers from after its end count for it. */
+	for (i = len - 1; i >= 0; i--)
+	{
+		occlusion_node *on = &nodes[i];
+		if (on->cullable && fz_is_valid_rect(on->bbox) && !fz_is_infinite_rect(on->bbox))
+		{
+			for (k = 0; k < num_occluders; k++)
+			{
+				if (occluders[k].start >= on->end && fz_contains_rect(occluders[k].rect, on->bbox))
+				{
+					on->culled = 1;
+					break;
+				}
+			}
+		}
+		if (!on->culled)
+			add_occluder(occluders, &num_occluders, on->cover, on->start);
+	}
+
+	*nodesp = nodes;
+	return len;
+}
+
+int
+fz_optimize_display_list(fz_context *ctx, fz_display_list *list)
+{
+	occlusion_node *nodes = NULL;
+	fz_list_index culled = { 0 };
+	fz_display_list *copy = NULL;
+	fz_device *dev = NULL;
+	fz_cookie cookie = { 0 };
+	int len, max = 0, removed = 0;
+	int was_indexed;
+	int i, j;
+
+	fz_var(copy);
+	fz_var(dev);
+	fz_var(nodes);
+
+	fz_try(ctx)
+	{
+		fz_list_state state = { 0 };
+		fz_display_node *node, *next;
+		fz_display_node *node_end = list->list + list->len;
+
+		/* Index the outermost culled spans as empty ones, so that
+		 * running the list skips them, picking up the graphics state
+		 * after each one. */
+		len = find_hidden_nodes(ctx, list, &nodes);
+		for (i = 0; i < len; i = j)
+		{
+			for (j = i + 1; nodes[i].culled && j < len && nodes[j].start < nodes[i].end; j++)
+				;
+			if (!nodes[i].culled)
+				continue;
+			if (culled.len == max)
+			{
+				int newmax = max ? max * 2 : 64;
+				culled.entries = fz_realloc_array(ctx, culled.entries, newmax, fz_list_index_entry);
+				max = newmax;
+			}
+			culled.entries[culled.len].bbox = fz_empty_rect;
+			culled.entries[culled.len].start = nodes[i].start;
+			culled.entries[culled.len].end = nodes[i].end;
+			culled.entries[culled.len].state = culled.len;
+			culled.len++;
+			removed += j - i;
+		}
+		if (culled.len == 0)
+			break;
+
+		culled.states = fz_malloc_array(ctx, culled.len, fz_list_state);
+		state.alpha = 1.0f;
+		state.ctm = fz_identity;
+		state.colorspace = fz_device_gray(ctx);
+		j = 0;
+		for (node = list->list; node != node_end && j < culled.len; node = next)
+		{
+			fz_display_node n = *node;
+			next = node + n.size;
+			unpack_node_state(ctx, &node, n, &state);
+			if ((size_t)(next - list->list) == culled.entries[j].end)
+				culled.states[j++] = state;
+		}
+
+		copy = fz_new_display_list(ctx, list->mediabox);
+		dev = fz_new_list_device(ctx, copy);
+		run_display_list(ctx, list, &culled, dev, fz_identity, fz_infinite_rect, &cookie);
+		fz_close_device(ctx, dev);
+		if (cookie.errors)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot optimize display list");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_free(ctx, culled.entries);
+		fz_free(ctx, culled.states);
+		fz_free(ctx, nodes);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, copy);
+		fz_rethrow(ctx);
+	}
+
+	if (!copy)
+		return 0;
+
+	/* Swap the new nodes in, and let the old ones go with the copy. */
+	was_indexed = list->index != NULL;
+	{
+		fz_display_node *old_list = list->list;
+		size_t old_max = list->max;
+		size_t old_len = list->len;
+		fz_list_index *old_index = list->index;
+
+		list->list = copy->list;
+		list->max = copy->max;
+		list->len = copy->len;
+		list->index = copy->index;
+		copy->list = old_list;
+		copy->max = old_max;
+		copy->len = old_len;
+		copy->index = old_index;
+	}
+	fz_drop_display_list(ctx, copy);
+
+	/* The old index does not fit the new nodes. */
+	if (was_indexed)
+		fz_index_display_list(ctx, list);
+
+	return removed;
+}
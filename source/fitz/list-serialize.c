@@ -0,0 +1,2184 @@
+#include "mupdf/fitz.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <string.h>
+
+/*
+	Serialized display lists.
+
+	A serialized list starts with the magic "MuDL", an int32 format
+	version and the mediabox of the list. This is followed by a body:
+	a sequence of records, each introduced by an opcode byte, ending
+	with DL_END. All numbers are stored little-endian.
+
+	Device calls map one-to-one onto records. Resources (colorspaces,
+	fonts, images and shades) are written in definition records the
+	first time they are used, and are referred to by index after
+	that. Type 3 fonts carry the bodies of their glyph display lists
+	inside their definition record. A glyph may use fonts defined
+	before or inside it, but not the font it belongs to, so that the
+	fonts read back never refer to themselves.
+*/
+
+#define DL_MAGIC "MuDL"
+#define DL_VERSION 2
+
+enum
+{
+	DL_END,
+
+	/* Resource definitions */
+	DL_COLORSPACE,
+	DL_FONT_DATA,
+	DL_FONT,
+	DL_IMAGE,
+	DL_SHADE,
+
+	/* Device calls */
+	DL_FILL_PATH,
+	DL_STROKE_PATH,
+	DL_CLIP_PATH,
+	DL_CLIP_STROKE_PATH,
+	DL_FILL_TEXT,
+	DL_STROKE_TEXT,
+	DL_CLIP_TEXT,
+	DL_CLIP_STROKE_TEXT,
+	DL_IGNORE_TEXT,
+	DL_FILL_SHADE,
+	DL_FILL_IMAGE,
+	DL_FILL_IMAGE_MASK,
+	DL_CLIP_IMAGE_MASK,
+	DL_POP_CLIP,
+	DL_BEGIN_MASK,
+	DL_END_MASK,
+	DL_BEGIN_GROUP,
+	DL_END_GROUP,
+	DL_BEGIN_TILE,
+	DL_END_TILE,
+	DL_RENDER_FLAGS,
+	DL_DEFAULT_COLORSPACES,
+	DL_BEGIN_LAYER,
+	DL_END_LAYER
+};
+
+/* Colorspace references. Defined colorspaces count up from CS_DEFINED. */
+enum
+{
+	CS_NONE,
+	CS_GRAY,
+	CS_RGB,
+	CS_BGR,
+	CS_CMYK,
+	CS_LAB,
+	CS_DEFINED = 16
+};
+
+enum { DL_CS_ICC, DL_CS_INDEXED };
+enum { DL_FONT_FT, DL_FONT_T3 };
+enum { DL_IMAGE_COMPRESSED, DL_IMAGE_PIXMAP };
+
+/* Writing */
+
+/* The Type 3 fonts whose glyphs are being written, innermost first. */
+typedef struct t3_def
+{
+	fz_font *font;
+	struct t3_def *up;
+} t3_def;
+
+typedef struct
+{
+	fz_output *out;
+	t3_def *defining;
+	fz_hash_table *colorspaces;
+	fz_hash_table *font_data;
+	fz_hash_table *fonts;
+	fz_hash_table *images;
+	fz_hash_table *shades;
+	int colorspace_count;
+	int font_data_count;
+	int font_count;
+	int image_count;
+	int shade_count;
+} list_writer;
+
+typedef struct
+{
+	fz_device super;
+	list_writer *w;
+} fz_write_list_device;
+
+static void write_list_body(fz_context *ctx, list_writer *w, fz_display_list *list);
+
+static int
+find_resource(fz_context *ctx, fz_hash_table *table, const void *key)
+{
+	return (int)(intptr_t)fz_hash_find(ctx, table, key) - 1;
+}
+
+static void
+add_resource(fz_context *ctx, fz_hash_table *table, const void *key, int id)
+{
+	fz_hash_insert(ctx, table, key, (void *)(intptr_t)(id + 1));
+}
+
+static void
+write_rect(fz_context *ctx, fz_output *out, fz_rect r)
+{
+	fz_write_float_le(ctx, out, r.x0);
+	fz_write_float_le(ctx, out, r.y0);
+	fz_write_float_le(ctx, out, r.x1);
+	fz_write_float_le(ctx, out, r.y1);
+}
+
+static void
+write_matrix(fz_context *ctx, fz_output *out, fz_matrix m)
+{
+	fz_write_float_le(ctx, out, m.a);
+	fz_write_float_le(ctx, out, m.b);
+	fz_write_float_le(ctx, out, m.c);
+	fz_write_float_le(ctx, out, m.d);
+	fz_write_float_le(ctx, out, m.e);
+	fz_write_float_le(ctx, out, m.f);
+}
+
+static void
+write_string(fz_context *ctx, fz_output *out, const char *s)
+{
+	if (!s)
+	{
+		fz_write_int32_le(ctx, out, -1);
+		return;
+	}
+	fz_write_int32_le(ctx, out, (int)strlen(s));
+	fz_write_data(ctx, out, s, strlen(s));
+}
+
+static void
+write_buffer(fz_context *ctx, fz_output *out, fz_buffer *buf)
+{
+	unsigned char *data;
+	size_t len = fz_buffer_storage(ctx, buf, &data);
+	if (len > INT_MAX)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "buffer too large to serialize");
+	fz_write_int32_le(ctx, out, (int)len);
+	fz_write_data(ctx, out, data, len);
+}
+
+static void
+write_color_params(fz_context *ctx, fz_output *out, fz_color_params cp)
+{
+	fz_write_byte(ctx, out, cp.ri);
+	fz_write_byte(ctx, out, cp.bp);
+	fz_write_byte(ctx, out, cp.op);
+	fz_write_byte(ctx, out, cp.opm);
+}
+
+static void
+write_color(fz_context *ctx, fz_output *out, fz_colorspace *cs, const float *color)
+{
+	int i, n = cs ? fz_colorspace_n(ctx, cs) : 0;
+	for (i = 0; i < n; i++)
+		fz_write_float_le(ctx, out, color ? color[i] : 0);
+}
+
+static void
+write_params(fz_context *ctx, fz_output *out, const fz_compression_params *params)
+{
+	fz_write_int32_le(ctx, out, params->type);
+	switch (params->type)
+	{
+	case FZ_IMAGE_JPEG:
+		fz_write_int32_le(ctx, out, params->u.jpeg.color_transform);
+		break;
+	case FZ_IMAGE_JPX:
+		fz_write_int32_le(ctx, out, params->u.jpx.smask_in_data);
+		break;
+	case FZ_IMAGE_JBIG2:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize JBIG2 parameters");
+	case FZ_IMAGE_FAX:
+		fz_write_int32_le(ctx, out, params->u.fax.columns);
+		fz_write_int32_le(ctx, out, params->u.fax.rows);
+		fz_write_int32_le(ctx, out, params->u.fax.k);
+		fz_write_int32_le(ctx, out, params->u.fax.end_of_line);
+		fz_write_int32_le(ctx, out, params->u.fax.encoded_byte_align);
+		fz_write_int32_le(ctx, out, params->u.fax.end_of_block);
+		fz_write_int32_le(ctx, out, params->u.fax.black_is_1);
+		fz_write_int32_le(ctx, out, params->u.fax.damaged_rows_before_error);
+		break;
+	case FZ_IMAGE_FLATE:
+		fz_write_int32_le(ctx, out, params->u.flate.columns);
+		fz_write_int32_le(ctx, out, params->u.flate.colors);
+		fz_write_int32_le(ctx, out, params->u.flate.predictor);
+		fz_write_int32_le(ctx, out, params->u.flate.bpc);
+		break;
+	case FZ_IMAGE_LZW:
+		fz_write_int32_le(ctx, out, params->u.lzw.columns);
+		fz_write_int32_le(ctx, out, params->u.lzw.colors);
+		fz_write_int32_le(ctx, out, params->u.lzw.predictor);
+		fz_write_int32_le(ctx, out, params->u.lzw.bpc);
+		fz_write_int32_le(ctx, out, params->u.lzw.early_change);
+		break;
+	}
+}
+
+static void
+write_compressed_buffer(fz_context *ctx, fz_output *out, fz_compressed_buffer *cbuf)
+{
+	write_params(ctx, out, &cbuf->params);
+	write_buffer(ctx, out, cbuf->buffer);
+}
+
+static int
+write_colorspace(fz_context *ctx, list_writer *w, fz_colorspace *cs)
+{
+	fz_output *out = w->out;
+	int id, base;
+
+	if (!cs)
+		return CS_NONE;
+	if (cs == fz_device_gray(ctx))
+		return CS_GRAY;
+	if (cs == fz_device_rgb(ctx))
+		return CS_RGB;
+	if (cs == fz_device_bgr(ctx))
+		return CS_BGR;
+	if (cs == fz_device_cmyk(ctx))
+		return CS_CMYK;
+	if (cs == fz_device_lab(ctx))
+		return CS_LAB;
+
+	id = find_resource(ctx, w->colorspaces, &cs);
+	if (id >= 0)
+		return CS_DEFINED + id;
+
+	switch (cs->type)
+	{
+	case FZ_COLORSPACE_INDEXED:
+		base = write_colorspace(ctx, w, cs->u.indexed.base);
+		fz_write_byte(ctx, out, DL_COLORSPACE);
+		fz_write_byte(ctx, out, DL_CS_INDEXED);
+		fz_write_int32_le(ctx, out, base);
+		fz_write_int32_le(ctx, out, cs->u.indexed.high);
+		fz_write_data(ctx, out, cs->u.indexed.lookup, (cs->u.indexed.high + 1) * (size_t)cs->u.indexed.base->n);
+		break;
+
+	case FZ_COLORSPACE_SEPARATION:
+		/* Tint transforms are arbitrary code, which we cannot record
+		 * without changing the colors they produce. */
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize separation colorspace %s", cs->name);
+
+	default:
+#if FZ_ENABLE_ICC
+		if (cs->flags & FZ_COLORSPACE_IS_ICC)
+		{
+			fz_write_byte(ctx, out, DL_COLORSPACE);
+			fz_write_byte(ctx, out, DL_CS_ICC);
+			fz_write_int32_le(ctx, out, cs->type);
+			fz_write_int32_le(ctx, out, cs->flags & ~FZ_COLORSPACE_IS_ICC);
+			write_string(ctx, out, cs->name);
+			write_buffer(ctx, out, cs->u.icc.buffer);
+			break;
+		}
+#endif
+		/* Without a profile all we know is the colorspace family. */
+		switch (cs->type)
+		{
+		case FZ_COLORSPACE_GRAY: return CS_GRAY;
+		case FZ_COLORSPACE_RGB: return CS_RGB;
+		case FZ_COLORSPACE_BGR: return CS_BGR;
+		case FZ_COLORSPACE_CMYK: return CS_CMYK;
+		case FZ_COLORSPACE_LAB: return CS_LAB;
+		default:
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize colorspace %s", cs->name);
+		}
+	}
+
+	id = w->colorspace_count++;
+	add_resource(ctx, w->colorspaces, &cs, id);
+	return CS_DEFINED + id;
+}
+
+static int
+font_flags_to_int(fz_font_flags_t *flags)
+{
+	return flags->is_mono |
+		(flags->is_serif << 1) |
+		(flags->is_bold << 2) |
+		(flags->is_italic << 3) |
+		(flags->ft_substitute << 4) |
+		(flags->ft_stretch << 5) |
+		(flags->fake_bold << 6) |
+		(flags->fake_italic << 7) |
+		(flags->has_opentype << 8) |
+		(flags->invalid_bbox << 9);
+}
+
+static int
+write_font_data(fz_context *ctx, list_writer *w, fz_font *font)
+{
+	unsigned char digest[16];
+	int id;
+
+	fz_font_digest(ctx, font, digest);
+	id = find_resource(ctx, w->font_data, digest);
+	if (id >= 0)
+		return id;
+
+	fz_write_byte(ctx, w->out, DL_FONT_DATA);
+	write_buffer(ctx, w->out, font->buffer);
+
+	id = w->font_data_count++;
+	add_resource(ctx, w->font_data, digest, id);
+	return id;
+}
+
+static int
+write_font(fz_context *ctx, list_writer *w, fz_font *font)
+{
+	fz_output *out = w->out;
+	t3_def def, *d;
+	int id, data, i;
+
+	id = find_resource(ctx, w->fonts, &font);
+	if (id >= 0)
+		return id;
+
+	if (font->t3lists)
+	{
+		/* A glyph that uses its own font, directly or through
+		 * another Type 3 font, would make the fonts we read back
+		 * hold references to themselves. */
+		for (d = w->defining; d; d = d->up)
+			if (d->font == font)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize Type 3 font %s with glyphs that use it", font->name);
+
+		/* Take the id now, but only register the font once its
+		 * glyphs (and any fonts they define) are written. */
+		id = w->font_count++;
+		def.font = font;
+		def.up = w->defining;
+		w->defining = &def;
+
+		fz_write_byte(ctx, out, DL_FONT);
+		fz_write_byte(ctx, out, DL_FONT_T3);
+		write_string(ctx, out, font->name);
+		fz_write_int32_le(ctx, out, font_flags_to_int(&font->flags));
+		write_rect(ctx, out, font->bbox);
+		write_matrix(ctx, out, font->t3matrix);
+		for (i = 0; i < 256; i++)
+		{
+			fz_write_float_le(ctx, out, font->t3widths[i]);
+			fz_write_int32_le(ctx, out, font->t3flags[i]);
+			write_rect(ctx, out, font->bbox_table ? font->bbox_table[i] : fz_infinite_rect);
+			fz_write_byte(ctx, out, font->t3lists[i] != NULL);
+			if (font->t3lists[i])
+			{
+				write_rect(ctx, out, fz_bound_display_list(ctx, font->t3lists[i]));
+				write_list_body(ctx, w, font->t3lists[i]);
+			}
+		}
+
+		w->defining = def.up;
+		add_resource(ctx, w->fonts, &font, id);
+		return id;
+	}
+
+	if (!font->ft_face || !font->buffer)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize font %s", font->name);
+
+	data = write_font_data(ctx, w, font);
+	fz_write_byte(ctx, out, DL_FONT);
+	fz_write_byte(ctx, out, DL_FONT_FT);
+	write_string(ctx, out, font->name);
+	fz_write_int32_le(ctx, out, font_flags_to_int(&font->flags));
+	write_rect(ctx, out, font->bbox);
+	fz_write_int32_le(ctx, out, data);
+	fz_write_int32_le(ctx, out, (int)((FT_Face)font->ft_face)->face_index);
+	fz_write_byte(ctx, out, font->bbox_table != NULL);
+	fz_write_int32_le(ctx, out, font->width_table ? font->width_count : 0);
+	fz_write_int32_le(ctx, out, font->width_default);
+	if (font->width_table)
+		for (i = 0; i < font->width_count; i++)
+			fz_write_int16_le(ctx, out, font->width_table[i]);
+
+	id = w->font_count++;
+	add_resource(ctx, w->fonts, &font, id);
+	return id;
+}
+
+static int
+write_image(fz_context *ctx, list_writer *w, fz_image *image)
+{
+	fz_output *out = w->out;
+	fz_compressed_buffer *cbuf;
+	fz_pixmap *pix = NULL;
+	int id, mask, cs, i, y;
+
+	id = find_resource(ctx, w->images, &image);
+	if (id >= 0)
+		return id;
+
+	mask = image->mask ? write_image(ctx, w, image->mask) : -1;
+
+	/* JBIG2 streams can depend on a separate globals stream, so they
+	 * are written as decoded pixmaps like non-compressed images. */
+	cbuf = fz_compressed_image_buffer(ctx, image);
+	if (cbuf && cbuf->params.type != FZ_IMAGE_JBIG2)
+	{
+		cs = write_colorspace(ctx, w, image->colorspace);
+		fz_write_byte(ctx, out, DL_IMAGE);
+		fz_write_byte(ctx, out, DL_IMAGE_COMPRESSED);
+		fz_write_int32_le(ctx, out, mask);
+		fz_write_byte(ctx, out, image->imagemask);
+		fz_write_byte(ctx, out, image->interpolate);
+		fz_write_int32_le(ctx, out, image->w);
+		fz_write_int32_le(ctx, out, image->h);
+		fz_write_int32_le(ctx, out, image->bpc);
+		fz_write_int32_le(ctx, out, cs);
+		fz_write_int32_le(ctx, out, image->xres);
+		fz_write_int32_le(ctx, out, image->yres);
+		fz_write_int32_le(ctx, out, image->n);
+		fz_write_byte(ctx, out, image->use_decode);
+		if (image->use_decode)
+			for (i = 0; i < image->n * 2; i++)
+				fz_write_float_le(ctx, out, image->decode[i]);
+		fz_write_byte(ctx, out, image->use_colorkey);
+		if (image->use_colorkey)
+			for (i = 0; i < image->n * 2; i++)
+				fz_write_int32_le(ctx, out, image->colorkey[i]);
+		fz_write_byte(ctx, out, image->invert_cmyk_jpeg);
+		write_compressed_buffer(ctx, out, cbuf);
+	}
+	else
+	{
+		/* The decoded pixmap already has the decode array, color key
+		 * and matte applied. */
+		pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+		fz_try(ctx)
+		{
+			cs = write_colorspace(ctx, w, pix->colorspace);
+			fz_write_byte(ctx, out, DL_IMAGE);
+			fz_write_byte(ctx, out, DL_IMAGE_PIXMAP);
+			fz_write_int32_le(ctx, out, mask);
+			fz_write_byte(ctx, out, image->imagemask);
+			fz_write_byte(ctx, out, image->interpolate);
+			fz_write_int32_le(ctx, out, pix->w);
+			fz_write_int32_le(ctx, out, pix->h);
+			fz_write_int32_le(ctx, out, pix->n);
+			fz_write_byte(ctx, out, pix->alpha);
+			fz_write_int32_le(ctx, out, cs);
+			fz_write_int32_le(ctx, out, pix->xres);
+			fz_write_int32_le(ctx, out, pix->yres);
+			for (y = 0; y < pix->h; y++)
+				fz_write_data(ctx, out, pix->samples + y * (size_t)pix->stride, pix->w * (size_t)pix->n);
+		}
+		fz_always(ctx)
+			fz_drop_pixmap(ctx, pix);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+
+	id = w->image_count++;
+	add_resource(ctx, w->images, &image, id);
+	return id;
+}
+
+static int
+write_shade(fz_context *ctx, list_writer *w, fz_shade *shade)
+{
+	fz_output *out = w->out;
+	int id, cs, n, i, k, count;
+
+	id = find_resource(ctx, w->shades, &shade);
+	if (id >= 0)
+		return id;
+
+	cs = write_colorspace(ctx, w, shade->colorspace);
+	n = fz_colorspace_n(ctx, shade->colorspace);
+
+	fz_write_byte(ctx, out, DL_SHADE);
+	fz_write_int32_le(ctx, out, shade->type);
+	write_rect(ctx, out, shade->bbox);
+	fz_write_int32_le(ctx, out, cs);
+	write_matrix(ctx, out, shade->matrix);
+	fz_write_byte(ctx, out, shade->use_background);
+	if (shade->use_background)
+		for (i = 0; i < n; i++)
+			fz_write_float_le(ctx, out, shade->background[i]);
+	fz_write_byte(ctx, out, shade->use_function);
+	if (shade->use_function)
+		for (i = 0; i < 256; i++)
+			for (k = 0; k <= n; k++)
+				fz_write_float_le(ctx, out, shade->function[i][k]);
+
+	switch (shade->type)
+	{
+	case FZ_FUNCTION_BASED:
+		write_matrix(ctx, out, shade->u.f.matrix);
+		fz_write_int32_le(ctx, out, shade->u.f.xdivs);
+		fz_write_int32_le(ctx, out, shade->u.f.ydivs);
+		fz_write_float_le(ctx, out, shade->u.f.domain[0][0]);
+		fz_write_float_le(ctx, out, shade->u.f.domain[0][1]);
+		fz_write_float_le(ctx, out, shade->u.f.domain[1][0]);
+		fz_write_float_le(ctx, out, shade->u.f.domain[1][1]);
+		count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n;
+		for (i = 0; i < count; i++)
+			fz_write_float_le(ctx, out, shade->u.f.fn_vals[i]);
+		break;
+	case FZ_LINEAR:
+	case FZ_RADIAL:
+		fz_write_int32_le(ctx, out, shade->u.l_or_r.extend[0]);
+		fz_write_int32_le(ctx, out, shade->u.l_or_r.extend[1]);
+		for (i = 0; i < 2; i++)
+			for (k = 0; k < 3; k++)
+				fz_write_float_le(ctx, out, shade->u.l_or_r.coords[i][k]);
+		break;
+	default:
+		fz_write_int32_le(ctx, out, shade->u.m.vprow);
+		fz_write_int32_le(ctx, out, shade->u.m.bpflag);
+		fz_write_int32_le(ctx, out, shade->u.m.bpcoord);
+		fz_write_int32_le(ctx, out, shade->u.m.bpcomp);
+		fz_write_float_le(ctx, out, shade->u.m.x0);
+		fz_write_float_le(ctx, out, shade->u.m.x1);
+		fz_write_float_le(ctx, out, shade->u.m.y0);
+		fz_write_float_le(ctx, out, shade->u.m.y1);
+		for (i = 0; i < FZ_MAX_COLORS; i++)
+			fz_write_float_le(ctx, out, shade->u.m.c0[i]);
+		for (i = 0; i < FZ_MAX_COLORS; i++)
+			fz_write_float_le(ctx, out, shade->u.m.c1[i]);
+		break;
+	}
+
+	fz_write_byte(ctx, out, shade->buffer != NULL);
+	if (shade->buffer)
+		write_compressed_buffer(ctx, out, shade->buffer);
+
+	id = w->shade_count++;
+	add_resource(ctx, w->shades, &shade, id);
+	return id;
+}
+
+static void
+write_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'M');
+	fz_write_float_le(ctx, out, x);
+	fz_write_float_le(ctx, out, y);
+}
+
+static void
+write_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'L');
+	fz_write_float_le(ctx, out, x);
+	fz_write_float_le(ctx, out, y);
+}
+
+static void
+write_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'C');
+	fz_write_float_le(ctx, out, x1);
+	fz_write_float_le(ctx, out, y1);
+	fz_write_float_le(ctx, out, x2);
+	fz_write_float_le(ctx, out, y2);
+	fz_write_float_le(ctx, out, x3);
+	fz_write_float_le(ctx, out, y3);
+}
+
+static void
+write_closepath(fz_context *ctx, void *arg)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'Z');
+}
+
+static void
+write_quadto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'Q');
+	fz_write_float_le(ctx, out, x1);
+	fz_write_float_le(ctx, out, y1);
+	fz_write_float_le(ctx, out, x2);
+	fz_write_float_le(ctx, out, y2);
+}
+
+static void
+write_curvetov(fz_context *ctx, void *arg, float x2, float y2, float x3, float y3)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'V');
+	fz_write_float_le(ctx, out, x2);
+	fz_write_float_le(ctx, out, y2);
+	fz_write_float_le(ctx, out, x3);
+	fz_write_float_le(ctx, out, y3);
+}
+
+static void
+write_curvetoy(fz_context *ctx, void *arg, float x1, float y1, float x3, float y3)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'Y');
+	fz_write_float_le(ctx, out, x1);
+	fz_write_float_le(ctx, out, y1);
+	fz_write_float_le(ctx, out, x3);
+	fz_write_float_le(ctx, out, y3);
+}
+
+static void
+write_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, 'R');
+	fz_write_float_le(ctx, out, x1);
+	fz_write_float_le(ctx, out, y1);
+	fz_write_float_le(ctx, out, x2);
+	fz_write_float_le(ctx, out, y2);
+}
+
+static const fz_path_walker path_writer =
+{
+	write_moveto,
+	write_lineto,
+	write_curveto,
+	write_closepath,
+	write_quadto,
+	write_curvetov,
+	write_curvetoy,
+	write_rectto
+};
+
+static void
+write_path(fz_context *ctx, fz_output *out, const fz_path *path)
+{
+	fz_walk_path(ctx, path, &path_writer, out);
+	fz_write_byte(ctx, out, 0);
+}
+
+static void
+write_stroke(fz_context *ctx, fz_output *out, const fz_stroke_state *stroke)
+{
+	int i;
+	fz_write_byte(ctx, out, stroke->start_cap);
+	fz_write_byte(ctx, out, stroke->dash_cap);
+	fz_write_byte(ctx, out, stroke->end_cap);
+	fz_write_byte(ctx, out, stroke->linejoin);
+	fz_write_float_le(ctx, out, stroke->linewidth);
+	fz_write_float_le(ctx, out, stroke->miterlimit);
+	fz_write_float_le(ctx, out, stroke->dash_phase);
+	fz_write_int32_le(ctx, out, stroke->dash_len);
+	for (i = 0; i < stroke->dash_len; i++)
+		fz_write_float_le(ctx, out, stroke->dash_list[i]);
+}
+
+/* Fonts must be defined before the record that uses the text starts. */
+static void
+define_text_fonts(fz_context *ctx, list_writer *w, const fz_text *text)
+{
+	fz_text_span *span;
+	for (span = text->head; span; span = span->next)
+		write_font(ctx, w, span->font);
+}
+
+static void
+write_text(fz_context *ctx, list_writer *w, const fz_text *text)
+{
+	fz_output *out = w->out;
+	fz_text_span *span;
+	int i, count = 0;
+
+	for (span = text->head; span; span = span->next)
+		count++;
+	fz_write_int32_le(ctx, out, count);
+	for (span = text->head; span; span = span->next)
+	{
+		fz_write_int32_le(ctx, out, write_font(ctx, w, span->font));
+		write_matrix(ctx, out, span->trm);
+		fz_write_byte(ctx, out, span->wmode);
+		fz_write_byte(ctx, out, span->bidi_level);
+		fz_write_byte(ctx, out, span->markup_dir);
+		fz_write_int32_le(ctx, out, span->language);
+		fz_write_int32_le(ctx, out, span->len);
+		for (i = 0; i < span->len; i++)
+		{
+			fz_write_float_le(ctx, out, span->items[i].x);
+			fz_write_float_le(ctx, out, span->items[i].y);
+			fz_write_int32_le(ctx, out, span->items[i].gid);
+			fz_write_int32_le(ctx, out, span->items[i].ucs);
+		}
+	}
+}
+
+static void
+fz_write_list_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int cs = write_colorspace(ctx, w, colorspace);
+	fz_write_byte(ctx, w->out, DL_FILL_PATH);
+	write_path(ctx, w->out, path);
+	fz_write_byte(ctx, w->out, even_odd);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_int32_le(ctx, w->out, cs);
+	write_color(ctx, w->out, colorspace, color);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke,
+	fz_matrix ctm, fz_colorspace *colorspace, const float *color, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int cs = write_colorspace(ctx, w, colorspace);
+	fz_write_byte(ctx, w->out, DL_STROKE_PATH);
+	write_path(ctx, w->out, path);
+	write_stroke(ctx, w->out, stroke);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_int32_le(ctx, w->out, cs);
+	write_color(ctx, w->out, colorspace, color);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_CLIP_PATH);
+	write_path(ctx, w->out, path);
+	fz_write_byte(ctx, w->out, even_odd);
+	write_matrix(ctx, w->out, ctm);
+	write_rect(ctx, w->out, scissor);
+}
+
+static void
+fz_write_list_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_CLIP_STROKE_PATH);
+	write_path(ctx, w->out, path);
+	write_stroke(ctx, w->out, stroke);
+	write_matrix(ctx, w->out, ctm);
+	write_rect(ctx, w->out, scissor);
+}
+
+static void
+fz_write_list_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int cs = write_colorspace(ctx, w, colorspace);
+	define_text_fonts(ctx, w, text);
+	fz_write_byte(ctx, w->out, DL_FILL_TEXT);
+	write_text(ctx, w, text);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_int32_le(ctx, w->out, cs);
+	write_color(ctx, w->out, colorspace, color);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int cs = write_colorspace(ctx, w, colorspace);
+	define_text_fonts(ctx, w, text);
+	fz_write_byte(ctx, w->out, DL_STROKE_TEXT);
+	write_text(ctx, w, text);
+	write_stroke(ctx, w->out, stroke);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_int32_le(ctx, w->out, cs);
+	write_color(ctx, w->out, colorspace, color);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	define_text_fonts(ctx, w, text);
+	fz_write_byte(ctx, w->out, DL_CLIP_TEXT);
+	write_text(ctx, w, text);
+	write_matrix(ctx, w->out, ctm);
+	write_rect(ctx, w->out, scissor);
+}
+
+static void
+fz_write_list_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	define_text_fonts(ctx, w, text);
+	fz_write_byte(ctx, w->out, DL_CLIP_STROKE_TEXT);
+	write_text(ctx, w, text);
+	write_stroke(ctx, w->out, stroke);
+	write_matrix(ctx, w->out, ctm);
+	write_rect(ctx, w->out, scissor);
+}
+
+static void
+fz_write_list_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	define_text_fonts(ctx, w, text);
+	fz_write_byte(ctx, w->out, DL_IGNORE_TEXT);
+	write_text(ctx, w, text);
+	write_matrix(ctx, w->out, ctm);
+}
+
+static void
+fz_write_list_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int id = write_shade(ctx, w, shade);
+	fz_write_byte(ctx, w->out, DL_FILL_SHADE);
+	fz_write_int32_le(ctx, w->out, id);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int id = write_image(ctx, w, image);
+	fz_write_byte(ctx, w->out, DL_FILL_IMAGE);
+	fz_write_int32_le(ctx, w->out, id);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int id = write_image(ctx, w, image);
+	int cs = write_colorspace(ctx, w, colorspace);
+	fz_write_byte(ctx, w->out, DL_FILL_IMAGE_MASK);
+	fz_write_int32_le(ctx, w->out, id);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_int32_le(ctx, w->out, cs);
+	write_color(ctx, w->out, colorspace, color);
+	fz_write_float_le(ctx, w->out, alpha);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int id = write_image(ctx, w, image);
+	fz_write_byte(ctx, w->out, DL_CLIP_IMAGE_MASK);
+	fz_write_int32_le(ctx, w->out, id);
+	write_matrix(ctx, w->out, ctm);
+	write_rect(ctx, w->out, scissor);
+}
+
+static void
+fz_write_list_pop_clip(fz_context *ctx, fz_device *dev)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_POP_CLIP);
+}
+
+static void
+fz_write_list_begin_mask(fz_context *ctx, fz_device *dev, fz_rect area, int luminosity,
+	fz_colorspace *colorspace, const float *color, fz_color_params color_params)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int cs = write_colorspace(ctx, w, colorspace);
+	fz_write_byte(ctx, w->out, DL_BEGIN_MASK);
+	write_rect(ctx, w->out, area);
+	fz_write_byte(ctx, w->out, luminosity);
+	fz_write_int32_le(ctx, w->out, cs);
+	write_color(ctx, w->out, colorspace, color);
+	write_color_params(ctx, w->out, color_params);
+}
+
+static void
+fz_write_list_end_mask(fz_context *ctx, fz_device *dev)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_END_MASK);
+}
+
+static void
+fz_write_list_begin_group(fz_context *ctx, fz_device *dev, fz_rect area, fz_colorspace *colorspace,
+	int isolated, int knockout, int blendmode, float alpha)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int cs = write_colorspace(ctx, w, colorspace);
+	fz_write_byte(ctx, w->out, DL_BEGIN_GROUP);
+	write_rect(ctx, w->out, area);
+	fz_write_int32_le(ctx, w->out, cs);
+	fz_write_byte(ctx, w->out, isolated);
+	fz_write_byte(ctx, w->out, knockout);
+	fz_write_byte(ctx, w->out, blendmode);
+	fz_write_float_le(ctx, w->out, alpha);
+}
+
+static void
+fz_write_list_end_group(fz_context *ctx, fz_device *dev)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_END_GROUP);
+}
+
+static int
+fz_write_list_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_BEGIN_TILE);
+	write_rect(ctx, w->out, area);
+	write_rect(ctx, w->out, view);
+	fz_write_float_le(ctx, w->out, xstep);
+	fz_write_float_le(ctx, w->out, ystep);
+	write_matrix(ctx, w->out, ctm);
+	fz_write_int32_le(ctx, w->out, id);
+	return 0;
+}
+
+static void
+fz_write_list_end_tile(fz_context *ctx, fz_device *dev)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_END_TILE);
+}
+
+static void
+fz_write_list_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_RENDER_FLAGS);
+	fz_write_int32_le(ctx, w->out, set);
+	fz_write_int32_le(ctx, w->out, clear);
+}
+
+static void
+fz_write_list_set_default_colorspaces(fz_context *ctx, fz_device *dev, fz_default_colorspaces *default_cs)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	int gray = write_colorspace(ctx, w, fz_default_gray(ctx, default_cs));
+	int rgb = write_colorspace(ctx, w, fz_default_rgb(ctx, default_cs));
+	int cmyk = write_colorspace(ctx, w, fz_default_cmyk(ctx, default_cs));
+	int oi = write_colorspace(ctx, w, fz_default_output_intent(ctx, default_cs));
+	fz_write_byte(ctx, w->out, DL_DEFAULT_COLORSPACES);
+	fz_write_int32_le(ctx, w->out, gray);
+	fz_write_int32_le(ctx, w->out, rgb);
+	fz_write_int32_le(ctx, w->out, cmyk);
+	fz_write_int32_le(ctx, w->out, oi);
+}
+
+static void
+fz_write_list_begin_layer(fz_context *ctx, fz_device *dev, const char *layer_name)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_BEGIN_LAYER);
+	write_string(ctx, w->out, layer_name);
+}
+
+static void
+fz_write_list_end_layer(fz_context *ctx, fz_device *dev)
+{
+	list_writer *w = ((fz_write_list_device *)dev)->w;
+	fz_write_byte(ctx, w->out, DL_END_LAYER);
+}
+
+static fz_device *
+new_write_list_device(fz_context *ctx, list_writer *w)
+{
+	fz_write_list_device *dev = fz_new_derived_device(ctx, fz_write_list_device);
+
+	dev->super.fill_path = fz_write_list_fill_path;
+	dev->super.stroke_path = fz_write_list_stroke_path;
+	dev->super.clip_path = fz_write_list_clip_path;
+	dev->super.clip_stroke_path = fz_write_list_clip_stroke_path;
+
+	dev->super.fill_text = fz_write_list_fill_text;
+	dev->super.stroke_text = fz_write_list_stroke_text;
+	dev->super.clip_text = fz_write_list_clip_text;
+	dev->super.clip_stroke_text = fz_write_list_clip_stroke_text;
+	dev->super.ignore_text = fz_write_list_ignore_text;
+
+	dev->super.fill_shade = fz_write_list_fill_shade;
+	dev->super.fill_image = fz_write_list_fill_image;
+	dev->super.fill_image_mask = fz_write_list_fill_image_mask;
+	dev->super.clip_image_mask = fz_write_list_clip_image_mask;
+
+	dev->super.pop_clip = fz_write_list_pop_clip;
+
+	dev->super.begin_mask = fz_write_list_begin_mask;
+	dev->super.end_mask = fz_write_list_end_mask;
+	dev->super.begin_group = fz_write_list_begin_group;
+	dev->super.end_group = fz_write_list_end_group;
+
+	dev->super.begin_tile = fz_write_list_begin_tile;
+	dev->super.end_tile = fz_write_list_end_tile;
+
+	dev->super.render_flags = fz_write_list_render_flags;
+	dev->super.set_default_colorspaces = fz_write_list_set_default_colorspaces;
+
+	dev->super.begin_layer = fz_write_list_begin_layer;
+	dev->super.end_layer = fz_write_list_end_layer;
+
+	dev->w = w;
+
+	return &dev->super;
+}
+
+static void
+write_list_body(fz_context *ctx, list_writer *w, fz_display_list *list)
+{
+	fz_device *dev = new_write_list_device(ctx, w);
+	fz_cookie cookie = { 0 };
+	fz_try(ctx)
+	{
+		fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, &cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	/* Running the list swallows errors from the device, and the output
+	 * may stop part way through a record, so the result is useless. */
+	if (cookie.errors)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize display list");
+	fz_write_byte(ctx, w->out, DL_END);
+}
+
+void
+fz_write_display_list(fz_context *ctx, fz_output *out, fz_display_list *list)
+{
+	list_writer w = { 0 };
+
+	w.out = out;
+
+	fz_try(ctx)
+	{
+		w.colorspaces = fz_new_hash_table(ctx, 64, sizeof(fz_colorspace *), -1, NULL);
+		w.font_data = fz_new_hash_table(ctx, 64, 16, -1, NULL);
+		w.fonts = fz_new_hash_table(ctx, 64, sizeof(fz_font *), -1, NULL);
+		w.images = fz_new_hash_table(ctx, 64, sizeof(fz_image *), -1, NULL);
+		w.shades = fz_new_hash_table(ctx, 64, sizeof(fz_shade *), -1, NULL);
+
+		fz_write_data(ctx, out, DL_MAGIC, 4);
+		fz_write_int32_le(ctx, out, DL_VERSION);
+		write_rect(ctx, out, fz_bound_display_list(ctx, list));
+		write_list_body(ctx, &w, list);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_hash_table(ctx, w.colorspaces);
+		fz_drop_hash_table(ctx, w.font_data);
+		fz_drop_hash_table(ctx, w.fonts);
+		fz_drop_hash_table(ctx, w.images);
+		fz_drop_hash_table(ctx, w.shades);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+void
+fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_output *out = fz_new_output_with_path(ctx, filename, 0);
+	fz_try(ctx)
+	{
+		fz_write_display_list(ctx, out, list);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Reading */
+
+typedef struct
+{
+	int len, cap;
+	void **items;
+} list_table;
+
+typedef struct
+{
+	fz_stream *stm;
+	list_table colorspaces;
+	list_table font_data;
+	list_table fonts;
+	list_table images;
+	list_table shades;
+
+	/* Objects under construction for the current record. */
+	fz_path *path;
+	fz_stroke_state *stroke;
+	fz_text *text;
+	fz_default_colorspaces *default_cs;
+} list_reader;
+
+static fz_display_list *read_list(fz_context *ctx, list_reader *r, fz_rect mediabox);
+
+static void
+table_add(fz_context *ctx, list_table *table, void *item)
+{
+	if (table->len == table->cap)
+	{
+		int cap = table->cap ? table->cap * 2 : 16;
+		table->items = fz_realloc_array(ctx, table->items, cap, void *);
+		table->cap = cap;
+	}
+	table->items[table->len++] = item;
+}
+
+static void *
+table_get(fz_context *ctx, list_table *table, int id)
+{
+	/* Type 3 fonts have no entry until their glyphs are read. */
+	if (id < 0 || id >= table->len || !table->items[id])
+		fz_throw(ctx, FZ_ERROR_GENERIC, "invalid resource reference in display list");
+	return table->items[id];
+}
+
+static void
+drop_scratch(fz_context *ctx, list_reader *r)
+{
+	fz_drop_path(ctx, r->path);
+	fz_drop_stroke_state(ctx, r->stroke);
+	fz_drop_text(ctx, r->text);
+	fz_drop_default_colorspaces(ctx, r->default_cs);
+	r->path = NULL;
+	r->stroke = NULL;
+	r->text = NULL;
+	r->default_cs = NULL;
+}
+
+static int
+read_byte(fz_context *ctx, fz_stream *stm)
+{
+	int c = fz_read_byte(ctx, stm);
+	if (c == EOF)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+	return c;
+}
+
+static int
+read_count(fz_context *ctx, fz_stream *stm, int max)
+{
+	int n = fz_read_int32_le(ctx, stm);
+	if (n < 0 || n > max)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "invalid count in display list");
+	return n;
+}
+
+static fz_rect
+read_rect(fz_context *ctx, fz_stream *stm)
+{
+	fz_rect r;
+	r.x0 = fz_read_float_le(ctx, stm);
+	r.y0 = fz_read_float_le(ctx, stm);
+	r.x1 = fz_read_float_le(ctx, stm);
+	r.y1 = fz_read_float_le(ctx, stm);
+	return r;
+}
+
+static fz_matrix
+read_matrix(fz_context *ctx, fz_stream *stm)
+{
+	fz_matrix m;
+	m.a = fz_read_float_le(ctx, stm);
+	m.b = fz_read_float_le(ctx, stm);
+	m.c = fz_read_float_le(ctx, stm);
+	m.d = fz_read_float_le(ctx, stm);
+	m.e = fz_read_float_le(ctx, stm);
+	m.f = fz_read_float_le(ctx, stm);
+	return m;
+}
+
+static void
+read_data(fz_context *ctx, fz_stream *stm, void *data, size_t len)
+{
+	if (fz_read(ctx, stm, data, len) != len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+}
+
+/* Check that the stream still holds at least len bytes, where it can
+ * tell, before we allocate something that len bytes are to fill. */
+static void
+check_remaining(fz_context *ctx, fz_stream *stm, size_t len)
+{
+	int64_t pos, end;
+
+	if (!stm->seek)
+		return;
+	pos = fz_tell(ctx, stm);
+	fz_seek(ctx, stm, 0, SEEK_END);
+	end = fz_tell(ctx, stm);
+	fz_seek(ctx, stm, pos, SEEK_SET);
+	if (end < pos || (uint64_t)(end - pos) < len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+}
+
+/* Read len bytes into a new block, with room for extra bytes after
+ * them. The block grows as the data arrives, so a corrupt length
+ * cannot make us allocate much more than the stream holds. */
+static unsigned char *
+read_block(fz_context *ctx, fz_stream *stm, size_t len, size_t extra)
+{
+	size_t cap = fz_minz(len, 65536);
+	size_t pos = 0, n;
+	unsigned char *data = fz_malloc(ctx, cap + extra);
+
+	fz_var(data);
+	fz_var(cap);
+
+	fz_try(ctx)
+	{
+		while (pos < len)
+		{
+			if (pos == cap)
+			{
+				cap = fz_minz(len, cap * 2);
+				data = fz_realloc(ctx, data, cap + extra);
+			}
+			n = fz_read(ctx, stm, data + pos, cap - pos);
+			if (n == 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+			pos += n;
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, data);
+		fz_rethrow(ctx);
+	}
+	return data;
+}
+
+static char *
+read_string(fz_context *ctx, fz_stream *stm)
+{
+	int len = fz_read_int32_le(ctx, stm);
+	char *s;
+	if (len < 0)
+		return NULL;
+	s = (char *)read_block(ctx, stm, len, 1);
+	s[len] = 0;
+	return s;
+}
+
+static fz_buffer *
+read_buffer(fz_context *ctx, fz_stream *stm)
+{
+	int len = read_count(ctx, stm, INT_MAX);
+	unsigned char *data = read_block(ctx, stm, len, 0);
+	fz_buffer *buf = NULL;
+	fz_try(ctx)
+		buf = fz_new_buffer_from_data(ctx, data, len);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, data);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+static fz_color_params
+read_color_params(fz_context *ctx, fz_stream *stm)
+{
+	fz_color_params cp;
+	cp.ri = read_byte(ctx, stm);
+	cp.bp = read_byte(ctx, stm);
+	cp.op = read_byte(ctx, stm);
+	cp.opm = read_byte(ctx, stm);
+	return cp;
+}
+
+static fz_colorspace *
+read_colorspace(fz_context *ctx, list_reader *r)
+{
+	int ref = fz_read_int32_le(ctx, r->stm);
+	switch (ref)
+	{
+	case CS_NONE: return NULL;
+	case CS_GRAY: return fz_device_gray(ctx);
+	case CS_RGB: return fz_device_rgb(ctx);
+	case CS_BGR: return fz_device_bgr(ctx);
+	case CS_CMYK: return fz_device_cmyk(ctx);
+	case CS_LAB: return fz_device_lab(ctx);
+	}
+	return table_get(ctx, &r->colorspaces, ref - CS_DEFINED);
+}
+
+static void
+read_color(fz_context *ctx, fz_stream *stm, fz_colorspace *cs, float *color)
+{
+	int i, n = cs ? fz_colorspace_n(ctx, cs) : 0;
+	for (i = 0; i < n; i++)
+		color[i] = fz_read_float_le(ctx, stm);
+}
+
+static void
+read_params(fz_context *ctx, fz_stream *stm, fz_compression_params *params)
+{
+	params->type = fz_read_int32_le(ctx, stm);
+	switch (params->type)
+	{
+	case FZ_IMAGE_JPEG:
+		params->u.jpeg.color_transform = fz_read_int32_le(ctx, stm);
+		break;
+	case FZ_IMAGE_JPX:
+		params->u.jpx.smask_in_data = fz_read_int32_le(ctx, stm);
+		break;
+	case FZ_IMAGE_JBIG2:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected JBIG2 parameters in display list");
+	case FZ_IMAGE_FAX:
+		params->u.fax.columns = fz_read_int32_le(ctx, stm);
+		params->u.fax.rows = fz_read_int32_le(ctx, stm);
+		params->u.fax.k = fz_read_int32_le(ctx, stm);
+		params->u.fax.end_of_line = fz_read_int32_le(ctx, stm);
+		params->u.fax.encoded_byte_align = fz_read_int32_le(ctx, stm);
+		params->u.fax.end_of_block = fz_read_int32_le(ctx, stm);
+		params->u.fax.black_is_1 = fz_read_int32_le(ctx, stm);
+		params->u.fax.damaged_rows_before_error = fz_read_int32_le(ctx, stm);
+		break;
+	case FZ_IMAGE_FLATE:
+		params->u.flate.columns = fz_read_int32_le(ctx, stm);
+		params->u.flate.colors = fz_read_int32_le(ctx, stm);
+		params->u.flate.predictor = fz_read_int32_le(ctx, stm);
+		params->u.flate.bpc = fz_read_int32_le(ctx, stm);
+		break;
+	case FZ_IMAGE_LZW:
+		params->u.lzw.columns = fz_read_int32_le(ctx, stm);
+		params->u.lzw.colors = fz_read_int32_le(ctx, stm);
+		params->u.lzw.predictor = fz_read_int32_le(ctx, stm);
+		params->u.lzw.bpc = fz_read_int32_le(ctx, stm);
+		params->u.lzw.early_change = fz_read_int32_le(ctx, stm);
+		break;
+	}
+}
+
+static fz_compressed_buffer *
+read_compressed_buffer(fz_context *ctx, fz_stream *stm)
+{
+	fz_compressed_buffer *cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+	fz_try(ctx)
+	{
+		read_params(ctx, stm, &cbuf->params);
+		cbuf->buffer = read_buffer(ctx, stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, cbuf);
+		fz_rethrow(ctx);
+	}
+	return cbuf;
+}
+
+static void
+read_colorspace_def(fz_context *ctx, list_reader *r)
+{
+	fz_stream *stm = r->stm;
+	fz_colorspace *cs = NULL;
+	fz_colorspace *base;
+	fz_buffer *buf = NULL;
+	unsigned char *lookup = NULL;
+	char *name = NULL;
+	int kind, type, flags, high;
+
+	fz_var(cs);
+	fz_var(buf);
+	fz_var(lookup);
+	fz_var(name);
+
+	fz_try(ctx)
+	{
+		kind = read_byte(ctx, stm);
+		switch (kind)
+		{
+		case DL_CS_ICC:
+			type = fz_read_int32_le(ctx, stm);
+			flags = fz_read_int32_le(ctx, stm);
+			name = read_string(ctx, stm);
+			buf = read_buffer(ctx, stm);
+			cs = fz_new_icc_colorspace(ctx, type, flags & FZ_COLORSPACE_HAS_CMYK_AND_SPOTS, name, buf);
+			break;
+
+		case DL_CS_INDEXED:
+			base = read_colorspace(ctx, r);
+			high = fz_read_int32_le(ctx, stm);
+			if (!base || high < 0 || high > 255)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid indexed colorspace in display list");
+			lookup = fz_malloc(ctx, (high + 1) * (size_t)base->n);
+			read_data(ctx, stm, lookup, (high + 1) * (size_t)base->n);
+			cs = fz_new_indexed_colorspace(ctx, base, high, lookup);
+			lookup = NULL;
+			break;
+
+		default:
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown colorspace kind in display list");
+		}
+		table_add(ctx, &r->colorspaces, cs);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_free(ctx, lookup);
+		fz_free(ctx, name);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_colorspace(ctx, cs);
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+font_flags_from_int(fz_font_flags_t *flags, int x)
+{
+	flags->is_mono = x & 1;
+	flags->is_serif = (x >> 1) & 1;
+	flags->is_bold = (x >> 2) & 1;
+	flags->is_italic = (x >> 3) & 1;
+	flags->ft_substitute = (x >> 4) & 1;
+	flags->ft_stretch = (x >> 5) & 1;
+	flags->fake_bold = (x >> 6) & 1;
+	flags->fake_italic = (x >> 7) & 1;
+	flags->has_opentype = (x >> 8) & 1;
+	flags->invalid_bbox = (x >> 9) & 1;
+}
+
+static void
+read_t3_glyphs(fz_context *ctx, list_reader *r, fz_font *font)
+{
+	fz_stream *stm = r->stm;
+	fz_rect bounds;
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		font->t3widths[i] = fz_read_float_le(ctx, stm);
+		font->t3flags[i] = fz_read_int32_le(ctx, stm);
+		font->bbox_table[i] = read_rect(ctx, stm);
+		if (read_byte(ctx, stm))
+		{
+			bounds = read_rect(ctx, stm);
+			font->t3lists[i] = read_list(ctx, r, bounds);
+		}
+	}
+}
+
+static void
+read_font_def(fz_context *ctx, list_reader *r)
+{
+	fz_stream *stm = r->stm;
+	fz_font *font = NULL;
+	char *name = NULL;
+	int kind, flags, data, index, use_glyph_bbox, slot, i;
+	fz_rect bbox;
+
+	fz_var(font);
+	fz_var(name);
+
+	fz_try(ctx)
+	{
+		kind = read_byte(ctx, stm);
+		name = read_string(ctx, stm);
+		flags = fz_read_int32_le(ctx, stm);
+		bbox = read_rect(ctx, stm);
+		switch (kind)
+		{
+		case DL_FONT_T3:
+			font = fz_new_type3_font(ctx, name, read_matrix(ctx, stm));
+			font_flags_from_int(&font->flags, flags);
+			font->bbox = bbox;
+			/* Keep the font's place in the table empty while its
+			 * glyphs are read, so that glyphs that use the font
+			 * are refused rather than making a reference cycle. */
+			table_add(ctx, &r->fonts, NULL);
+			slot = r->fonts.len - 1;
+			read_t3_glyphs(ctx, r, font);
+			r->fonts.items[slot] = font;
+			font = NULL;
+			break;
+
+		case DL_FONT_FT:
+			data = fz_read_int32_le(ctx, stm);
+			index = fz_read_int32_le(ctx, stm);
+			use_glyph_bbox = read_byte(ctx, stm);
+			font = fz_new_font_from_buffer(ctx, name, table_get(ctx, &r->font_data, data), index, use_glyph_bbox);
+			font_flags_from_int(&font->flags, flags);
+			font->bbox = bbox;
+			font->width_count = read_count(ctx, stm, 1 << 24);
+			font->width_default = fz_read_int32_le(ctx, stm);
+			if (font->width_count > 0)
+			{
+				check_remaining(ctx, stm, font->width_count * (size_t)2);
+				font->width_table = fz_malloc_array(ctx, font->width_count, short);
+				for (i = 0; i < font->width_count; i++)
+					font->width_table[i] = fz_read_int16_le(ctx, stm);
+			}
+			table_add(ctx, &r->fonts, font);
+			font = NULL;
+			break;
+
+		default:
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown font kind in display list");
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, name);
+	fz_catch(ctx)
+	{
+		fz_drop_font(ctx, font);
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+read_image_def(fz_context *ctx, list_reader *r)
+{
+	fz_stream *stm = r->stm;
+	fz_image *image = NULL;
+	fz_image *mask;
+	fz_pixmap *pix = NULL;
+	fz_colorspace *cs;
+	fz_compressed_buffer *cbuf;
+	float decode[FZ_MAX_COLORS * 2];
+	int colorkey[FZ_MAX_COLORS * 2];
+	int kind, mask_id, imagemask, interpolate;
+	int w, h, bpc, n, xres, yres, alpha, use_decode, use_colorkey, i, y;
+
+	fz_var(image);
+	fz_var(pix);
+
+	fz_try(ctx)
+	{
+		kind = read_byte(ctx, stm);
+		mask_id = fz_read_int32_le(ctx, stm);
+		mask = mask_id < 0 ? NULL : table_get(ctx, &r->images, mask_id);
+		imagemask = read_byte(ctx, stm);
+		interpolate = read_byte(ctx, stm);
+		switch (kind)
+		{
+		case DL_IMAGE_COMPRESSED:
+			w = fz_read_int32_le(ctx, stm);
+			h = fz_read_int32_le(ctx, stm);
+			bpc = fz_read_int32_le(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			xres = fz_read_int32_le(ctx, stm);
+			yres = fz_read_int32_le(ctx, stm);
+			n = read_count(ctx, stm, FZ_MAX_COLORS);
+			/* The decoders trust these, so check them as pdf_load_image does. */
+			if (w <= 0 || h <= 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid image size in display list");
+			if (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8 && bpc != 16)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid image depth in display list");
+			if (n != (cs ? fz_colorspace_n(ctx, cs) : 1))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid image components in display list");
+			use_decode = read_byte(ctx, stm);
+			if (use_decode)
+				for (i = 0; i < n * 2; i++)
+					decode[i] = fz_read_float_le(ctx, stm);
+			use_colorkey = read_byte(ctx, stm);
+			if (use_colorkey)
+				for (i = 0; i < n * 2; i++)
+					colorkey[i] = fz_read_int32_le(ctx, stm);
+			i = read_byte(ctx, stm);
+			cbuf = read_compressed_buffer(ctx, stm);
+			image = fz_new_image_from_compressed_buffer(ctx, w, h, bpc, cs, xres, yres, interpolate, imagemask,
+				use_decode ? decode : NULL, use_colorkey ? colorkey : NULL, cbuf, mask);
+			image->invert_cmyk_jpeg = i;
+			break;
+
+		case DL_IMAGE_PIXMAP:
+			w = fz_read_int32_le(ctx, stm);
+			h = fz_read_int32_le(ctx, stm);
+			n = fz_read_int32_le(ctx, stm);
+			alpha = read_byte(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			xres = fz_read_int32_le(ctx, stm);
+			yres = fz_read_int32_le(ctx, stm);
+			if (w <= 0 || h <= 0 || alpha > 1 || n <= 0 || w > INT_MAX / n ||
+				n != fz_colorspace_n(ctx, cs) + alpha)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid image in display list");
+			check_remaining(ctx, stm, (size_t)w * n * h);
+			pix = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+			pix->xres = xres;
+			pix->yres = yres;
+			for (y = 0; y < h; y++)
+				read_data(ctx, stm, pix->samples + y * (size_t)pix->stride, w * (size_t)n);
+			image = fz_new_image_from_pixmap(ctx, pix, mask);
+			image->imagemask = imagemask;
+			image->interpolate = interpolate;
+			break;
+
+		default:
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown image kind in display list");
+		}
+		table_add(ctx, &r->images, image);
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+	{
+		fz_drop_image(ctx, image);
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+read_shade_def(fz_context *ctx, list_reader *r)
+{
+	fz_stream *stm = r->stm;
+	fz_shade *shade;
+	int n, i, k, count;
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+
+	fz_try(ctx)
+	{
+		shade->type = fz_read_int32_le(ctx, stm);
+		if (shade->type < FZ_FUNCTION_BASED || shade->type > FZ_MESH_TYPE7)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown shade type in display list");
+		shade->bbox = read_rect(ctx, stm);
+		shade->colorspace = fz_keep_colorspace(ctx, read_colorspace(ctx, r));
+		if (!shade->colorspace)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "shade without colorspace in display list");
+		n = fz_colorspace_n(ctx, shade->colorspace);
+		shade->matrix = read_matrix(ctx, stm);
+		shade->use_background = read_byte(ctx, stm);
+		if (shade->use_background)
+			for (i = 0; i < n; i++)
+				shade->background[i] = fz_read_float_le(ctx, stm);
+		shade->use_function = read_byte(ctx, stm);
+		if (shade->use_function)
+			for (i = 0; i < 256; i++)
+				for (k = 0; k <= n; k++)
+					shade->function[i][k] = fz_read_float_le(ctx, stm);
+
+		switch (shade->type)
+		{
+		case FZ_FUNCTION_BASED:
+			shade->u.f.matrix = read_matrix(ctx, stm);
+			shade->u.f.xdivs = read_count(ctx, stm, 1024);
+			shade->u.f.ydivs = read_count(ctx, stm, 1024);
+			shade->u.f.domain[0][0] = fz_read_float_le(ctx, stm);
+			shade->u.f.domain[0][1] = fz_read_float_le(ctx, stm);
+			shade->u.f.domain[1][0] = fz_read_float_le(ctx, stm);
+			shade->u.f.domain[1][1] = fz_read_float_le(ctx, stm);
+			count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n;
+			check_remaining(ctx, stm, count * sizeof(float));
+			shade->u.f.fn_vals = fz_malloc_array(ctx, count, float);
+			for (i = 0; i < count; i++)
+				shade->u.f.fn_vals[i] = fz_read_float_le(ctx, stm);
+			break;
+		case FZ_LINEAR:
+		case FZ_RADIAL:
+			shade->u.l_or_r.extend[0] = fz_read_int32_le(ctx, stm);
+			shade->u.l_or_r.extend[1] = fz_read_int32_le(ctx, stm);
+			for (i = 0; i < 2; i++)
+				for (k = 0; k < 3; k++)
+					shade->u.l_or_r.coords[i][k] = fz_read_float_le(ctx, stm);
+			break;
+		default:
+			shade->u.m.vprow = fz_read_int32_le(ctx, stm);
+			shade->u.m.bpflag = fz_read_int32_le(ctx, stm);
+			shade->u.m.bpcoord = fz_read_int32_le(ctx, stm);
+			shade->u.m.bpcomp = fz_read_int32_le(ctx, stm);
+			/* The same limits as the PDF shading loader. */
+			if (shade->type == FZ_MESH_TYPE5 && shade->u.m.vprow < 2)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid vertices per row in display list");
+			if (shade->type != FZ_MESH_TYPE5 && shade->u.m.bpflag != 2 && shade->u.m.bpflag != 4 &&
+				shade->u.m.bpflag != 8)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid bits per flag in display list");
+			if (shade->u.m.bpcoord != 1 && shade->u.m.bpcoord != 2 && shade->u.m.bpcoord != 4 &&
+				shade->u.m.bpcoord != 8 && shade->u.m.bpcoord != 12 && shade->u.m.bpcoord != 16 &&
+				shade->u.m.bpcoord != 24 && shade->u.m.bpcoord != 32)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid bits per coordinate in display list");
+			if (shade->u.m.bpcomp != 1 && shade->u.m.bpcomp != 2 && shade->u.m.bpcomp != 4 &&
+				shade->u.m.bpcomp != 8 && shade->u.m.bpcomp != 12 && shade->u.m.bpcomp != 16)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid bits per component in display list");
+			shade->u.m.x0 = fz_read_float_le(ctx, stm);
+			shade->u.m.x1 = fz_read_float_le(ctx, stm);
+			shade->u.m.y0 = fz_read_float_le(ctx, stm);
+			shade->u.m.y1 = fz_read_float_le(ctx, stm);
+			for (i = 0; i < FZ_MAX_COLORS; i++)
+				shade->u.m.c0[i] = fz_read_float_le(ctx, stm);
+			for (i = 0; i < FZ_MAX_COLORS; i++)
+				shade->u.m.c1[i] = fz_read_float_le(ctx, stm);
+			break;
+		}
+
+		if (read_byte(ctx, stm))
+			shade->buffer = read_compressed_buffer(ctx, stm);
+		if (shade->type >= FZ_MESH_TYPE4 && !shade->buffer)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "mesh shade without data in display list");
+
+		table_add(ctx, &r->shades, shade);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+}
+
+static fz_path *
+read_path(fz_context *ctx, fz_stream *stm)
+{
+	fz_path *path = fz_new_path(ctx);
+	float v[6];
+	int c;
+
+	fz_try(ctx)
+	{
+		while ((c = read_byte(ctx, stm)) != 0)
+		{
+			switch (c)
+			{
+			case 'M':
+				v[0] = fz_read_float_le(ctx, stm);
+				v[1] = fz_read_float_le(ctx, stm);
+				fz_moveto(ctx, path, v[0], v[1]);
+				break;
+			case 'L':
+				v[0] = fz_read_float_le(ctx, stm);
+				v[1] = fz_read_float_le(ctx, stm);
+				fz_lineto(ctx, path, v[0], v[1]);
+				break;
+			case 'C':
+				for (c = 0; c < 6; c++)
+					v[c] = fz_read_float_le(ctx, stm);
+				fz_curveto(ctx, path, v[0], v[1], v[2], v[3], v[4], v[5]);
+				break;
+			case 'Z':
+				fz_closepath(ctx, path);
+				break;
+			case 'Q':
+				for (c = 0; c < 4; c++)
+					v[c] = fz_read_float_le(ctx, stm);
+				fz_quadto(ctx, path, v[0], v[1], v[2], v[3]);
+				break;
+			case 'V':
+				for (c = 0; c < 4; c++)
+					v[c] = fz_read_float_le(ctx, stm);
+				fz_curvetov(ctx, path, v[0], v[1], v[2], v[3]);
+				break;
+			case 'Y':
+				for (c = 0; c < 4; c++)
+					v[c] = fz_read_float_le(ctx, stm);
+				fz_curvetoy(ctx, path, v[0], v[1], v[2], v[3]);
+				break;
+			case 'R':
+				for (c = 0; c < 4; c++)
+					v[c] = fz_read_float_le(ctx, stm);
+				fz_rectto(ctx, path, v[0], v[1], v[2], v[3]);
+				break;
+			default:
+				fz_throw(ctx, FZ_ERROR_GENERIC, "unknown path segment in display list");
+			}
+		}
+		fz_trim_path(ctx, path);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_rethrow(ctx);
+	}
+	return path;
+}
+
+static fz_stroke_state *
+read_stroke(fz_context *ctx, fz_stream *stm)
+{
+	fz_stroke_state stroke;
+	fz_stroke_state *result;
+	int i;
+
+	stroke.start_cap = read_byte(ctx, stm);
+	stroke.dash_cap = read_byte(ctx, stm);
+	stroke.end_cap = read_byte(ctx, stm);
+	stroke.linejoin = read_byte(ctx, stm);
+	stroke.linewidth = fz_read_float_le(ctx, stm);
+	stroke.miterlimit = fz_read_float_le(ctx, stm);
+	stroke.dash_phase = fz_read_float_le(ctx, stm);
+	stroke.dash_len = read_count(ctx, stm, 1 << 16);
+
+	result = fz_new_stroke_state_with_dash_len(ctx, stroke.dash_len);
+	result->start_cap = stroke.start_cap;
+	result->dash_cap = stroke.dash_cap;
+	result->end_cap = stroke.end_cap;
+	result->linejoin = stroke.linejoin;
+	result->linewidth = stroke.linewidth;
+	result->miterlimit = stroke.miterlimit;
+	result->dash_phase = stroke.dash_phase;
+	result->dash_len = stroke.dash_len;
+	fz_try(ctx)
+		for (i = 0; i < stroke.dash_len; i++)
+			result->dash_list[i] = fz_read_float_le(ctx, stm);
+	fz_catch(ctx)
+	{
+		fz_drop_stroke_state(ctx, result);
+		fz_rethrow(ctx);
+	}
+	return result;
+}
+
+static fz_text *
+read_text(fz_context *ctx, list_reader *r)
+{
+	fz_stream *stm = r->stm;
+	fz_text *text = fz_new_text(ctx);
+	fz_font *font;
+	fz_matrix trm;
+	int spans, len, wmode, bidi_level, markup_dir, language, gid, ucs, i;
+
+	fz_try(ctx)
+	{
+		spans = read_count(ctx, stm, INT_MAX);
+		while (spans-- > 0)
+		{
+			font = table_get(ctx, &r->fonts, fz_read_int32_le(ctx, stm));
+			trm = read_matrix(ctx, stm);
+			wmode = read_byte(ctx, stm);
+			bidi_level = read_byte(ctx, stm);
+			markup_dir = read_byte(ctx, stm);
+			language = fz_read_int32_le(ctx, stm);
+			len = read_count(ctx, stm, INT_MAX);
+			for (i = 0; i < len; i++)
+			{
+				trm.e = fz_read_float_le(ctx, stm);
+				trm.f = fz_read_float_le(ctx, stm);
+				gid = fz_read_int32_le(ctx, stm);
+				ucs = fz_read_int32_le(ctx, stm);
+				fz_show_glyph(ctx, text, font, trm, gid, ucs, wmode, bidi_level, markup_dir, language);
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+static void
+read_body(fz_context *ctx, list_reader *r, fz_device *dev)
+{
+	fz_stream *stm = r->stm;
+	fz_colorspace *cs;
+	fz_image *image;
+	fz_shade *shade;
+	fz_matrix ctm;
+	fz_rect rect, view;
+	float color[FZ_MAX_COLORS];
+	float alpha, xstep, ystep;
+	int op, even_odd, luminosity, isolated, knockout, blendmode, id;
+	char *name;
+
+	while ((op = read_byte(ctx, stm)) != DL_END)
+	{
+		switch (op)
+		{
+		case DL_COLORSPACE:
+			read_colorspace_def(ctx, r);
+			break;
+		case DL_FONT_DATA:
+			table_add(ctx, &r->font_data, NULL);
+			r->font_data.items[r->font_data.len - 1] = read_buffer(ctx, stm);
+			break;
+		case DL_FONT:
+			read_font_def(ctx, r);
+			break;
+		case DL_IMAGE:
+			read_image_def(ctx, r);
+			break;
+		case DL_SHADE:
+			read_shade_def(ctx, r);
+			break;
+
+		case DL_FILL_PATH:
+			r->path = read_path(ctx, stm);
+			even_odd = read_byte(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			read_color(ctx, stm, cs, color);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_fill_path(ctx, dev, r->path, even_odd, ctm, cs, color, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_STROKE_PATH:
+			r->path = read_path(ctx, stm);
+			r->stroke = read_stroke(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			read_color(ctx, stm, cs, color);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_stroke_path(ctx, dev, r->path, r->stroke, ctm, cs, color, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_CLIP_PATH:
+			r->path = read_path(ctx, stm);
+			even_odd = read_byte(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			fz_clip_path(ctx, dev, r->path, even_odd, ctm, read_rect(ctx, stm));
+			break;
+		case DL_CLIP_STROKE_PATH:
+			r->path = read_path(ctx, stm);
+			r->stroke = read_stroke(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			fz_clip_stroke_path(ctx, dev, r->path, r->stroke, ctm, read_rect(ctx, stm));
+			break;
+
+		case DL_FILL_TEXT:
+			r->text = read_text(ctx, r);
+			ctm = read_matrix(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			read_color(ctx, stm, cs, color);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_fill_text(ctx, dev, r->text, ctm, cs, color, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_STROKE_TEXT:
+			r->text = read_text(ctx, r);
+			r->stroke = read_stroke(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			read_color(ctx, stm, cs, color);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_stroke_text(ctx, dev, r->text, r->stroke, ctm, cs, color, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_CLIP_TEXT:
+			r->text = read_text(ctx, r);
+			ctm = read_matrix(ctx, stm);
+			fz_clip_text(ctx, dev, r->text, ctm, read_rect(ctx, stm));
+			break;
+		case DL_CLIP_STROKE_TEXT:
+			r->text = read_text(ctx, r);
+			r->stroke = read_stroke(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			fz_clip_stroke_text(ctx, dev, r->text, r->stroke, ctm, read_rect(ctx, stm));
+			break;
+		case DL_IGNORE_TEXT:
+			r->text = read_text(ctx, r);
+			fz_ignore_text(ctx, dev, r->text, read_matrix(ctx, stm));
+			break;
+
+		case DL_FILL_SHADE:
+			shade = table_get(ctx, &r->shades, fz_read_int32_le(ctx, stm));
+			ctm = read_matrix(ctx, stm);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_fill_shade(ctx, dev, shade, ctm, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_FILL_IMAGE:
+			image = table_get(ctx, &r->images, fz_read_int32_le(ctx, stm));
+			ctm = read_matrix(ctx, stm);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_fill_image(ctx, dev, image, ctm, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_FILL_IMAGE_MASK:
+			image = table_get(ctx, &r->images, fz_read_int32_le(ctx, stm));
+			ctm = read_matrix(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			read_color(ctx, stm, cs, color);
+			alpha = fz_read_float_le(ctx, stm);
+			fz_fill_image_mask(ctx, dev, image, ctm, cs, color, alpha, read_color_params(ctx, stm));
+			break;
+		case DL_CLIP_IMAGE_MASK:
+			image = table_get(ctx, &r->images, fz_read_int32_le(ctx, stm));
+			ctm = read_matrix(ctx, stm);
+			fz_clip_image_mask(ctx, dev, image, ctm, read_rect(ctx, stm));
+			break;
+
+		case DL_POP_CLIP:
+			fz_pop_clip(ctx, dev);
+			break;
+
+		case DL_BEGIN_MASK:
+			rect = read_rect(ctx, stm);
+			luminosity = read_byte(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			read_color(ctx, stm, cs, color);
+			fz_begin_mask(ctx, dev, rect, luminosity, cs, color, read_color_params(ctx, stm));
+			break;
+		case DL_END_MASK:
+			fz_end_mask(ctx, dev);
+			break;
+		case DL_BEGIN_GROUP:
+			rect = read_rect(ctx, stm);
+			cs = read_colorspace(ctx, r);
+			isolated = read_byte(ctx, stm);
+			knockout = read_byte(ctx, stm);
+			blendmode = read_byte(ctx, stm);
+			if (blendmode > FZ_BLEND_LUMINOSITY)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid blend mode in display list");
+			alpha = fz_read_float_le(ctx, stm);
+			fz_begin_group(ctx, dev, rect, cs, isolated, knockout, blendmode, alpha);
+			break;
+		case DL_END_GROUP:
+			fz_end_group(ctx, dev);
+			break;
+
+		case DL_BEGIN_TILE:
+			rect = read_rect(ctx, stm);
+			view = read_rect(ctx, stm);
+			xstep = fz_read_float_le(ctx, stm);
+			ystep = fz_read_float_le(ctx, stm);
+			ctm = read_matrix(ctx, stm);
+			id = fz_read_int32_le(ctx, stm);
+			fz_begin_tile_id(ctx, dev, rect, view, xstep, ystep, ctm, id);
+			break;
+		case DL_END_TILE:
+			fz_end_tile(ctx, dev);
+			break;
+
+		case DL_RENDER_FLAGS:
+			id = fz_read_int32_le(ctx, stm);
+			fz_render_flags(ctx, dev, id, fz_read_int32_le(ctx, stm));
+			break;
+		case DL_DEFAULT_COLORSPACES:
+			r->default_cs = fz_new_default_colorspaces(ctx);
+			{
+				fz_colorspace *gray = read_colorspace(ctx, r);
+				fz_colorspace *rgb = read_colorspace(ctx, r);
+				fz_colorspace *cmyk = read_colorspace(ctx, r);
+				fz_colorspace *oi = read_colorspace(ctx, r);
+				/* Setting the output intent also sets the defaults,
+				 * so it has to come first. */
+				if (oi)
+					fz_set_default_output_intent(ctx, r->default_cs, oi);
+				if (gray)
+					fz_set_default_gray(ctx, r->default_cs, gray);
+				if (rgb)
+					fz_set_default_rgb(ctx, r->default_cs, rgb);
+				if (cmyk)
+					fz_set_default_cmyk(ctx, r->default_cs, cmyk);
+			}
+			fz_set_default_colorspaces(ctx, dev, r->default_cs);
+			break;
+
+		case DL_BEGIN_LAYER:
+			name = read_string(ctx, stm);
+			fz_try(ctx)
+				fz_begin_layer(ctx, dev, name);
+			fz_always(ctx)
+				fz_free(ctx, name);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+			break;
+		case DL_END_LAYER:
+			fz_end_layer(ctx, dev);
+			break;
+
+		default:
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown record type %d in display list", op);
+		}
+		drop_scratch(ctx, r);
+	}
+}
+
+static fz_display_list *
+read_list(fz_context *ctx, list_reader *r, fz_rect mediabox)
+{
+	fz_display_list *list = fz_new_display_list(ctx, mediabox);
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		dev = fz_new_list_device(ctx, list);
+		read_body(ctx, r, dev);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	return list;
+}
+
+static void
+drop_table(fz_context *ctx, list_table *table, void (*drop)(fz_context *, void *))
+{
+	int i;
+	for (i = 0; i < table->len; i++)
+		drop(ctx, table->items[i]);
+	fz_free(ctx, table->items);
+}
+
+static void drop_colorspace_item(fz_context *ctx, void *p) { fz_drop_colorspace(ctx, p); }
+static void drop_buffer_item(fz_context *ctx, void *p) { fz_drop_buffer(ctx, p); }
+static void drop_font_item(fz_context *ctx, void *p) { fz_drop_font(ctx, p); }
+static void drop_image_item(fz_context *ctx, void *p) { fz_drop_image(ctx, p); }
+static void drop_shade_item(fz_context *ctx, void *p) { fz_drop_shade(ctx, p); }
+
+fz_display_list *
+fz_read_display_list(fz_context *ctx, fz_stream *stm)
+{
+	list_reader r = { 0 };
+	fz_display_list *list = NULL;
+	unsigned char magic[4];
+	int version;
+	fz_rect mediabox;
+
+	fz_var(list);
+
+	r.stm = stm;
+
+	fz_try(ctx)
+	{
+		if (fz_read(ctx, stm, magic, 4) != 4 || memcmp(magic, DL_MAGIC, 4))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "not a serialized display list");
+		version = fz_read_int32_le(ctx, stm);
+		if (version != DL_VERSION)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unsupported display list version %d", version);
+		mediabox = read_rect(ctx, stm);
+		list = read_list(ctx, &r, mediabox);
+	}
+	fz_always(ctx)
+	{
+		drop_scratch(ctx, &r);
+		drop_table(ctx, &r.shades, drop_shade_item);
+		drop_table(ctx, &r.images, drop_image_item);
+		drop_table(ctx, &r.fonts, drop_font_item);
+		drop_table(ctx, &r.font_data, drop_buffer_item);
+		drop_table(ctx, &r.colorspaces, drop_colorspace_item);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return list;
+}
+
+fz_display_list *
+fz_load_display_list(fz_context *ctx, const char *filename)
+{
+	fz_display_list *list = NULL;
+	fz_stream *stm = fz_open_file(ctx, filename);
+	fz_var(list);
+	fz_try(ctx)
+		list = fz_read_display_list(ctx, stm);
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return list;
+}
@@ -1,5 +1,7 @@
 #include "mupdf/fitz.h"
 
+#include "context-imp.h"
+
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
@@ -18,22 +20,152 @@
  * except the _no_throw family which instead silently returns NULL.
  */
 
+#if FZ_ENABLE_ALLOC_CACHE
+
+/*
+ * Small blocks are cached per context, so that the common case of
+ * allocating and freeing them does not need FZ_LOCK_ALLOC at all.
+ *
+ * Every block handed out carries a header giving its size class, or
+ * ALLOC_UNCACHED for blocks that are too large to cache (or that were
+ * allocated once the cache was shut down). The header is 16 bytes so
+ * that blocks keep the alignment that malloc gives them. While a block
+ * sits on a free list, its header holds the link to the next one.
+ *
+ * Blocks may be freed by a different context to the one that allocated
+ * them; they simply join the free list of the freeing context.
+ */
+
+#define ALLOC_HEADER 16
+#define ALLOC_UNCACHED ((size_t)-1)
+#define ALLOC_CACHE_MAX_SIZE 2048
+#define ALLOC_REFILL 16
+
+/*
+ * Size classes go up in steps of 16 bytes to 256, and then in quarter
+ * steps between powers of two up to 2048. Class sizes include the
+ * header.
+ */
+static size_t
+alloc_class_size(size_t c)
+{
+	if (c < 16)
+		return ((c + 1) << 4) + ALLOC_HEADER;
+	c -= 16;
+	return (256 << (c >> 2)) + ((c & 3) + 1) * (64 << (c >> 2)) + ALLOC_HEADER;
+}
+
+static int
+alloc_size_class(size_t size)
+{
+	int b = 8;
+	size--;
+	if (size < 256)
+		return (int)(size >> 4);
+	while (size >> (b + 1))
+		b++;
+	return 16 + (b - 8) * 4 + (int)(size >> (b - 2)) - 4;
+}
+
+static void
+report_alloc_cache_locked(fz_context *ctx)
+{
+	fz_alloc_cache *cache = &ctx->alloc_cache;
+
+	if (ctx->store && cache->bytes != cache->reported)
+	{
+		fz_store_account_alloc_cache_locked(ctx, cache->reported, cache->bytes);
+		cache->reported = cache->bytes;
+	}
+}
+
+/* Return all (or half) of the cached blocks to the allocator. */
+static int
+release_alloc_cache(fz_context *ctx, int all)
+{
+	fz_alloc_cache *cache = &ctx->alloc_cache;
+	size_t old_bytes = cache->bytes;
+	void *block;
+	int c, n;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (c = 0; c < FZ_ALLOC_CACHE_CLASSES; c++)
+	{
+		n = all ? cache->count[c] : (cache->count[c] + 1) / 2;
+		cache->count[c] -= n;
+		cache->bytes -= n * alloc_class_size(c);
+		while (n--)
+		{
+			block = cache->list[c];
+			cache->list[c] = *(void **)block;
+			ctx->alloc.free(ctx->alloc.user, block);
+		}
+	}
+	report_alloc_cache_locked(ctx);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return cache->bytes != old_bytes;
+}
+
+static int
+flush_alloc_cache(fz_context *ctx)
+{
+	return release_alloc_cache(ctx, 1);
+}
+
+void
+fz_init_alloc_cache(fz_context *ctx)
+{
+	memset(&ctx->alloc_cache, 0, sizeof(ctx->alloc_cache));
+	ctx->alloc_cache.enabled = 1;
+}
+
+void
+fz_drop_alloc_cache(fz_context *ctx)
+{
+	flush_alloc_cache(ctx);
+	ctx->alloc_cache.enabled = 0;
+}
+
+void
+fz_flush_alloc_cache(fz_context *ctx)
+{
+	if (ctx)
+		flush_alloc_cache(ctx);
+}
+
+#else
+
+static int
+flush_alloc_cache(fz_context *ctx)
+{
+	return 0;
+}
+
+void
+fz_flush_alloc_cache(fz_context *ctx)
+{
+}
+
+#endif /* FZ_ENABLE_ALLOC_CACHE */
+
 static void *
 do_scavenging_malloc(fz_context *ctx, size_t size)
 {
 	void *p;
 	int phase = 0;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* The store is protected by its own locks, which can't be taken
+	 * while we hold the alloc lock, so scavenge without it. Our own
+	 * cached blocks are the cheapest thing to give back, so they go
+	 * first. */
 	do {
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 		p = ctx->alloc.malloc(ctx->alloc.user, size);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		if (p != NULL)
-		{
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
 			return p;
-		}
-	} while (fz_store_scavenge(ctx, size, &phase));
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	} while (flush_alloc_cache(ctx) || fz_store_scavenge(ctx, size, &phase));
 
 	return NULL;
 }
@@ -44,27 +176,167 @@ do_scavenging_realloc(fz_context *ctx, void *p, size_t size)
 	void *q;
 	int phase = 0;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* The store is protected by its own locks, which can't be taken
+	 * while we hold the alloc lock, so scavenge without it. */
 	do {
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 		q = ctx->alloc.realloc(ctx->alloc.user, p, size);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		if (q != NULL)
-		{
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
 			return q;
+	} while (flush_alloc_cache(ctx) || fz_store_scavenge(ctx, size, &phase));
+
+	return NULL;
+}
+
+#if FZ_ENABLE_ALLOC_CACHE
+
+/* Allocate a block of class c, along with a batch of spares for the
+ * free list, for the price of a single lock. */
+static char *
+refill_alloc_cache(fz_context *ctx, int c)
+{
+	fz_alloc_cache *cache = &ctx->alloc_cache;
+	size_t size = alloc_class_size(c);
+	void *block, *spare;
+	int i;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	block = ctx->alloc.malloc(ctx->alloc.user, size);
+	if (block == NULL)
+	{
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		return do_scavenging_malloc(ctx, size);
+	}
+	for (i = 1; i < ALLOC_REFILL && cache->bytes + size <= FZ_ALLOC_CACHE_MAX; i++)
+	{
+		spare = ctx->alloc.malloc(ctx->alloc.user, size);
+		if (spare == NULL)
+			break;
+		*(void **)spare = cache->list[c];
+		cache->list[c] = spare;
+		cache->count[c]++;
+		cache->bytes += size;
+	}
+	report_alloc_cache_locked(ctx);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return block;
+}
+
+static void *
+do_malloc(fz_context *ctx, size_t size)
+{
+	fz_alloc_cache *cache = &ctx->alloc_cache;
+	char *block;
+
+	if (size <= ALLOC_CACHE_MAX_SIZE && cache->enabled)
+	{
+		int c = alloc_size_class(size);
+		block = cache->list[c];
+		if (block)
+		{
+			cache->list[c] = *(void **)block;
+			cache->count[c]--;
+			cache->bytes -= alloc_class_size(c);
+		}
+		else
+		{
+			block = refill_alloc_cache(ctx, c);
+			if (block == NULL)
+				return NULL;
 		}
-	} while (fz_store_scavenge(ctx, size, &phase));
+		*(size_t *)block = c;
+		return block + ALLOC_HEADER;
+	}
+
+	if (size > SIZE_MAX - ALLOC_HEADER)
+		return NULL;
+	block = do_scavenging_malloc(ctx, size + ALLOC_HEADER);
+	if (block == NULL)
+		return NULL;
+	*(size_t *)block = ALLOC_UNCACHED;
+	return block + ALLOC_HEADER;
+}
+
+static void
+do_free(fz_context *ctx, void *p)
+{
+	fz_alloc_cache *cache = &ctx->alloc_cache;
+	char *block = (char *)p - ALLOC_HEADER;
+	size_t c = *(size_t *)block;
+
+	if (c != ALLOC_UNCACHED && cache->enabled)
+	{
+		*(void **)block = cache->list[c];
+		cache->list[c] = block;
+		cache->count[c]++;
+		cache->bytes += alloc_class_size(c);
+		if (cache->bytes > FZ_ALLOC_CACHE_MAX)
+			release_alloc_cache(ctx, 0);
+		return;
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->alloc.free(ctx->alloc.user, block);
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
 
-	return NULL;
+static void *
+do_realloc(fz_context *ctx, void *p, size_t size)
+{
+	char *block, *q;
+	size_t c;
+
+	if (p == NULL)
+		return do_malloc(ctx, size);
+
+	block = (char *)p - ALLOC_HEADER;
+	c = *(size_t *)block;
+	if (c != ALLOC_UNCACHED)
+	{
+		/* Cached blocks can shrink in place, but must be copied
+		 * to grow. */
+		if (size <= alloc_class_size(c) - ALLOC_HEADER)
+			return p;
+		q = do_malloc(ctx, size);
+		if (q == NULL)
+			return NULL;
+		memcpy(q, p, alloc_class_size(c) - ALLOC_HEADER);
+		do_free(ctx, p);
+		return q;
+	}
+
+	if (size > SIZE_MAX - ALLOC_HEADER)
+		return NULL;
+	block = do_scavenging_realloc(ctx, block, size + ALLOC_HEADER);
+	if (block == NULL)
+		return NULL;
+	return block + ALLOC_HEADER;
+}
+
+#else
+
+#define do_malloc do_scavenging_malloc
+#define do_realloc do_scavenging_realloc
+
+static void
+do_free(fz_context *ctx, void *p)
+{
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->alloc.free(ctx->alloc.user, p);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
+#endif /* FZ_ENABLE_ALLOC_CACHE */
+
 void *
 fz_malloc(fz_context *ctx, size_t size)
 {
 	void *p;
 	if (size == 0)
 		return NULL;
-	p = do_scavenging_malloc(ctx, size);
+	p = do_malloc(ctx, size);
 	if (!p)
 		fz_throw(ctx, FZ_ERROR_MEMORY, "malloc of %zu bytes failed", size);
 	return p;
@@ -75,7 +347,7 @@ fz_malloc_no_throw(fz_context *ctx, size_t size)
 {
 	if (size == 0)
 		return NULL;
-	return do_scavenging_malloc(ctx, size);
+	return do_malloc(ctx, size);
 }
 
 void *
@@ -86,7 +358,7 @@ fz_calloc(fz_context *ctx, size_t count, size_t size)
 		return NULL;
 	if (count > SIZE_MAX / size)
 		fz_throw(ctx, FZ_ERROR_MEMORY, "calloc (%zu x %zu bytes) failed (size_t overflow)", count, size);
-	p = do_scavenging_malloc(ctx, count * size);
+	p = do_malloc(ctx, count * size);
 	if (!p)
 		fz_throw(ctx, FZ_ERROR_MEMORY, "calloc (%zu x %zu bytes) failed", count, size);
 	memset(p, 0, count*size);
@@ -101,7 +373,7 @@ fz_calloc_no_throw(fz_context *ctx, size_t count, size_t size)
 		return NULL;
 	if (count > SIZE_MAX / size)
 		return NULL;
-	p = do_scavenging_malloc(ctx, count * size);
+	p = do_malloc(ctx, count * size);
 	if (p)
 		memset(p, 0, count * size);
 	return p;
@@ -115,7 +387,7 @@ fz_realloc(fz_context *ctx, void *p, size_t size)
 		fz_free(ctx, p);
 		return NULL;
 	}
-	p = do_scavenging_realloc(ctx, p, size);
+	p = do_realloc(ctx, p, size);
 	if (!p)
 		fz_throw(ctx, FZ_ERROR_MEMORY, "realloc (%zu bytes) failed", size);
 	return p;
@@ -129,18 +401,14 @@ fz_realloc_no_throw(fz_context *ctx, void *p, size_t size)
 		fz_free(ctx, p);
 		return NULL;
 	}
-	return do_scavenging_realloc(ctx, p, size);
+	return do_realloc(ctx, p, size);
 }
 
 void
 fz_free(fz_context *ctx, void *p)
 {
 	if (p)
-	{
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		ctx->alloc.free(ctx->alloc.user, p);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-	}
+		do_free(ctx, p);
 }
 
 char *
@@ -955,6 +955,85 @@ fz_bound_path(fz_context *ctx, const fz_path *path, const fz_stroke_state *strok
 	return arg.rect;
 }
 
+typedef struct
+{
+	int n;
+	int bad;
+	fz_point p[5];
+} rect_walker;
+
+static void
+rect_walker_point(rect_walker *rw, float x, float y)
+{
+	if (rw->n == nelem(rw->p))
+		rw->bad = 1;
+	else
+		rw->p[rw->n++] = fz_make_point(x, y);
+}
+
+static void
+rect_walker_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+	rect_walker *rw = arg;
+	if (rw->n > 0)
+		rw->bad = 1;
+	rect_walker_point(rw, x, y);
+}
+
+static void
+rect_walker_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+	rect_walker_point(arg, x, y);
+}
+
+static void
+rect_walker_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	((rect_walker *)arg)->bad = 1;
+}
+
+static const fz_path_walker rect_walker_procs =
+{
+	rect_walker_moveto,
+	rect_walker_lineto,
+	rect_walker_curveto,
+	NULL
+};
+
+fz_rect
+fz_path_fill_rect(fz_context *ctx, const fz_path *path, fz_matrix ctm)
+{
+	rect_walker rw = { 0 };
+	fz_rect r = fz_empty_rect;
+	int i;
+
+	fz_walk_path(ctx, path, &rect_walker_procs, &rw);
+	if (rw.bad)
+		return fz_empty_rect;
+	if (rw.n == 5 && rw.p[4].x == rw.p[0].x && rw.p[4].y == rw.p[0].y)
+		rw.n = 4;
+	if (rw.n != 4)
+		return fz_empty_rect;
+
+	for (i = 0; i < 4; i++)
+	{
+		rw.p[i] = fz_transform_point(rw.p[i], ctm);
+		r = fz_include_point_in_rect(r, rw.p[i]);
+	}
+	/* Every point must be a corner, and each edge must run along
+	 * one axis. */
+	for (i = 0; i < 4; i++)
+	{
+		fz_point a = rw.p[i];
+		fz_point b = rw.p[(i + 1) & 3];
+		if ((a.x != r.x0 && a.x != r.x1) || (a.y != r.y0 && a.y != r.y1))
+			return fz_empty_rect;
+		if ((a.x == b.x) == (a.y == b.y))
+			return fz_empty_rect;
+	}
+	return r;
+}
+
 fz_rect
 fz_adjust_rect_for_stroke(fz_context *ctx, fz_rect r, const fz_stroke_state *stroke, fz_matrix ctm)
 {
@@ -1198,12 +1277,12 @@ fz_transform_path(fz_context *ctx, fz_path *path, fz_matrix ctm)
 				break;
 			}
 		}
-		if (path->cmd_len + extra_cmd < path->cmd_cap)
+		if (path->cmd_len + extra_cmd > path->cmd_cap)
 		{
 			path->cmds = fz_realloc_array(ctx, path->cmds, path->cmd_len + extra_cmd, unsigned char);
 			path->cmd_cap = path->cmd_len + extra_cmd;
 		}
-		if (path->coord_len + extra_coord < path->coord_cap)
+		if (path->coord_len + extra_coord > path->coord_cap)
 		{
 			path->coords = fz_realloc_array(ctx, path->coords, path->coord_len + extra_coord, float);
 			path->coord_cap = path->coord_len + extra_coord;
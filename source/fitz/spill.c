@@ -0,0 +1,606 @@
+#include "mupdf/fitz.h"
+
+#include "context-imp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+	The spill context is a second level cache, on disk, for items that
+	are expensive to regenerate. Each item is kept in a file of its own
+	in the spill directory, named by the digest that identifies its
+	contents. The files only last as long as the spill context (or until
+	spilling is turned off), and the total size of the files is kept
+	below a maximum by deleting the least recently used ones.
+
+	Items are not written when they are evicted from the store, as that
+	happens in the middle of someone else's fz_store_item. Instead they
+	are queued, and written later by fz_flush_image_spill. Items wanted
+	again while still queued are taken back off the queue, rather than
+	being written and read back. The queue holds no more than
+	SPILL_PENDING_MAX bytes, nor more than the store itself may; once
+	it is full, the oldest items are written as new ones are queued.
+
+	The index of what is on disk is protected by the alloc lock, so
+	nothing may be allocated while it is held (other than by the hash
+	table, which knows to drop the lock). No file operations are done
+	with the lock held either.
+*/
+
+#define SPILL_DIR_MAX 1024
+#define SPILL_PATH_MAX (SPILL_DIR_MAX + 64)
+#define SPILL_PENDING_MAX (16 << 20)
+
+typedef struct fz_spill_pending
+{
+	struct fz_spill_pending *next;
+	unsigned char digest[16];
+	size_t size;
+	fz_spill_fn *fn;
+	void *arg;
+} fz_spill_pending;
+
+typedef struct fz_spill_entry
+{
+	struct fz_spill_entry *prev;
+	struct fz_spill_entry *next;
+	unsigned char digest[16];
+	size_t size;
+	int ready;
+} fz_spill_entry;
+
+struct fz_spill_context
+{
+	int refs;
+
+	/* The directory to spill to, or empty if spilling is disabled. */
+	char dir[SPILL_DIR_MAX];
+
+	/* A random prefix for our file names, so that several processes
+	 * can safely share a spill directory. */
+	char prefix[17];
+
+	size_t max;
+	size_t size;
+
+	/* Every entry, ready or not, is in the index. Only entries whose
+	 * files have been completely written are in the LRU list, and only
+	 * those may be read or evicted. Pending entries belong to the
+	 * output that is writing them. */
+	fz_hash_table *index;
+	fz_spill_entry *head;
+	fz_spill_entry *tail;
+
+	/* Changes whenever spilling is turned on or off, so that writers
+	 * can tell whether their file is still wanted. */
+	int generation;
+
+	/* Items waiting to be written, oldest first. */
+	fz_spill_pending *pending;
+	fz_spill_pending *pending_tail;
+	size_t pending_size;
+};
+
+typedef struct
+{
+	fz_spill_context *spill;
+	fz_spill_entry *entry;
+	int generation;
+	FILE *file;
+	char path[SPILL_PATH_MAX];
+	size_t size;
+	int committed;
+} fz_spill_writer;
+
+static FILE *
+spill_fopen(const char *path, const char *mode)
+{
+#ifdef _WIN32
+	return fz_fopen_utf8(path, mode);
+#else
+	return fopen(path, mode);
+#endif
+}
+
+static void
+spill_remove(const char *path)
+{
+#ifdef _WIN32
+	(void)fz_remove_utf8(path);
+#else
+	(void)remove(path);
+#endif
+}
+
+static void
+spill_path(char *path, const char *dir, const char *prefix, const unsigned char digest[16])
+{
+	static const char hex[] = "0123456789abcdef";
+	char name[33];
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		name[2*i] = hex[digest[i] >> 4];
+		name[2*i+1] = hex[digest[i] & 15];
+	}
+	name[32] = 0;
+
+	fz_snprintf(path, SPILL_PATH_MAX, "%s/mupdf-%s-%s", dir, prefix, name);
+}
+
+static void
+unlink_entry(fz_spill_context *spill, fz_spill_entry *entry)
+{
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		spill->tail = entry->prev;
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		spill->head = entry->next;
+	entry->prev = entry->next = NULL;
+}
+
+static void
+link_entry(fz_spill_context *spill, fz_spill_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = spill->head;
+	if (spill->head)
+		spill->head->prev = entry;
+	else
+		spill->tail = entry;
+	spill->head = entry;
+}
+
+/*
+	Remove the least recently used entries until the spill is no larger
+	than max, and return them, chained through their next pointers, so
+	that their files can be deleted once the lock has been dropped.
+	Entered with the alloc lock held.
+*/
+static fz_spill_entry *
+trim_spill(fz_context *ctx, fz_spill_context *spill, size_t max)
+{
+	fz_spill_entry *entry, *victims = NULL;
+
+	while (spill->size > max && spill->tail)
+	{
+		entry = spill->tail;
+		unlink_entry(spill, entry);
+		fz_hash_remove(ctx, spill->index, entry->digest);
+		spill->size -= entry->size;
+		entry->next = victims;
+		victims = entry;
+	}
+
+	return victims;
+}
+
+/* Delete the files for a chain of entries, and free them. Entered with no
+ * locks held. */
+static void
+drop_victims(fz_context *ctx, const char *dir, const char *prefix, fz_spill_entry *victims)
+{
+	char path[SPILL_PATH_MAX];
+	fz_spill_entry *entry;
+
+	while (victims)
+	{
+		entry = victims;
+		victims = entry->next;
+		spill_path(path, dir, prefix, entry->digest);
+		spill_remove(path);
+		fz_free(ctx, entry);
+	}
+}
+
+/* Take the oldest pending items off the queue until there are no more
+ * than max bytes of them left, and return them. Entered with the alloc
+ * lock held. */
+static fz_spill_pending *
+take_pending(fz_spill_context *spill, size_t max)
+{
+	fz_spill_pending *taken = spill->pending, *last = NULL;
+
+	while (spill->pending && spill->pending_size > max)
+	{
+		last = spill->pending;
+		spill->pending_size -= last->size;
+		spill->pending = last->next;
+	}
+	if (last == NULL)
+		return NULL;
+	last->next = NULL;
+	if (spill->pending == NULL)
+		spill->pending_tail = NULL;
+	return taken;
+}
+
+/* Write (or just discard) a chain of pending items, and free them.
+ * Entered with no locks held. */
+static void
+run_pending(fz_context *ctx, fz_spill_pending *pending, int write)
+{
+	fz_spill_pending *item;
+
+	while (pending)
+	{
+		item = pending;
+		pending = item->next;
+		item->fn(ctx, item->arg, write);
+		fz_free(ctx, item);
+	}
+}
+
+void
+fz_new_spill_context(fz_context *ctx)
+{
+	fz_spill_context *spill = fz_malloc_struct(ctx, fz_spill_context);
+	unsigned char rnd[8];
+	int i;
+
+	fz_try(ctx)
+		spill->index = fz_new_hash_table(ctx, 256, 16, FZ_LOCK_ALLOC, NULL);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, spill);
+		fz_rethrow(ctx);
+	}
+
+	spill->refs = 1;
+	fz_memrnd(ctx, rnd, sizeof rnd);
+	for (i = 0; i < 8; i++)
+		fz_snprintf(spill->prefix + 2 * i, 3, "%02x", rnd[i]);
+	ctx->spill = spill;
+}
+
+fz_spill_context *
+fz_keep_spill_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->spill)
+		return NULL;
+	return fz_keep_imp(ctx, ctx->spill, &ctx->spill->refs);
+}
+
+void
+fz_drop_spill_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->spill)
+		return;
+	if (fz_drop_imp(ctx, ctx->spill, &ctx->spill->refs))
+	{
+		fz_set_image_spill(ctx, NULL, 0);
+		fz_drop_hash_table(ctx, ctx->spill->index);
+		fz_free(ctx, ctx->spill);
+		ctx->spill = NULL;
+	}
+}
+
+void
+fz_set_image_spill(fz_context *ctx, const char *dir, size_t max)
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_entry *victims;
+	fz_spill_pending *pending;
+	char old_dir[SPILL_DIR_MAX];
+
+	if (spill == NULL)
+		return;
+
+	if (dir && strlen(dir) >= SPILL_DIR_MAX)
+	{
+		fz_warn(ctx, "image spill directory name too long");
+		dir = NULL;
+	}
+
+	/* Forget all the files we have spilled so far, and the items
+	 * waiting to be. Files being written will be discarded by their
+	 * writers, who will notice the change of generation. */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_strlcpy(old_dir, spill->dir, sizeof old_dir);
+	victims = trim_spill(ctx, spill, 0);
+	pending = take_pending(spill, 0);
+	fz_strlcpy(spill->dir, dir ? dir : "", sizeof spill->dir);
+	spill->max = max;
+	spill->generation++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	drop_victims(ctx, old_dir, spill->prefix, victims);
+	run_pending(ctx, pending, 0);
+}
+
+void
+fz_defer_spill(fz_context *ctx, const unsigned char digest[16], size_t size, fz_spill_fn *fn, void *arg)
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_pending *item = NULL, *dropped = NULL, *overflow = NULL;
+	size_t max;
+
+	if (spill)
+		item = fz_malloc_no_throw(ctx, sizeof *item);
+	if (item == NULL)
+	{
+		fn(ctx, arg, 0);
+		return;
+	}
+	item->next = NULL;
+	memcpy(item->digest, digest, 16);
+	item->size = size;
+	item->fn = fn;
+	item->arg = arg;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (spill->dir[0])
+	{
+		if (spill->pending_tail)
+			spill->pending_tail->next = item;
+		else
+			spill->pending = item;
+		spill->pending_tail = item;
+		spill->pending_size += size;
+		max = fz_store_max_locked(ctx);
+		if (max == FZ_STORE_UNLIMITED || max > SPILL_PENDING_MAX)
+			max = SPILL_PENDING_MAX;
+		overflow = take_pending(spill, max);
+	}
+	else
+		dropped = item;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	run_pending(ctx, dropped, 0);
+	run_pending(ctx, overflow, 1);
+}
+
+void *
+fz_take_deferred_spill(fz_context *ctx, const unsigned char digest[16])
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_pending *item, *prev = NULL;
+	void *arg = NULL;
+
+	if (spill == NULL)
+		return NULL;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (item = spill->pending; item; prev = item, item = item->next)
+	{
+		if (memcmp(item->digest, digest, 16))
+			continue;
+		if (prev)
+			prev->next = item->next;
+		else
+			spill->pending = item->next;
+		if (spill->pending_tail == item)
+			spill->pending_tail = prev;
+		spill->pending_size -= item->size;
+		arg = item->arg;
+		break;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	fz_free(ctx, item);
+	return arg;
+}
+
+void
+fz_flush_image_spill(fz_context *ctx)
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_pending *pending;
+
+	if (spill == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	pending = take_pending(spill, 0);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	run_pending(ctx, pending, 1);
+}
+
+int
+fz_spill_enabled(fz_context *ctx)
+{
+	int enabled;
+
+	if (ctx->spill == NULL)
+		return 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	enabled = ctx->spill->dir[0] != 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return enabled;
+}
+
+static void
+spill_write(fz_context *ctx, void *opaque, const void *data, size_t n)
+{
+	fz_spill_writer *w = opaque;
+
+	if (fwrite(data, 1, n, w->file) < n)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write spill file: %s", strerror(errno));
+	w->size += n;
+}
+
+static void
+spill_close(fz_context *ctx, void *opaque)
+{
+	fz_spill_writer *w = opaque;
+	fz_spill_context *spill = w->spill;
+	fz_spill_entry *victims = NULL;
+	char dir[SPILL_DIR_MAX];
+	int n;
+
+	n = fclose(w->file);
+	w->file = NULL;
+	if (n != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot close spill file: %s", strerror(errno));
+
+	/* If spilling has been turned off (or on again) since we started,
+	 * or the file is too big to ever fit, we leave it uncommitted so
+	 * that the drop discards it. */
+	dir[0] = 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (spill->generation == w->generation && w->size <= spill->max)
+	{
+		w->entry->ready = 1;
+		w->entry->size = w->size;
+		spill->size += w->size;
+		link_entry(spill, w->entry);
+		w->committed = 1;
+		fz_strlcpy(dir, spill->dir, sizeof dir);
+		victims = trim_spill(ctx, spill, spill->max);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	drop_victims(ctx, dir, spill->prefix, victims);
+}
+
+static void
+spill_drop(fz_context *ctx, void *opaque)
+{
+	fz_spill_writer *w = opaque;
+	fz_spill_context *spill = w->spill;
+
+	if (w->file)
+		fclose(w->file);
+
+	if (!w->committed)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		fz_hash_remove(ctx, spill->index, w->entry->digest);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		spill_remove(w->path);
+		fz_free(ctx, w->entry);
+	}
+
+	fz_free(ctx, w);
+}
+
+fz_output *
+fz_new_spill_output(fz_context *ctx, const unsigned char digest[16])
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_entry *entry;
+	fz_spill_writer *w;
+	int reserved = 0;
+
+	if (spill == NULL)
+		return NULL;
+
+	w = fz_malloc_struct(ctx, fz_spill_writer);
+	fz_try(ctx)
+		entry = fz_malloc_struct(ctx, fz_spill_entry);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, w);
+		fz_rethrow(ctx);
+	}
+	memcpy(entry->digest, digest, 16);
+	w->spill = spill;
+	w->entry = entry;
+
+	/* Reserve the entry, unless someone else has beaten us to it. */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (spill->dir[0])
+	{
+		fz_try(ctx)
+			reserved = (fz_hash_insert(ctx, spill->index, digest, entry) == NULL);
+		fz_catch(ctx)
+			reserved = 0;
+		if (reserved)
+		{
+			w->generation = spill->generation;
+			spill_path(w->path, spill->dir, spill->prefix, digest);
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (!reserved)
+	{
+		fz_free(ctx, entry);
+		fz_free(ctx, w);
+		return NULL;
+	}
+
+	w->file = spill_fopen(w->path, "wb");
+	if (w->file == NULL)
+	{
+		fz_warn(ctx, "cannot create spill file '%s': %s", w->path, strerror(errno));
+		spill_drop(ctx, w);
+		return NULL;
+	}
+
+	return fz_new_output(ctx, 8192, w, spill_write, spill_close, spill_drop);
+}
+
+fz_stream *
+fz_open_spilled(fz_context *ctx, const unsigned char digest[16])
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_entry *entry;
+	fz_stream *stm = NULL;
+	char path[SPILL_PATH_MAX];
+	int found = 0;
+
+	if (spill == NULL)
+		return NULL;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (spill->dir[0])
+	{
+		entry = fz_hash_find(ctx, spill->index, digest);
+		if (entry && entry->ready)
+		{
+			unlink_entry(spill, entry);
+			link_entry(spill, entry);
+			spill_path(path, spill->dir, spill->prefix, digest);
+			found = 1;
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (!found)
+		return NULL;
+
+	fz_try(ctx)
+		stm = fz_open_file(ctx, path);
+	fz_catch(ctx)
+	{
+		/* Someone has tidied our file away from under us. */
+		fz_forget_spilled(ctx, digest);
+		return NULL;
+	}
+
+	return stm;
+}
+
+void
+fz_forget_spilled(fz_context *ctx, const unsigned char digest[16])
+{
+	fz_spill_context *spill = ctx->spill;
+	fz_spill_entry *entry;
+	char dir[SPILL_DIR_MAX];
+
+	if (spill == NULL)
+		return;
+
+	dir[0] = 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	entry = fz_hash_find(ctx, spill->index, digest);
+	if (entry && entry->ready)
+	{
+		unlink_entry(spill, entry);
+		fz_hash_remove(ctx, spill->index, digest);
+		spill->size -= entry->size;
+		fz_strlcpy(dir, spill->dir, sizeof dir);
+	}
+	else
+		entry = NULL;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	drop_victims(ctx, dir, spill->prefix, entry);
+}
@@ -1,5 +1,7 @@
 #include "mupdf/fitz.h"
 
+#include "context-imp.h"
+
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
@@ -14,14 +16,29 @@ typedef struct fz_item
 	struct fz_item *prev;
 	fz_store *store;
 	const fz_store_type *type;
+
+	/* Eviction policy state. */
+	unsigned int digest;
+	int frequent;
+	size_t cost;
+	double priority;
 } fz_item;
 
-/* Every entry in fz_store is protected by the alloc lock */
-struct fz_store
+/* A recently evicted item, remembered by the digest of its key. */
+typedef struct
 {
-	int refs;
+	unsigned int digest;
+	size_t size;
+} fz_store_ghost;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
+#define STORE_GHOSTS 64
+
+/* Each shard of the store is protected by its own lock. */
+typedef struct
+{
+	int lock;
+
+	/* Every item in the shard is kept in a doubly linked list, ordered
 	 * by usage (so LRU entries are at the end). */
 	fz_item *head;
 	fz_item *tail;
@@ -30,36 +47,90 @@ struct fz_store
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
 
+	/* The size of the items in this shard. */
+	size_t size;
+
+	int scavenging;
+
+	/* For FZ_STORE_ARC: the size of the items that have been used
+	 * more than once, the target size for those that have not, and
+	 * the items recently evicted from either set. */
+	size_t frequent_size;
+	size_t recent_target;
+	fz_store_ghost ghost[2][STORE_GHOSTS];
+	size_t ghost_size[2];
+	int ghost_pos[2];
+
+	/* For FZ_STORE_COST: the priority of the last item evicted. */
+	double inflation;
+
+	/* Statistics, kept per store type. */
+	const fz_store_type *stats_type[FZ_STORE_STATS_TYPES];
+	fz_store_type_stats stats[FZ_STORE_STATS_TYPES];
+} fz_store_shard;
+
+/*
+	The store is split into FZ_STORE_SHARDS shards, selected by the
+	hash of the key (or by the store type for keys that cannot be
+	hashed). The shards' contents are protected by the shards' locks.
+	The overall accounting (size, reaping state), and the reference
+	counts of the values, are protected by the alloc lock. A shard
+	lock may be held when taking the alloc lock, but never the other
+	way around, and we never hold two shard locks at once.
+*/
+struct fz_store
+{
+	int refs;
+
+	fz_store_shard shard[FZ_STORE_SHARDS];
+
 	/* We keep track of the size of the store, and keep it below max. */
 	size_t max;
 	size_t size;
 
+	/* Bytes held in the contexts' small block caches. Only reported;
+	 * they do not count against max. */
+	size_t alloc_cache;
+
 	int defer_reap_count;
 	int needs_reaping;
-	int scavenging;
+
+	/* The shard at which the next scavenge starts. */
+	int next_shard;
+
+	int policy;
+
+	int64_t reaps;
 };
 
 void
 fz_new_store_context(fz_context *ctx, size_t max)
 {
 	fz_store *store;
+	int i;
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC, NULL);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+		{
+			store->shard[i].lock = FZ_LOCK_STORE + i;
+			store->shard[i].hash = fz_new_hash_table(ctx, (4096 + FZ_STORE_SHARDS - 1) / FZ_STORE_SHARDS, sizeof(fz_store_hash), FZ_LOCK_STORE + i, NULL);
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_drop_hash_table(ctx, store->shard[i].hash);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
 	store->size = 0;
 	store->max = max;
 	store->defer_reap_count = 0;
 	store->needs_reaping = 0;
+	store->next_shard = 0;
+	store->policy = FZ_STORE_LRU;
 	ctx->store = store;
 }
 
@@ -78,82 +149,228 @@ void *fz_keep_key_storable(fz_context *ctx, const fz_key_storable *sc)
 	return fz_keep_storable(ctx, &sc->storable);
 }
 
+static unsigned int
+digest_key(const fz_store_hash *hash, int use_hash, const fz_store_type *type)
+{
+	unsigned int h = 2166136261u;
+	const unsigned char *p;
+	size_t i, n;
+
+	/* FNV-1a over the hash key, or over the type pointer for items
+	 * that have to be found by a linear search. */
+	if (use_hash)
+	{
+		p = (const unsigned char *)hash;
+		n = sizeof(*hash);
+	}
+	else
+	{
+		p = (const unsigned char *)&type;
+		n = sizeof(type);
+	}
+	for (i = 0; i < n; i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+static fz_store_shard *
+find_shard(fz_store *store, unsigned int digest)
+{
+	return &store->shard[digest % FZ_STORE_SHARDS];
+}
+
+/* Read the reference count of a stored value. Entered with the alloc lock
+ * held, which is enough to make this safe unless the counts are atomic. */
+static int
+val_refs(fz_storable *val)
+{
+#if FZ_ENABLE_ATOMIC_REFS
+	return FZ_ATOMIC_LOAD_REFS(int, &val->refs);
+#else
+	return val->refs;
+#endif
+}
+
+/* Unlink an item from its shard's list. Entered with the shard lock held. */
+static void
+unlink_item(fz_store_shard *shard, fz_item *item)
+{
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		shard->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		shard->head = item->next;
+}
+
+/* Remove an item from its shard's hash table. Entered with the shard lock held. */
+static void
+unhash_item(fz_context *ctx, fz_store_shard *shard, fz_item *item)
+{
+	if (item->type->make_hash_key)
+	{
+		fz_store_hash hash = { NULL };
+		hash.drop = item->val->drop;
+		if (item->type->make_hash_key(ctx, &hash, item->key))
+			fz_hash_remove(ctx, shard->hash, &hash);
+	}
+}
+
+/* Find the statistics for a type of item in a shard. Entered with the
+ * shard lock held. */
+static fz_store_type_stats *
+type_stats(fz_store_shard *shard, const fz_store_type *type)
+{
+	int i;
+
+	for (i = 0; i < FZ_STORE_STATS_TYPES - 1; i++)
+	{
+		if (shard->stats_type[i] == type)
+			return &shard->stats[i];
+		if (shard->stats_type[i] == NULL)
+		{
+			shard->stats_type[i] = type;
+			shard->stats[i].name = type->name;
+			return &shard->stats[i];
+		}
+	}
+
+	/* Too many types; lump the rest together. */
+	shard->stats[i].name = "(other)";
+	return &shard->stats[i];
+}
+
+/* Add the size of an item to its shard's accounting. Entered with the
+ * shard lock held. */
+static void
+account_shard_item(fz_store_shard *shard, fz_item *item)
+{
+	fz_store_type_stats *stats = type_stats(shard, item->type);
+
+	shard->size += item->size;
+	if (item->frequent)
+		shard->frequent_size += item->size;
+	stats->items++;
+	stats->size += item->size;
+}
+
+/* Remove the size of an item from its shard's accounting. Entered with the
+ * shard lock held. */
+static void
+unaccount_shard_item(fz_store_shard *shard, fz_item *item)
+{
+	fz_store_type_stats *stats = type_stats(shard, item->type);
+
+	shard->size -= item->size;
+	if (item->frequent)
+		shard->frequent_size -= item->size;
+	stats->items--;
+	stats->size -= item->size;
+}
+
+/* Remove the size of an item from the store accounting. Entered with the
+ * shard lock held. */
+static void
+unaccount_item(fz_context *ctx, fz_store_shard *shard, fz_item *item)
+{
+	unaccount_shard_item(shard, item);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->store->size -= item->size;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
 /*
-	Entered with FZ_LOCK_ALLOC held.
-	Drops FZ_LOCK_ALLOC.
+	Drop the store's reference to the value of an item that has been
+	removed from the store, and free the item. Items evicted to make
+	space for new ones are first offered to their type's evicted
+	function. Entered with no locks held.
+*/
+static void
+free_item(fz_context *ctx, fz_item *item, int evicted)
+{
+	if (evicted && item->type->evicted)
+		item->type->evicted(ctx, item->key, item->val);
+
+	if (fz_drop_imp(ctx, item->val, &item->val->refs))
+		item->val->drop(ctx, item->val);
+
+	/* Always drops the key and drop the item */
+	item->type->drop_key(ctx, item->key);
+	fz_free(ctx, item);
+}
+
+/*
+	Entered with no locks held.
 */
 static void
 do_reap(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
 	fz_item *item, *prev, *remove;
+	int i;
 
 	if (store == NULL)
-	{
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		return;
-	}
-
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
 
-	ctx->store->needs_reaping = 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->needs_reaping = 0;
+	store->reaps++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	FZ_LOG_DUMP_STORE(ctx, "Before reaping store:\n");
 
-	/* Reap the items */
-	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		prev = item->prev;
+		fz_store_shard *shard = &store->shard[i];
 
-		if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
-			continue;
+		/* We take the alloc lock too, so that the key reference
+		 * counts cannot change while we decide what to reap. */
+		fz_lock(ctx, shard->lock);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 
-		/* We have to drop it */
-		store->size -= item->size;
+		/* Reap the items */
+		remove = NULL;
+		for (item = shard->tail; item; item = prev)
+		{
+			prev = item->prev;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+			if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
+				continue;
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			/* We have to drop it */
+			unaccount_shard_item(shard, item);
+			type_stats(shard, item->type)->reaped++;
+			store->size -= item->size;
 
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+			unlink_item(shard, item);
+			unhash_item(ctx, shard, item);
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+			/* Store whether to drop this value or not in 'prev' */
+			item->prev = fz_drop_imp_locked(ctx, item->val, &item->val->refs) == 0 ? item : NULL;
 
-	/* Now drop the remove chain */
-	for (item = remove; item != NULL; item = remove)
-	{
-		remove = item->next;
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
+		}
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
+
+		/* Now drop the remove chain */
+		for (item = remove; item != NULL; item = remove)
+		{
+			remove = item->next;
 
-		/* Drop a reference to the value (freeing if required) */
-		if (item->prev)
-			item->val->drop(ctx, item->val);
+			/* Drop a reference to the value (freeing if required) */
+			if (item->prev)
+				item->val->drop(ctx, item->val);
 
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
+			/* Always drops the key and drop the item */
+			item->type->drop_key(ctx, item->key);
+			fz_free(ctx, item);
+		}
 	}
 	FZ_LOG_DUMP_STORE(ctx, "After reaping store:\n");
 }
@@ -163,35 +380,31 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_key_storable *s = (fz_key_storable *)sc;
-	int drop;
-	int unlock = 1;
+	int drop, num;
+	int reap = 0;
 
 	if (s == NULL)
 		return;
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	assert(s->storable.refs != 0);
-	if (s->storable.refs > 0)
+	num = fz_drop_imp_locked(ctx, s, &s->storable.refs);
+	if (num >= 0)
 	{
-		(void)Memento_dropRef(s);
-		drop = --s->storable.refs == 0;
-		if (!drop && s->storable.refs == s->store_key_refs)
+		drop = num == 0;
+		if (!drop && num == s->store_key_refs)
 		{
 			if (ctx->store->defer_reap_count > 0)
-			{
 				ctx->store->needs_reaping = 1;
-			}
 			else
-			{
-				do_reap(ctx);
-				unlock = 0;
-			}
+				reap = 1;
 		}
 	}
 	else
 		drop = 0;
-	if (unlock)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (reap)
+		do_reap(ctx);
 	/*
 		If we are dropping the last reference to an object, then
 		it cannot possibly be in the store (as the store always
@@ -213,12 +426,8 @@ void *fz_keep_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		return NULL;
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (s->storable.refs > 0)
-	{
-		(void)Memento_takeRef(s);
-		++s->storable.refs;
+	if (fz_keep_imp_locked(ctx, s, &s->storable.refs) > 0)
 		++s->store_key_refs;
-	}
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	return s;
 }
@@ -235,8 +444,7 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	assert(s->store_key_refs > 0 && s->storable.refs >= s->store_key_refs);
-	(void)Memento_dropRef(s);
-	drop = --s->storable.refs == 0;
+	drop = fz_drop_imp_locked(ctx, s, &s->storable.refs) == 0;
 	--s->store_key_refs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	/*
@@ -250,164 +458,442 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		s->storable.drop(ctx, &s->storable);
 }
 
+/*
+	The bookkeeping for all the eviction policies is kept up to date
+	whatever the policy in use, so that the policy can be changed at any
+	time. It is all protected by the shard lock.
+*/
+
+static double
+item_priority(fz_store_shard *shard, fz_item *item)
+{
+	return shard->inflation + (double)item->cost / (item->size ? item->size : 1);
+}
+
+static size_t
+recent_size(fz_store_shard *shard)
+{
+	return shard->size > shard->frequent_size ? shard->size - shard->frequent_size : 0;
+}
+
+/* Look for (and forget) a ghost of a new item. Returns the list it was
+ * found on (0 for items that had been used once, 1 for items that had
+ * been used more than once), or -1 if it was not found. */
+static int
+find_ghost(fz_store_shard *shard, unsigned int digest)
+{
+	int i, j;
+
+	if (digest == 0)
+		return -1;
+	for (i = 0; i < 2; i++)
+	{
+		for (j = 0; j < STORE_GHOSTS; j++)
+		{
+			fz_store_ghost *ghost = &shard->ghost[i][j];
+			if (ghost->digest == digest)
+			{
+				shard->ghost_size[i] -= ghost->size;
+				ghost->digest = 0;
+				ghost->size = 0;
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+static void
+add_ghost(fz_store_shard *shard, fz_item *item)
+{
+	int i = item->frequent;
+	fz_store_ghost *ghost = &shard->ghost[i][shard->ghost_pos[i]];
+
+	shard->ghost_pos[i] = (shard->ghost_pos[i] + 1) % STORE_GHOSTS;
+	shard->ghost_size[i] -= ghost->size;
+	ghost->digest = item->digest;
+	ghost->size = item->size;
+	shard->ghost_size[i] += item->size;
+}
+
+/* Called for a new item, before it is inserted into the shard. */
 static void
-evict(fz_context *ctx, fz_item *item)
+note_insert(fz_context *ctx, fz_store_shard *shard, fz_item *item)
 {
 	fz_store *store = ctx->store;
-	int drop;
+	size_t limit, delta;
+	int ghost;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
+	item->priority = item_priority(shard, item);
+
+	/* If we evicted this item recently, then we should have kept it.
+	 * Move the target balance of the shard towards the kind of item
+	 * that it was. Either way, it has now been used more than once. */
+	ghost = find_ghost(shard, item->digest);
+	if (ghost < 0)
+		return;
+	item->frequent = 1;
+
+	limit = store->max == FZ_STORE_UNLIMITED ? SIZE_MAX : store->max / FZ_STORE_SHARDS;
+	delta = item->size;
+	if (ghost == 0)
+	{
+		if (shard->ghost_size[0] && shard->ghost_size[1] > shard->ghost_size[0])
+			delta = fz_minz(limit, delta * (shard->ghost_size[1] / shard->ghost_size[0]));
+		shard->recent_target = limit - shard->recent_target > delta ? shard->recent_target + delta : limit;
+	}
 	else
-		store->head = item->next;
+	{
+		if (shard->ghost_size[1] && shard->ghost_size[0] > shard->ghost_size[1])
+			delta = fz_minz(limit, delta * (shard->ghost_size[0] / shard->ghost_size[1]));
+		shard->recent_target = shard->recent_target > delta ? shard->recent_target - delta : 0;
+	}
+}
+
+/* Called when an item is found in the store. Items found before they have
+ * been put into the list are not accounted for yet, so we leave the
+ * accounting to fz_store_item for those. */
+static void
+note_hit(fz_store_shard *shard, fz_item *item)
+{
+	item->priority = item_priority(shard, item);
+	if (!item->frequent)
+	{
+		item->frequent = 1;
+		if (item->next != item)
+			shard->frequent_size += item->size;
+	}
+}
+
+/* Called when an item is chosen for eviction (but not when it is removed
+ * for any other reason). */
+static void
+note_eviction(fz_store_shard *shard, fz_item *item)
+{
+	fz_store_type_stats *stats = type_stats(shard, item->type);
 
-	/* Drop a reference to the value (freeing if required) */
-	if (item->val->refs > 0)
-		(void)Memento_dropRef(item->val);
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
+	stats->evictions++;
+	stats->evicted_bytes += item->size;
 
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
+	if (item->priority > shard->inflation)
+		shard->inflation = item->priority;
+	if (item->digest)
+		add_ghost(shard, item);
+}
+
+/*
+	A search for items to evict from a shard, according to the store's
+	eviction policy. Only items held by nothing but the store may be
+	evicted. Successive victims are found by carrying on from where
+	the last search left off, rather than by searching the whole shard
+	again, so the items returned must be removed from the shard (and
+	no others) before asking for the next one. Both locks must be held
+	throughout, so that the list and the reference counts stay put.
+
+	LRU walks from the tail towards the head. ARC does the same, but
+	keeps the next candidate of each kind. COST picks the cheapest
+	items in batches, so that the shard is searched once per batch
+	rather than once per victim.
+*/
+
+#define VICTIM_BATCH 64
+
+typedef struct
+{
+	fz_item *next;
+	fz_item *kind[2];
+	int n, pos;
+	fz_item *batch[VICTIM_BATCH];
+} victim_search;
+
+static void
+start_victim_search(fz_context *ctx, fz_store_shard *shard, victim_search *search)
+{
+	fz_item *item;
+
+	search->next = shard->tail;
+	search->kind[0] = search->kind[1] = NULL;
+	search->n = search->pos = 0;
+
+	if (ctx->store->policy == FZ_STORE_ARC)
 	{
-		fz_store_hash hash = { NULL };
-		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
+		for (item = shard->tail; item && !(search->kind[0] && search->kind[1]); item = item->prev)
+			if (val_refs(item->val) == 1 && search->kind[item->frequent] == NULL)
+				search->kind[item->frequent] = item;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop)
-		item->val->drop(ctx, item->val);
+}
 
-	/* Always drops the key and drop the item */
-	item->type->drop_key(ctx, item->key);
-	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+/* The least recently used evictable item of the given kind, starting at
+ * 'from'. */
+static fz_item *
+next_of_kind(fz_item *from, int frequent)
+{
+	fz_item *item;
+
+	for (item = from; item; item = item->prev)
+		if (val_refs(item->val) == 1 && item->frequent == frequent)
+			return item;
+	return NULL;
 }
 
-static size_t
-ensure_space(fz_context *ctx, size_t tofree)
+/* Put an item at the top of a max-heap of n items ordered by priority,
+ * and move it down to where it belongs. */
+static void
+sift_down(fz_item **heap, int n, fz_item *item)
 {
-	fz_item *item, *prev;
-	size_t count;
-	fz_store *store = ctx->store;
-	fz_item *to_be_freed = NULL;
+	int i, k;
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; (k = 2 * i + 1) < n; i = k)
+	{
+		if (k + 1 < n && heap[k + 1]->priority > heap[k]->priority)
+			k++;
+		if (heap[k]->priority <= item->priority)
+			break;
+		heap[i] = heap[k];
+	}
+	heap[i] = item;
+}
+
+/* Fill the batch with the cheapest evictable items, cheapest first.
+ * The batch is kept as a max-heap while the shard is searched, and
+ * then sorted. */
+static void
+fill_victim_batch(fz_store_shard *shard, victim_search *search)
+{
+	fz_item **heap = search->batch;
+	fz_item *item, *tmp;
+	int n = 0, i;
 
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+	for (item = shard->tail; item; item = item->prev)
 	{
-		if (item->val->refs == 1)
+		if (val_refs(item->val) != 1)
+			continue;
+		if (n < VICTIM_BATCH)
 		{
-			count += item->size;
-			if (count >= tofree)
-				break;
+			/* Sift up. */
+			for (i = n++; i > 0 && heap[(i - 1) / 2]->priority < item->priority; i = (i - 1) / 2)
+				heap[i] = heap[(i - 1) / 2];
+			heap[i] = item;
 		}
+		else if (item->priority < heap[0]->priority)
+			sift_down(heap, n, item); /* Replaces the most expensive. */
 	}
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
+	/* Sort the heap in place. */
+	search->n = n;
+	while (n > 1)
 	{
-		return 0;
+		tmp = heap[--n];
+		heap[n] = heap[0];
+		sift_down(heap, n, tmp);
 	}
+	search->pos = 0;
+}
+
+static fz_item *
+next_victim(fz_context *ctx, fz_store_shard *shard, victim_search *search)
+{
+	fz_item *item;
+	int kind;
 
-	/* Now move all the items to be freed onto 'to_be_freed' */
-	count = 0;
-	for (item = store->tail; item; item = prev)
+	switch (ctx->store->policy)
 	{
-		prev = item->prev;
-		if (item->val->refs != 1)
-			continue;
+	default:
+	case FZ_STORE_LRU:
+		for (item = search->next; item; item = item->prev)
+			if (val_refs(item->val) == 1)
+				break;
+		if (item)
+			search->next = item->prev;
+		return item;
+
+	case FZ_STORE_ARC:
+		/* Evict the least recently used item that has only been used
+		 * once if there are more of those than we want. */
+		if (search->kind[0] && (search->kind[1] == NULL || recent_size(shard) > shard->recent_target))
+			kind = 0;
+		else
+			kind = 1;
+		item = search->kind[kind];
+		if (item)
+			search->kind[kind] = next_of_kind(item->prev, kind);
+		return item;
+
+	case FZ_STORE_COST:
+		/* Items are only removed as we return them, and their
+		 * priorities do not change meanwhile, so once a batch is
+		 * used up everything cheaper has gone. */
+		if (search->pos == search->n)
+			fill_victim_batch(shard, search);
+		if (search->pos == search->n)
+			return NULL;
+		return search->batch[search->pos++];
+	}
+}
+
+/*
+	Entered with the shard lock held. Drops the lock while freeing
+	the item, and retakes it before returning.
+*/
+static void
+evict(fz_context *ctx, fz_store_shard *shard, fz_item *item)
+{
+	unaccount_item(ctx, shard, item);
+	unlink_item(shard, item);
+	unhash_item(ctx, shard, item);
+	fz_unlock(ctx, shard->lock);
+	free_item(ctx, item, 0);
+	fz_lock(ctx, shard->lock);
+}
 
-		store->size -= item->size;
+/*
+	Take items that are held only by the shard, as chosen by the
+	eviction policy, out of the shard until at least tofree bytes have
+	been found. Returns them linked through their next pointers, ready
+	to be freed once the shard lock has been dropped. They have been
+	removed from both the store list and the hash table, so they can't
+	be 'found' by anyone else in the meantime. Entered with the shard
+	lock held.
+*/
+static fz_item *
+take_victims(fz_context *ctx, fz_store_shard *shard, size_t tofree, size_t *count)
+{
+	victim_search search;
+	fz_item *item;
+	fz_item *to_be_freed = NULL;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+	fz_assert_lock_held(ctx, shard->lock);
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+	/* The alloc lock keeps the reference counts stable while we
+	 * decide. */
+	*count = 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	start_victim_search(ctx, shard, &search);
+	while (*count < tofree && (item = next_victim(ctx, shard, &search)) != NULL)
+	{
+		note_eviction(shard, item);
+		unaccount_shard_item(shard, item);
+		ctx->store->size -= item->size;
+		unlink_item(shard, item);
+		unhash_item(ctx, shard, item);
 
 		/* Link into to_be_freed */
 		item->next = to_be_freed;
 		to_be_freed = item;
 
-		count += item->size;
-		if (count >= tofree)
-			break;
+		*count += item->size;
 	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return to_be_freed;
+}
+
+/*
+	Free a list of items taken by take_victims. Entered with the shard
+	lock held; drops it while freeing the items, and retakes it before
+	returning.
+*/
+static void
+free_victims(fz_context *ctx, fz_store_shard *shard, fz_item *to_be_freed, int evicted)
+{
+	fz_item *item;
 
-	/* Now we can safely drop the lock and free our pending items. These
-	 * have all been removed from both the store list, and the hash table,
-	 * so they can't be 'found' by anyone else in the meantime. */
+	if (to_be_freed == NULL)
+		return;
 
+	fz_unlock(ctx, shard->lock);
 	while (to_be_freed)
 	{
-		fz_item *item = to_be_freed;
-		int drop;
-
+		item = to_be_freed;
 		to_be_freed = to_be_freed->next;
+		free_item(ctx, item, evicted);
+	}
+	fz_lock(ctx, shard->lock);
+}
+
+/*
+	Evict items that are held only by the shard, as chosen by the
+	eviction policy, until at least tofree bytes have been released.
+	Entered with the shard lock held, and may drop and retake it.
+*/
+static size_t
+ensure_space_in_shard(fz_context *ctx, fz_store_shard *shard, size_t tofree)
+{
+	size_t count;
 
-		/* Drop a reference to the value (freeing if required) */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		drop = (item->val->refs > 0 && --item->val->refs == 0);
+	free_victims(ctx, shard, take_victims(ctx, shard, tofree, &count), 1);
 
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (drop)
-			item->val->drop(ctx, item->val);
+	return count;
+}
 
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+/*
+	Free at least tofree bytes from the store, starting with the given
+	shard. Entered with no locks held.
+*/
+static size_t
+ensure_space(fz_context *ctx, fz_store_shard *first, size_t tofree)
+{
+	fz_store *store = ctx->store;
+	size_t count = 0;
+	int i, n = first - store->shard;
+
+	for (i = 0; i < FZ_STORE_SHARDS && count < tofree; i++)
+	{
+		fz_store_shard *shard = &store->shard[(n + i) % FZ_STORE_SHARDS];
+		fz_lock(ctx, shard->lock);
+		count += ensure_space_in_shard(ctx, shard, tofree - count);
+		fz_unlock(ctx, shard->lock);
 	}
 
 	return count;
 }
 
+/*
+	Returns the number of bytes by which the store exceeds its
+	maximum size. Entered with the alloc lock held.
+*/
+static size_t
+store_excess(fz_store *store)
+{
+	if (store->max == FZ_STORE_UNLIMITED || store->size <= store->max)
+		return 0;
+	return store->size - store->max;
+}
+
+#if FZ_ENABLE_ALLOC_CACHE
+void
+fz_store_account_alloc_cache_locked(fz_context *ctx, size_t old_size, size_t new_size)
+{
+	fz_store *store = ctx->store;
+
+	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	store->alloc_cache += new_size;
+	store->alloc_cache -= old_size;
+}
+#endif
+
+size_t
+fz_store_max_locked(fz_context *ctx)
+{
+	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	return ctx->store ? ctx->store->max : FZ_STORE_UNLIMITED;
+}
+
 static void
-touch(fz_store *store, fz_item *item)
+touch(fz_store_shard *shard, fz_item *item)
 {
 	if (item->next != item)
 	{
 		/* Already in the list - unlink it */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		unlink_item(shard, item);
 	}
 	/* Now relink it at the start of the LRU chain */
-	item->next = store->head;
+	item->next = shard->head;
 	if (item->next)
 		item->next->prev = item;
 	else
-		store->tail = item;
-	store->head = item;
+		shard->tail = item;
+	shard->head = item;
 	item->prev = NULL;
 }
 
@@ -415,11 +901,14 @@ void *
 fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_store_type *type)
 {
 	fz_item *item = NULL;
-	size_t size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	unsigned int digest;
+	size_t excess, cost;
+	int reap;
 
 	if (!store)
 		return NULL;
@@ -438,9 +927,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		hash.drop = val->drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	digest = digest_key(&hash, use_hash, type);
+	shard = find_shard(store, digest);
+
+	cost = type->cost ? type->cost(ctx, key, val, itemsize) : itemsize;
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 
 	/* Fill out the item. To start with, we always set item->next == item
 	 * and item->prev == item. This is so that we can spot items that have
@@ -452,6 +945,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 	item->next = item;
 	item->prev = item;
 	item->type = type;
+	item->store = store;
+	item->cost = cost;
+
+	/* Only items that we can find by hash can be recognised when they
+	 * come back after being evicted. A digest of 0 means "none". */
+	item->digest = use_hash ? (digest ? digest : 1) : 0;
+	note_insert(ctx, shard, item);
 
 	/* If we can index it fast, put it into the hash table. This serves
 	 * to check whether we have one there already. */
@@ -462,13 +962,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		fz_try(ctx)
 		{
 			/* May drop and retake the lock */
-			existing = fz_hash_insert(ctx, store->hash, &hash, item);
+			existing = fz_hash_insert(ctx, shard->hash, &hash, item);
 		}
 		fz_catch(ctx)
 		{
 			/* Any error here means that item never made it into the
 			 * hash - so no one else can have a reference. */
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return NULL;
@@ -478,13 +978,10 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 			/* There was one there already! Take a new reference
 			 * to the existing one, and drop our current one. */
 			fz_warn(ctx, "found duplicate %s in the store", type->name);
-			touch(store, existing);
-			if (existing->val->refs > 0)
-			{
-				(void)Memento_takeRef(existing->val);
-				existing->val->refs++;
-			}
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			note_hit(shard, existing);
+			touch(shard, existing);
+			(void)fz_keep_imp(ctx, existing->val, &existing->val->refs);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return existing->val;
@@ -492,61 +989,54 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 	}
 
 	/* Now bump the ref */
-	if (val->refs > 0)
+	(void)fz_keep_imp(ctx, val, &val->refs);
+
+	/* Regardless of whether it's indexed, it goes into the linked list */
+	touch(shard, item);
+	account_shard_item(shard, item);
+	type_stats(shard, type)->inserts++;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->size += itemsize;
+	excess = store_excess(store);
+	reap = excess && store->needs_reaping;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	/* If we haven't got an infinite store, check for space within it.
+	 * We used to refuse to store items that did not fit, but that's
+	 * wrong. If we've already spent the memory to malloc it then not
+	 * putting it in the store just means that a resource used multiple
+	 * times will just be malloced again. Better to put it in the store,
+	 * have the store account for it, and for it to potentially be reused.
+	 * Our new item is held by the caller, so it cannot be evicted here;
+	 * when the caller drops its reference, it can then be dropped from
+	 * the store on the next attempt to store anything else. */
+	if (excess)
 	{
-		(void)Memento_takeRef(val);
-		val->refs++;
+		/* Evict from our own shard first, as that is the one we
+		 * already hold. */
+		excess -= fz_minz(excess, ensure_space_in_shard(ctx, shard, excess));
 	}
+	fz_unlock(ctx, shard->lock);
 
-	/* If we haven't got an infinite store, check for space within it */
-	if (store->max != FZ_STORE_UNLIMITED)
+	if (excess)
 	{
-		/* FIXME: Overflow? */
-		size = store->size + itemsize;
-		if (size > store->max)
-		{
-			FZ_LOG_STORE(ctx, "Store size exceeded: item=%zu, size=%zu, max=%zu\n",
-				itemsize, store->size, store->max);
-			while (size > store->max)
-			{
-				size_t saved;
-
-				/* First, do any outstanding reaping, even if defer_reap_count > 0 */
-				if (store->needs_reaping)
-				{
-					do_reap(ctx); /* Drops alloc lock */
-					fz_lock(ctx, FZ_LOCK_ALLOC);
-				}
-				size = store->size + itemsize;
-				if (size <= store->max)
-					break;
+		FZ_LOG_STORE(ctx, "Store size exceeded: item=%zu, excess=%zu, max=%zu\n",
+			itemsize, excess, store->max);
 
-				/* ensure_space may drop, then retake the lock */
-				saved = ensure_space(ctx, size - store->max);
-				size -= saved;
-				if (saved == 0)
-				{
-					/* Failed to free any space. */
-					/* We used to 'unstore' it here, but that's wrong.
-					 * If we've already spent the memory to malloc it
-					 * then not putting it in the store just means that
-					 * a resource used multiple times will just be malloced
-					 * again. Better to put it in the store, have the
-					 * store account for it, and for it to potentially be reused.
-					 * When the caller drops the reference to it, it can then
-					 * be dropped from the store on the next attempt to store
-					 * anything else. */
-					break;
-				}
-			}
-			FZ_LOG_DUMP_STORE(ctx, "After eviction:\n");
-		}
-	}
-	store->size += itemsize;
+		/* First, do any outstanding reaping, even if defer_reap_count > 0 */
+		if (reap)
+			do_reap(ctx);
 
-	/* Regardless of whether it's indexed, it goes into the linked list */
-	touch(store, item);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		excess = store_excess(store);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+		/* Then spill over into the other shards. */
+		if (excess)
+			(void)ensure_space(ctx, shard, excess);
+		FZ_LOG_DUMP_STORE(ctx, "After eviction:\n");
+	}
 
 	return NULL;
 }
@@ -556,8 +1046,10 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	fz_store_type_stats *stats;
 
 	if (!store)
 		return NULL;
@@ -570,39 +1062,42 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, digest_key(&hash, use_hash, type));
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 		{
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 		}
 	}
+	stats = type_stats(shard, type);
+	stats->lookups++;
 	if (item)
 	{
+		stats->hits++;
+
 		/* LRU the block. This also serves to ensure that any item
 		 * picked up from the hash before it has made it into the
 		 * linked list does not get whipped out again due to the
 		 * store being full. */
-		touch(store, item);
+		note_hit(shard, item);
+		touch(shard, item);
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-		{
-			(void)Memento_takeRef(item->val);
-			item->val->refs++;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		(void)fz_keep_imp(ctx, item->val, &item->val->refs);
+		fz_unlock(ctx, shard->lock);
 		return (void *)item->val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	stats->misses++;
+	fz_unlock(ctx, shard->lock);
 
 	return NULL;
 }
@@ -612,7 +1107,7 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
-	int dodrop;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
 
@@ -621,19 +1116,20 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, digest_key(&hash, use_hash, type));
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 	}
@@ -644,41 +1140,58 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 		 * such items by setting item->next == item. */
 		if (item->next != item)
 		{
-			if (item->next)
-				item->next->prev = item->prev;
-			else
-				store->tail = item->prev;
-			if (item->prev)
-				item->prev->next = item->next;
-			else
-				store->head = item->next;
+			unlink_item(shard, item);
+			unaccount_item(ctx, shard, item);
 		}
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (dodrop)
-			item->val->drop(ctx, item->val);
-		type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
+		fz_unlock(ctx, shard->lock);
+		free_item(ctx, item, 0);
 	}
 	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	int i;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Run through all the items in the store */
-	while (store->head)
-		evict(ctx, store->head); /* Drops then retakes lock */
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+		fz_lock(ctx, shard->lock);
+		while (shard->head)
+			evict(ctx, shard, shard->head); /* Drops then retakes lock */
+		fz_unlock(ctx, shard->lock);
+	}
+}
+
+void
+fz_set_store_policy(fz_context *ctx, int policy)
+{
+	if (ctx->store == NULL)
+		return;
+	if (policy < FZ_STORE_LRU || policy > FZ_STORE_COST)
+		policy = FZ_STORE_LRU;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->store->policy = policy;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+int
+fz_store_policy(fz_context *ctx)
+{
+	int policy;
+	if (ctx->store == NULL)
+		return FZ_STORE_LRU;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	policy = ctx->store->policy;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return policy;
 }
 
 fz_store *
@@ -692,80 +1205,213 @@ fz_keep_store_context(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
+	int i;
 	if (!ctx)
 		return;
 	if (fz_drop_imp(ctx, ctx->store, &ctx->store->refs))
 	{
 		fz_empty_store(ctx);
-		fz_drop_hash_table(ctx, ctx->store->hash);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_drop_hash_table(ctx, ctx->store->shard[i].hash);
 		fz_free(ctx, ctx->store);
 		ctx->store = NULL;
 	}
 }
 
+typedef struct
+{
+	fz_output *out;
+	fz_store_shard *shard;
+} fz_debug_store_state;
+
 static void
-fz_debug_store_item(fz_context *ctx, void *state, void *key_, int keylen, void *item_)
+fz_debug_store_item(fz_context *ctx, void *state_, void *key_, int keylen, void *item_)
 {
 	unsigned char *key = key_;
 	fz_item *item = item_;
 	int i;
 	char buf[256];
-	fz_output *out = (fz_output *)state;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_debug_store_state *state = (fz_debug_store_state *)state_;
+	fz_output *out = state->out;
+	fz_unlock(ctx, state->shard->lock);
 	item->type->format_key(ctx, buf, sizeof buf, item->key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, state->shard->lock);
 	fz_write_printf(ctx, out, "STORE\thash[");
 	for (i=0; i < keylen; ++i)
 		fz_write_printf(ctx, out,"%02x", key[i]);
 	fz_write_printf(ctx, out, "][refs=%d][size=%d] key=%s val=%p\n", item->val->refs, (int)item->size, buf, (void *)item->val);
 }
 
-static void
-fz_debug_store_locked(fz_context *ctx, fz_output *out)
+/* Entered with the shard lock held. */
+static size_t
+fz_debug_store_shard_locked(fz_context *ctx, fz_output *out, fz_store_shard *shard)
 {
 	fz_item *item, *next;
 	char buf[256];
-	fz_store *store = ctx->store;
 	size_t list_total = 0;
+	fz_debug_store_state state;
 
-	fz_write_printf(ctx, out, "STORE\t-- resource store contents --\n");
+	fz_write_printf(ctx, out, "STORE\t-- resource store shard %d contents --\n", shard->lock - FZ_LOCK_STORE);
 
-	for (item = store->head; item; item = next)
+	for (item = shard->head; item; item = next)
 	{
 		next = item->next;
 		if (next)
-		{
-			(void)Memento_takeRef(next->val);
-			next->val->refs++;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+			(void)fz_keep_imp(ctx, next->val, &next->val->refs);
+		fz_unlock(ctx, shard->lock);
 		item->type->format_key(ctx, buf, sizeof buf, item->key);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+		fz_lock(ctx, shard->lock);
 		fz_write_printf(ctx, out, "STORE\tstore[*][refs=%d][size=%d] key=%s val=%p\n",
 				item->val->refs, (int)item->size, buf, (void *)item->val);
 		list_total += item->size;
 		if (next)
-		{
-			(void)Memento_dropRef(next->val);
-			next->val->refs--;
-		}
+			(void)fz_drop_imp(ctx, next->val, &next->val->refs);
 	}
 
-	fz_write_printf(ctx, out, "STORE\t-- resource store hash contents --\n");
-	fz_hash_for_each(ctx, store->hash, out, fz_debug_store_item);
+	fz_write_printf(ctx, out, "STORE\t-- resource store shard %d hash contents --\n", shard->lock - FZ_LOCK_STORE);
+	state.out = out;
+	state.shard = shard;
+	fz_hash_for_each(ctx, shard->hash, &state, fz_debug_store_item);
+
+	return list_total;
+}
+
+void
+fz_debug_store(fz_context *ctx, fz_output *out)
+{
+	fz_store *store = ctx->store;
+	size_t list_total = 0;
+	int i;
+
+	fz_write_printf(ctx, out, "STORE\t-- resource store contents --\n");
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_lock(ctx, store->shard[i].lock);
+		list_total += fz_debug_store_shard_locked(ctx, out, &store->shard[i]);
+		fz_unlock(ctx, store->shard[i].lock);
+	}
 	fz_write_printf(ctx, out, "STORE\t-- end --\n");
 
 	fz_write_printf(ctx, out, "STORE\tmax=%zu, size=%zu, actual size=%zu\n", store->max, store->size, list_total);
+#if FZ_ENABLE_ALLOC_CACHE
+	fz_write_printf(ctx, out, "STORE\talloc cache=%zu\n", store->alloc_cache);
+#endif
+}
+
+static fz_store_type_stats *
+find_stats(fz_store_stats *stats, const char *name)
+{
+	int i;
+
+	for (i = 0; i < stats->num_types; i++)
+		if (!strcmp(stats->types[i].name, name))
+			return &stats->types[i];
+	if (stats->num_types == FZ_STORE_STATS_TYPES)
+	{
+		/* Too many types; lump the rest together. */
+		stats->types[i - 1].name = "(other)";
+		return &stats->types[i - 1];
+	}
+	stats->types[i].name = name;
+	return &stats->types[stats->num_types++];
 }
 
 void
-fz_debug_store(fz_context *ctx, fz_output *out)
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	fz_store *store = ctx->store;
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	if (store == NULL)
+		return;
+
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+		fz_lock(ctx, shard->lock);
+		for (j = 0; j < FZ_STORE_STATS_TYPES; j++)
+		{
+			fz_store_type_stats *src = &shard->stats[j];
+			fz_store_type_stats *dst;
+			if (src->name == NULL)
+				continue;
+			dst = find_stats(stats, src->name);
+			dst->lookups += src->lookups;
+			dst->hits += src->hits;
+			dst->misses += src->misses;
+			dst->inserts += src->inserts;
+			dst->evictions += src->evictions;
+			dst->evicted_bytes += src->evicted_bytes;
+			dst->reaped += src->reaped;
+			dst->items += src->items;
+			dst->size += src->size;
+		}
+		fz_unlock(ctx, shard->lock);
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	stats->max = store->max;
+	stats->size = store->size;
+	stats->reaps = store->reaps;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+void
+fz_reset_store_stats(fz_context *ctx)
 {
+	fz_store *store = ctx->store;
+	int i, j;
+
+	if (store == NULL)
+		return;
+
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+		fz_lock(ctx, shard->lock);
+		for (j = 0; j < FZ_STORE_STATS_TYPES; j++)
+		{
+			fz_store_type_stats *stats = &shard->stats[j];
+			stats->lookups = 0;
+			stats->hits = 0;
+			stats->misses = 0;
+			stats->inserts = 0;
+			stats->evictions = 0;
+			stats->evicted_bytes = 0;
+			stats->reaped = 0;
+		}
+		fz_unlock(ctx, shard->lock);
+	}
+
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_debug_store_locked(ctx, out);
+	store->reaps = 0;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
+void
+fz_print_store_stats(fz_context *ctx, fz_output *out)
+{
+	fz_store_stats stats;
+	int i;
+
+	fz_get_store_stats(ctx, &stats);
+
+	if (stats.max == FZ_STORE_UNLIMITED)
+		fz_write_printf(ctx, out, "store: max=unlimited size=%zu reaps=%ld\n", stats.size, stats.reaps);
+	else
+		fz_write_printf(ctx, out, "store: max=%zu size=%zu reaps=%ld\n", stats.max, stats.size, stats.reaps);
+	for (i = 0; i < stats.num_types; i++)
+	{
+		fz_store_type_stats *t = &stats.types[i];
+		fz_write_printf(ctx, out, "store: %s lookups=%ld hits=%ld (%ld%%) misses=%ld inserts=%ld evictions=%ld (%ld bytes) reaped=%ld items=%ld (%ld bytes)\n",
+			t->name, t->lookups, t->hits,
+			t->lookups ? t->hits * 100 / t->lookups : (int64_t)0,
+			t->misses, t->inserts, t->evictions, t->evicted_bytes,
+			t->reaped, t->items, t->size);
+	}
+}
+
 /*
 	Consider if we have blocks of the following sizes in the store, from oldest
 	to newest:
@@ -788,18 +1434,31 @@ fz_debug_store(fz_context *ctx, fz_output *out)
 	momentarily, which means we have to start the scan process all over again, so
 	we repeat. This guarantees we only evict a minimum of blocks, but does mean we
 	scan more blocks than we'd ideally like.
+
+	This is done a shard at a time; each shard is asked for what the previous ones
+	could not provide. Successive scavenges start at successive shards, so that
+	the burden of eviction is spread over the whole store.
+
+	This is how the LRU policy works; the other eviction policies choose
+	the blocks to evict for themselves, all in one go.
  */
-static int
-scavenge(fz_context *ctx, size_t tofree)
+static size_t
+scavenge_shard(fz_context *ctx, fz_store_shard *shard, size_t tofree)
 {
-	fz_store *store = ctx->store;
 	size_t freed = 0;
 	fz_item *item;
 
-	if (store->scavenging)
+	if (shard->scavenging)
 		return 0;
 
-	store->scavenging = 1;
+	shard->scavenging = 1;
+
+	if (ctx->store->policy != FZ_STORE_LRU)
+	{
+		free_victims(ctx, shard, take_victims(ctx, shard, tofree, &freed), 0);
+		shard->scavenging = 0;
+		return freed;
+	}
 
 	do
 	{
@@ -808,9 +1467,10 @@ scavenge(fz_context *ctx, size_t tofree)
 		size_t suffix_size = 0;
 		fz_item *largest = NULL;
 
-		for (item = store->tail; item; item = item->prev)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		for (item = shard->tail; item; item = item->prev)
 		{
-			if (item->val->refs == 1)
+			if (val_refs(item->val) == 1)
 			{
 				/* This one is evictable */
 				suffix_size += item->size;
@@ -820,24 +1480,50 @@ scavenge(fz_context *ctx, size_t tofree)
 					break;
 			}
 		}
+		if (largest)
+			note_eviction(shard, largest);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 		/* If there are no evictable blocks, we can't find anything to free. */
 		if (largest == NULL)
 			break;
 
 		/* Free largest. */
-		if (freed == 0) {
-			FZ_LOG_DUMP_STORE(ctx, "Before scavenge:\n");
-		}
 		freed += largest->size;
-		evict(ctx, largest); /* Drops then retakes lock */
+		evict(ctx, shard, largest); /* Drops then retakes lock */
 	}
 	while (freed < tofree);
 
+	shard->scavenging = 0;
+
+	return freed;
+}
+
+/* Entered with no locks held. */
+static int
+scavenge(fz_context *ctx, size_t tofree)
+{
+	fz_store *store = ctx->store;
+	size_t freed = 0;
+	int i, n;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	n = store->next_shard;
+	store->next_shard = (n + 1) % FZ_STORE_SHARDS;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	FZ_LOG_DUMP_STORE(ctx, "Before scavenge:\n");
+	for (i = 0; i < FZ_STORE_SHARDS && freed < tofree; i++)
+	{
+		fz_store_shard *shard = &store->shard[(n + i) % FZ_STORE_SHARDS];
+		fz_lock(ctx, shard->lock);
+		freed += scavenge_shard(ctx, shard, tofree - freed);
+		fz_unlock(ctx, shard->lock);
+	}
+
 	if (freed != 0) {
 		FZ_LOG_DUMP_STORE(ctx, "After scavenge:\n");
 	}
-	store->scavenging = 0;
 	/* Success is managing to evict any blocks */
 	return freed != 0;
 }
@@ -848,6 +1534,7 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_storable *s = (fz_storable *)sc;
+	size_t excess = 0;
 	int num;
 
 	if (s == NULL)
@@ -856,24 +1543,20 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Drop the ref, and leave num as being the number of
 	 * refs left (-1 meaning, "statically allocated"). */
-	if (s->refs > 0)
-	{
-		(void)Memento_dropIntRef(s);
-		num = --s->refs;
-	}
-	else
-		num = -1;
+	num = fz_drop_imp_locked(ctx, s, &s->refs);
 
 	/* If we have just 1 ref left, it's possible that
 	 * this ref is held by the store. If the store is
 	 * oversized, we ought to throw any such references
 	 * away to try to bring the store down to a "legal"
 	 * size. Run a scavenge to check for this case. */
-	if (ctx->store->max != FZ_STORE_UNLIMITED)
-		if (num == 1 && ctx->store->size > ctx->store->max)
-			scavenge(ctx, ctx->store->size - ctx->store->max);
+	if (num == 1)
+		excess = store_excess(ctx->store);
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
+	if (excess)
+		scavenge(ctx, excess);
+
 	/* If we have no references to an object left, then
 	 * it cannot possibly be in the store (as the store always
 	 * keeps a ref to everything in it, and doesn't drop via
@@ -886,19 +1569,13 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 
 int fz_store_scavenge_external(fz_context *ctx, size_t size, int *phase)
 {
-	int ret;
-
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	ret = fz_store_scavenge(ctx, size, phase);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-
-	return ret;
+	return fz_store_scavenge(ctx, size, phase);
 }
 
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 {
 	fz_store *store;
-	size_t max;
+	size_t max, store_size;
 
 	store = ctx->store;
 	if (store == NULL)
@@ -906,29 +1583,33 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 
 #ifdef DEBUG_SCAVENGING
 	fz_write_printf(ctx, fz_stdout(ctx), "Scavenging: store=%zu size=%zu phase=%d\n", store->size, size, *phase);
-	fz_debug_store_locked(ctx, fz_stdout(ctx));
+	fz_debug_store(ctx, fz_stdout(ctx));
 	Memento_stats();
 #endif
 	do
 	{
 		size_t tofree;
 
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		store_size = store->size;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+
 		/* Calculate 'max' as the maximum size of the store for this phase */
 		if (*phase >= 16)
 			max = 0;
 		else if (store->max != FZ_STORE_UNLIMITED)
 			max = store->max / 16 * (16 - *phase);
 		else
-			max = store->size / (16 - *phase) * (15 - *phase);
+			max = store_size / (16 - *phase) * (15 - *phase);
 		(*phase)++;
 
 		/* Slightly baroque calculations to avoid overflow */
-		if (size > SIZE_MAX - store->size)
+		if (size > SIZE_MAX - store_size)
 			tofree = SIZE_MAX - max;
-		else if (size + store->size > max)
+		else if (size + store_size > max)
 			continue;
 		else
-			tofree = size + store->size - max;
+			tofree = size + store_size - max;
 
 		if (scavenge(ctx, tofree))
 		{
@@ -968,11 +1649,14 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	fz_write_printf(ctx, fz_stdout(ctx), "fz_shrink_store: %zu\n", store->size/(1024*1024));
 #endif
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-
 	new_size = (size_t)(((uint64_t)store->size * percent) / 100);
 	if (store->size > new_size)
-		scavenge(ctx, store->size - new_size);
-
+	{
+		size_t tofree = store->size - new_size;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		scavenge(ctx, tofree);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
 	success = (store->size <= new_size) ? 1 : 0;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 #ifdef DEBUG_SCAVENGING
@@ -986,69 +1670,46 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const f
 {
 	fz_store *store;
 	fz_item *item, *prev, *remove;
+	int i;
 
 	store = ctx->store;
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-
-	/* Filter the items */
-	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		prev = item->prev;
-		if (item->type != type)
-			continue;
+		fz_store_shard *shard = &store->shard[i];
 
-		if (fn(ctx, arg, item->key) == 0)
-			continue;
-
-		/* We have to drop it */
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		fz_lock(ctx, shard->lock);
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
+		/* Filter the items */
+		remove = NULL;
+		for (item = shard->tail; item; item = prev)
 		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			prev = item->prev;
+			if (item->type != type)
+				continue;
 
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
-
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+			if (fn(ctx, arg, item->key) == 0)
+				continue;
 
-	/* Now drop the remove chain */
-	for (item = remove; item != NULL; item = remove)
-	{
-		remove = item->next;
+			/* We have to drop it */
+			unaccount_item(ctx, shard, item);
+			unlink_item(shard, item);
+			unhash_item(ctx, shard, item);
 
-		/* Drop a reference to the value (freeing if required) */
-		if (item->prev) /* See above for our abuse of prev here */
-			item->val->drop(ctx, item->val);
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
+		}
+		fz_unlock(ctx, shard->lock);
 
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
+		/* Now drop the remove chain */
+		for (item = remove; item != NULL; item = remove)
+		{
+			remove = item->next;
+			free_item(ctx, item, 0);
+		}
 	}
 }
 
@@ -1072,10 +1733,9 @@ void fz_defer_reap_end(fz_context *ctx)
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	--ctx->store->defer_reap_count;
 	reap = ctx->store->defer_reap_count == 0 && ctx->store->needs_reaping;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (reap)
-		do_reap(ctx); /* Drops FZ_LOCK_ALLOC */
-	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		do_reap(ctx);
 }
 
 #ifdef ENABLE_STORE_LOGGING
@@ -9,6 +9,13 @@
 #include <errno.h>
 #include <stdio.h>
 
+#if FZ_ENABLE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 int
 fz_file_exists(fz_context *ctx, const char *path)
 {
@@ -201,7 +208,7 @@ static void seek_buffer(fz_context *ctx, fz_stream *stm, int64_t offset, int whe
 		offset = 0;
 	if (offset > stm->pos)
 		offset = stm->pos;
-	stm->rp += (int)(offset - pos);
+	stm->rp += (ptrdiff_t)(offset - pos);
 }
 
 static void drop_buffer(fz_context *ctx, void *state_)
@@ -230,15 +237,85 @@ fz_open_buffer(fz_context *ctx, fz_buffer *buf)
 fz_stream *
 fz_open_memory(fz_context *ctx, const unsigned char *data, size_t len)
 {
+	fz_buffer *buf = fz_new_buffer_from_shared_data(ctx, data, len);
 	fz_stream *stm;
 
-	stm = fz_new_stream(ctx, NULL, next_buffer, NULL);
-	stm->seek = seek_buffer;
+	fz_try(ctx)
+		stm = fz_open_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
-	stm->rp = (unsigned char *)data;
-	stm->wp = (unsigned char *)data + len;
+	return stm;
+}
 
-	stm->pos = (int64_t)len;
+fz_buffer *
+fz_stream_buffer(fz_context *ctx, fz_stream *stm)
+{
+	if (stm->next == next_buffer && stm->drop == drop_buffer)
+		return stm->state;
+	return NULL;
+}
+
+/* Memory mapped file stream */
+
+#if FZ_ENABLE_MMAP
+
+static void drop_mmap(fz_context *ctx, unsigned char *data, size_t len)
+{
+	if (munmap(data, len) < 0)
+		fz_warn(ctx, "cannot unmap file: %s", strerror(errno));
+}
+
+fz_stream *
+fz_open_file_mmap(fz_context *ctx, const char *name)
+{
+	fz_buffer *buf;
+	fz_stream *stm;
+	struct stat info;
+	void *data;
+	size_t len;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open %s: %s", name, strerror(errno));
+
+	/* Only map regular files that fit in our address space. Anything
+	 * else (pipes, devices, empty files) is read through stdio. */
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 || (uint64_t)info.st_size > SIZE_MAX)
+	{
+		close(fd);
+		return fz_open_file(ctx, name);
+	}
+
+	/* The mapping is shared by every slice of the file, so it is
+	 * read-only; nothing may patch document data in place. */
+	len = (size_t)info.st_size;
+	data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return fz_open_file(ctx, name);
+
+	/* The whole file is one buffer, that slices can share. */
+	buf = fz_new_buffer_from_external_data(ctx, data, len, drop_mmap);
+	fz_try(ctx)
+		stm = fz_open_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
 	return stm;
 }
+
+#else
+
+fz_stream *
+fz_open_file_mmap(fz_context *ctx, const char *name)
+{
+	return fz_open_file(ctx, name);
+}
+
+#endif
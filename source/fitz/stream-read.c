@@ -59,6 +59,7 @@ fz_buffer *
 fz_read_best(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated)
 {
 	fz_buffer *buf = NULL;
+	fz_buffer *src;
 	int check_bomb = (initial > 0);
 	size_t n;
 
@@ -67,6 +68,23 @@ fz_read_best(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated)
 	if (truncated)
 		*truncated = 0;
 
+	/* A stream reading straight from a buffer can hand over the rest
+	 * of it as a slice, rather than copying it out a block at a time. */
+	src = fz_stream_buffer(ctx, stm);
+	if (src)
+	{
+		/* Leave anything the loop below would call a compression
+		 * bomb to that loop, so that it is reported (or truncated)
+		 * the same way whatever the stream reads from. */
+		n = stm->wp - stm->rp;
+		if (!check_bomb || n < MIN_BOMB || n / 200 <= initial)
+		{
+			buf = fz_new_buffer_slice(ctx, src, stm->rp - src->data, n);
+			stm->rp = stm->wp;
+			return buf;
+		}
+	}
+
 	fz_try(ctx)
 	{
 		if (initial < 1024)
@@ -1,6 +1,8 @@
 #include "mupdf/fitz.h"
+#include "pixmap-imp.h"
 
 #include <float.h>
+#include <string.h>
 
 fz_display_list *
 fz_new_display_list_from_page(fz_context *ctx, fz_page *page)
@@ -119,6 +121,220 @@ fz_new_pixmap_from_display_list_with_separations(fz_context *ctx, fz_display_lis
 	return pix;
 }
 
+/* The pixmap is drawn in strips of this many rows. Each job takes every
+ * jobs'th strip, so that busy and empty parts of the page are shared
+ * out. The strips don't depend on the number of jobs, so neither does
+ * the result. */
+#define STRIP_HEIGHT 64
+
+typedef struct
+{
+	int failed;
+	char message[256];
+} render_result;
+
+typedef struct
+{
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *pix;
+	int jobs;
+	int strips;
+	render_result *results;
+} render_job;
+
+static void
+render_strips(fz_context *ctx, void *arg, int index)
+{
+	render_job *job = arg;
+	fz_pixmap *strip = NULL;
+	fz_device *dev = NULL;
+	int h = job->pix->h;
+	int i;
+
+	fz_var(strip);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		for (i = index; i < job->strips; i += job->jobs)
+		{
+			fz_irect r;
+			r.x0 = job->pix->x;
+			r.x1 = job->pix->x + job->pix->w;
+			r.y0 = job->pix->y + i * STRIP_HEIGHT;
+			r.y1 = job->pix->y + fz_mini(h, (i + 1) * STRIP_HEIGHT);
+
+			strip = fz_new_pixmap_from_pixmap(ctx, job->pix, &r);
+			dev = fz_new_draw_device(ctx, fz_identity, strip);
+			fz_run_display_list(ctx, job->list, dev, job->ctm, fz_rect_from_irect(r), NULL);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+			fz_drop_pixmap(ctx, strip);
+			strip = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, strip);
+	}
+	fz_catch(ctx)
+	{
+		job->results[index].failed = 1;
+		fz_strlcpy(job->results[index].message, fz_caught_message(ctx), sizeof job->results[index].message);
+	}
+}
+
+void
+fz_render_display_list_parallel(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, int jobs, fz_tune_parallel_fn *parallel, void *arg)
+{
+	render_job job;
+	int i;
+
+	if (pix->w <= 0 || pix->h <= 0)
+		return;
+	job.strips = (pix->h + STRIP_HEIGHT - 1) / STRIP_HEIGHT;
+	jobs = fz_clampi(jobs, 1, job.strips);
+
+	job.list = list;
+	job.ctm = ctm;
+	job.pix = pix;
+	job.jobs = jobs;
+	job.results = fz_calloc(ctx, jobs, sizeof *job.results);
+
+	if (parallel && jobs > 1)
+		parallel(arg, ctx, jobs, render_strips, &job);
+	else
+		for (i = 0; i < jobs; i++)
+			render_strips(ctx, &job, i);
+
+	for (i = 0; i < jobs; i++)
+	{
+		if (job.results[i].failed)
+		{
+			char message[sizeof job.results[i].message];
+			fz_strlcpy(message, job.results[i].message, sizeof message);
+			fz_free(ctx, job.results);
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot render display list: %s", message);
+		}
+	}
+	fz_free(ctx, job.results);
+}
+
+/* The full quality pass of a progressive render replaces the preview
+ * in bands of this many rows. */
+#define PROGRESSIVE_BAND_HEIGHT (4 * STRIP_HEIGHT)
+
+/* Is every pixel of the pixmap the same as the first? */
+static int
+is_uniform_pixmap(fz_pixmap *pix)
+{
+	unsigned char *s = pix->samples;
+	size_t w = (size_t)pix->w * pix->n;
+	size_t i;
+	int y;
+
+	for (y = 0; y < pix->h; y++)
+	{
+		for (i = 0; i < w; i++)
+			if (s[i] != pix->samples[i % pix->n])
+				return 0;
+		s += pix->stride;
+	}
+	return 1;
+}
+
+static void
+fill_pixmap_with_pixel(fz_pixmap *pix, const unsigned char *pixel)
+{
+	unsigned char *s = pix->samples;
+	int x, y;
+
+	for (y = 0; y < pix->h; y++)
+	{
+		for (x = 0; x < pix->w; x++)
+			memcpy(s + x * pix->n, pixel, pix->n);
+		s += pix->stride;
+	}
+}
+
+void
+fz_render_display_list_progressive(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, float greek, fz_cookie *cookie, fz_progressive_fn *fn, void *arg)
+{
+	unsigned char pixel[FZ_MAX_COLORS];
+	fz_pixmap *full = NULL;
+	fz_pixmap *band = NULL;
+	fz_device *dev = NULL;
+	fz_irect area = fz_pixmap_bbox(ctx, pix);
+	fz_irect r;
+	int uniform;
+
+	if (fz_is_empty_irect(area))
+		return;
+
+	fz_var(full);
+	fz_var(band);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		/* The bands are drawn over the background, which the preview
+		 * is about to cover. A plain background (the usual case) is
+		 * remembered as a single pixel; anything else is kept in a
+		 * copy of the whole pixmap. */
+		uniform = is_uniform_pixmap(pix);
+		if (uniform)
+			memcpy(pixel, pix->samples, pix->n);
+		else
+			full = fz_clone_pixmap(ctx, pix);
+
+		dev = fz_new_draw_device_preview(ctx, fz_identity, pix, greek);
+		fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(area), cookie);
+		fz_close_device(ctx, dev);
+		fz_drop_device(ctx, dev);
+		dev = NULL;
+		if (cookie && cookie->abort)
+			break;
+		if (fn)
+			fn(ctx, arg, area, 1);
+
+		r = area;
+		for (r.y0 = area.y0; r.y0 < area.y1; r.y0 = r.y1)
+		{
+			r.y1 = fz_mini(area.y1, r.y0 + PROGRESSIVE_BAND_HEIGHT);
+			if (uniform)
+			{
+				band = fz_new_pixmap_with_bbox(ctx, pix->colorspace, r, pix->seps, pix->alpha);
+				fill_pixmap_with_pixel(band, pixel);
+			}
+			else
+				band = fz_new_pixmap_from_pixmap(ctx, full, &r);
+			dev = fz_new_draw_device(ctx, fz_identity, band);
+			fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(r), cookie);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+			if (cookie && cookie->abort)
+				break;
+			fz_copy_pixmap_rect(ctx, pix, band, r, NULL);
+			fz_drop_pixmap(ctx, band);
+			band = NULL;
+			if (fn)
+				fn(ctx, arg, r, 0);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, band);
+		fz_drop_pixmap(ctx, full);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 fz_pixmap *
 fz_new_pixmap_from_page_contents(fz_context *ctx, fz_page *page, fz_matrix ctm, fz_colorspace *cs, int alpha)
 {
@@ -139,68 +139,64 @@ static const char *prev_period(const char *start, const char *p)
 	return NULL;
 }
 
-fz_document_writer *
-fz_new_document_writer(fz_context *ctx, const char *path, const char *explicit_format, const char *options)
+/*
+	The formats fz_new_document_writer knows, by file name extension,
+	with the name each is resolved to, and whether
+	fz_new_document_writer_with_output can write it (the others write
+	a file per page, or need a path of their own).
+*/
+static const struct
+{
+	const char *ext;
+	const char *format;
+	int with_output;
+} writer_formats[] =
+{
+	{ "ocr", "ocr", 1 },
+#if FZ_ENABLE_PDF
+	{ "pdf", "pdf", 1 },
+#endif
+	{ "cbz", "cbz", 1 },
+	{ "svg", "svg", 0 },
+	{ "png", "png", 0 },
+	{ "pam", "pam", 0 },
+	{ "pnm", "pnm", 0 },
+	{ "pgm", "pgm", 0 },
+	{ "ppm", "ppm", 0 },
+	{ "pbm", "pbm", 0 },
+	{ "pkm", "pkm", 0 },
+	{ "pcl", "pcl", 1 },
+	{ "pclm", "pclm", 1 },
+	{ "ps", "ps", 1 },
+	{ "pwg", "pwg", 1 },
+	{ "txt", "text", 1 },
+	{ "text", "text", 1 },
+	{ "html", "html", 1 },
+	{ "xhtml", "xhtml", 1 },
+	{ "stext", "stext.xml", 1 },
+	{ "stext.xml", "stext.xml", 1 },
+	{ "stext.json", "stext.json", 1 },
+	{ "docx", "docx", 0 },
+};
+
+const char *
+fz_resolve_document_writer_format(fz_context *ctx, const char *path, const char *explicit_format, int *with_output)
 {
 	const char *format = explicit_format;
-	if (!format)
+	int i;
+
+	if (!format && path)
 		format = strrchr(path, '.');
 	while (format)
 	{
-		if (is_extension(format, "ocr"))
-			return fz_new_pdfocr_writer(ctx, path, options);
-#if FZ_ENABLE_PDF
-		if (is_extension(format, "pdf"))
-			return fz_new_pdf_writer(ctx, path, options);
-#endif
-
-		if (is_extension(format, "cbz"))
-			return fz_new_cbz_writer(ctx, path, options);
-
-		if (is_extension(format, "svg"))
-			return fz_new_svg_writer(ctx, path, options);
-
-		if (is_extension(format, "png"))
-			return fz_new_png_pixmap_writer(ctx, path, options);
-		if (is_extension(format, "pam"))
-			return fz_new_pam_pixmap_writer(ctx, path, options);
-		if (is_extension(format, "pnm"))
-			return fz_new_pnm_pixmap_writer(ctx, path, options);
-		if (is_extension(format, "pgm"))
-			return fz_new_pgm_pixmap_writer(ctx, path, options);
-		if (is_extension(format, "ppm"))
-			return fz_new_ppm_pixmap_writer(ctx, path, options);
-		if (is_extension(format, "pbm"))
-			return fz_new_pbm_pixmap_writer(ctx, path, options);
-		if (is_extension(format, "pkm"))
-			return fz_new_pkm_pixmap_writer(ctx, path, options);
-
-		if (is_extension(format, "pcl"))
-			return fz_new_pcl_writer(ctx, path, options);
-		if (is_extension(format, "pclm"))
-			return fz_new_pclm_writer(ctx, path, options);
-		if (is_extension(format, "ps"))
-			return fz_new_ps_writer(ctx, path, options);
-		if (is_extension(format, "pwg"))
-			return fz_new_pwg_writer(ctx, path, options);
-
-		if (is_extension(format, "txt") || is_extension(format, "text"))
-			return fz_new_text_writer(ctx, "text", path, options);
-		if (is_extension(format, "html"))
-			return fz_new_text_writer(ctx, "html", path, options);
-		if (is_extension(format, "xhtml"))
-			return fz_new_text_writer(ctx, "xhtml", path, options);
-		if (is_extension(format, "stext") || is_extension(format, "stext.xml"))
-			return fz_new_text_writer(ctx, "stext.xml", path, options);
-		if (is_extension(format, "stext.json"))
-			return fz_new_text_writer(ctx, "stext.json", path, options);
-		if (is_extension(format, "docx"))
+		for (i = 0; i < (int)nelem(writer_formats); i++)
 		{
-#ifdef HAVE_EXTRACT
-			return fz_new_docx_writer(ctx, format, path, options);
-#else
-			fz_throw(ctx, FZ_ERROR_GENERIC, "docx output not available in this build.");
-#endif
+			if (is_extension(format, writer_formats[i].ext))
+			{
+				if (with_output)
+					*with_output = writer_formats[i].with_output;
+				return writer_formats[i].format;
+			}
 		}
 
 		if (format != explicit_format)
@@ -208,42 +204,90 @@ fz_new_document_writer(fz_context *ctx, const char *path, const char *explicit_f
 		else
 			format = NULL;
 	}
+	if (explicit_format)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown output document format: %s", explicit_format);
 	fz_throw(ctx, FZ_ERROR_GENERIC, "cannot detect document format");
 }
 
 fz_document_writer *
-fz_new_document_writer_with_output(fz_context *ctx, fz_output *out, const char *format, const char *options)
+fz_new_document_writer(fz_context *ctx, const char *path, const char *explicit_format, const char *options)
 {
-	if (is_extension(format, "cbz"))
+	const char *format = fz_resolve_document_writer_format(ctx, path, explicit_format, NULL);
+
+	if (!strcmp(format, "ocr"))
+		return fz_new_pdfocr_writer(ctx, path, options);
+#if FZ_ENABLE_PDF
+	if (!strcmp(format, "pdf"))
+		return fz_new_pdf_writer(ctx, path, options);
+#endif
+
+	if (!strcmp(format, "cbz"))
+		return fz_new_cbz_writer(ctx, path, options);
+
+	if (!strcmp(format, "svg"))
+		return fz_new_svg_writer(ctx, path, options);
+
+	if (!strcmp(format, "png"))
+		return fz_new_png_pixmap_writer(ctx, path, options);
+	if (!strcmp(format, "pam"))
+		return fz_new_pam_pixmap_writer(ctx, path, options);
+	if (!strcmp(format, "pnm"))
+		return fz_new_pnm_pixmap_writer(ctx, path, options);
+	if (!strcmp(format, "pgm"))
+		return fz_new_pgm_pixmap_writer(ctx, path, options);
+	if (!strcmp(format, "ppm"))
+		return fz_new_ppm_pixmap_writer(ctx, path, options);
+	if (!strcmp(format, "pbm"))
+		return fz_new_pbm_pixmap_writer(ctx, path, options);
+	if (!strcmp(format, "pkm"))
+		return fz_new_pkm_pixmap_writer(ctx, path, options);
+
+	if (!strcmp(format, "pcl"))
+		return fz_new_pcl_writer(ctx, path, options);
+	if (!strcmp(format, "pclm"))
+		return fz_new_pclm_writer(ctx, path, options);
+	if (!strcmp(format, "ps"))
+		return fz_new_ps_writer(ctx, path, options);
+	if (!strcmp(format, "pwg"))
+		return fz_new_pwg_writer(ctx, path, options);
+
+	if (!strcmp(format, "text") || !strcmp(format, "html") || !strcmp(format, "xhtml") ||
+		!strcmp(format, "stext.xml") || !strcmp(format, "stext.json"))
+		return fz_new_text_writer(ctx, format, path, options);
+
+	/* docx is all that is left. */
+	return fz_new_docx_writer(ctx, format, path, options);
+}
+
+fz_document_writer *
+fz_new_document_writer_with_output(fz_context *ctx, fz_output *out, const char *explicit_format, const char *options)
+{
+	int with_output;
+	const char *format = fz_resolve_document_writer_format(ctx, NULL, explicit_format, &with_output);
+
+	if (!with_output)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown output document format: %s", explicit_format);
+
+	if (!strcmp(format, "cbz"))
 		return fz_new_cbz_writer_with_output(ctx, out, options);
-	if (is_extension(format, "ocr"))
+	if (!strcmp(format, "ocr"))
 		return fz_new_pdfocr_writer_with_output(ctx, out, options);
 #if FZ_ENABLE_PDF
-	if (is_extension(format, "pdf"))
+	if (!strcmp(format, "pdf"))
 		return fz_new_pdf_writer_with_output(ctx, out, options);
 #endif
 
-	if (is_extension(format, "pcl"))
+	if (!strcmp(format, "pcl"))
 		return fz_new_pcl_writer_with_output(ctx, out, options);
-	if (is_extension(format, "pclm"))
+	if (!strcmp(format, "pclm"))
 		return fz_new_pclm_writer_with_output(ctx, out, options);
-	if (is_extension(format, "ps"))
+	if (!strcmp(format, "ps"))
 		return fz_new_ps_writer_with_output(ctx, out, options);
-	if (is_extension(format, "pwg"))
+	if (!strcmp(format, "pwg"))
 		return fz_new_pwg_writer_with_output(ctx, out, options);
 
-	if (is_extension(format, "txt") || is_extension(format, "text"))
-		return fz_new_text_writer_with_output(ctx, "text", out, options);
-	if (is_extension(format, "html"))
-		return fz_new_text_writer_with_output(ctx, "html", out, options);
-	if (is_extension(format, "xhtml"))
-		return fz_new_text_writer_with_output(ctx, "xhtml", out, options);
-	if (is_extension(format, "stext") || is_extension(format, "stext.xml"))
-		return fz_new_text_writer_with_output(ctx, "stext.xml", out, options);
-	if (is_extension(format, "stext.json"))
-		return fz_new_text_writer_with_output(ctx, "stext.json", out, options);
-
-	fz_throw(ctx, FZ_ERROR_GENERIC, "unknown output document format: %s", format);
+	/* The text formats are all that is left. */
+	return fz_new_text_writer_with_output(ctx, format, out, options);
 }
 
 void
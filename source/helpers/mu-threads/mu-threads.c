@@ -1,9 +1,11 @@
+#include "mupdf/fitz.h"
 #include "mupdf/helpers/mu-threads.h"
 
-#ifdef DISABLE_MUTHREADS
-
+#include <string.h>
 #include <stdlib.h>
 
+#ifdef DISABLE_MUTHREADS
+
 /* Null implementation. Just error out. */
 
 int mu_create_semaphore(mu_semaphore *sem)
@@ -277,3 +279,451 @@ void mu_unlock_mutex(mu_mutex *mutex)
 #else
 #error Unknown MU_THREAD_IMPL_TYPE setting
 #endif
+
+/* Locking contexts, built on the primitives above. */
+
+typedef struct
+{
+	fz_locks_context locks;
+	mu_mutex mutexes[FZ_LOCK_MAX];
+} mu_locks;
+
+static void
+mu_locks_lock(void *user, int lock)
+{
+	mu_locks *l = user;
+	mu_lock_mutex(&l->mutexes[lock]);
+}
+
+static void
+mu_locks_unlock(void *user, int lock)
+{
+	mu_locks *l = user;
+	mu_unlock_mutex(&l->mutexes[lock]);
+}
+
+fz_locks_context *
+mu_new_locks(void)
+{
+	mu_locks *l;
+	int i;
+	int failed = 0;
+
+	l = calloc(1, sizeof *l);
+	if (!l)
+		return NULL;
+
+	l->locks.user = l;
+	l->locks.lock = mu_locks_lock;
+	l->locks.unlock = mu_locks_unlock;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		failed |= mu_create_mutex(&l->mutexes[i]);
+
+	if (failed)
+	{
+		mu_drop_locks(&l->locks);
+		return NULL;
+	}
+
+	return &l->locks;
+}
+
+void
+mu_drop_locks(fz_locks_context *locks)
+{
+	mu_locks *l;
+	int i;
+
+	if (!locks)
+		return;
+
+	l = locks->user;
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		mu_destroy_mutex(&l->mutexes[i]);
+	free(l);
+}
+
+/* Write-behind output, built on the primitives above. */
+
+typedef struct
+{
+	fz_context *ctx; /* Used by the writer thread only. */
+	fz_output *chain;
+	int64_t pos;
+
+	int nbufs;
+	size_t bufsize;
+	unsigned char **bufs;
+	size_t *lens;
+
+	/* Owned by the producer: the buffer being filled. */
+	int tail;
+	size_t fill;
+
+	/* Protected by mutex: the buffers queued for the writer. */
+	int head, count;
+	int producer_waiting, writer_waiting;
+	int stopping, failed;
+	char message[256];
+
+	/* Which of these have been created, for unwinding. */
+	mu_mutex mutex;
+	mu_semaphore work, space;
+	mu_thread thread;
+	int have_mutex, have_work, have_space;
+	int running;
+} async_output;
+
+/*
+	Both sides only trigger a semaphore after seeing (and clearing)
+	the other's waiting flag, so neither semaphore ever goes above 1.
+*/
+static void
+async_writer(void *arg)
+{
+	async_output *state = arg;
+	fz_context *ctx = state->ctx;
+	unsigned char *data;
+	size_t len;
+	int failed;
+
+	mu_lock_mutex(&state->mutex);
+	for (;;)
+	{
+		while (state->count == 0 && !state->stopping)
+		{
+			state->writer_waiting = 1;
+			mu_unlock_mutex(&state->mutex);
+			mu_wait_semaphore(&state->work);
+			mu_lock_mutex(&state->mutex);
+		}
+		if (state->count == 0)
+			break;
+
+		data = state->bufs[state->head];
+		len = state->lens[state->head];
+		failed = state->failed;
+		mu_unlock_mutex(&state->mutex);
+
+		/* Once something has gone wrong, just discard the data. */
+		if (!failed)
+		{
+			fz_try(ctx)
+				fz_write_data(ctx, state->chain, data, len);
+			fz_catch(ctx)
+				failed = 1;
+		}
+
+		mu_lock_mutex(&state->mutex);
+		if (failed && !state->failed)
+		{
+			state->failed = 1;
+			fz_strlcpy(state->message, fz_caught_message(ctx), sizeof state->message);
+		}
+		state->head = (state->head + 1) % state->nbufs;
+		state->count--;
+		if (state->producer_waiting)
+		{
+			state->producer_waiting = 0;
+			mu_trigger_semaphore(&state->space);
+		}
+	}
+	mu_unlock_mutex(&state->mutex);
+}
+
+/* Call with the mutex held. */
+static void
+async_wait_for_space(async_output *state, int limit)
+{
+	while (state->count > limit)
+	{
+		state->producer_waiting = 1;
+		mu_unlock_mutex(&state->mutex);
+		mu_wait_semaphore(&state->space);
+		mu_lock_mutex(&state->mutex);
+	}
+}
+
+/*
+	Queue the buffer being filled (if there is anything in it), and
+	wait until the queue holds no more than limit buffers.
+*/
+static void
+async_submit(fz_context *ctx, async_output *state, int limit)
+{
+	int failed;
+
+	mu_lock_mutex(&state->mutex);
+	if (state->fill > 0)
+	{
+		state->lens[state->tail] = state->fill;
+		state->count++;
+		if (state->writer_waiting)
+		{
+			state->writer_waiting = 0;
+			mu_trigger_semaphore(&state->work);
+		}
+		state->tail = (state->tail + 1) % state->nbufs;
+		state->fill = 0;
+	}
+	async_wait_for_space(state, limit);
+	failed = state->failed;
+	mu_unlock_mutex(&state->mutex);
+
+	if (failed)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "%s", state->message);
+}
+
+static void
+async_write(fz_context *ctx, void *opaque, const void *data_, size_t len)
+{
+	async_output *state = opaque;
+	const unsigned char *data = data_;
+	size_t n;
+
+	state->pos += len;
+	while (len > 0)
+	{
+		n = state->bufsize - state->fill;
+		if (n > len)
+			n = len;
+		memcpy(state->bufs[state->tail] + state->fill, data, n);
+		state->fill += n;
+		data += n;
+		len -= n;
+
+		/* The next buffer must be free before we can fill it. */
+		if (state->fill == state->bufsize)
+			async_submit(ctx, state, state->nbufs - 1);
+	}
+}
+
+static void
+async_stop(async_output *state)
+{
+	if (!state->running)
+		return;
+	mu_lock_mutex(&state->mutex);
+	state->stopping = 1;
+	if (state->writer_waiting)
+	{
+		state->writer_waiting = 0;
+		mu_trigger_semaphore(&state->work);
+	}
+	mu_unlock_mutex(&state->mutex);
+	mu_destroy_thread(&state->thread);
+	state->running = 0;
+}
+
+/* Wait for everything queued so far to reach the underlying output. */
+static void
+async_drain(fz_context *ctx, async_output *state)
+{
+	async_submit(ctx, state, 0);
+}
+
+static void
+async_close(fz_context *ctx, void *opaque)
+{
+	async_output *state = opaque;
+
+	async_drain(ctx, state);
+	async_stop(state);
+	fz_close_output(ctx, state->chain);
+}
+
+static void
+async_drop(fz_context *ctx, void *opaque)
+{
+	async_output *state = opaque;
+	int i;
+
+	async_stop(state);
+	if (state->have_space)
+		mu_destroy_semaphore(&state->space);
+	if (state->have_work)
+		mu_destroy_semaphore(&state->work);
+	if (state->have_mutex)
+		mu_destroy_mutex(&state->mutex);
+	fz_drop_context(state->ctx);
+	fz_drop_output(ctx, state->chain);
+	for (i = 0; i < state->nbufs; i++)
+		fz_free(ctx, state->bufs[i]);
+	fz_free(ctx, state->bufs);
+	fz_free(ctx, state->lens);
+	fz_free(ctx, state);
+}
+
+static void
+async_seek(fz_context *ctx, void *opaque, int64_t off, int whence)
+{
+	async_output *state = opaque;
+
+	async_drain(ctx, state);
+	fz_seek_output(ctx, state->chain, off, whence);
+	if (state->chain->tell)
+		state->pos = fz_tell_output(ctx, state->chain);
+}
+
+static int64_t
+async_tell(fz_context *ctx, void *opaque)
+{
+	async_output *state = opaque;
+	return state->pos;
+}
+
+static fz_stream *
+async_as_stream(fz_context *ctx, void *opaque)
+{
+	async_output *state = opaque;
+
+	async_drain(ctx, state);
+	return fz_stream_from_output(ctx, state->chain);
+}
+
+static void
+async_truncate(fz_context *ctx, void *opaque)
+{
+	async_output *state = opaque;
+
+	async_drain(ctx, state);
+	fz_truncate_output(ctx, state->chain);
+}
+
+fz_output *
+mu_new_async_output(fz_context *ctx, fz_output *chain, int nbufs, size_t bufsize)
+{
+	async_output *state = NULL;
+	fz_output *out;
+	int i;
+
+	fz_var(state);
+
+	if (nbufs < 2)
+		nbufs = 4;
+	if (bufsize == 0)
+		bufsize = 1 << 20;
+
+	fz_try(ctx)
+	{
+		state = fz_malloc_struct(ctx, async_output);
+		state->chain = chain;
+		state->nbufs = nbufs;
+		state->bufsize = bufsize;
+		if (chain->tell)
+			state->pos = fz_tell_output(ctx, chain);
+		state->bufs = fz_malloc_array(ctx, nbufs, unsigned char *);
+		memset(state->bufs, 0, nbufs * sizeof *state->bufs);
+		for (i = 0; i < nbufs; i++)
+			state->bufs[i] = fz_malloc(ctx, bufsize);
+		state->lens = fz_malloc_array(ctx, nbufs, size_t);
+	}
+	fz_catch(ctx)
+	{
+		if (state && state->bufs)
+			for (i = 0; i < nbufs; i++)
+				fz_free(ctx, state->bufs[i]);
+		if (state)
+		{
+			fz_free(ctx, state->bufs);
+			fz_free(ctx, state);
+		}
+		fz_drop_output(ctx, chain);
+		fz_rethrow(ctx);
+	}
+
+	/* Without threads (or locks to share the context between them)
+	 * we can still write, just not behind the caller's back. */
+	state->ctx = fz_clone_context(ctx);
+	if (state->ctx)
+		state->have_mutex = !mu_create_mutex(&state->mutex);
+	if (state->have_mutex)
+		state->have_work = !mu_create_semaphore(&state->work);
+	if (state->have_work)
+		state->have_space = !mu_create_semaphore(&state->space);
+	if (state->have_space)
+		state->running = !mu_create_thread(&state->thread, async_writer, state);
+	if (!state->running)
+	{
+		state->chain = NULL;
+		async_drop(ctx, state);
+		return chain;
+	}
+
+	/* If this fails, it calls async_drop, which stops the thread
+	 * and drops the chain we were given. */
+	out = fz_new_output(ctx, 0, state, async_write, async_close, async_drop);
+	if (chain->seek)
+		out->seek = async_seek;
+	if (chain->tell)
+		out->tell = async_tell;
+	if (chain->as_stream)
+		out->as_stream = async_as_stream;
+	if (chain->truncate)
+		out->truncate = async_truncate;
+
+	return out;
+}
+
+/* Parallel jobs, built on the primitives above. */
+
+typedef struct
+{
+	fz_context *ctx;
+	void (*job)(fz_context *ctx, void *job_arg, int index);
+	void *job_arg;
+	int index;
+	mu_thread thread;
+	int running;
+} parallel_worker;
+
+static void
+parallel_worker_run(void *arg)
+{
+	parallel_worker *worker = arg;
+	worker->job(worker->ctx, worker->job_arg, worker->index);
+}
+
+void
+mu_run_parallel(void *arg, fz_context *ctx, int count, void (*job)(fz_context *ctx, void *job_arg, int index), void *job_arg)
+{
+	parallel_worker *workers;
+	int i;
+
+	/* Job 0, and any job we cannot start a thread for, runs here. */
+	workers = fz_calloc_no_throw(ctx, count, sizeof *workers);
+	if (workers)
+	{
+		for (i = 1; i < count; i++)
+		{
+			workers[i].ctx = fz_clone_context(ctx);
+			workers[i].job = job;
+			workers[i].job_arg = job_arg;
+			workers[i].index = i;
+			if (workers[i].ctx && !mu_create_thread(&workers[i].thread, parallel_worker_run, &workers[i]))
+				workers[i].running = 1;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		if (!workers || !workers[i].running)
+			job(ctx, job_arg, i);
+
+	if (workers)
+	{
+		for (i = 1; i < count; i++)
+		{
+			if (workers[i].running)
+				mu_destroy_thread(&workers[i].thread);
+			fz_drop_context(workers[i].ctx);
+		}
+		fz_free(ctx, workers);
+	}
+}
+
+void
+mu_render_display_list(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, int threads)
+{
+	fz_render_display_list_parallel(ctx, list, ctm, pix, threads, mu_run_parallel, NULL);
+}
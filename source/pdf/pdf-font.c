@@ -2,6 +2,7 @@
 #include "mupdf/pdf.h"
 
 #include <assert.h>
+#include <math.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -244,21 +245,18 @@ pdf_font_cid_to_gid(fz_context *ctx, pdf_font_desc *fontdesc, int cid)
 
 static int ft_width(fz_context *ctx, pdf_font_desc *fontdesc, int cid)
 {
-	int mask = FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM;
 	int gid = ft_cid_to_gid(fontdesc, cid);
-	FT_Fixed adv = 0;
-	int fterr;
 	FT_Face face = fontdesc->font->ft_face;
 	FT_UShort units_per_EM;
-
-	fterr = FT_Get_Advance(face, gid, mask, &adv);
-	if (fterr && fterr != FT_Err_Invalid_Argument)
-		fz_warn(ctx, "FT_Get_Advance(%d): %s", gid, ft_error_string(fterr));
+	long adv;
 
 	units_per_EM = face->units_per_EM;
 	if (units_per_EM == 0)
 		units_per_EM = 2048;
 
+	/* The cached advance is in ems; turn it back into whole font units,
+	 * and scale those to a width by truncating, as we always have. */
+	adv = floorf(fz_advance_glyph(ctx, fontdesc->font, gid, 0) * units_per_EM + 0.5f);
 	return adv * 1000 / units_per_EM;
 }
 
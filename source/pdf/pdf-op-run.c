@@ -841,6 +841,236 @@ pdf_flush_text(fz_context *ctx, pdf_run_processor *pr)
 	return pr->gstate + pr->gtop;
 }
 
+/*
+	Type 3 glyphs that inherit graphics state from the text that
+	shows them cannot go through the glyph cache, and used to be
+	rerun through the interpreter every time they were drawn. We
+	record them once per font, glyph and inherited state into a
+	display list in the store, and replay that instead.
+*/
+
+typedef struct
+{
+	int refs;
+	fz_font *font;
+	int gid;
+	fz_colorspace *fill_cs;
+	fz_colorspace *stroke_cs;
+	fz_default_colorspaces *default_cs;
+	pdf_font_desc *text_font;
+	unsigned char digest[16];
+} pdf_t3_direct_key;
+
+static int
+pdf_make_hash_t3_direct_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	pdf_t3_direct_key *key = (pdf_t3_direct_key *)key_;
+	hash->u.pid.ptr = key->font;
+	hash->u.pid.i = key->gid;
+	memcpy(hash->u.pid.digest, key->digest, 16);
+	return 1;
+}
+
+static void *
+pdf_keep_t3_direct_key(fz_context *ctx, void *key_)
+{
+	pdf_t3_direct_key *key = (pdf_t3_direct_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+pdf_drop_t3_direct_key(fz_context *ctx, void *key_)
+{
+	pdf_t3_direct_key *key = (pdf_t3_direct_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+	{
+		fz_drop_font(ctx, key->font);
+		fz_drop_colorspace(ctx, key->fill_cs);
+		fz_drop_colorspace(ctx, key->stroke_cs);
+		fz_drop_default_colorspaces(ctx, key->default_cs);
+		pdf_drop_font(ctx, key->text_font);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+pdf_cmp_t3_direct_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	pdf_t3_direct_key *k0 = (pdf_t3_direct_key *)k0_;
+	pdf_t3_direct_key *k1 = (pdf_t3_direct_key *)k1_;
+	return k0->font == k1->font && k0->gid == k1->gid && k0->text_font == k1->text_font && !memcmp(k0->digest, k1->digest, 16);
+}
+
+static void
+pdf_format_t3_direct_key(fz_context *ctx, char *s, size_t n, void *key_)
+{
+	pdf_t3_direct_key *key = (pdf_t3_direct_key *)key_;
+	fz_snprintf(s, n, "(type3 glyph font=%s, gid=%d)", key->font->name, key->gid);
+}
+
+static const fz_store_type pdf_t3_direct_store_type =
+{
+	"pdf_t3_direct_glyph",
+	pdf_make_hash_t3_direct_key,
+	pdf_keep_t3_direct_key,
+	pdf_drop_t3_direct_key,
+	pdf_cmp_t3_direct_key,
+	pdf_format_t3_direct_key,
+	NULL
+};
+
+typedef struct
+{
+	fz_storable storable;
+	fz_display_list *list;
+} pdf_t3_direct_record;
+
+static void
+pdf_drop_t3_direct_record_imp(fz_context *ctx, fz_storable *storable)
+{
+	pdf_t3_direct_record *rec = (pdf_t3_direct_record *)storable;
+	fz_drop_display_list(ctx, rec->list);
+	fz_free(ctx, rec);
+}
+
+static void
+pdf_digest_t3_material(fz_context *ctx, fz_md5 *md5, const pdf_material *mat)
+{
+	int n = mat->colorspace ? fz_colorspace_n(ctx, mat->colorspace) : 0;
+	fz_md5_update(md5, (const unsigned char *)&mat->colorspace, sizeof mat->colorspace);
+	fz_md5_update(md5, (const unsigned char *)&mat->color_params, sizeof mat->color_params);
+	fz_md5_update(md5, (const unsigned char *)&mat->alpha, sizeof mat->alpha);
+	fz_md5_update(md5, (const unsigned char *)mat->v, n * sizeof(float));
+}
+
+/* Text that the glyph shows without setting up its own text state
+ * inherits all of it, font included. */
+static void
+pdf_digest_t3_text(fz_context *ctx, fz_md5 *md5, const pdf_text_state *text)
+{
+	fz_md5_update(md5, (const unsigned char *)&text->char_space, sizeof text->char_space);
+	fz_md5_update(md5, (const unsigned char *)&text->word_space, sizeof text->word_space);
+	fz_md5_update(md5, (const unsigned char *)&text->scale, sizeof text->scale);
+	fz_md5_update(md5, (const unsigned char *)&text->leading, sizeof text->leading);
+	fz_md5_update(md5, (const unsigned char *)&text->font, sizeof text->font);
+	fz_md5_update(md5, (const unsigned char *)&text->size, sizeof text->size);
+	fz_md5_update(md5, (const unsigned char *)&text->render, sizeof text->render);
+	fz_md5_update(md5, (const unsigned char *)&text->rise, sizeof text->rise);
+}
+
+static void
+pdf_render_t3_glyph_direct(fz_context *ctx, pdf_run_processor *pr, pdf_gstate *gstate, fz_font *font, int gid, fz_matrix trm)
+{
+	pdf_t3_direct_key key, *new_key = NULL;
+	pdf_t3_direct_record *rec = NULL, *other;
+	fz_display_list *list = NULL;
+	fz_device *dev = NULL;
+	fz_stroke_state *stroke = gstate->stroke_state;
+	fz_md5 md5;
+
+	/* Nested inside the recording of another type 3 glyph, the glyph
+	 * has to run for real so that the outer glyph sees what graphics
+	 * state it depends on. Patterns, shadings, dashes and soft masks
+	 * depend on more than we want to key on; run those directly too. */
+	if ((pr->dev->flags & (FZ_DEVFLAG_FILLCOLOR_UNDEFINED |
+			FZ_DEVFLAG_STROKECOLOR_UNDEFINED |
+			FZ_DEVFLAG_STARTCAP_UNDEFINED |
+			FZ_DEVFLAG_DASHCAP_UNDEFINED |
+			FZ_DEVFLAG_ENDCAP_UNDEFINED |
+			FZ_DEVFLAG_LINEJOIN_UNDEFINED |
+			FZ_DEVFLAG_MITERLIMIT_UNDEFINED |
+			FZ_DEVFLAG_LINEWIDTH_UNDEFINED)) ||
+		gstate->fill.kind != PDF_MAT_COLOR ||
+		gstate->stroke.kind != PDF_MAT_COLOR ||
+		gstate->softmask ||
+		stroke->dash_len != 0)
+	{
+		fz_render_t3_glyph_direct(ctx, pr->dev, font, gid, trm, gstate, pr->default_cs);
+		return;
+	}
+
+	fz_md5_init(&md5);
+	pdf_digest_t3_material(ctx, &md5, &gstate->fill);
+	pdf_digest_t3_material(ctx, &md5, &gstate->stroke);
+	fz_md5_update(&md5, (const unsigned char *)&pr->default_cs, sizeof pr->default_cs);
+	fz_md5_update(&md5, (const unsigned char *)&gstate->blendmode, sizeof gstate->blendmode);
+	pdf_digest_t3_text(ctx, &md5, &gstate->text);
+	fz_md5_update(&md5, (const unsigned char *)&stroke->start_cap, sizeof stroke->start_cap);
+	fz_md5_update(&md5, (const unsigned char *)&stroke->dash_cap, sizeof stroke->dash_cap);
+	fz_md5_update(&md5, (const unsigned char *)&stroke->end_cap, sizeof stroke->end_cap);
+	fz_md5_update(&md5, (const unsigned char *)&stroke->linejoin, sizeof stroke->linejoin);
+	fz_md5_update(&md5, (const unsigned char *)&stroke->linewidth, sizeof stroke->linewidth);
+	fz_md5_update(&md5, (const unsigned char *)&stroke->miterlimit, sizeof stroke->miterlimit);
+
+	key.refs = 1;
+	key.font = font;
+	key.gid = gid;
+	key.fill_cs = gstate->fill.colorspace;
+	key.stroke_cs = gstate->stroke.colorspace;
+	key.default_cs = pr->default_cs;
+	key.text_font = gstate->text.font;
+	fz_md5_final(&md5, key.digest);
+
+	rec = fz_find_item(ctx, pdf_drop_t3_direct_record_imp, &key, &pdf_t3_direct_store_type);
+	if (rec)
+	{
+		list = fz_keep_display_list(ctx, rec->list);
+		fz_drop_storable(ctx, &rec->storable);
+	}
+	else
+	{
+		fz_var(list);
+		fz_var(dev);
+		fz_var(rec);
+		fz_var(new_key);
+		fz_try(ctx)
+		{
+			list = fz_new_display_list(ctx, fz_transform_rect(font->bbox, font->t3matrix));
+			dev = fz_new_list_device(ctx, list);
+			fz_render_t3_glyph_direct(ctx, dev, font, gid, fz_identity, gstate, pr->default_cs);
+			fz_close_device(ctx, dev);
+
+			rec = fz_malloc_struct(ctx, pdf_t3_direct_record);
+			FZ_INIT_STORABLE(rec, 1, pdf_drop_t3_direct_record_imp);
+			rec->list = fz_keep_display_list(ctx, list);
+			new_key = fz_malloc_struct(ctx, pdf_t3_direct_key);
+			*new_key = key;
+			new_key->font = fz_keep_font(ctx, font);
+			new_key->fill_cs = fz_keep_colorspace(ctx, key.fill_cs);
+			new_key->stroke_cs = fz_keep_colorspace(ctx, key.stroke_cs);
+			new_key->default_cs = fz_keep_default_colorspaces(ctx, key.default_cs);
+			new_key->text_font = pdf_keep_font(ctx, key.text_font);
+			other = fz_store_item(ctx, new_key, rec, sizeof(*rec) + fz_display_list_size(ctx, list), &pdf_t3_direct_store_type);
+			if (other)
+			{
+				fz_drop_display_list(ctx, list);
+				list = fz_keep_display_list(ctx, other->list);
+				fz_drop_storable(ctx, &other->storable);
+			}
+		}
+		fz_always(ctx)
+		{
+			fz_drop_device(ctx, dev);
+			if (new_key)
+				pdf_drop_t3_direct_key(ctx, new_key);
+			if (rec)
+				fz_drop_storable(ctx, &rec->storable);
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_display_list(ctx, list);
+			fz_rethrow(ctx);
+		}
+	}
+
+	fz_try(ctx)
+		fz_run_display_list(ctx, list, pr->dev, trm, fz_infinite_rect, NULL);
+	fz_always(ctx)
+		fz_drop_display_list(ctx, list);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 static void
 pdf_show_char(fz_context *ctx, pdf_run_processor *pr, int cid)
 {
@@ -871,7 +1101,7 @@ pdf_show_char(fz_context *ctx, pdf_run_processor *pr, int cid)
 		 * type3 glyphs that seem to inherit current graphics
 		 * attributes, or type 3 glyphs within type3 glyphs). */
 		fz_matrix composed = fz_concat(trm, gstate->ctm);
-		fz_render_t3_glyph_direct(ctx, pr->dev, fontdesc->font, gid, composed, gstate, pr->default_cs);
+		pdf_render_t3_glyph_direct(ctx, pr, gstate, fontdesc->font, gid, composed);
 		/* Render text invisibly so that it can still be extracted. */
 		pr->tos.text_mode = 3;
 	}
@@ -326,6 +326,76 @@ pdf_open_raw_filter(fz_context *ctx, fz_stream *file_stm, pdf_document *doc, pdf
 	return null_stm;
 }
 
+/*
+ * When the whole file is held in a buffer (a memory mapped or in-memory
+ * document) and the stream needs no decryption, the raw stream data can
+ * be shared with the file rather than copied out through the filters.
+ * This repeats the length correction that the endstream filter makes
+ * for the usual case of 'endstream' following within a few bytes; for
+ * anything less tidy it returns NULL, and the caller reads the stream.
+ */
+static fz_buffer *
+pdf_slice_raw_stream(fz_context *ctx, pdf_document *doc, pdf_obj *stmobj, int64_t offset)
+{
+	fz_buffer *file = doc->file ? fz_stream_buffer(ctx, doc->file) : NULL;
+	unsigned char *s, *e, *p;
+	int64_t len;
+
+	if (!file || offset <= 0 || (uint64_t)offset > file->len)
+		return NULL;
+	if (doc->crypt && !pdf_stream_has_crypt(ctx, stmobj))
+		return NULL;
+
+	len = pdf_dict_get_int(ctx, stmobj, PDF_NAME(Length));
+	if (len < 0)
+		len = 0;
+	if ((uint64_t)len > file->len - offset)
+		return NULL;
+
+	s = file->data + offset + len;
+	e = file->data + file->len;
+	if (e - s > 32)
+		e = s + 32;
+	p = fz_memmem(s, e - s, "endstream", 9);
+	if (!p)
+		return NULL;
+
+	/* Include newline (CR|LF|CRLF) before 'endstream' token */
+	if (p > s && p[-1] == '\n') --p;
+	if (p > s && p[-1] == '\r') --p;
+	if (p > s)
+		fz_warn(ctx, "PDF stream Length incorrect");
+
+	return fz_new_buffer_slice(ctx, file, offset, p - (file->data + offset));
+}
+
+/*
+ * Check whether opening a stream left its data exactly as it is stored:
+ * either there are no filters, or the only one is JPXDecode (which the
+ * image code decodes itself) or was shortstopped into params. Call this
+ * after opening the stream, which is what fills in params.
+ */
+static int
+pdf_stream_is_undecoded(fz_context *ctx, pdf_obj *stmobj, fz_compression_params *params)
+{
+	pdf_obj *f = pdf_dict_geta(ctx, stmobj, PDF_NAME(Filter), PDF_NAME(F));
+
+	if (pdf_is_array(ctx, f))
+	{
+		int n = pdf_array_len(ctx, f);
+		if (n == 0)
+			return 1;
+		if (n != 1)
+			return 0;
+		f = pdf_array_get(ctx, f, 0);
+	}
+	if (!f || pdf_is_null(ctx, f))
+		return 1;
+	if (pdf_name_eq(ctx, f, PDF_NAME(JPXDecode)))
+		return 1;
+	return pdf_is_name(ctx, f) && params && params->type != FZ_IMAGE_RAW;
+}
+
 /*
  * Construct a filter to decode a stream, constraining
  * to stream length and decrypting.
@@ -468,6 +538,14 @@ pdf_load_raw_stream_number(fz_context *ctx, pdf_document *doc, int num)
 			return fz_keep_buffer(ctx, x->stm_buf);
 	}
 
+	x = pdf_cache_object(ctx, doc, num);
+	if (x->stm_ofs != 0)
+	{
+		buf = pdf_slice_raw_stream(ctx, doc, x->obj, x->stm_ofs);
+		if (buf)
+			return buf;
+	}
+
 	dict = pdf_load_object(ctx, doc, num);
 
 	fz_try(ctx)
@@ -562,10 +640,12 @@ pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compressio
 {
 	fz_stream *stm = NULL;
 	pdf_obj *dict, *obj;
+	pdf_xref_entry *x;
 	int i, len, n;
 	fz_buffer *buf;
 
 	fz_var(buf);
+	fz_var(stm);
 
 	if (num > 0 && num < pdf_xref_len(ctx, doc))
 	{
@@ -585,21 +665,21 @@ pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compressio
 		n = pdf_array_len(ctx, obj);
 		for (i = 0; i < n; i++)
 			len = pdf_guess_filter_length(len, pdf_to_name(ctx, pdf_array_get(ctx, obj, i)));
-	}
-	fz_always(ctx)
-	{
-		pdf_drop_obj(ctx, dict);
-	}
-	fz_catch(ctx)
-	{
-		fz_rethrow(ctx);
-	}
 
-	stm = pdf_open_image_stream(ctx, doc, num, params);
+		stm = pdf_open_image_stream(ctx, doc, num, params);
 
-	fz_try(ctx)
-	{
-		if (truncated)
+		/* Data that needs no decoding can be shared with the file. */
+		buf = NULL;
+		x = pdf_cache_object(ctx, doc, num);
+		if (x->stm_buf == NULL && pdf_stream_is_undecoded(ctx, dict, params))
+			buf = pdf_slice_raw_stream(ctx, doc, dict, x->stm_ofs);
+
+		if (buf)
+		{
+			if (truncated)
+				*truncated = 0;
+		}
+		else if (truncated)
 			buf = fz_read_best(ctx, stm, len, truncated);
 		else
 			buf = fz_read_all(ctx, stm, len);
@@ -607,6 +687,7 @@ pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compressio
 	fz_always(ctx)
 	{
 		fz_drop_stream(ctx, stm);
+		pdf_drop_obj(ctx, dict);
 	}
 	fz_catch(ctx)
 	{
@@ -172,7 +172,7 @@ pdf_load_type3_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *d
 					font->t3procs[i] = pdf_load_stream(ctx, obj);
 					fz_trim_buffer(ctx, font->t3procs[i]);
 					fontdesc->size += fz_buffer_storage(ctx, font->t3procs[i], NULL);
-					fontdesc->size += 0; // TODO: display list size calculation
+					fontdesc->size += fz_display_list_size(ctx, fontdesc->font->t3lists[i]);
 				}
 			}
 		}
@@ -199,7 +199,7 @@ void pdf_load_type3_glyphs(fz_context *ctx, pdf_document *doc, pdf_font_desc *fo
 			if (fontdesc->font->t3procs[i])
 			{
 				fz_prepare_t3_glyph(ctx, fontdesc->font, i);
-				fontdesc->size += 0; // TODO: display list size calculation
+				fontdesc->size += fz_display_list_size(ctx, fontdesc->font->t3lists[i]);
 			}
 		}
 	}
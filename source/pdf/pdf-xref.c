@@ -2677,7 +2677,7 @@ pdf_open_document(fz_context *ctx, const char *filename)
 
 	fz_try(ctx)
 	{
-		file = fz_open_file(ctx, filename);
+		file = fz_open_file_mmap(ctx, filename);
 		doc = pdf_new_document(ctx, file);
 		pdf_init_document(ctx, doc);
 	}
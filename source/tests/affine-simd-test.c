@@ -0,0 +1,225 @@
+/*
+ * affine-simd-test -- check the SIMD affine image painters against the
+ * plain C ones.
+ *
+ * Random images are drawn with random transforms (so with both the
+ * nearest neighbour and the interpolating painters) into random
+ * destinations, once with the plain C painters and once at each SIMD
+ * level the CPU supports, and the results must match bit for bit.
+ * Every pixel layout the SIMD painters accept is covered, including
+ * two colorants with alpha drawn into two colorants without, with and
+ * without a shape, a group alpha and overprint.
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/draw-imp.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#if FZ_ENABLE_SIMD
+
+#define ITERATIONS 300
+#define DST_W 48
+#define DST_H 40
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static float rndf(float lo, float hi)
+{
+	return lo + (hi - lo) * (rnd() & 0xffff) / 65535.0f;
+}
+
+/* Fill a pixmap with random (premultiplied, if it has alpha) pixels. */
+static void fill_random(fz_pixmap *pix)
+{
+	int n1 = pix->n - pix->alpha;
+	unsigned char *p;
+	int x, y, k, a;
+
+	for (y = 0; y < pix->h; y++)
+	{
+		p = pix->samples + y * (size_t)pix->stride;
+		for (x = 0; x < pix->w; x++)
+		{
+			a = 255;
+			if (pix->alpha)
+			{
+				switch (rnd() % 4)
+				{
+				case 0: a = 0; break;
+				case 1: a = 255; break;
+				default: a = rnd() & 255; break;
+				}
+			}
+			for (k = 0; k < n1; k++)
+				*p++ = (rnd() & 255) * a / 255;
+			if (pix->alpha)
+				*p++ = a;
+		}
+	}
+}
+
+/* A pixmap with n colorants. Two colorants are gray and a spot. */
+static fz_pixmap *new_pixmap(fz_context *ctx, int n, int w, int h, int alpha)
+{
+	fz_separations *seps = NULL;
+	fz_colorspace *cs;
+	fz_pixmap *pix;
+
+	switch (n)
+	{
+	default: cs = fz_device_gray(ctx); break;
+	case 2:
+		cs = fz_device_gray(ctx);
+		seps = fz_new_separations(ctx, 0);
+		fz_add_separation(ctx, seps, "Spot", fz_device_gray(ctx), 0);
+		fz_set_separation_behavior(ctx, seps, 0, FZ_SEPARATION_SPOT);
+		break;
+	case 3: cs = fz_device_rgb(ctx); break;
+	case 4: cs = fz_device_cmyk(ctx); break;
+	}
+	pix = fz_new_pixmap(ctx, cs, w, h, seps, alpha);
+	fz_drop_separations(ctx, seps);
+	fill_random(pix);
+	return pix;
+}
+
+static int same_samples(fz_pixmap *a, fz_pixmap *b)
+{
+	return !memcmp(a->samples, b->samples, (size_t)a->stride * a->h);
+}
+
+static void test_layout(fz_context *ctx, int level, int sn, int sa, int dn, int da)
+{
+	fz_pixmap *img, *init, *c_out, *simd_out;
+	fz_pixmap *shape = NULL, *c_shape = NULL, *simd_shape = NULL;
+	fz_pixmap *ga = NULL, *c_ga = NULL, *simd_ga = NULL;
+	fz_overprint op, *eop;
+	fz_irect scissor = { 0, 0, DST_W, DST_H };
+	fz_matrix ctm;
+	int i, alpha, changed = 0;
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		img = new_pixmap(ctx, sn, 1 + rnd() % 20, 1 + rnd() % 20, sa);
+		init = new_pixmap(ctx, dn, DST_W, DST_H, da);
+		alpha = (rnd() & 1) ? 255 : 1 + rnd() % 255;
+
+		/* A unit square, scaled, maybe rotated, and placed in the
+		 * destination; some of it may fall outside. */
+		ctm = fz_scale(rndf(4, 60), rndf(4, 60));
+		if (rnd() & 1)
+			ctm = fz_concat(ctm, fz_rotate(rndf(0, 360)));
+		else if (rnd() & 1)
+			ctm = fz_concat(ctm, fz_rotate(90 * (rnd() % 4)));
+		ctm = fz_concat(ctm, fz_translate(rndf(-10, DST_W), rndf(-10, DST_H)));
+
+		if (rnd() & 1)
+		{
+			shape = fz_new_pixmap(ctx, NULL, DST_W, DST_H, NULL, 1);
+			fill_random(shape);
+		}
+		if (rnd() & 1)
+		{
+			ga = fz_new_pixmap(ctx, NULL, DST_W, DST_H, NULL, 1);
+			fill_random(ga);
+		}
+
+		/* Overprint only applies when the colorants match; protect
+		 * a random non-empty set of them. */
+		eop = NULL;
+		if (sn == dn && (rnd() & 1))
+		{
+			memset(&op, 0, sizeof op);
+			do
+				op.mask[0] = rnd() & ((1 << dn) - 1);
+			while (op.mask[0] == 0);
+			eop = &op;
+		}
+
+		fz_limit_simd_level(FZ_SIMD_NONE);
+		c_out = fz_clone_pixmap(ctx, init);
+		c_shape = shape ? fz_clone_pixmap(ctx, shape) : NULL;
+		c_ga = ga ? fz_clone_pixmap(ctx, ga) : NULL;
+		fz_paint_image(ctx, c_out, &scissor, c_shape, c_ga, img, ctm, alpha, 1, 0, eop);
+
+		fz_limit_simd_level(level);
+		simd_out = fz_clone_pixmap(ctx, init);
+		simd_shape = shape ? fz_clone_pixmap(ctx, shape) : NULL;
+		simd_ga = ga ? fz_clone_pixmap(ctx, ga) : NULL;
+		fz_paint_image(ctx, simd_out, &scissor, simd_shape, simd_ga, img, ctm, alpha, 1, 0, eop);
+
+		CHECK(same_samples(simd_out, c_out));
+		if (shape)
+			CHECK(same_samples(simd_shape, c_shape));
+		if (ga)
+			CHECK(same_samples(simd_ga, c_ga));
+		if (!same_samples(simd_out, c_out) || (shape && !same_samples(simd_shape, c_shape)) || (ga && !same_samples(simd_ga, c_ga)))
+		{
+			fprintf(stderr, "affine: level=%d sn=%d sa=%d dn=%d da=%d alpha=%d op=%x ga=%d ctm=[%g %g %g %g %g %g]\n",
+				level, sn, sa, dn, da, alpha, eop ? eop->mask[0] : 0, ga != NULL, ctm.a, ctm.b, ctm.c, ctm.d, ctm.e, ctm.f);
+			i = ITERATIONS;
+		}
+		if (!same_samples(c_out, init))
+			changed = 1;
+
+		fz_drop_pixmap(ctx, img);
+		fz_drop_pixmap(ctx, init);
+		fz_drop_pixmap(ctx, c_out);
+		fz_drop_pixmap(ctx, simd_out);
+		fz_drop_pixmap(ctx, shape);
+		fz_drop_pixmap(ctx, c_shape);
+		fz_drop_pixmap(ctx, simd_shape);
+		fz_drop_pixmap(ctx, ga);
+		fz_drop_pixmap(ctx, c_ga);
+		fz_drop_pixmap(ctx, simd_ga);
+		shape = c_shape = simd_shape = NULL;
+		ga = c_ga = simd_ga = NULL;
+	}
+
+	/* Make sure we were drawing something. */
+	CHECK(changed);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	int best = fz_simd_level();
+	int level, n, sa, da;
+
+	if (best == FZ_SIMD_NONE)
+		fprintf(stderr, "affine-simd-test: no SIMD support; nothing to compare\n");
+
+	for (level = FZ_SIMD_SSE4_1; level <= best; level++)
+	{
+		for (n = 1; n <= 4; n++)
+			for (sa = 0; sa <= 1; sa++)
+				for (da = 0; da <= 1; da++)
+					test_layout(ctx, level, n, sa, n, da);
+		for (sa = 0; sa <= 1; sa++)
+			for (da = 0; da <= 1; da++)
+				test_layout(ctx, level, 1, sa, 3, da);
+	}
+
+	fz_drop_context(ctx);
+	return mu_test_result("affine-simd-test");
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+	fprintf(stderr, "affine-simd-test: skipped; built without FZ_ENABLE_SIMD\n");
+	return EXIT_SUCCESS;
+}
+
+#endif
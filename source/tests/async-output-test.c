@@ -0,0 +1,169 @@
+/*
+ * async-output-test -- check the write-behind output in mu-threads.
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/helpers/mu-threads.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define DATA_LEN (100000)
+
+static unsigned char pattern(int i)
+{
+	return (unsigned char)(i * 7 + (i >> 8));
+}
+
+static void write_pattern(fz_context *ctx, fz_output *out)
+{
+	unsigned char chunk[333];
+	int i, n, pos = 0;
+
+	while (pos < DATA_LEN)
+	{
+		n = DATA_LEN - pos;
+		if (n > (int)sizeof chunk)
+			n = sizeof chunk;
+		for (i = 0; i < n; i++)
+			chunk[i] = pattern(pos + i);
+		fz_write_data(ctx, out, chunk, n);
+		pos += n;
+	}
+}
+
+static int check_pattern(fz_buffer *buf)
+{
+	int i;
+	if (buf->len != DATA_LEN)
+		return 0;
+	for (i = 0; i < DATA_LEN; i++)
+		if (buf->data[i] != pattern(i))
+			return 0;
+	return 1;
+}
+
+/* Write everything through an async output, and check it arrives. */
+static void test_roundtrip(fz_context *ctx, int expect_wrapped)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 16);
+	fz_output *chain = fz_new_output_with_buffer(ctx, buf);
+	fz_output *out = mu_new_async_output(ctx, chain, 3, 1000);
+
+	CHECK((out != chain) == expect_wrapped);
+
+	write_pattern(ctx, out);
+	CHECK(fz_tell_output(ctx, out) == DATA_LEN);
+	fz_close_output(ctx, out);
+	fz_drop_output(ctx, out);
+
+	CHECK(check_pattern(buf));
+	fz_drop_buffer(ctx, buf);
+}
+
+static void fail_write(fz_context *ctx, void *opaque, const void *data, size_t len)
+{
+	fz_throw(ctx, FZ_ERROR_GENERIC, "test write error");
+}
+
+/* Errors on the writer thread surface on the caller's side. */
+static void test_write_error(fz_context *ctx)
+{
+	fz_output *out = NULL;
+	int caught = 0;
+
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		out = mu_new_async_output(ctx, fz_new_output(ctx, 0, NULL, fail_write, NULL, NULL), 2, 100);
+		write_pattern(ctx, out);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+	{
+		caught = 1;
+		CHECK(strstr(fz_caught_message(ctx), "test write error") != NULL);
+	}
+	CHECK(caught);
+}
+
+/* Fail each allocation in turn, and check that nothing leaks. */
+static void test_alloc_failures(fz_context *ctx)
+{
+	fz_buffer *buf = NULL;
+	fz_output *out = NULL;
+	int base, n, ok;
+
+	fz_var(buf);
+	fz_var(out);
+
+	for (n = 0; ; n++)
+	{
+		base = mu_test_live(ctx);
+		buf = NULL;
+		out = NULL;
+		ok = 0;
+
+		fz_try(ctx)
+		{
+			buf = fz_new_buffer(ctx, DATA_LEN);
+			mu_test_fail_countdown = n;
+			out = mu_new_async_output(ctx, fz_new_output_with_buffer(ctx, buf), 3, 1000);
+			write_pattern(ctx, out);
+			fz_close_output(ctx, out);
+			ok = (mu_test_fail_countdown != 0);
+		}
+		fz_always(ctx)
+		{
+			mu_test_fail_countdown = -1;
+			fz_drop_output(ctx, out);
+			fz_drop_buffer(ctx, buf);
+		}
+		fz_catch(ctx)
+			ok = 0;
+
+		CHECK(mu_test_live(ctx) == base);
+		if (ok || n > 1000)
+			break;
+	}
+	CHECK(n > 0);
+}
+
+/* Failures are expected, so keep them quiet. */
+static void quiet(void *user, const char *message)
+{
+}
+
+int main(int argc, char **argv)
+{
+	fz_locks_context *locks;
+	fz_context *ctx;
+	int base;
+
+	/* Without locks, the output cannot be shared with a thread. */
+	ctx = fz_new_context(mu_test_alloc(), NULL, FZ_STORE_DEFAULT);
+	base = mu_test_live(ctx);
+	test_roundtrip(ctx, 0);
+	CHECK(mu_test_live(ctx) == base);
+	fz_drop_context(ctx);
+
+	locks = mu_new_locks();
+	CHECK(locks != NULL);
+	ctx = fz_new_context(mu_test_alloc(), locks, FZ_STORE_DEFAULT);
+	fz_set_error_callback(ctx, quiet, NULL);
+	fz_set_warning_callback(ctx, quiet, NULL);
+	base = mu_test_live(ctx);
+	test_roundtrip(ctx, 1);
+	test_write_error(ctx);
+	test_alloc_failures(ctx);
+	CHECK(mu_test_live(ctx) == base);
+	fz_drop_context(ctx);
+	mu_drop_locks(locks);
+
+	CHECK(mu_test_live_blocks == 0);
+
+	return mu_test_result("async-output-test");
+}
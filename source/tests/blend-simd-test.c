@@ -0,0 +1,167 @@
+/*
+ * blend-simd-test -- check the SIMD group blenders against the plain C
+ * ones.
+ *
+ * Random groups are blended onto random backdrops in every blend mode,
+ * isolated, non-isolated and knockout, for gray, rgb and cmyk with and
+ * without alpha. The results at each SIMD level the CPU supports must
+ * match the plain C code bit for bit.
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/draw-imp.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#if FZ_ENABLE_SIMD
+
+#define ITERATIONS 40
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int rnd_alpha(void)
+{
+	switch (rnd() % 4)
+	{
+	case 0: return 0;
+	case 1: return 255;
+	default: return rnd() & 255;
+	}
+}
+
+/* Fill a pixmap with random (premultiplied, if it has alpha) pixels. */
+static void fill_random(fz_pixmap *pix)
+{
+	int n1 = pix->n - pix->alpha;
+	unsigned char *p;
+	int x, y, k, a;
+
+	for (y = 0; y < pix->h; y++)
+	{
+		p = pix->samples + y * (size_t)pix->stride;
+		for (x = 0; x < pix->w; x++)
+		{
+			a = pix->alpha ? rnd_alpha() : 255;
+			for (k = 0; k < n1; k++)
+				*p++ = (rnd() & 255) * a / 255;
+			if (pix->alpha)
+				*p++ = a;
+		}
+	}
+}
+
+/* A pixmap somewhere around the origin, so the groups only partly overlap. */
+static fz_pixmap *new_pixmap(fz_context *ctx, fz_colorspace *cs, int alpha)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, 1 + rnd() % 40, 1 + rnd() % 8, NULL, alpha);
+	pix->x = rnd() % 8;
+	pix->y = rnd() % 4;
+	fill_random(pix);
+	return pix;
+}
+
+static int same_samples(fz_pixmap *a, fz_pixmap *b)
+{
+	return !memcmp(a->samples, b->samples, (size_t)a->stride * a->h);
+}
+
+/* isolated is 0 or 1 for fz_blend_pixmap, or -1 for a knockout group. */
+static void test_blend(fz_context *ctx, int level, fz_colorspace *cs, int alpha, int blendmode, int isolated)
+{
+	fz_pixmap *src, *dst, *shape, *c_src, *c_dst, *simd_src, *simd_dst;
+	int i, group_alpha;
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		src = new_pixmap(ctx, cs, alpha);
+		dst = new_pixmap(ctx, cs, alpha);
+		shape = fz_new_pixmap(ctx, NULL, 48, 12, NULL, 1);
+		fill_random(shape);
+		group_alpha = rnd_alpha();
+
+		fz_limit_simd_level(FZ_SIMD_NONE);
+		c_src = fz_clone_pixmap(ctx, src);
+		c_dst = fz_clone_pixmap(ctx, dst);
+		if (isolated < 0)
+			fz_blend_pixmap_knockout(ctx, c_dst, c_src, shape);
+		else
+			fz_blend_pixmap(ctx, c_dst, c_src, group_alpha, blendmode, isolated, shape);
+
+		fz_limit_simd_level(level);
+		simd_src = fz_clone_pixmap(ctx, src);
+		simd_dst = fz_clone_pixmap(ctx, dst);
+		if (isolated < 0)
+			fz_blend_pixmap_knockout(ctx, simd_dst, simd_src, shape);
+		else
+			fz_blend_pixmap(ctx, simd_dst, simd_src, group_alpha, blendmode, isolated, shape);
+
+		CHECK(same_samples(simd_dst, c_dst));
+		CHECK(same_samples(simd_src, c_src));
+		if (!same_samples(simd_dst, c_dst) || !same_samples(simd_src, c_src))
+		{
+			fprintf(stderr, "blend: level=%d n=%d alpha=%d mode=%s isolated=%d group_alpha=%d\n",
+				level, fz_colorspace_n(ctx, cs), alpha, fz_blendmode_name(blendmode), isolated, group_alpha);
+			i = ITERATIONS;
+		}
+
+		fz_drop_pixmap(ctx, src);
+		fz_drop_pixmap(ctx, dst);
+		fz_drop_pixmap(ctx, shape);
+		fz_drop_pixmap(ctx, c_src);
+		fz_drop_pixmap(ctx, c_dst);
+		fz_drop_pixmap(ctx, simd_src);
+		fz_drop_pixmap(ctx, simd_dst);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_colorspace *cs[3];
+	int best = fz_simd_level();
+	int level, i, alpha, mode, isolated;
+
+	cs[0] = fz_device_gray(ctx);
+	cs[1] = fz_device_rgb(ctx);
+	cs[2] = fz_device_cmyk(ctx);
+
+	if (best == FZ_SIMD_NONE)
+		fprintf(stderr, "blend-simd-test: no SIMD support; nothing to compare\n");
+
+	for (level = FZ_SIMD_SSE4_1; level <= best; level++)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			for (alpha = 0; alpha <= 1; alpha++)
+			{
+				for (mode = FZ_BLEND_NORMAL; mode <= FZ_BLEND_LUMINOSITY; mode++)
+					for (isolated = 0; isolated <= 1; isolated++)
+						test_blend(ctx, level, cs[i], alpha, mode, isolated);
+				test_blend(ctx, level, cs[i], alpha, FZ_BLEND_NORMAL, -1);
+			}
+		}
+	}
+
+	fz_limit_simd_level(best);
+	fz_drop_context(ctx);
+	return mu_test_result("blend-simd-test");
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+	fprintf(stderr, "blend-simd-test: skipped; built without FZ_ENABLE_SIMD\n");
+	return EXIT_SUCCESS;
+}
+
+#endif
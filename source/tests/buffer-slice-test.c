@@ -0,0 +1,199 @@
+/*
+ * buffer-slice-test -- check that buffer slices survive changes to the
+ * buffers they were taken from.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define DATA_LEN (1000)
+
+static fz_buffer *new_pattern_buffer(fz_context *ctx, int seed)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, DATA_LEN);
+	int i;
+	for (i = 0; i < DATA_LEN; i++)
+		fz_append_byte(ctx, buf, i * 7 + seed);
+	return buf;
+}
+
+static int check_pattern(fz_buffer *buf, int offset, int len, int seed)
+{
+	int i;
+	if ((int)buf->len != len)
+		return 0;
+	for (i = 0; i < len; i++)
+		if (buf->data[i] != (unsigned char)((offset + i) * 7 + seed))
+			return 0;
+	return 1;
+}
+
+static int shares_storage(fz_buffer *slice, fz_buffer *buf)
+{
+	return slice->data >= buf->data && slice->data + slice->len <= buf->data + buf->len;
+}
+
+/* Resize, grow, trim and refill a buffer that has been sliced. */
+static void test_change_parent(fz_context *ctx)
+{
+	fz_buffer *parent = new_pattern_buffer(ctx, 1);
+	fz_buffer *a = fz_new_buffer_slice(ctx, parent, 100, 200);
+	fz_buffer *b = fz_new_buffer_slice(ctx, a, 50, 50);
+	fz_buffer *c;
+	int i;
+
+	CHECK(shares_storage(a, parent));
+	CHECK(shares_storage(b, parent));
+	CHECK(check_pattern(parent, 0, DATA_LEN, 1));
+
+	/* Growing the parent moves its storage. */
+	fz_resize_buffer(ctx, parent, 1 << 20);
+	CHECK(check_pattern(parent, 0, DATA_LEN, 1));
+	CHECK(check_pattern(a, 100, 200, 1));
+	CHECK(check_pattern(b, 150, 50, 1));
+
+	/* Appending to it, and slicing it again. */
+	for (i = 0; i < 100000; i++)
+		fz_append_byte(ctx, parent, 0);
+	c = fz_new_buffer_slice(ctx, parent, 10, 20);
+	CHECK(check_pattern(c, 10, 20, 1));
+	fz_trim_buffer(ctx, parent);
+	CHECK(check_pattern(a, 100, 200, 1));
+	CHECK(check_pattern(c, 10, 20, 1));
+
+	/* Refilling it in place. */
+	fz_clear_buffer(ctx, parent);
+	for (i = 0; i < DATA_LEN; i++)
+		fz_append_byte(ctx, parent, 0xff);
+	CHECK(check_pattern(a, 100, 200, 1));
+	CHECK(check_pattern(b, 150, 50, 1));
+	CHECK(check_pattern(c, 10, 20, 1));
+
+	/* The slices outlive the parent. */
+	fz_drop_buffer(ctx, parent);
+	CHECK(check_pattern(a, 100, 200, 1));
+	CHECK(check_pattern(b, 150, 50, 1));
+
+	fz_drop_buffer(ctx, a);
+	fz_drop_buffer(ctx, b);
+	fz_drop_buffer(ctx, c);
+}
+
+/* Change a slice, and check that the data it shares is untouched. */
+static void test_change_slice(fz_context *ctx)
+{
+	fz_buffer *parent = new_pattern_buffer(ctx, 2);
+	fz_buffer *a = fz_new_buffer_slice(ctx, parent, 0, 100);
+	fz_buffer *b = fz_new_buffer_slice(ctx, parent, 100, 100);
+	unsigned char *data;
+	size_t len;
+
+	fz_append_byte(ctx, a, 0);
+	CHECK(a->len == 101);
+	CHECK(!shares_storage(a, parent));
+
+	fz_clear_buffer(ctx, b);
+	fz_append_string(ctx, b, "overwritten");
+	CHECK(check_pattern(parent, 0, DATA_LEN, 2));
+
+	len = fz_buffer_extract(ctx, b, &data);
+	CHECK(len == 11 && !memcmp(data, "overwritten", 11));
+	fz_free(ctx, data);
+
+	fz_drop_buffer(ctx, parent);
+	fz_drop_buffer(ctx, a);
+	fz_drop_buffer(ctx, b);
+}
+
+/* Read a stream on a buffer, with and without the bomb checks. */
+static void test_read_best(fz_context *ctx)
+{
+	fz_buffer *parent = new_pattern_buffer(ctx, 3);
+	fz_buffer *big, *buf;
+	fz_stream *stm;
+	int truncated, caught;
+
+	stm = fz_open_buffer(ctx, parent);
+	fz_skip(ctx, stm, 10);
+	buf = fz_read_best(ctx, stm, 1, &truncated);
+	CHECK(!truncated);
+	CHECK(shares_storage(buf, parent));
+	CHECK(check_pattern(buf, 10, DATA_LEN - 10, 3));
+	fz_drop_stream(ctx, stm);
+	fz_drop_buffer(ctx, buf);
+
+	/* A source over 200 times the expected size is refused, as it
+	 * would be from any other stream. */
+	big = fz_new_buffer(ctx, (100 << 20) + 1);
+	memset(big->data, 0, big->cap);
+	big->len = big->cap;
+
+	caught = 0;
+	buf = NULL;
+	stm = fz_open_buffer(ctx, big);
+	fz_try(ctx)
+		buf = fz_read_all(ctx, stm, 1000);
+	fz_catch(ctx)
+		caught = 1;
+	CHECK(caught);
+	CHECK(buf == NULL);
+	fz_drop_stream(ctx, stm);
+
+	stm = fz_open_buffer(ctx, big);
+	buf = fz_read_best(ctx, stm, 1000, &truncated);
+	CHECK(truncated);
+	CHECK(!shares_storage(buf, big));
+	fz_drop_stream(ctx, stm);
+	fz_drop_buffer(ctx, buf);
+
+	/* Without an expected size there is no check. */
+	stm = fz_open_buffer(ctx, big);
+	buf = fz_read_all(ctx, stm, 0);
+	CHECK(shares_storage(buf, big));
+	CHECK(buf->len == big->len);
+	fz_drop_stream(ctx, stm);
+	fz_drop_buffer(ctx, buf);
+
+	fz_drop_buffer(ctx, big);
+	fz_drop_buffer(ctx, parent);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	int base;
+
+	ctx = fz_new_context(mu_test_alloc(), NULL, FZ_STORE_DEFAULT);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		base = mu_test_live(ctx);
+		test_change_parent(ctx);
+		CHECK(mu_test_live(ctx) == base);
+
+		base = mu_test_live(ctx);
+		test_change_slice(ctx);
+		CHECK(mu_test_live(ctx) == base);
+
+		base = mu_test_live(ctx);
+		test_read_best(ctx);
+		CHECK(mu_test_live(ctx) == base);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	CHECK(mu_test_live_blocks == 0);
+
+	return mu_test_result("buffer-slice-test");
+}
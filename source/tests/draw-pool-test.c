@@ -0,0 +1,267 @@
+/*
+ * draw-pool-test -- check that the scratch pixmaps the draw device
+ * reuses, and the scissors it uses for pixel aligned clip rectangles,
+ * do not change what is drawn.
+ *
+ * Random nests of clips, groups, knockout groups and soft masks are
+ * drawn, one after the other, twice over on a single device, so that
+ * later ones are drawn with pixmaps left over from earlier ones. The
+ * results must match drawing each nest on a device of its own, which
+ * has next to nothing to reuse.
+ *
+ * Content clipped by rectangles on pixel boundaries must also match
+ * the same content clipped by a path of two abutting rectangles, which
+ * is drawn through a mask.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define NESTS 40
+#define PAGE 300
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static float rndf(float lo, float hi)
+{
+	return lo + (hi - lo) * (rnd() & 0xffff) / 65535.0f;
+}
+
+static fz_rect random_rect(void)
+{
+	fz_rect r;
+	r.x0 = rndf(-20, PAGE);
+	r.y0 = rndf(-20, PAGE);
+	r.x1 = r.x0 + rndf(1, 150);
+	r.y1 = r.y0 + rndf(1, 150);
+	return r;
+}
+
+static fz_rect aligned_rect(void)
+{
+	fz_rect r;
+	r.x0 = rnd() % PAGE;
+	r.y0 = rnd() % PAGE;
+	r.x1 = r.x0 + 2 + 2 * (rnd() % 75);
+	r.y1 = r.y0 + 1 + rnd() % 150;
+	return r;
+}
+
+static void add_rect(fz_context *ctx, fz_path *path, fz_rect r)
+{
+	fz_moveto(ctx, path, r.x0, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y1);
+	fz_lineto(ctx, path, r.x0, r.y1);
+	fz_closepath(ctx, path);
+}
+
+static void fill_rects(fz_context *ctx, fz_device *dev, int len)
+{
+	fz_path *path;
+	float color[3];
+
+	while (len--)
+	{
+		color[0] = rndf(0, 1);
+		color[1] = rndf(0, 1);
+		color[2] = rndf(0, 1);
+		path = fz_new_path(ctx);
+		add_rect(ctx, path, random_rect());
+		fz_fill_path(ctx, dev, path, 0, fz_rotate(rndf(-20, 20)), fz_device_rgb(ctx), color, rndf(0.2f, 1), fz_default_color_params);
+		fz_drop_path(ctx, path);
+	}
+}
+
+/* A chain of clips and groups, each inside the last, with a soft mask
+ * or some plain fills innermost. Apart from the pixmaps for each fill
+ * in a knockout group, nothing is popped until everything has been
+ * pushed, so a device drawing one of these on its own has next to
+ * nothing to reuse. */
+static void draw_nest(fz_context *ctx, fz_device *dev, unsigned int nest_seed)
+{
+	float color[3] = { 0 };
+	fz_path *path;
+	fz_rect r;
+	int depth = 1 + nest_seed % 4;
+	int kind[4];
+	int i;
+
+	seed = nest_seed;
+	for (i = 0; i < depth; i++)
+	{
+		r = random_rect();
+		kind[i] = rnd() % 3;
+		switch (kind[i])
+		{
+		case 0:
+			path = fz_new_path(ctx);
+			add_rect(ctx, path, r);
+			add_rect(ctx, path, random_rect());
+			fz_clip_path(ctx, dev, path, rnd() & 1, fz_rotate(rndf(-10, 10)), fz_infinite_rect);
+			fz_drop_path(ctx, path);
+			break;
+		case 1:
+			path = fz_new_path(ctx);
+			add_rect(ctx, path, aligned_rect());
+			fz_clip_path(ctx, dev, path, 0, fz_identity, fz_infinite_rect);
+			fz_drop_path(ctx, path);
+			break;
+		case 2:
+			fz_begin_group(ctx, dev, fz_expand_rect(r, 50), NULL, rnd() & 1, rnd() & 1, rnd() % 16, rndf(0.3f, 1));
+			fill_rects(ctx, dev, 1 + rnd() % 3);
+			break;
+		}
+	}
+
+	if (rnd() & 1)
+	{
+		fz_begin_mask(ctx, dev, fz_expand_rect(random_rect(), 50), rnd() & 1, fz_device_gray(ctx), color, fz_default_color_params);
+		fill_rects(ctx, dev, 1 + rnd() % 4);
+		fz_end_mask(ctx, dev);
+		fill_rects(ctx, dev, 1 + rnd() % 6);
+		fz_pop_clip(ctx, dev);
+	}
+	else
+		fill_rects(ctx, dev, 1 + rnd() % 6);
+
+	while (depth--)
+	{
+		if (kind[depth] == 2)
+			fz_end_group(ctx, dev);
+		else
+			fz_pop_clip(ctx, dev);
+	}
+}
+
+static fz_pixmap *new_page(fz_context *ctx, int alpha)
+{
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), fz_make_irect(0, 0, PAGE, PAGE), NULL, alpha);
+	if (alpha)
+		fz_clear_pixmap(ctx, pix);
+	else
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+	return pix;
+}
+
+static int same_samples(fz_pixmap *a, fz_pixmap *b)
+{
+	return !memcmp(a->samples, b->samples, (size_t)a->stride * a->h);
+}
+
+static void test_pool(fz_context *ctx, int alpha)
+{
+	fz_pixmap *ref = new_page(ctx, alpha);
+	fz_pixmap *pix = new_page(ctx, alpha);
+	fz_device *dev;
+	int i, pass;
+
+	for (i = 0; i < NESTS; i++)
+	{
+		dev = fz_new_draw_device(ctx, fz_identity, ref);
+		draw_nest(ctx, dev, 1000 + i * 7);
+		fz_close_device(ctx, dev);
+		fz_drop_device(ctx, dev);
+	}
+
+	dev = fz_new_draw_device(ctx, fz_identity, pix);
+	for (pass = 0; pass < 2; pass++)
+	{
+		if (alpha)
+			fz_clear_pixmap(ctx, pix);
+		else
+			fz_clear_pixmap_with_value(ctx, pix, 0xff);
+		for (i = 0; i < NESTS; i++)
+			draw_nest(ctx, dev, 1000 + i * 7);
+		CHECK(same_samples(pix, ref));
+		if (!same_samples(pix, ref))
+			fprintf(stderr, "draw-pool-test: pass %d differs (alpha=%d)\n", pass, alpha);
+	}
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+
+	fz_drop_pixmap(ctx, pix);
+	fz_drop_pixmap(ctx, ref);
+}
+
+static void draw_clipped(fz_context *ctx, fz_pixmap *pix, fz_path *clip)
+{
+	fz_device *dev = fz_new_draw_device(ctx, fz_identity, pix);
+	unsigned int saved = seed;
+
+	fz_clip_path(ctx, dev, clip, 0, fz_identity, fz_infinite_rect);
+	fill_rects(ctx, dev, 20);
+	fz_pop_clip(ctx, dev);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	seed = saved;
+}
+
+static void test_aligned_clip(fz_context *ctx)
+{
+	fz_pixmap *scissored, *masked;
+	fz_path *whole, *halves;
+	fz_rect r;
+	int i;
+
+	for (i = 0; i < 20; i++)
+	{
+		/* An even width, so that it can be split on a whole pixel. */
+		r = aligned_rect();
+		whole = fz_new_path(ctx);
+		add_rect(ctx, whole, r);
+		halves = fz_new_path(ctx);
+		add_rect(ctx, halves, fz_make_rect(r.x0, r.y0, (r.x0 + r.x1) / 2, r.y1));
+		add_rect(ctx, halves, fz_make_rect((r.x0 + r.x1) / 2, r.y0, r.x1, r.y1));
+
+		scissored = new_page(ctx, i & 1);
+		masked = new_page(ctx, i & 1);
+		draw_clipped(ctx, scissored, whole);
+		draw_clipped(ctx, masked, halves);
+		rnd();
+		CHECK(same_samples(scissored, masked));
+		if (!same_samples(scissored, masked))
+			fprintf(stderr, "draw-pool-test: clip [%g %g %g %g] differs\n", r.x0, r.y0, r.x1, r.y1);
+
+		fz_drop_pixmap(ctx, scissored);
+		fz_drop_pixmap(ctx, masked);
+		fz_drop_path(ctx, whole);
+		fz_drop_path(ctx, halves);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		test_pool(ctx, 0);
+		test_pool(ctx, 1);
+		test_aligned_clip(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	return mu_test_result("draw-pool-test");
+}
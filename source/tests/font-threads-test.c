@@ -0,0 +1,201 @@
+/*
+ * font-threads-test -- check that glyphs render the same on several
+ * threads at once as they do on one.
+ *
+ * Glyphs of a CFF font and a TrueType font are rendered, hinted and
+ * antialiased, plain and with fake bold, on the calling thread. Then
+ * several threads, each with a clone of the context, render them all
+ * again at the same time, and must get the same pixels. With
+ * FZ_ENABLE_FT_CONTEXT_FACES each clone loads them from a FreeType face
+ * of its own, so this also checks that those faces behave just like
+ * the font's shared one.
+ *
+ * The glyph advances of a second copy of each font, whose advance cache
+ * starts out empty, are also read by several threads at once, and must
+ * match those of the first copy.
+ *
+ * The TrueType font is read from resources/fonts, so run this from the
+ * top of the source tree, or give the path of another font.
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/helpers/mu-threads.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define TRUETYPE_FONT "resources/fonts/noto/NotoSerifDevanagari-Regular.ttf"
+#define GLYPHS 80
+#define JOBS 4
+#define ROUNDS 3
+
+static const int aa_levels[] = { 0, 8 };
+
+typedef struct
+{
+	fz_font *font;
+	fz_matrix ctm[2];
+	unsigned int ref[2][nelem(aa_levels)][GLYPHS];
+	int failures[JOBS];
+} glyph_set;
+
+/* A hash of the glyph's position, size and pixels. */
+static unsigned int render(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, int aa)
+{
+	fz_pixmap *pix = fz_render_glyph_pixmap(ctx, font, gid, &ctm, NULL, aa);
+	unsigned int h = 5381;
+	int i, len;
+
+	if (!pix)
+		return 0;
+	h = h * 33 + pix->x;
+	h = h * 33 + pix->y;
+	h = h * 33 + pix->w;
+	h = h * 33 + pix->h;
+	len = pix->stride * pix->h;
+	for (i = 0; i < len; i++)
+		h = h * 33 + pix->samples[i];
+	fz_drop_pixmap(ctx, pix);
+	return h;
+}
+
+static void render_all(fz_context *ctx, glyph_set *set, unsigned int out[2][nelem(aa_levels)][GLYPHS])
+{
+	int m, a, gid;
+
+	for (m = 0; m < 2; m++)
+		for (a = 0; a < (int)nelem(aa_levels); a++)
+			for (gid = 0; gid < GLYPHS; gid++)
+				out[m][a][gid] = render(ctx, set->font, gid, set->ctm[m], aa_levels[a]);
+}
+
+static void job(fz_context *ctx, void *arg, int index)
+{
+	glyph_set *set = arg;
+	unsigned int got[2][nelem(aa_levels)][GLYPHS];
+	int round;
+
+	for (round = 0; round < ROUNDS; round++)
+	{
+		render_all(ctx, set, got);
+		if (memcmp(got, set->ref, sizeof got))
+			set->failures[index]++;
+	}
+}
+
+typedef struct
+{
+	fz_font *font;
+	int count;
+	float *ref;
+	int failures[JOBS];
+} advance_set;
+
+/* Each job starts at a different glyph, so that they race to fill in
+ * different pages of the cache. */
+static void advance_job(fz_context *ctx, void *arg, int index)
+{
+	advance_set *set = arg;
+	int k, i;
+
+	for (k = 0; k < set->count * 2; k++)
+	{
+		i = (k + index * 97) % (set->count * 2);
+		if (fz_advance_glyph(ctx, set->font, i >> 1, i & 1) != set->ref[i])
+			set->failures[index]++;
+	}
+}
+
+static void test_advances(fz_context *ctx, fz_font *font, fz_font *copy)
+{
+	advance_set set = { copy };
+	int i;
+
+	set.count = font->glyph_count;
+	set.ref = fz_malloc_array(ctx, set.count * 2, float);
+	for (i = 0; i < set.count * 2; i++)
+		set.ref[i] = fz_advance_glyph(ctx, font, i >> 1, i & 1);
+
+	mu_run_parallel(NULL, ctx, JOBS, advance_job, &set);
+	for (i = 0; i < JOBS; i++)
+	{
+		CHECK(set.failures[i] == 0);
+		if (set.failures[i])
+			fprintf(stderr, "font-threads-test: %s advances differ on job %d\n",
+				fz_font_name(ctx, font), i);
+	}
+
+	fz_free(ctx, set.ref);
+}
+
+static void test_font(fz_context *ctx, fz_font *font)
+{
+	glyph_set *set = fz_malloc_struct(ctx, glyph_set);
+	int i, bold;
+
+	set->font = font;
+	set->ctm[0] = fz_scale(12, -12);
+	set->ctm[1] = fz_concat(fz_scale(37.5f, -41), fz_rotate(17));
+
+	for (bold = 0; bold < 2; bold++)
+	{
+		font->flags.fake_bold = bold;
+		render_all(ctx, set, set->ref);
+		memset(set->failures, 0, sizeof set->failures);
+		mu_run_parallel(NULL, ctx, JOBS, job, set);
+		for (i = 0; i < JOBS; i++)
+		{
+			CHECK(set->failures[i] == 0);
+			if (set->failures[i])
+				fprintf(stderr, "font-threads-test: %s%s differs on job %d\n",
+					fz_font_name(ctx, font), bold ? " (fake bold)" : "", i);
+		}
+	}
+	font->flags.fake_bold = 0;
+
+	fz_free(ctx, set);
+}
+
+int main(int argc, char **argv)
+{
+	fz_locks_context *locks = mu_new_locks();
+	const char *path = argc > 1 ? argv[1] : TRUETYPE_FONT;
+	const unsigned char *data;
+	fz_context *ctx;
+	fz_font *font, *copy;
+	int len;
+
+	if (!locks)
+	{
+		fprintf(stderr, "cannot create locks\n");
+		return EXIT_FAILURE;
+	}
+	ctx = fz_new_context(NULL, locks, FZ_STORE_DEFAULT);
+
+	fz_try(ctx)
+	{
+		font = fz_new_base14_font(ctx, "Times-Roman");
+		data = fz_lookup_base14_font(ctx, "Times-Roman", &len);
+		copy = fz_new_font_from_memory(ctx, "Times-Roman", data, len, 0, 0);
+		test_font(ctx, font);
+		test_advances(ctx, font, copy);
+		fz_drop_font(ctx, copy);
+		fz_drop_font(ctx, font);
+
+		font = fz_new_font_from_file(ctx, NULL, path, 0, 0);
+		copy = fz_new_font_from_file(ctx, NULL, path, 0, 0);
+		test_font(ctx, font);
+		test_advances(ctx, font, copy);
+		fz_drop_font(ctx, copy);
+		fz_drop_font(ctx, font);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	mu_drop_locks(locks);
+	return mu_test_result("font-threads-test");
+}
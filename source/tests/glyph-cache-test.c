@@ -0,0 +1,384 @@
+/*
+ * glyph-cache-test -- check that each shard of the glyph cache keeps
+ * to its share of the limit, dropping its least recently used glyphs
+ * first, and that the cache holds up when several threads use it.
+ *
+ * The glyphs of a font are first rendered once each, to learn which
+ * shard each falls in and how many bytes it takes there. Then, under a
+ * limit too small for them all, they are rendered again in an order
+ * that revisits some, and after every glyph the size, hits, misses and
+ * evictions of each shard must match those of a simple model of an
+ * LRU list per shard. Lowering the limit further must evict down to
+ * the new share at once.
+ *
+ * Finally several threads render all the glyphs at the same time,
+ * under the small limit, and must get the same pixels as before, with
+ * every lookup counted once and no shard over its share.
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/helpers/mu-threads.h"
+#include "mu-test.h"
+#include "../fitz/glyph-imp.h"
+
+#include <string.h>
+
+#define SHARDS FZ_GLYPH_CACHE_SHARDS
+#define GLYPHS 64
+#define JOBS 4
+#define ROUNDS 3
+
+typedef struct
+{
+	size_t total[SHARDS];
+	int hits[SHARDS];
+	int misses[SHARDS];
+	int evictions[SHARDS];
+} cache_stats;
+
+typedef struct
+{
+	fz_font *font;
+	fz_matrix ctm;
+	int count;
+	int gid[GLYPHS];
+	int shard[GLYPHS];
+	size_t size[GLYPHS];
+	unsigned int ref[GLYPHS];
+	int failures[JOBS];
+} glyph_set;
+
+/* What the cache should hold: the glyphs of each shard, least recently
+ * used first, and the counts it should report. */
+typedef struct
+{
+	size_t share;
+	int lru[SHARDS][GLYPHS];
+	int len[SHARDS];
+	cache_stats stats;
+} cache_model;
+
+static void read_stats(fz_context *ctx, cache_stats *stats)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 1024);
+	fz_output *out = NULL;
+	const char *s;
+	int i;
+
+	fz_var(out);
+
+	memset(stats, 0, sizeof *stats);
+	fz_try(ctx)
+	{
+		out = fz_new_output_with_buffer(ctx, buf);
+		fz_dump_glyph_cache_stats(ctx, out);
+		fz_close_output(ctx, out);
+		s = fz_string_from_buffer(ctx, buf);
+		while ((s = strstr(s, "Glyph Cache Shard ")) != NULL)
+		{
+			size_t total;
+			int hits, misses, evictions;
+			if (sscanf(s, "Glyph Cache Shard %d: %zu bytes, %d hits, %d misses, %d evictions",
+					&i, &total, &hits, &misses, &evictions) == 5 && i >= 0 && i < SHARDS)
+			{
+				stats->total[i] = total;
+				stats->hits[i] = hits;
+				stats->misses[i] = misses;
+				stats->evictions[i] = evictions;
+			}
+			s++;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* A hash of the glyph's position, size and pixels, through the cache. */
+static unsigned int render(fz_context *ctx, glyph_set *set, int i)
+{
+	fz_matrix ctm = set->ctm;
+	fz_glyph *glyph = fz_render_glyph(ctx, set->font, set->gid[i], &ctm, NULL, &fz_infinite_irect, 0, 8);
+	unsigned int h = 5381;
+	size_t k, len;
+	unsigned char *p;
+
+	if (!glyph)
+		return 0;
+	h = h * 33 + glyph->x;
+	h = h * 33 + glyph->y;
+	h = h * 33 + glyph->w;
+	h = h * 33 + glyph->h;
+	if (glyph->pixmap)
+	{
+		p = glyph->pixmap->samples;
+		len = (size_t)glyph->pixmap->stride * glyph->pixmap->h;
+	}
+	else
+	{
+		p = glyph->data;
+		len = glyph->size;
+	}
+	for (k = 0; k < len; k++)
+		h = h * 33 + p[k];
+	fz_drop_glyph(ctx, glyph);
+	return h;
+}
+
+/* Render each glyph once into an empty cache, and keep those that
+ * land in it, with the shard they land in and the bytes they take. */
+static void learn_glyphs(fz_context *ctx, glyph_set *set)
+{
+	cache_stats before, after;
+	int gid, i, s, grown;
+
+	fz_set_glyph_cache_limits(ctx, 0, 0);
+	fz_purge_glyph_cache(ctx);
+
+	set->count = 0;
+	for (gid = 1; gid < set->font->glyph_count && set->count < GLYPHS; gid++)
+	{
+		i = set->count;
+		set->gid[i] = gid;
+		read_stats(ctx, &before);
+		set->ref[i] = render(ctx, set, i);
+		read_stats(ctx, &after);
+		grown = 0;
+		for (s = 0; s < SHARDS; s++)
+		{
+			if (after.total[s] != before.total[s])
+			{
+				set->shard[i] = s;
+				set->size[i] = after.total[s] - before.total[s];
+				grown++;
+			}
+		}
+		if (grown == 1)
+			set->count++;
+	}
+}
+
+/* Make the model's counts those of the (empty) cache, and its share
+ * that of the given limit. */
+static void start_model(fz_context *ctx, cache_model *model, size_t limit)
+{
+	memset(model, 0, sizeof *model);
+	model->share = limit / SHARDS;
+	read_stats(ctx, &model->stats);
+}
+
+static void model_evict(cache_model *model, glyph_set *set, int s)
+{
+	while (model->stats.total[s] > model->share && model->len[s] > 0)
+	{
+		model->stats.total[s] -= set->size[model->lru[s][0]];
+		model->stats.evictions[s]++;
+		memmove(&model->lru[s][0], &model->lru[s][1], --model->len[s] * sizeof(int));
+	}
+}
+
+static void model_use(cache_model *model, glyph_set *set, int i)
+{
+	int s = set->shard[i];
+	int k;
+
+	for (k = 0; k < model->len[s]; k++)
+		if (model->lru[s][k] == i)
+			break;
+	if (k < model->len[s])
+	{
+		model->stats.hits[s]++;
+		memmove(&model->lru[s][k], &model->lru[s][k + 1], (model->len[s] - k - 1) * sizeof(int));
+		model->lru[s][model->len[s] - 1] = i;
+		return;
+	}
+	model->stats.misses[s]++;
+	model->lru[s][model->len[s]++] = i;
+	model->stats.total[s] += set->size[i];
+	model_evict(model, set, s);
+}
+
+static int check_model(fz_context *ctx, cache_model *model, const char *what, int i)
+{
+	cache_stats got;
+	int s;
+
+	read_stats(ctx, &got);
+	for (s = 0; s < SHARDS; s++)
+	{
+		if (got.total[s] != model->stats.total[s] ||
+			got.hits[s] != model->stats.hits[s] ||
+			got.misses[s] != model->stats.misses[s] ||
+			got.evictions[s] != model->stats.evictions[s])
+		{
+			fprintf(stderr, "glyph-cache-test: %s %d: shard %d has %zu bytes, %d hits, %d misses, %d evictions; expected %zu, %d, %d, %d\n",
+				what, i, s, got.total[s], got.hits[s], got.misses[s], got.evictions[s],
+				model->stats.total[s], model->stats.hits[s], model->stats.misses[s], model->stats.evictions[s]);
+			return 0;
+		}
+		if (got.total[s] > model->share)
+		{
+			fprintf(stderr, "glyph-cache-test: %s %d: shard %d over its share\n", what, i, s);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void use(fz_context *ctx, cache_model *model, glyph_set *set, int i, const char *what)
+{
+	unsigned int h = render(ctx, set, i);
+
+	model_use(model, set, i);
+	CHECK(h == set->ref[i]);
+	CHECK(check_model(ctx, model, what, i));
+}
+
+static void test_eviction(fz_context *ctx, glyph_set *set)
+{
+	cache_model *model = fz_malloc_struct(ctx, cache_model);
+	size_t all = 0, limit;
+	int i, s, evictions = 0;
+
+	for (i = 0; i < set->count; i++)
+		all += set->size[i];
+	limit = all / 3;
+
+	fz_purge_glyph_cache(ctx);
+	fz_set_glyph_cache_limits(ctx, limit, 0);
+	start_model(ctx, model, limit);
+
+	/* Fill past the limit, going back to some glyphs as we go, so that
+	 * the least recently used are not simply the first rendered. */
+	for (i = 0; i < set->count; i++)
+	{
+		use(ctx, model, set, i, "fill");
+		if (i % 5 == 4)
+			use(ctx, model, set, i - 3, "revisit");
+	}
+	for (s = 0; s < SHARDS; s++)
+		evictions += model->stats.evictions[s];
+	CHECK(evictions > 0);
+
+	/* The glyphs still held are hits, the others misses. */
+	for (i = set->count - 1; i >= 0; i--)
+		use(ctx, model, set, i, "again");
+
+	/* Lowering the limit evicts the least recently used at once. */
+	fz_set_glyph_cache_limits(ctx, limit / 2, 0);
+	model->share = limit / 2 / SHARDS;
+	for (s = 0; s < SHARDS; s++)
+		model_evict(model, set, s);
+	CHECK(check_model(ctx, model, "lower", 0));
+	for (i = 0; i < set->count; i++)
+		use(ctx, model, set, i, "lowered");
+
+	fz_free(ctx, model);
+}
+
+/* Each job starts at a different glyph, so that they race to fill and
+ * evict different entries of each shard. */
+static void job(fz_context *ctx, void *arg, int index)
+{
+	glyph_set *set = arg;
+	int round, k, i;
+
+	for (round = 0; round < ROUNDS; round++)
+	{
+		for (k = 0; k < set->count; k++)
+		{
+			i = (k + index * 17) % set->count;
+			if (render(ctx, set, i) != set->ref[i])
+				set->failures[index]++;
+		}
+	}
+}
+
+static void test_threads(fz_context *ctx, glyph_set *set)
+{
+	cache_stats before, after;
+	size_t all = 0, limit;
+	int i, s, lookups = 0;
+
+	for (i = 0; i < set->count; i++)
+		all += set->size[i];
+	limit = all / 3;
+
+	fz_purge_glyph_cache(ctx);
+	fz_set_glyph_cache_limits(ctx, limit, 0);
+	read_stats(ctx, &before);
+
+	memset(set->failures, 0, sizeof set->failures);
+	mu_run_parallel(NULL, ctx, JOBS, job, set);
+	for (i = 0; i < JOBS; i++)
+	{
+		CHECK(set->failures[i] == 0);
+		if (set->failures[i])
+			fprintf(stderr, "glyph-cache-test: glyphs differ on job %d\n", i);
+	}
+
+	read_stats(ctx, &after);
+	for (s = 0; s < SHARDS; s++)
+	{
+		CHECK(after.total[s] <= limit / SHARDS);
+		lookups += after.hits[s] - before.hits[s];
+		lookups += after.misses[s] - before.misses[s];
+	}
+	CHECK(lookups == JOBS * ROUNDS * set->count);
+	if (lookups != JOBS * ROUNDS * set->count)
+		fprintf(stderr, "glyph-cache-test: %d lookups counted, expected %d\n",
+			lookups, JOBS * ROUNDS * set->count);
+}
+
+int main(int argc, char **argv)
+{
+	fz_locks_context *locks = mu_new_locks();
+	glyph_set *set = NULL;
+	fz_context *ctx;
+
+	if (!locks)
+	{
+		fprintf(stderr, "cannot create locks\n");
+		return EXIT_FAILURE;
+	}
+	ctx = fz_new_context(NULL, locks, FZ_STORE_DEFAULT);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		mu_drop_locks(locks);
+		return EXIT_FAILURE;
+	}
+
+	fz_var(set);
+
+	fz_try(ctx)
+	{
+		set = fz_malloc_struct(ctx, glyph_set);
+		set->font = fz_new_base14_font(ctx, "Times-Roman");
+		set->ctm = fz_scale(20, -20);
+		learn_glyphs(ctx, set);
+		CHECK(set->count == GLYPHS);
+		test_eviction(ctx, set);
+		test_threads(ctx, set);
+	}
+	fz_always(ctx)
+	{
+		if (set)
+			fz_drop_font(ctx, set->font);
+		fz_free(ctx, set);
+		fz_purge_glyph_cache(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	mu_drop_locks(locks);
+	return mu_test_result("glyph-cache-test");
+}
@@ -0,0 +1,282 @@
+/*
+ * list-index-test -- check that the display list index does not change
+ * what is run.
+ *
+ * Random lists of nested paths, images, clips, masks, groups, tiles and
+ * layers are recorded twice: once into a list that is indexed, and once
+ * into a list that is not. Both are then run through
+ * the trace device with random scissors and matrices, and must give the
+ * same trace and the same cookie progress.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define LISTS 10
+#define RUNS 40
+#define PAGE 1000
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static float rndf(float lo, float hi)
+{
+	return lo + (hi - lo) * (rnd() & 0xffff) / 65535.0f;
+}
+
+/* Drawings are mostly made piece by piece, so wander about the page. */
+static fz_point cursor;
+
+static fz_rect next_rect(void)
+{
+	fz_rect r;
+	if (rnd() % 50 == 0)
+	{
+		cursor.x = rndf(-100, PAGE + 100);
+		cursor.y = rndf(-100, PAGE + 100);
+	}
+	else
+	{
+		cursor.x += rndf(-15, 15);
+		cursor.y += rndf(-15, 15);
+	}
+	r.x0 = cursor.x;
+	r.y0 = cursor.y;
+	r.x1 = r.x0 + rndf(0.5f, (rnd() % 20) ? 20 : 400);
+	r.y1 = r.y0 + rndf(0.5f, (rnd() % 20) ? 20 : 400);
+	return r;
+}
+
+static fz_path *rect_path(fz_context *ctx, fz_rect r)
+{
+	fz_path *path = fz_new_path(ctx);
+	fz_moveto(ctx, path, r.x0, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y1);
+	fz_closepath(ctx, path);
+	return path;
+}
+
+typedef struct
+{
+	fz_device *dev;
+	fz_image *image;
+	fz_stroke_state *stroke;
+	int count;
+} content;
+
+static void draw_content(fz_context *ctx, content *c, int depth, int len);
+
+static void draw_item(fz_context *ctx, content *c, int depth)
+{
+	fz_colorspace *rgb = fz_device_rgb(ctx);
+	fz_colorspace *gray = fz_device_gray(ctx);
+	fz_color_params cp = fz_default_color_params;
+	fz_device *dev = c->dev;
+	float color[3] = { rndf(0, 1), rndf(0, 1), rndf(0, 1) };
+	float alpha = (rnd() & 3) ? 1 : rndf(0, 1);
+	fz_rect r = next_rect();
+	fz_matrix ctm = (rnd() & 3) ? fz_identity : fz_rotate(rndf(0, 360));
+	fz_path *path;
+	int kind = rnd() % 24;
+
+	c->count++;
+
+	/* Keep the nesting shallow and the lists finite. */
+	if (depth > 5 || c->count > 6000)
+		kind %= 8;
+
+	switch (kind)
+	{
+	default:
+		path = rect_path(ctx, r);
+		fz_fill_path(ctx, dev, path, rnd() & 1, ctm, (rnd() & 1) ? rgb : gray, color, alpha, cp);
+		fz_drop_path(ctx, path);
+		break;
+	case 4: case 5:
+		path = rect_path(ctx, r);
+		c->stroke->linewidth = rndf(0, 8);
+		fz_stroke_path(ctx, dev, path, c->stroke, ctm, rgb, color, alpha, cp);
+		fz_drop_path(ctx, path);
+		break;
+	case 6:
+		ctm = fz_concat(fz_scale(r.x1 - r.x0, r.y1 - r.y0), fz_translate(r.x0, r.y0));
+		fz_fill_image(ctx, dev, c->image, ctm, alpha, cp);
+		break;
+	case 7:
+		ctm = fz_concat(fz_scale(r.x1 - r.x0, r.y1 - r.y0), fz_translate(r.x0, r.y0));
+		fz_fill_image_mask(ctx, dev, c->image, ctm, rgb, color, alpha, cp);
+		break;
+	case 8: case 9: case 10:
+		path = rect_path(ctx, fz_expand_rect(r, rndf(0, 200)));
+		fz_clip_path(ctx, dev, path, rnd() & 1, ctm, fz_infinite_rect);
+		fz_drop_path(ctx, path);
+		draw_content(ctx, c, depth + 1, rnd() % 200);
+		fz_pop_clip(ctx, dev);
+		break;
+	case 11:
+		path = rect_path(ctx, r);
+		fz_clip_stroke_path(ctx, dev, path, c->stroke, ctm, fz_infinite_rect);
+		fz_drop_path(ctx, path);
+		draw_content(ctx, c, depth + 1, rnd() % 50);
+		fz_pop_clip(ctx, dev);
+		break;
+	case 12:
+		ctm = fz_concat(fz_scale(r.x1 - r.x0 + 100, r.y1 - r.y0 + 100), fz_translate(r.x0, r.y0));
+		fz_clip_image_mask(ctx, dev, c->image, ctm, fz_infinite_rect);
+		draw_content(ctx, c, depth + 1, rnd() % 50);
+		fz_pop_clip(ctx, dev);
+		break;
+	case 13: case 14:
+		fz_begin_mask(ctx, dev, fz_expand_rect(r, 100), rnd() & 1, gray, color, cp);
+		draw_content(ctx, c, depth + 1, rnd() % 20);
+		fz_end_mask(ctx, dev);
+		draw_content(ctx, c, depth + 1, rnd() % 100);
+		fz_pop_clip(ctx, dev);
+		break;
+	case 15: case 16: case 17:
+		fz_begin_group(ctx, dev, fz_expand_rect(r, 100), (rnd() & 1) ? rgb : NULL, rnd() & 1, rnd() & 1, rnd() % 16, alpha);
+		draw_content(ctx, c, depth + 1, rnd() % 200);
+		fz_end_group(ctx, dev);
+		break;
+	case 18:
+		fz_begin_tile(ctx, dev, fz_expand_rect(r, 100), fz_make_rect(0, 0, 10, 10), 10, 10, ctm);
+		draw_content(ctx, c, depth + 1, rnd() % 10);
+		fz_end_tile(ctx, dev);
+		break;
+	case 19: case 20:
+		fz_begin_layer(ctx, dev, "Layer");
+		draw_content(ctx, c, depth + 1, rnd() % 100);
+		fz_end_layer(ctx, dev);
+		break;
+	case 21:
+		if (rnd() & 1)
+			fz_render_flags(ctx, dev, FZ_DEVFLAG_GRIDFIT_AS_TILED, 0);
+		else
+			fz_render_flags(ctx, dev, 0, FZ_DEVFLAG_GRIDFIT_AS_TILED);
+		break;
+	}
+}
+
+static void draw_content(fz_context *ctx, content *c, int depth, int len)
+{
+	while (len--)
+		draw_item(ctx, c, depth);
+}
+
+/* Record the same random content into list. */
+static void record(fz_context *ctx, fz_display_list *list, fz_image *image, unsigned int list_seed, int index)
+{
+	content c = { 0 };
+	fz_point start = { PAGE / 2, PAGE / 2 };
+
+	seed = list_seed;
+	cursor = start;
+	c.dev = fz_new_list_device(ctx, list);
+	c.image = image;
+	c.stroke = fz_new_stroke_state(ctx);
+	draw_content(ctx, &c, 0, 1000 + rnd() % 3000);
+	fz_close_device(ctx, c.dev);
+	fz_drop_device(ctx, c.dev);
+	fz_drop_stroke_state(ctx, c.stroke);
+	if (index)
+		fz_index_display_list(ctx, list);
+}
+
+static fz_buffer *trace(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_rect scissor, fz_cookie *cookie)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 1024);
+	fz_output *out = fz_new_output_with_buffer(ctx, buf);
+	fz_device *dev = fz_new_trace_device(ctx, out);
+	fz_run_display_list(ctx, list, dev, ctm, scissor, cookie);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	fz_close_output(ctx, out);
+	fz_drop_output(ctx, out);
+	return buf;
+}
+
+static void test_list(fz_context *ctx, fz_image *image, unsigned int list_seed)
+{
+	fz_rect page = fz_make_rect(0, 0, PAGE, PAGE);
+	fz_display_list *indexed = fz_new_display_list(ctx, page);
+	fz_display_list *plain = fz_new_display_list(ctx, page);
+	fz_cookie indexed_cookie, plain_cookie;
+	fz_buffer *a, *b;
+	fz_matrix ctm;
+	fz_rect scissor;
+	float size;
+	int i;
+
+	record(ctx, indexed, image, list_seed, 1);
+	record(ctx, plain, image, list_seed, 0);
+
+	for (i = 0; i < RUNS; i++)
+	{
+		ctm = fz_scale(rndf(0.2f, 3), rndf(0.2f, 3));
+		if (rnd() & 1)
+			ctm = fz_concat(ctm, fz_rotate((rnd() & 1) ? 90 * (rnd() % 4) : rndf(0, 360)));
+		ctm = fz_concat(ctm, fz_translate(rndf(-500, 500), rndf(-500, 500)));
+
+		/* Bands, tiles, and the odd empty or infinite scissor. */
+		size = rndf(1, 300);
+		scissor.x0 = rndf(-200, 1200);
+		scissor.y0 = rndf(-200, 1200);
+		scissor.x1 = scissor.x0 + ((rnd() & 1) ? size : 3000);
+		scissor.y1 = scissor.y0 + size;
+		if (rnd() % 20 == 0)
+			scissor = fz_infinite_rect;
+		else if (rnd() % 20 == 0)
+			scissor = fz_empty_rect;
+
+		memset(&indexed_cookie, 0, sizeof indexed_cookie);
+		memset(&plain_cookie, 0, sizeof plain_cookie);
+		a = trace(ctx, indexed, ctm, scissor, &indexed_cookie);
+		b = trace(ctx, plain, ctm, scissor, &plain_cookie);
+
+		CHECK(a->len == b->len && !memcmp(a->data, b->data, a->len));
+		CHECK(indexed_cookie.progress == plain_cookie.progress);
+		if (a->len != b->len || memcmp(a->data, b->data, a->len))
+		{
+			fprintf(stderr, "list %u: traces differ with ctm=[%g %g %g %g %g %g] scissor=[%g %g %g %g]\n",
+				list_seed, ctm.a, ctm.b, ctm.c, ctm.d, ctm.e, ctm.f,
+				scissor.x0, scissor.y0, scissor.x1, scissor.y1);
+			i = RUNS;
+		}
+
+		fz_drop_buffer(ctx, a);
+		fz_drop_buffer(ctx, b);
+	}
+
+	fz_drop_display_list(ctx, indexed);
+	fz_drop_display_list(ctx, plain);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_pixmap *pix;
+	fz_image *image;
+	unsigned int i;
+
+	pix = fz_new_pixmap(ctx, NULL, 4, 4, NULL, 1);
+	fz_clear_pixmap_with_value(ctx, pix, 128);
+	image = fz_new_image_from_pixmap(ctx, pix, NULL);
+	fz_drop_pixmap(ctx, pix);
+
+	for (i = 1; i <= LISTS; i++)
+		test_list(ctx, image, i * 7919);
+
+	fz_drop_image(ctx, image);
+	fz_drop_context(ctx);
+	return mu_test_result("list-index-test");
+}
@@ -0,0 +1,393 @@
+/*
+ * list-optimize-test -- check that fz_optimize_display_list does not
+ * change what a list draws.
+ *
+ * Random lists of fills, masks, knockout groups and tiles, with opaque
+ * rectangles over parts of them, are drawn before and after being
+ * optimized. When the covering rectangles lie on whole pixels, nothing
+ * can show through their edges, and the results must match byte for
+ * byte. When they do not, the only pixels that may differ are the
+ * antialiased ones along the edges of the covering rectangles, as the
+ * header promises.
+ *
+ * Images in indexed colour spaces must only hide what lies beneath them
+ * when their base colour space paints every plate.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define LISTS 12
+#define PAGE 400
+#define OCCLUDERS_MAX 1000
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static float rndf(float lo, float hi)
+{
+	return lo + (hi - lo) * (rnd() & 0xffff) / 65535.0f;
+}
+
+static fz_path *rect_path(fz_context *ctx, fz_rect r)
+{
+	fz_path *path = fz_new_path(ctx);
+	fz_moveto(ctx, path, r.x0, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y1);
+	fz_lineto(ctx, path, r.x0, r.y1);
+	fz_closepath(ctx, path);
+	return path;
+}
+
+typedef struct
+{
+	fz_device *dev;
+	int aligned;
+	int nested; /* Levels open around us, other than plain groups. */
+	int num_occluders;
+	fz_rect occluders[OCCLUDERS_MAX];
+} content;
+
+/* A rectangle, on whole pixels if the list is to be aligned. */
+static fz_rect random_rect(content *c, float size)
+{
+	fz_rect r;
+	r.x0 = rndf(-20, PAGE);
+	r.y0 = rndf(-20, PAGE);
+	r.x1 = r.x0 + rndf(1, size);
+	r.y1 = r.y0 + rndf(1, size);
+	if (c->aligned)
+		r = fz_rect_from_irect(fz_round_rect(r));
+	return r;
+}
+
+/* Fill a rectangle, noting where it may hide what lies beneath it. */
+static void fill_rect(fz_context *ctx, content *c, fz_rect r, fz_matrix ctm, float alpha)
+{
+	fz_path *path = rect_path(ctx, r);
+	float color[3];
+
+	color[0] = rndf(0, 1);
+	color[1] = rndf(0, 1);
+	color[2] = rndf(0, 1);
+	fz_fill_path(ctx, c->dev, path, rnd() & 1, ctm, fz_device_rgb(ctx), color, alpha, fz_default_color_params);
+	fz_drop_path(ctx, path);
+
+	if (alpha == 1 && fz_is_identity(ctm) && c->nested == 0 && c->num_occluders < OCCLUDERS_MAX)
+		c->occluders[c->num_occluders++] = r;
+}
+
+/* A large rectangle, opaque more often than not. */
+static void occlude(fz_context *ctx, content *c, fz_rect r)
+{
+	fill_rect(ctx, c, r, fz_identity, (rnd() & 3) ? 1 : rndf(0.3f, 0.9f));
+}
+
+static fz_rect random_cover(content *c)
+{
+	fz_rect r = random_rect(c, 140);
+	r.x1 += 60;
+	r.y1 += 60;
+	return r;
+}
+
+static void draw_content(fz_context *ctx, content *c, int depth, int len)
+{
+	fz_device *dev = c->dev;
+	float color[1] = { 0 };
+	fz_path *path;
+	fz_matrix ctm;
+	fz_rect r;
+	float w, h, alpha;
+	int i, knockout, blend, plain;
+
+	while (len--)
+	{
+		r = random_rect(c, 60);
+		switch (depth > 2 ? rnd() % 3 : rnd() % 11)
+		{
+		default:
+			fill_rect(ctx, c, r, (rnd() & 3) ? fz_identity : fz_rotate(rndf(-10, 10)), (rnd() & 3) ? 1 : rndf(0.2f, 1));
+			break;
+		case 2:
+			occlude(ctx, c, random_cover(c));
+			break;
+		case 3:
+			path = rect_path(ctx, fz_expand_rect(r, 10));
+			fz_clip_path(ctx, dev, path, 0, fz_identity, fz_infinite_rect);
+			fz_drop_path(ctx, path);
+			c->nested++;
+			draw_content(ctx, c, depth + 1, 1 + rnd() % 5);
+			c->nested--;
+			fz_pop_clip(ctx, dev);
+			break;
+		case 4: case 5:
+			fz_begin_mask(ctx, dev, fz_expand_rect(r, 10), rnd() & 1, fz_device_gray(ctx), color, fz_default_color_params);
+			c->nested++;
+			draw_content(ctx, c, depth + 1, 1 + rnd() % 3);
+			fz_end_mask(ctx, dev);
+			draw_content(ctx, c, depth + 1, 1 + rnd() % 5);
+			c->nested--;
+			fz_pop_clip(ctx, dev);
+			break;
+		case 6: case 7: case 8:
+			/* Plain groups, through which covers still work, and
+			 * knockout, blended and translucent ones. */
+			knockout = rnd() & 1;
+			blend = (rnd() & 3) ? FZ_BLEND_NORMAL : rnd() % 16;
+			alpha = (rnd() & 3) ? 1 : rndf(0.3f, 1);
+			plain = !knockout && blend == FZ_BLEND_NORMAL && alpha == 1;
+			fz_begin_group(ctx, dev, (rnd() & 1) ? fz_expand_rect(r, 10) : fz_make_rect(0, 0, PAGE, PAGE), NULL, rnd() & 1, knockout, blend, alpha);
+			c->nested += !plain;
+			draw_content(ctx, c, depth + 1, 1 + rnd() % 5);
+			if (rnd() & 1)
+				occlude(ctx, c, random_cover(c));
+			c->nested -= !plain;
+			fz_end_group(ctx, dev);
+			break;
+		case 9:
+			/* A few cells of a small pattern. The area starts part
+			 * way into a cell, so that the cells at the edges stick
+			 * out of it. */
+			w = rndf(4, 20);
+			h = rndf(4, 20);
+			ctm = fz_translate(r.x0 - rndf(0, w), r.y0 - rndf(0, h));
+			fz_begin_tile(ctx, dev, fz_transform_rect(r, fz_invert_matrix(ctm)), fz_make_rect(0, 0, w, h), w, h, ctm);
+			c->nested++;
+			for (i = 1 + rnd() % 3; i > 0; i--)
+				fill_rect(ctx, c, fz_make_rect(rndf(0, w / 2), rndf(0, h / 2), rndf(w / 2, w), rndf(h / 2, h)), ctm, 1);
+			c->nested--;
+			fz_end_tile(ctx, dev);
+			break;
+		case 10:
+			/* Content beneath what hides it. */
+			draw_content(ctx, c, depth + 1, 1 + rnd() % 10);
+			occlude(ctx, c, random_cover(c));
+			break;
+		}
+	}
+}
+
+static fz_pixmap *draw(fz_context *ctx, fz_display_list *list, int alpha)
+{
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), fz_make_irect(0, 0, PAGE, PAGE), NULL, alpha);
+	fz_device *dev;
+
+	if (alpha)
+		fz_clear_pixmap(ctx, pix);
+	else
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+	dev = fz_new_draw_device(ctx, fz_identity, pix);
+	fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, NULL);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	return pix;
+}
+
+/* Whether pixel x, y is partly, but not wholly, covered by any of the
+ * occluders. */
+static int on_occluder_edge(content *c, int x, int y)
+{
+	int i;
+
+	for (i = 0; i < c->num_occluders; i++)
+	{
+		fz_rect r = c->occluders[i];
+		if (x + 1 <= r.x0 || x >= r.x1 || y + 1 <= r.y0 || y >= r.y1)
+			continue;
+		if (x < r.x0 || x + 1 > r.x1 || y < r.y0 || y + 1 > r.y1)
+			return 1;
+	}
+	return 0;
+}
+
+/* Count the pixels that differ where they should not. */
+static int count_differences(content *c, fz_pixmap *a, fz_pixmap *b)
+{
+	int x, y, bad = 0;
+
+	for (y = 0; y < a->h; y++)
+	{
+		for (x = 0; x < a->w; x++)
+		{
+			unsigned char *pa = a->samples + y * a->stride + x * a->n;
+			unsigned char *pb = b->samples + y * b->stride + x * b->n;
+			if (memcmp(pa, pb, a->n) && (c->aligned || !on_occluder_edge(c, x, y)))
+				bad++;
+		}
+	}
+	return bad;
+}
+
+static int test_list(fz_context *ctx, int aligned)
+{
+	fz_display_list *list = fz_new_display_list(ctx, fz_make_rect(0, 0, PAGE, PAGE));
+	fz_pixmap *before[2], *after[2];
+	content c = { 0 };
+	int alpha, bad, removed;
+
+	c.dev = fz_new_list_device(ctx, list);
+	c.aligned = aligned;
+	draw_content(ctx, &c, 0, 150);
+	fz_close_device(ctx, c.dev);
+	fz_drop_device(ctx, c.dev);
+
+	for (alpha = 0; alpha < 2; alpha++)
+		before[alpha] = draw(ctx, list, alpha);
+	removed = fz_optimize_display_list(ctx, list);
+	for (alpha = 0; alpha < 2; alpha++)
+	{
+		after[alpha] = draw(ctx, list, alpha);
+		bad = count_differences(&c, before[alpha], after[alpha]);
+		CHECK(bad == 0);
+		if (bad)
+			fprintf(stderr, "list-optimize-test: %d pixels differ (aligned=%d, alpha=%d)\n", bad, aligned, alpha);
+		fz_drop_pixmap(ctx, before[alpha]);
+		fz_drop_pixmap(ctx, after[alpha]);
+	}
+
+	fz_drop_display_list(ctx, list);
+	return removed;
+}
+
+/* The draw device paints whole cells over the tiled area, so a tile
+ * whose area starts part way into a cell paints outside it, and is not
+ * hidden by a cover over the area alone. */
+static void test_tile_edges(fz_context *ctx)
+{
+	fz_display_list *list = fz_new_display_list(ctx, fz_make_rect(0, 0, PAGE, PAGE));
+	fz_pixmap *before, *after;
+	content c = { 0 };
+
+	c.dev = fz_new_list_device(ctx, list);
+	c.aligned = 1;
+	fz_begin_tile(ctx, c.dev, fz_make_rect(15, 15, 55, 55), fz_make_rect(0, 0, 30, 30), 30, 30, fz_translate(85, 85));
+	c.nested++;
+	fill_rect(ctx, &c, fz_make_rect(0, 0, 30, 30), fz_translate(85, 85), 1);
+	c.nested--;
+	fz_end_tile(ctx, c.dev);
+	fill_rect(ctx, &c, fz_make_rect(100, 100, 140, 140), fz_identity, 1);
+	fz_close_device(ctx, c.dev);
+	fz_drop_device(ctx, c.dev);
+
+	before = draw(ctx, list, 0);
+	fz_optimize_display_list(ctx, list);
+	after = draw(ctx, list, 0);
+	CHECK(count_differences(&c, before, after) == 0);
+
+	fz_drop_pixmap(ctx, before);
+	fz_drop_pixmap(ctx, after);
+	fz_drop_display_list(ctx, list);
+}
+
+static void tint(fz_context *ctx, void *tint, const float *s, int sn, float *d, int dn)
+{
+	int i;
+	for (i = 0; i < dn; i++)
+		d[i] = s[0];
+}
+
+static void drop_tint(fz_context *ctx, void *tint)
+{
+}
+
+/* A one pixel image in an indexed colour space over base. */
+static fz_image *new_indexed_image(fz_context *ctx, fz_colorspace *base)
+{
+	fz_compressed_buffer *cbuf;
+	fz_colorspace *cs;
+	fz_image *image;
+	unsigned char *lookup;
+
+	lookup = fz_calloc(ctx, 2, base->n);
+	cs = fz_new_indexed_colorspace(ctx, base, 1, lookup);
+	cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+	cbuf->params.type = FZ_IMAGE_RAW;
+	cbuf->buffer = fz_new_buffer(ctx, 1);
+	fz_append_byte(ctx, cbuf->buffer, 1);
+	image = fz_new_image_from_compressed_buffer(ctx, 1, 1, 8, cs, 72, 72, 0, 0, NULL, NULL, cbuf, NULL);
+	fz_drop_colorspace(ctx, cs);
+	return image;
+}
+
+/* Draw a rectangle, and an image over the whole page, and see whether
+ * the rectangle can be optimized away. */
+static int image_hides(fz_context *ctx, fz_image *image)
+{
+	fz_display_list *list = fz_new_display_list(ctx, fz_make_rect(0, 0, PAGE, PAGE));
+	content c = { 0 };
+	int removed;
+
+	c.dev = fz_new_list_device(ctx, list);
+	fill_rect(ctx, &c, fz_make_rect(50, 50, 150, 150), fz_identity, 1);
+	fz_fill_image(ctx, c.dev, image, fz_scale(PAGE, PAGE), 1, fz_default_color_params);
+	fz_close_device(ctx, c.dev);
+	fz_drop_device(ctx, c.dev);
+
+	removed = fz_optimize_display_list(ctx, list);
+	fz_drop_display_list(ctx, list);
+	return removed > 0;
+}
+
+/* An indexed image only hides what lies beneath it when its base
+ * colour space does; a separation may leave some plates unpainted. */
+static void test_indexed_images(fz_context *ctx)
+{
+	fz_colorspace *sep = fz_new_colorspace(ctx, FZ_COLORSPACE_SEPARATION, 0, 1, "Separation(DeviceCMYK,Spot)");
+	fz_image *image;
+
+	sep->u.separation.base = fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
+	sep->u.separation.eval = tint;
+	sep->u.separation.drop = drop_tint;
+	fz_colorspace_name_colorant(ctx, sep, 0, "Spot");
+
+	image = new_indexed_image(ctx, fz_device_rgb(ctx));
+	CHECK(image_hides(ctx, image));
+	fz_drop_image(ctx, image);
+
+	image = new_indexed_image(ctx, sep);
+	CHECK(!image_hides(ctx, image));
+	fz_drop_image(ctx, image);
+
+	fz_drop_colorspace(ctx, sep);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	int i, removed = 0;
+
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < LISTS; i++)
+			removed += test_list(ctx, i & 1);
+		/* Make sure there was something to optimize away. */
+		CHECK(removed > 0);
+		test_tile_edges(ctx);
+		test_indexed_images(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	return mu_test_result("list-optimize-test");
+}
@@ -0,0 +1,628 @@
+/*
+ * list-serialize-test -- check that display lists survive being written
+ * and read back, that bad records are rejected before anything they
+ * ask for is allocated, and that lists that cannot be written exactly
+ * are refused. Type 3 fonts are checked for leaks.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define IMG_W 37
+#define IMG_H 23
+#define IMG_BPC 8
+#define IMG_RES 96
+
+#define MESH_BPFLAG 8
+#define MESH_BPCOORD 24
+#define MESH_BPCOMP 12
+#define LAYER_NAME "Some layer"
+
+/* The text matrix of the glyph that uses another Type 3 font. */
+static const float inner_trm[4] = { 0.75f, 0.125f, 0.25f, 0.5f };
+
+/* A raw rgb image, kept compressed so it is written as such. */
+static fz_image *new_raw_image(fz_context *ctx)
+{
+	fz_compressed_buffer *cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+	fz_buffer *buf = fz_new_buffer(ctx, IMG_W * IMG_H * 3);
+	int i;
+
+	for (i = 0; i < IMG_W * IMG_H * 3; i++)
+		fz_append_byte(ctx, buf, i * 13);
+	cbuf->params.type = FZ_IMAGE_RAW;
+	cbuf->buffer = buf;
+	return fz_new_image_from_compressed_buffer(ctx, IMG_W, IMG_H, IMG_BPC, fz_device_rgb(ctx),
+		IMG_RES, IMG_RES, 0, 0, NULL, NULL, cbuf, NULL);
+}
+
+/* A free form triangle mesh, with one triangle in it. */
+static fz_shade *new_mesh_shade(fz_context *ctx)
+{
+	static const unsigned char mesh[] = {
+		0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xf0, 0x00,
+		0, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x0f, 0xff,
+		0, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0x00, 0x0f, 0xff,
+	};
+	fz_shade *shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	shade->type = FZ_MESH_TYPE4;
+	shade->bbox = fz_infinite_rect;
+	shade->colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	shade->matrix = fz_identity;
+	shade->u.m.bpflag = MESH_BPFLAG;
+	shade->u.m.bpcoord = MESH_BPCOORD;
+	shade->u.m.bpcomp = MESH_BPCOMP;
+	shade->u.m.x1 = 100;
+	shade->u.m.y1 = 100;
+	shade->u.m.c1[0] = 1;
+	shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+	shade->buffer->params.type = FZ_IMAGE_RAW;
+	shade->buffer->buffer = fz_new_buffer_from_copied_data(ctx, mesh, sizeof mesh);
+	return shade;
+}
+
+static fz_display_list *new_list(fz_context *ctx)
+{
+	fz_display_list *list = fz_new_display_list(ctx, fz_make_rect(0, 0, 100, 100));
+	fz_device *dev = fz_new_list_device(ctx, list);
+	fz_image *image = new_raw_image(ctx);
+	fz_shade *shade = new_mesh_shade(ctx);
+	fz_path *path = fz_new_path(ctx);
+	float red[3] = { 1, 0, 0 };
+
+	fz_rectto(ctx, path, 10, 10, 60, 40);
+	fz_fill_path(ctx, dev, path, 0, fz_identity, fz_device_rgb(ctx), red, 1, fz_default_color_params);
+	fz_begin_layer(ctx, dev, LAYER_NAME);
+	fz_begin_group(ctx, dev, fz_make_rect(20, 20, 80, 80), NULL, 0, 0, FZ_BLEND_MULTIPLY, 1);
+	fz_fill_image(ctx, dev, image, fz_make_matrix(50, 0, 0, 50, 30, 30), 0.5f, fz_default_color_params);
+	fz_fill_shade(ctx, dev, shade, fz_make_matrix(0.5f, 0, 0, 0.5f, 40, 0), 1, fz_default_color_params);
+	fz_end_group(ctx, dev);
+	fz_end_layer(ctx, dev);
+	fz_close_device(ctx, dev);
+
+	fz_drop_path(ctx, path);
+	fz_drop_shade(ctx, shade);
+	fz_drop_image(ctx, image);
+	fz_drop_device(ctx, dev);
+	return list;
+}
+
+static fz_buffer *write_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 1024);
+	fz_output *out = NULL;
+
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		out = fz_new_output_with_buffer(ctx, buf);
+		fz_write_display_list(ctx, out, list);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+static fz_display_list *read_list(fz_context *ctx, fz_buffer *buf)
+{
+	fz_stream *stm = fz_open_buffer(ctx, buf);
+	fz_display_list *list = NULL;
+	fz_try(ctx)
+		list = fz_read_display_list(ctx, stm);
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return list;
+}
+
+static fz_pixmap *render(fz_context *ctx, fz_display_list *list)
+{
+	return fz_new_pixmap_from_display_list(ctx, list, fz_identity, fz_device_rgb(ctx), 0);
+}
+
+/* Both lists draw the same pixels. */
+static void test_roundtrip(fz_context *ctx)
+{
+	fz_display_list *list = new_list(ctx);
+	fz_buffer *buf = write_list(ctx, list);
+	fz_display_list *copy = read_list(ctx, buf);
+	fz_pixmap *a = render(ctx, list);
+	fz_pixmap *b = render(ctx, copy);
+
+	CHECK(a->w == b->w && a->h == b->h && a->n == b->n);
+	CHECK(!memcmp(a->samples, b->samples, (size_t)a->stride * a->h));
+
+	fz_drop_pixmap(ctx, a);
+	fz_drop_pixmap(ctx, b);
+	fz_drop_display_list(ctx, copy);
+	fz_drop_display_list(ctx, list);
+	fz_drop_buffer(ctx, buf);
+}
+
+static void put_int32_le(unsigned char *p, int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static unsigned char *find_key(fz_buffer *buf, const void *key, size_t len)
+{
+	size_t i;
+	for (i = 0; i + len <= buf->len; i++)
+		if (!memcmp(buf->data + i, key, len))
+			return buf->data + i;
+	return NULL;
+}
+
+/* Find the w, h and bpc fields of the compressed image record. */
+static unsigned char *find_image_record(fz_buffer *buf)
+{
+	unsigned char key[12];
+	put_int32_le(key, IMG_W);
+	put_int32_le(key + 4, IMG_H);
+	put_int32_le(key + 8, IMG_BPC);
+	return find_key(buf, key, sizeof key);
+}
+
+/* Find the bpflag, bpcoord and bpcomp fields of the mesh shade record. */
+static unsigned char *find_mesh_record(fz_buffer *buf)
+{
+	unsigned char key[12];
+	put_int32_le(key, MESH_BPFLAG);
+	put_int32_le(key + 4, MESH_BPCOORD);
+	put_int32_le(key + 8, MESH_BPCOMP);
+	return find_key(buf, key, sizeof key);
+}
+
+/* Find the rectangle that starts the begin group record. */
+static unsigned char *find_group_record(fz_buffer *buf)
+{
+	float key[4] = { 20, 20, 80, 80 };
+	return find_key(buf, key, sizeof key);
+}
+
+/* Find the begin layer record, at its string length. */
+static unsigned char *find_layer_record(fz_buffer *buf)
+{
+	unsigned char *rec = find_key(buf, LAYER_NAME, strlen(LAYER_NAME));
+	return rec ? rec - 4 : NULL;
+}
+
+/* Change a field of one record, and check the list is refused. */
+static void test_bad_field(fz_context *ctx, fz_buffer *good, unsigned char *(*find)(fz_buffer *),
+	int offset, int size, int value, const char *error)
+{
+	fz_buffer *bad = fz_new_buffer_from_copied_data(ctx, good->data, good->len);
+	fz_display_list *list = NULL;
+	unsigned char *rec = find(bad);
+	int caught = 0;
+
+	CHECK(rec != NULL);
+	if (rec && size == 1)
+		rec[offset] = value;
+	else if (rec)
+		put_int32_le(rec + offset, value);
+
+	fz_try(ctx)
+		list = read_list(ctx, bad);
+	fz_catch(ctx)
+	{
+		caught = 1;
+		CHECK(strstr(fz_caught_message(ctx), error) != NULL);
+	}
+	CHECK(caught);
+	if (!caught)
+		fprintf(stderr, "list-serialize-test: accepted field %d = %d (%s)\n", offset, value, error);
+
+	fz_drop_display_list(ctx, list);
+	fz_drop_buffer(ctx, bad);
+}
+
+static void test_bad_images(fz_context *ctx)
+{
+	fz_display_list *list = new_list(ctx);
+	fz_buffer *good = write_list(ctx, list);
+	unsigned char *rec = find_image_record(good);
+
+	/* The record is w, h, bpc, colorspace, xres, yres and n. */
+	CHECK(rec != NULL);
+	if (rec)
+	{
+		CHECK(rec[20] == IMG_RES && rec[24] == 3);
+		test_bad_field(ctx, good, find_image_record, 0, 4, 0, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 0, 4, -5, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 4, 4, 0, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 4, 4, -1, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 8, 4, 0, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 8, 4, 3, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 8, 4, 32, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 24, 4, 1, "invalid image");
+		test_bad_field(ctx, good, find_image_record, 24, 4, 4, "invalid image");
+	}
+
+	fz_drop_buffer(ctx, good);
+	fz_drop_display_list(ctx, list);
+}
+
+/* The mesh parameters are checked as the PDF shading loader does, and
+ * the group blend mode must be one we know. */
+static void test_bad_shades_and_groups(fz_context *ctx)
+{
+	fz_display_list *list = new_list(ctx);
+	fz_buffer *good = write_list(ctx, list);
+
+	test_bad_field(ctx, good, find_mesh_record, 0, 4, 3, "bits per flag");
+	test_bad_field(ctx, good, find_mesh_record, 0, 4, 0, "bits per flag");
+	test_bad_field(ctx, good, find_mesh_record, 4, 4, 0, "bits per coordinate");
+	test_bad_field(ctx, good, find_mesh_record, 4, 4, 33, "bits per coordinate");
+	test_bad_field(ctx, good, find_mesh_record, 8, 4, -8, "bits per component");
+	test_bad_field(ctx, good, find_mesh_record, 8, 4, 32, "bits per component");
+
+	/* The record is rect, colorspace, isolated, knockout, blendmode. */
+	CHECK(find_group_record(good) && find_group_record(good)[22] == FZ_BLEND_MULTIPLY);
+	test_bad_field(ctx, good, find_group_record, 22, 1, FZ_BLEND_LUMINOSITY + 1, "blend mode");
+	test_bad_field(ctx, good, find_group_record, 22, 1, 255, "blend mode");
+
+	fz_drop_buffer(ctx, good);
+	fz_drop_display_list(ctx, list);
+}
+
+/* A string length past the end of the data is refused without
+ * allocating a block of that size. */
+static void test_bad_lengths(fz_context *ctx)
+{
+	fz_display_list *list = new_list(ctx);
+	fz_buffer *good = write_list(ctx, list);
+
+	mu_test_largest_block = 0;
+	test_bad_field(ctx, good, find_layer_record, 0, 4, 0x7fffffff, "premature end");
+	CHECK(mu_test_largest_block < (1 << 20));
+
+	fz_drop_buffer(ctx, good);
+	fz_drop_display_list(ctx, list);
+}
+
+static void spot_eval(fz_context *ctx, void *tint, const float *s, int sn, float *d, int dn)
+{
+	d[0] = 1 - s[0];
+}
+
+static void spot_drop(fz_context *ctx, void *tint)
+{
+}
+
+/* A tint transform cannot be recorded, so the list is refused rather
+ * than written with different colors. */
+static void test_separation(fz_context *ctx)
+{
+	fz_colorspace *spot = fz_new_colorspace(ctx, FZ_COLORSPACE_SEPARATION, 0, 1, "Spot");
+	fz_display_list *list = fz_new_display_list(ctx, fz_make_rect(0, 0, 100, 100));
+	fz_device *dev = fz_new_list_device(ctx, list);
+	fz_path *path = fz_new_path(ctx);
+	fz_buffer *buf = NULL;
+	float tint = 0.5f;
+	int caught = 0;
+
+	spot->u.separation.base = fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	spot->u.separation.eval = spot_eval;
+	spot->u.separation.drop = spot_drop;
+	fz_rectto(ctx, path, 10, 10, 60, 40);
+	fz_fill_path(ctx, dev, path, 0, fz_identity, spot, &tint, 1, fz_default_color_params);
+	fz_close_device(ctx, dev);
+
+	fz_try(ctx)
+		buf = write_list(ctx, list);
+	fz_catch(ctx)
+		caught = 1;
+	CHECK(caught);
+
+	fz_drop_buffer(ctx, buf);
+	fz_drop_path(ctx, path);
+	fz_drop_device(ctx, dev);
+	fz_drop_display_list(ctx, list);
+	fz_drop_colorspace(ctx, spot);
+}
+
+/* A Type 3 font with glyph 'a' drawn by list, or a square if list is
+ * NULL. */
+static fz_font *new_t3_font(fz_context *ctx, const char *name, fz_display_list *list)
+{
+	fz_font *font = fz_new_type3_font(ctx, name, fz_scale(0.001f, 0.001f));
+	fz_device *dev;
+	fz_path *path;
+	float gray = 0.25f;
+
+	font->bbox = fz_make_rect(0, 0, 1, 1);
+	font->t3widths['a'] = 1;
+	font->bbox_table['a'] = font->bbox;
+	if (list)
+	{
+		font->t3lists['a'] = fz_keep_display_list(ctx, list);
+		return font;
+	}
+
+	font->t3lists['a'] = fz_new_display_list(ctx, fz_make_rect(0, 0, 1000, 1000));
+	dev = fz_new_list_device(ctx, font->t3lists['a']);
+	path = fz_new_path(ctx);
+	fz_rectto(ctx, path, 100, 100, 900, 900);
+	fz_fill_path(ctx, dev, path, 0, fz_identity, fz_device_gray(ctx), &gray, 1, fz_default_color_params);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	fz_drop_path(ctx, path);
+	return font;
+}
+
+/* A list that shows glyph 'a' of font with trm. */
+static fz_display_list *new_text_list(fz_context *ctx, fz_font *font, fz_matrix trm, fz_rect mediabox)
+{
+	fz_display_list *list = fz_new_display_list(ctx, mediabox);
+	fz_device *dev = fz_new_list_device(ctx, list);
+	fz_text *text = fz_new_text(ctx);
+	float black = 0;
+
+	fz_show_glyph(ctx, text, font, trm, 'a', 'a', 0, 0, FZ_BIDI_LTR, FZ_LANG_UNSET);
+	fz_fill_text(ctx, dev, text, fz_identity, fz_device_gray(ctx), &black, 1, fz_default_color_params);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	fz_drop_text(ctx, text);
+	return list;
+}
+
+/* Type 3 glyphs that use another Type 3 font survive the round trip,
+ * and nothing is leaked. */
+static void test_type3(fz_context *ctx, fz_buffer **out)
+{
+	fz_font *inner = new_t3_font(ctx, "Inner", NULL);
+	fz_display_list *glyph = new_text_list(ctx, inner, fz_make_matrix(inner_trm[0], inner_trm[1],
+		inner_trm[2], inner_trm[3], 0, 0), fz_make_rect(0, 0, 1, 1));
+	fz_font *outer = new_t3_font(ctx, "Outer", glyph);
+	fz_display_list *list = new_text_list(ctx, outer, fz_make_matrix(80, 0, 0, 80, 10, 10), fz_make_rect(0, 0, 100, 100));
+	fz_buffer *buf = write_list(ctx, list);
+	fz_display_list *copy = read_list(ctx, buf);
+	fz_pixmap *a = render(ctx, list);
+	fz_pixmap *b = render(ctx, copy);
+
+	CHECK(!memcmp(a->samples, b->samples, (size_t)a->stride * a->h));
+
+	fz_drop_pixmap(ctx, a);
+	fz_drop_pixmap(ctx, b);
+	fz_drop_display_list(ctx, copy);
+	fz_drop_display_list(ctx, list);
+	fz_drop_display_list(ctx, glyph);
+	fz_drop_font(ctx, outer);
+	fz_drop_font(ctx, inner);
+	*out = buf;
+}
+
+/* A glyph that uses its own font is refused when writing, and when
+ * reading (here by making the outer glyph use the outer font). */
+static void test_type3_cycle(fz_context *ctx, fz_buffer *good)
+{
+	fz_display_list *glyph, *list, *copy = NULL;
+	fz_buffer *buf = NULL;
+	fz_font *font;
+	unsigned char key[20];
+	unsigned char *rec;
+	int caught;
+
+	font = new_t3_font(ctx, "Self", NULL);
+	glyph = new_text_list(ctx, font, fz_identity, fz_make_rect(0, 0, 1, 1));
+	fz_drop_display_list(ctx, font->t3lists['a']);
+	font->t3lists['a'] = glyph;
+	list = new_text_list(ctx, font, fz_make_matrix(80, 0, 0, 80, 10, 10), fz_make_rect(0, 0, 100, 100));
+	caught = 0;
+	fz_try(ctx)
+		buf = write_list(ctx, list);
+	fz_catch(ctx)
+		caught = 1;
+	CHECK(caught);
+	fz_drop_buffer(ctx, buf);
+	fz_drop_display_list(ctx, list);
+	/* Break the cycle we made. */
+	font->t3lists['a'] = NULL;
+	fz_drop_display_list(ctx, glyph);
+	fz_drop_font(ctx, font);
+
+	/* The outer font is 0 and the inner font 1; the inner glyph's
+	 * text span starts with the font reference and the matrix. */
+	buf = fz_new_buffer_from_copied_data(ctx, good->data, good->len);
+	put_int32_le(key, 1);
+	memcpy(key + 4, inner_trm, sizeof inner_trm);
+	rec = find_key(buf, key, sizeof key);
+	CHECK(rec != NULL);
+	if (rec)
+		put_int32_le(rec, 0);
+	caught = 0;
+	fz_try(ctx)
+		copy = read_list(ctx, buf);
+	fz_catch(ctx)
+	{
+		caught = 1;
+		CHECK(strstr(fz_caught_message(ctx), "invalid resource") != NULL);
+	}
+	CHECK(caught);
+	fz_drop_display_list(ctx, copy);
+	fz_drop_buffer(ctx, buf);
+}
+
+#define FN_YDIVS 1024
+#define WIDTH_COUNT 4
+#define WIDTH_DEFAULT 1234
+
+/* The matrix of the function shade, which marks its record. */
+static const float fn_matrix[6] = { 0.5f, 0, 0, 0.25f, 7, 9 };
+
+/* A function shade with many rows of one column. */
+static fz_shade *new_function_shade(fz_context *ctx)
+{
+	fz_shade *shade = fz_malloc_struct(ctx, fz_shade);
+	int i;
+
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	shade->type = FZ_FUNCTION_BASED;
+	shade->bbox = fz_infinite_rect;
+	shade->colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	shade->matrix = fz_identity;
+	shade->u.f.matrix = fz_make_matrix(fn_matrix[0], fn_matrix[1], fn_matrix[2], fn_matrix[3], fn_matrix[4], fn_matrix[5]);
+	shade->u.f.xdivs = 1;
+	shade->u.f.ydivs = FN_YDIVS;
+	shade->u.f.domain[1][0] = 1;
+	shade->u.f.domain[1][1] = 1;
+	shade->u.f.fn_vals = fz_malloc_array(ctx, 2 * (FN_YDIVS + 1), float);
+	for (i = 0; i < 2 * (FN_YDIVS + 1); i++)
+		shade->u.f.fn_vals[i] = i & 1;
+	return shade;
+}
+
+/* A list with a decoded image, a function shade, and text in a font
+ * with a width table, which all have sizes that the reader allocates
+ * for. */
+static fz_display_list *new_sized_list(fz_context *ctx)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, fz_device_rgb(ctx), IMG_W, IMG_H, NULL, 0);
+	fz_image *image;
+	fz_shade *shade = new_function_shade(ctx);
+	const unsigned char *data;
+	fz_font *font;
+	fz_display_list *list;
+	fz_device *dev;
+	int len;
+
+	fz_clear_pixmap_with_value(ctx, pix, 0x80);
+	image = fz_new_image_from_pixmap(ctx, pix, NULL);
+	data = fz_lookup_base14_font(ctx, "Times-Roman", &len);
+	font = fz_new_font_from_memory(ctx, "Times-Roman", data, len, 0, 0);
+	font->width_count = WIDTH_COUNT;
+	font->width_default = WIDTH_DEFAULT;
+	font->width_table = fz_malloc_array(ctx, WIDTH_COUNT, short);
+	memset(font->width_table, 0, WIDTH_COUNT * sizeof(short));
+
+	list = new_text_list(ctx, font, fz_make_matrix(20, 0, 0, 20, 10, 10), fz_make_rect(0, 0, 100, 100));
+	dev = fz_new_list_device(ctx, list);
+	fz_fill_image(ctx, dev, image, fz_make_matrix(50, 0, 0, 50, 30, 30), 1, fz_default_color_params);
+	fz_fill_shade(ctx, dev, shade, fz_identity, 1, fz_default_color_params);
+	fz_close_device(ctx, dev);
+
+	fz_drop_device(ctx, dev);
+	fz_drop_font(ctx, font);
+	fz_drop_shade(ctx, shade);
+	fz_drop_image(ctx, image);
+	fz_drop_pixmap(ctx, pix);
+	return list;
+}
+
+/* Find the w, h and n fields of the decoded image record. */
+static unsigned char *find_pixmap_record(fz_buffer *buf)
+{
+	unsigned char key[12];
+	put_int32_le(key, IMG_W);
+	put_int32_le(key + 4, IMG_H);
+	put_int32_le(key + 8, 3);
+	return find_key(buf, key, sizeof key);
+}
+
+/* Find the function shade record, at its matrix. */
+static unsigned char *find_function_record(fz_buffer *buf)
+{
+	return find_key(buf, fn_matrix, sizeof fn_matrix);
+}
+
+/* Find the width count and default of the font record. */
+static unsigned char *find_widths_record(fz_buffer *buf)
+{
+	unsigned char key[8];
+	put_int32_le(key, WIDTH_COUNT);
+	put_int32_le(key + 4, WIDTH_DEFAULT);
+	return find_key(buf, key, sizeof key);
+}
+
+/* Sizes that do not fit what they describe are refused, and so are
+ * sizes that need more data than the list holds, without allocating
+ * a block of that size. */
+static void test_bad_sizes(fz_context *ctx)
+{
+	fz_display_list *list = new_sized_list(ctx);
+	fz_buffer *good = write_list(ctx, list);
+	fz_display_list *copy = read_list(ctx, good);
+
+	/* The image record is w, h, n, alpha and colorspace. */
+	CHECK(find_pixmap_record(good) && find_pixmap_record(good)[12] == 0);
+	test_bad_field(ctx, good, find_pixmap_record, 0, 4, 0, "invalid image");
+	test_bad_field(ctx, good, find_pixmap_record, 4, 4, -1, "invalid image");
+	test_bad_field(ctx, good, find_pixmap_record, 8, 4, 4, "invalid image");
+	test_bad_field(ctx, good, find_pixmap_record, 8, 4, 0, "invalid image");
+	test_bad_field(ctx, good, find_pixmap_record, 12, 1, 2, "invalid image");
+	test_bad_field(ctx, good, find_pixmap_record, 0, 4, 0x7fffffff, "invalid image");
+
+	mu_test_largest_block = 0;
+	test_bad_field(ctx, good, find_pixmap_record, 0, 4, 1 << 20, "premature end");
+	CHECK(mu_test_largest_block < (1 << 20));
+
+	/* The function record is its matrix, then xdivs and ydivs. */
+	mu_test_largest_block = 0;
+	test_bad_field(ctx, good, find_function_record, 24, 4, 1024, "premature end");
+	CHECK(mu_test_largest_block < (1 << 20));
+
+	mu_test_largest_block = 0;
+	test_bad_field(ctx, good, find_widths_record, 0, 4, 1 << 24, "premature end");
+	CHECK(mu_test_largest_block < (1 << 20));
+
+	fz_drop_display_list(ctx, copy);
+	fz_drop_buffer(ctx, good);
+	fz_drop_display_list(ctx, list);
+}
+
+/* Drop everything the context caches, so that leaks show. */
+static void empty_caches(fz_context *ctx)
+{
+	fz_purge_glyph_cache(ctx);
+	fz_empty_store(ctx);
+}
+
+/* Errors are expected, so keep them quiet. */
+static void quiet(void *user, const char *message)
+{
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(mu_test_alloc(), NULL, FZ_STORE_DEFAULT);
+	fz_buffer *t3;
+	int base;
+
+	fz_set_error_callback(ctx, quiet, NULL);
+	fz_set_warning_callback(ctx, quiet, NULL);
+
+	test_roundtrip(ctx);
+	test_bad_images(ctx);
+	test_bad_shades_and_groups(ctx);
+	test_bad_lengths(ctx);
+	test_bad_sizes(ctx);
+	test_separation(ctx);
+
+	empty_caches(ctx);
+	base = mu_test_live(ctx);
+	test_type3(ctx, &t3);
+	empty_caches(ctx);
+	CHECK(mu_test_live(ctx) == base + 2);
+	test_type3_cycle(ctx, t3);
+	fz_drop_buffer(ctx, t3);
+	empty_caches(ctx);
+	CHECK(mu_test_live(ctx) == base);
+
+	fz_drop_context(ctx);
+	return mu_test_result("list-serialize-test");
+}
@@ -0,0 +1,102 @@
+#ifndef MUPDF_TESTS_MU_TEST_H
+#define MUPDF_TESTS_MU_TEST_H
+
+/*
+	Minimal support for the self-checking test programs in this
+	directory. Each test is a program of its own; it prints every
+	failed check, and exits with a non-zero status if there were
+	any. "make check" builds and runs them all.
+*/
+
+#include "mupdf/fitz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int mu_test_failures = 0;
+
+#define CHECK(x) \
+	do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			mu_test_failures++; \
+		} \
+	} while (0)
+
+static int mu_test_result(const char *name)
+{
+	if (mu_test_failures)
+	{
+		fprintf(stderr, "%s: %d failed checks\n", name, mu_test_failures);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: passed\n", name);
+	return EXIT_SUCCESS;
+}
+
+/*
+	An allocator for tests that look for leaks. It counts the blocks
+	that are live, remembers the largest block asked for, and fails
+	once mu_test_fail_countdown allocations have been made (if it is
+	not negative). Pass mu_test_alloc() to fz_new_context.
+*/
+
+static int mu_test_live_blocks = 0;
+static size_t mu_test_largest_block = 0;
+static int mu_test_fail_countdown = -1;
+
+static inline int mu_test_should_fail(size_t size)
+{
+	if (size > mu_test_largest_block)
+		mu_test_largest_block = size;
+	if (mu_test_fail_countdown == 0)
+		return 1;
+	if (mu_test_fail_countdown > 0)
+		mu_test_fail_countdown--;
+	return 0;
+}
+
+static inline void *mu_test_malloc(void *user, size_t size)
+{
+	void *p;
+	if (mu_test_should_fail(size))
+		return NULL;
+	p = malloc(size);
+	if (p)
+		mu_test_live_blocks++;
+	return p;
+}
+
+static inline void *mu_test_realloc(void *user, void *old, size_t size)
+{
+	if (old == NULL)
+		return mu_test_malloc(user, size);
+	if (mu_test_should_fail(size))
+		return NULL;
+	return realloc(old, size);
+}
+
+static inline void mu_test_free(void *user, void *p)
+{
+	if (p)
+		mu_test_live_blocks--;
+	free(p);
+}
+
+static inline fz_alloc_context *mu_test_alloc(void)
+{
+	static fz_alloc_context alloc = { NULL, mu_test_malloc, mu_test_realloc, mu_test_free };
+	return &alloc;
+}
+
+/*
+	The number of live blocks, not counting those that ctx only keeps
+	cached for reuse (when built with FZ_ENABLE_ALLOC_CACHE).
+*/
+static inline int mu_test_live(fz_context *ctx)
+{
+	fz_flush_alloc_cache(ctx);
+	return mu_test_live_blocks;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * outline-cache-test -- check that glyph outlines kept in the store
+ * come back the same as when they were first made.
+ *
+ * The outlines of the glyphs of a CFF font and a TrueType font, with
+ * fake bold and fake italic set, are fetched once from an empty store
+ * and then again, when they come from the store. Both must give the
+ * same path, point for point. Turning fake bold off must not give the
+ * bold outlines from the store.
+ *
+ * The TrueType font is read from resources/fonts, so run this from the
+ * top of the source tree, or give the path of another font.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define TRUETYPE_FONT "resources/fonts/noto/NotoSerifDevanagari-Regular.ttf"
+#define GLYPHS 80
+
+/* Write the path out as a list of commands and points. */
+
+static void add_op(fz_context *ctx, fz_buffer *buf, char op, int n, const float *v)
+{
+	fz_append_byte(ctx, buf, op);
+	fz_append_data(ctx, buf, v, n * sizeof *v);
+}
+
+static void rec_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+	float v[2] = { x, y };
+	add_op(ctx, arg, 'm', 2, v);
+}
+
+static void rec_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+	float v[2] = { x, y };
+	add_op(ctx, arg, 'l', 2, v);
+}
+
+static void rec_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	float v[6] = { x1, y1, x2, y2, x3, y3 };
+	add_op(ctx, arg, 'c', 6, v);
+}
+
+static void rec_closepath(fz_context *ctx, void *arg)
+{
+	add_op(ctx, arg, 'h', 0, NULL);
+}
+
+static const fz_path_walker rec_walker =
+{
+	rec_moveto,
+	rec_lineto,
+	rec_curveto,
+	rec_closepath
+};
+
+static fz_buffer *outline(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 256);
+	fz_path *path = fz_outline_glyph(ctx, font, gid, ctm);
+
+	if (path)
+		fz_walk_path(ctx, path, &rec_walker, buf);
+	else
+		add_op(ctx, buf, '0', 0, NULL);
+	fz_drop_path(ctx, path);
+	return buf;
+}
+
+static int same_outline(fz_buffer *a, fz_buffer *b)
+{
+	return a->len == b->len && !memcmp(a->data, b->data, a->len);
+}
+
+static void test_font(fz_context *ctx, fz_font *font)
+{
+	fz_matrix ctms[2];
+	fz_buffer *first[GLYPHS];
+	fz_buffer *again;
+	int m, gid, changed = 0;
+
+	ctms[0] = fz_scale(12, -12);
+	ctms[1] = fz_concat(fz_scale(37.5f, -41), fz_translate(100, 200));
+
+	font->flags.fake_bold = 1;
+	font->flags.fake_italic = 1;
+
+	for (m = 0; m < (int)nelem(ctms); m++)
+	{
+		fz_empty_store(ctx);
+		for (gid = 0; gid < GLYPHS; gid++)
+			first[gid] = outline(ctx, font, gid, ctms[m]);
+
+		for (gid = 0; gid < GLYPHS; gid++)
+		{
+			again = outline(ctx, font, gid, ctms[m]);
+			CHECK(same_outline(first[gid], again));
+			if (!same_outline(first[gid], again))
+				fprintf(stderr, "outline-cache-test: %s glyph %d differs\n", fz_font_name(ctx, font), gid);
+			fz_drop_buffer(ctx, again);
+		}
+
+		/* The plain outlines are not the bold ones. */
+		font->flags.fake_bold = 0;
+		for (gid = 0; gid < GLYPHS; gid++)
+		{
+			again = outline(ctx, font, gid, ctms[m]);
+			if (!same_outline(first[gid], again))
+				changed++;
+			fz_drop_buffer(ctx, again);
+		}
+		font->flags.fake_bold = 1;
+
+		for (gid = 0; gid < GLYPHS; gid++)
+			fz_drop_buffer(ctx, first[gid]);
+	}
+	CHECK(changed > 0);
+
+	font->flags.fake_bold = 0;
+	font->flags.fake_italic = 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : TRUETYPE_FONT;
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_font *font;
+
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		font = fz_new_base14_font(ctx, "Times-Roman");
+		test_font(ctx, font);
+		fz_drop_font(ctx, font);
+
+		font = fz_new_font_from_file(ctx, NULL, path, 0, 0);
+		test_font(ctx, font);
+		fz_drop_font(ctx, font);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	return mu_test_result("outline-cache-test");
+}
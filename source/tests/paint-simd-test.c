@@ -0,0 +1,250 @@
+/*
+ * paint-simd-test -- check the SIMD painters against the plain C ones.
+ *
+ * Every painter is run on the same random spans (of random widths and
+ * alignments) at each SIMD level the CPU supports, and the results must
+ * match the plain C versions bit for bit. The solid color painters are
+ * also checked against FZ_BLEND worked out pixel by pixel.
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/draw-imp.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#if FZ_ENABLE_SIMD
+
+#define ITERATIONS 2000
+#define MAX_W 100
+#define GUARD 32
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void fill_random(unsigned char *p, size_t len)
+{
+	while (len--)
+		*p++ = (unsigned char)rnd();
+}
+
+/* Colors with alpha are premultiplied, so no component exceeds it. */
+static void premultiply(unsigned char *p, int n1, int w)
+{
+	int k;
+	while (w--)
+	{
+		for (k = 0; k < n1; k++)
+			p[k] = p[k] * p[n1] / 255;
+		p += n1 + 1;
+	}
+}
+
+static int rnd_alpha(void)
+{
+	switch (rnd() % 4)
+	{
+	case 0: return 0;
+	case 1: return 255;
+	default: return rnd() & 255;
+	}
+}
+
+static const char *level_name[] = { "none", "sse4.1", "avx2" };
+
+static void solid_reference(unsigned char *dp, int n1, int da, int w, const unsigned char *color)
+{
+	int sa = FZ_EXPAND(color[n1]);
+	int k;
+	while (w--)
+	{
+		for (k = 0; k < n1; k++)
+			dp[k] = FZ_BLEND(color[k], dp[k], sa);
+		if (da)
+			dp[n1] = FZ_BLEND(255, dp[n1], sa);
+		dp += n1 + da;
+	}
+}
+
+static void test_solid(int level, int n1, int da)
+{
+	unsigned char init[MAX_W * 5 + 2 * GUARD];
+	unsigned char ref[sizeof init], c_out[sizeof init], simd_out[sizeof init];
+	unsigned char color[FZ_MAX_COLORS + 1];
+	fz_solid_color_painter_t *fn;
+	int i, w, off, n = n1 + da;
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		w = 1 + rnd() % MAX_W;
+		off = GUARD - rnd() % 16;
+		fill_random(init, sizeof init);
+		if (da)
+			premultiply(init + off, n1, w);
+		fill_random(color, n1);
+		color[n1] = rnd_alpha();
+
+		memcpy(ref, init, sizeof init);
+		solid_reference(ref + off, n1, da, w, color);
+
+		fz_limit_simd_level(FZ_SIMD_NONE);
+		memcpy(c_out, init, sizeof init);
+		fn = fz_get_solid_color_painter(n, color, da, NULL);
+		fn(c_out + off, n, w, color, da, NULL);
+
+		fz_limit_simd_level(level);
+		memcpy(simd_out, init, sizeof init);
+		fn = fz_get_solid_color_painter(n, color, da, NULL);
+		fn(simd_out + off, n, w, color, da, NULL);
+
+		CHECK(!memcmp(c_out, ref, sizeof init));
+		CHECK(!memcmp(simd_out, c_out, sizeof init));
+		if (memcmp(c_out, ref, sizeof init) || memcmp(simd_out, c_out, sizeof init))
+		{
+			fprintf(stderr, "solid color: level=%s n=%d da=%d w=%d alpha=%d\n", level_name[level], n1, da, w, color[n1]);
+			return;
+		}
+	}
+}
+
+static void test_span_color(int level, int n1, int da)
+{
+	unsigned char init[MAX_W * 5 + 2 * GUARD];
+	unsigned char c_out[sizeof init], simd_out[sizeof init];
+	unsigned char mask[MAX_W];
+	unsigned char color[FZ_MAX_COLORS + 1];
+	fz_span_color_painter_t *fn;
+	int i, j, w, off, n = n1 + da;
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		w = 1 + rnd() % MAX_W;
+		off = GUARD - rnd() % 16;
+		fill_random(init, sizeof init);
+		if (da)
+			premultiply(init + off, n1, w);
+		fill_random(color, n1);
+		color[n1] = rnd_alpha();
+		/* Runs of empty and full coverage take their own paths. */
+		for (j = 0; j < w; j++)
+			mask[j] = rnd_alpha();
+		if (rnd() & 1)
+			memset(mask, 0, w / 2);
+		if (rnd() & 1)
+			memset(mask + w / 2, 255, w - w / 2);
+
+		fz_limit_simd_level(FZ_SIMD_NONE);
+		memcpy(c_out, init, sizeof init);
+		fn = fz_get_span_color_painter(n, da, color, NULL);
+		fn(c_out + off, mask, n, w, color, da, NULL);
+
+		fz_limit_simd_level(level);
+		memcpy(simd_out, init, sizeof init);
+		fn = fz_get_span_color_painter(n, da, color, NULL);
+		fn(simd_out + off, mask, n, w, color, da, NULL);
+
+		CHECK(!memcmp(simd_out, c_out, sizeof init));
+		if (memcmp(simd_out, c_out, sizeof init))
+		{
+			fprintf(stderr, "span with color: level=%s n=%d da=%d w=%d alpha=%d\n", level_name[level], n1, da, w, color[n1]);
+			return;
+		}
+	}
+}
+
+static fz_pixmap *random_pixmap(fz_context *ctx, fz_colorspace *cs, int w, int a)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, w, 1, NULL, a);
+	fill_random(pix->samples, (size_t)pix->stride);
+	if (a && cs)
+		premultiply(pix->samples, pix->n - 1, w);
+	return pix;
+}
+
+static void test_span_mask(fz_context *ctx, int level, fz_colorspace *cs, int a)
+{
+	fz_pixmap *src, *msk, *init, *c_out, *simd_out;
+	int i, w;
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		w = 1 + rnd() % MAX_W;
+		src = random_pixmap(ctx, cs, w, a);
+		msk = random_pixmap(ctx, NULL, w, 1);
+		init = random_pixmap(ctx, cs, w, a);
+		if (rnd() & 1)
+			memset(msk->samples, 0, w / 2);
+		if (rnd() & 1)
+			memset(msk->samples + w / 2, 255, w - w / 2);
+		/* Pixels with no source alpha are skipped. */
+		if (a && (rnd() & 1))
+			memset(src->samples, 0, src->stride / 3);
+
+		fz_limit_simd_level(FZ_SIMD_NONE);
+		c_out = fz_clone_pixmap(ctx, init);
+		fz_paint_pixmap_with_mask(c_out, src, msk);
+
+		fz_limit_simd_level(level);
+		simd_out = fz_clone_pixmap(ctx, init);
+		fz_paint_pixmap_with_mask(simd_out, src, msk);
+
+		CHECK(!memcmp(simd_out->samples, c_out->samples, (size_t)c_out->stride));
+		if (memcmp(simd_out->samples, c_out->samples, (size_t)c_out->stride))
+			fprintf(stderr, "span with mask: level=%s n=%d a=%d w=%d\n", level_name[level], fz_colorspace_n(ctx, cs), a, w);
+
+		fz_drop_pixmap(ctx, src);
+		fz_drop_pixmap(ctx, msk);
+		fz_drop_pixmap(ctx, init);
+		fz_drop_pixmap(ctx, c_out);
+		fz_drop_pixmap(ctx, simd_out);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_colorspace *cs[3];
+	int n1[3] = { 1, 3, 4 };
+	int best = fz_simd_level();
+	int level, i, da;
+
+	cs[0] = fz_device_gray(ctx);
+	cs[1] = fz_device_rgb(ctx);
+	cs[2] = fz_device_cmyk(ctx);
+
+	if (best == FZ_SIMD_NONE)
+		fprintf(stderr, "paint-simd-test: no SIMD support; checking the plain C painters only\n");
+
+	for (level = FZ_SIMD_NONE; level <= best; level++)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			for (da = 0; da <= 1; da++)
+			{
+				test_solid(level, n1[i], da);
+				test_span_color(level, n1[i], da);
+				test_span_mask(ctx, level, cs[i], da);
+			}
+		}
+	}
+
+	fz_drop_context(ctx);
+	return mu_test_result("paint-simd-test");
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+	fprintf(stderr, "paint-simd-test: skipped; built without FZ_ENABLE_SIMD\n");
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * render-parallel-test -- check that fz_render_display_list_parallel
+ * does not depend on how its strips are shared out.
+ *
+ * Random lists of paths, images, clips, masks and groups are drawn into
+ * pixmaps of awkward sizes and positions (including heights that are
+ * not a multiple of the strip height) once as a single job, and then
+ * split into several jobs, both on the calling thread and on threads
+ * of their own. The results must match byte for byte. Lists of pixel
+ * aligned rectangles, where strip edges cannot change the antialiasing,
+ * must also match drawing the whole pixmap with one draw device.
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/helpers/mu-threads.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define LISTS 6
+#define PAGE 600
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static float rndf(float lo, float hi)
+{
+	return lo + (hi - lo) * (rnd() & 0xffff) / 65535.0f;
+}
+
+static fz_rect random_rect(int aligned)
+{
+	fz_rect r;
+	if (aligned)
+	{
+		r.x0 = rnd() % PAGE;
+		r.y0 = rnd() % PAGE;
+		r.x1 = r.x0 + 1 + rnd() % 150;
+		r.y1 = r.y0 + 1 + rnd() % 150;
+	}
+	else
+	{
+		r.x0 = rndf(-50, PAGE);
+		r.y0 = rndf(-50, PAGE);
+		r.x1 = r.x0 + rndf(0.5f, 200);
+		r.y1 = r.y0 + rndf(0.5f, 200);
+	}
+	return r;
+}
+
+static fz_path *rect_path(fz_context *ctx, fz_rect r)
+{
+	fz_path *path = fz_new_path(ctx);
+	fz_moveto(ctx, path, r.x0, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y0);
+	fz_lineto(ctx, path, r.x1, r.y1);
+	fz_lineto(ctx, path, r.x0, r.y1);
+	fz_closepath(ctx, path);
+	return path;
+}
+
+static void draw_content(fz_context *ctx, fz_device *dev, fz_image *image, int depth, int len)
+{
+	fz_colorspace *rgb = fz_device_rgb(ctx);
+	fz_colorspace *gray = fz_device_gray(ctx);
+	fz_color_params cp = fz_default_color_params;
+	fz_stroke_state *stroke;
+	fz_path *path;
+	fz_matrix ctm;
+	fz_rect r;
+	float color[3];
+	float alpha;
+
+	while (len--)
+	{
+		color[0] = rndf(0, 1);
+		color[1] = rndf(0, 1);
+		color[2] = rndf(0, 1);
+		alpha = (rnd() & 3) ? 1 : rndf(0, 1);
+		r = random_rect(0);
+		ctm = (rnd() & 3) ? fz_identity : fz_rotate(rndf(-10, 10));
+
+		switch (depth > 3 ? rnd() % 4 : rnd() % 10)
+		{
+		default:
+			path = rect_path(ctx, r);
+			fz_fill_path(ctx, dev, path, rnd() & 1, ctm, rgb, color, alpha, cp);
+			fz_drop_path(ctx, path);
+			break;
+		case 2:
+			path = rect_path(ctx, r);
+			stroke = fz_new_stroke_state(ctx);
+			stroke->linewidth = rndf(0.5f, 10);
+			fz_stroke_path(ctx, dev, path, stroke, ctm, rgb, color, alpha, cp);
+			fz_drop_stroke_state(ctx, stroke);
+			fz_drop_path(ctx, path);
+			break;
+		case 3:
+			ctm = fz_concat(fz_scale(r.x1 - r.x0, r.y1 - r.y0), fz_translate(r.x0, r.y0));
+			fz_fill_image(ctx, dev, image, ctm, alpha, cp);
+			break;
+		case 4: case 5:
+			path = rect_path(ctx, fz_expand_rect(r, 50));
+			fz_clip_path(ctx, dev, path, 0, ctm, fz_infinite_rect);
+			fz_drop_path(ctx, path);
+			draw_content(ctx, dev, image, depth + 1, rnd() % 10);
+			fz_pop_clip(ctx, dev);
+			break;
+		case 6: case 7:
+			fz_begin_mask(ctx, dev, fz_expand_rect(r, 50), rnd() & 1, gray, color, cp);
+			draw_content(ctx, dev, image, depth + 1, rnd() % 5);
+			fz_end_mask(ctx, dev);
+			draw_content(ctx, dev, image, depth + 1, rnd() % 10);
+			fz_pop_clip(ctx, dev);
+			break;
+		case 8: case 9:
+			fz_begin_group(ctx, dev, fz_expand_rect(r, 50), NULL, rnd() & 1, rnd() & 1, rnd() % 16, alpha);
+			draw_content(ctx, dev, image, depth + 1, rnd() % 10);
+			fz_end_group(ctx, dev);
+			break;
+		}
+	}
+}
+
+/* Opaque rectangles on whole pixels, which antialias the same however
+ * the pixmap is split. */
+static void draw_aligned_content(fz_context *ctx, fz_device *dev, int len)
+{
+	fz_path *path;
+	float color[3];
+
+	while (len--)
+	{
+		color[0] = rndf(0, 1);
+		color[1] = rndf(0, 1);
+		color[2] = rndf(0, 1);
+		path = rect_path(ctx, random_rect(1));
+		fz_fill_path(ctx, dev, path, 0, fz_identity, fz_device_rgb(ctx), color, 1, fz_default_color_params);
+		fz_drop_path(ctx, path);
+	}
+}
+
+static fz_display_list *new_list(fz_context *ctx, fz_image *image, int aligned)
+{
+	fz_display_list *list = fz_new_display_list(ctx, fz_make_rect(0, 0, PAGE, PAGE));
+	fz_device *dev = fz_new_list_device(ctx, list);
+	if (aligned)
+		draw_aligned_content(ctx, dev, 200);
+	else
+		draw_content(ctx, dev, image, 0, 200);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	return list;
+}
+
+static fz_pixmap *new_background(fz_context *ctx, fz_irect bbox, int alpha)
+{
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, alpha);
+	if (alpha)
+		fz_clear_pixmap(ctx, pix);
+	else
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+	return pix;
+}
+
+static int same_samples(fz_pixmap *a, fz_pixmap *b)
+{
+	return !memcmp(a->samples, b->samples, (size_t)a->stride * a->h);
+}
+
+static void test_list(fz_context *ctx, fz_display_list *list, int aligned)
+{
+	static const int heights[] = { 1, 63, 64, 65, 130, 200, 333, PAGE };
+	static const int jobs[] = { 2, 3, 4, 8, 100 };
+	fz_pixmap *serial, *pix;
+	fz_device *dev;
+	fz_irect bbox;
+	fz_matrix ctm;
+	int i, k, alpha;
+
+	for (i = 0; i < (int)nelem(heights); i++)
+	{
+		alpha = i & 1;
+		ctm = aligned ? fz_identity : fz_scale(rndf(0.5f, 1.5f), rndf(0.5f, 1.5f));
+		bbox.x0 = aligned ? 0 : rnd() % 100 - 50;
+		bbox.y0 = aligned ? 0 : rnd() % 100 - 50;
+		bbox.x1 = bbox.x0 + 1 + rnd() % PAGE;
+		bbox.y1 = bbox.y0 + heights[i];
+
+		serial = new_background(ctx, bbox, alpha);
+		fz_render_display_list_parallel(ctx, list, ctm, serial, 1, NULL, NULL);
+
+		for (k = 0; k < (int)nelem(jobs); k++)
+		{
+			/* Several jobs on the calling thread... */
+			pix = new_background(ctx, bbox, alpha);
+			fz_render_display_list_parallel(ctx, list, ctm, pix, jobs[k], NULL, NULL);
+			CHECK(same_samples(pix, serial));
+			fz_drop_pixmap(ctx, pix);
+
+			/* ...and on threads of their own. */
+			pix = new_background(ctx, bbox, alpha);
+			mu_render_display_list(ctx, list, ctm, pix, jobs[k]);
+			CHECK(same_samples(pix, serial));
+			if (!same_samples(pix, serial))
+				fprintf(stderr, "render-parallel: %d jobs differ for [%d %d %d %d] alpha=%d\n",
+					jobs[k], bbox.x0, bbox.y0, bbox.x1, bbox.y1, alpha);
+			fz_drop_pixmap(ctx, pix);
+		}
+
+		if (aligned)
+		{
+			pix = new_background(ctx, bbox, alpha);
+			dev = fz_new_draw_device(ctx, fz_identity, pix);
+			fz_run_display_list(ctx, list, dev, ctm, fz_infinite_rect, NULL);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			CHECK(same_samples(pix, serial));
+			fz_drop_pixmap(ctx, pix);
+		}
+
+		fz_drop_pixmap(ctx, serial);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	fz_locks_context *locks = mu_new_locks();
+	fz_context *ctx;
+	fz_display_list *list;
+	fz_pixmap *pix;
+	fz_image *image;
+	int i;
+
+	if (!locks)
+	{
+		fprintf(stderr, "cannot create locks\n");
+		return EXIT_FAILURE;
+	}
+	ctx = fz_new_context(NULL, locks, FZ_STORE_DEFAULT);
+
+	pix = fz_new_pixmap(ctx, fz_device_rgb(ctx), 7, 5, NULL, 1);
+	for (i = 0; i < pix->w * pix->h; i++)
+	{
+		unsigned char a = i * 53;
+		pix->samples[i * 4 + 0] = (i * 37 & 255) * a / 255;
+		pix->samples[i * 4 + 1] = (i * 71 & 255) * a / 255;
+		pix->samples[i * 4 + 2] = (i * 13 & 255) * a / 255;
+		pix->samples[i * 4 + 3] = a;
+	}
+	image = fz_new_image_from_pixmap(ctx, pix, NULL);
+	fz_drop_pixmap(ctx, pix);
+
+	for (i = 0; i < LISTS; i++)
+	{
+		list = new_list(ctx, image, i & 1);
+		test_list(ctx, list, i & 1);
+		fz_drop_display_list(ctx, list);
+	}
+
+	fz_drop_image(ctx, image);
+	fz_drop_context(ctx);
+	mu_drop_locks(locks);
+	return mu_test_result("render-parallel-test");
+}
@@ -0,0 +1,182 @@
+/*
+ * scale-test -- check the SIMD and banded image scalers against the
+ * plain C one.
+ *
+ * Random images are scaled to random sizes and positions (with flips,
+ * clips and sub-pixel offsets), once with the plain C scaler on the
+ * calling thread, and then at each SIMD level the CPU supports and split
+ * into bands over several threads. The results must match bit for bit.
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/helpers/mu-threads.h"
+#include "../fitz/draw-imp.h"
+#include "../fitz/pixmap-imp.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define ITERATIONS 400
+#define BANDED_ITERATIONS 12
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static float rndf(float lo, float hi)
+{
+	return lo + (hi - lo) * (rnd() & 0xffff) / 65535.0f;
+}
+
+/* A pixmap with n components. Colorants beyond the process ones are spots. */
+static fz_pixmap *random_pixmap(fz_context *ctx, int n, int w, int h, int alpha)
+{
+	fz_separations *seps = NULL;
+	fz_colorspace *cs;
+	fz_pixmap *pix;
+	unsigned char *p;
+	size_t len;
+	int k, spots = 0;
+
+	switch (n - alpha)
+	{
+	case 0: cs = NULL; break;
+	case 1: cs = fz_device_gray(ctx); break;
+	case 2: cs = fz_device_gray(ctx); spots = 1; break;
+	case 3: cs = fz_device_rgb(ctx); break;
+	default: cs = fz_device_cmyk(ctx); spots = n - alpha - 4; break;
+	}
+	if (spots)
+	{
+		seps = fz_new_separations(ctx, 0);
+		for (k = 0; k < spots; k++)
+		{
+			fz_add_separation(ctx, seps, "Spot", fz_device_gray(ctx), 0);
+			fz_set_separation_behavior(ctx, seps, k, FZ_SEPARATION_SPOT);
+		}
+	}
+	pix = fz_new_pixmap(ctx, cs, w, h, seps, alpha);
+	fz_drop_separations(ctx, seps);
+	p = pix->samples;
+	len = (size_t)pix->stride * h;
+	while (len--)
+		*p++ = (unsigned char)rnd();
+	return pix;
+}
+
+static int same_pixmap(fz_pixmap *a, fz_pixmap *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	if (a->x != b->x || a->y != b->y || a->w != b->w || a->h != b->h || a->n != b->n)
+		return 0;
+	return !memcmp(a->samples, b->samples, (size_t)a->stride * a->h);
+}
+
+/* Count how often the scaler splits its work, to be sure we tested it. */
+static int banded_scales = 0;
+
+static void
+count_parallel(void *arg, fz_context *ctx, int count, void (*job)(fz_context *ctx, void *job_arg, int index), void *job_arg)
+{
+	banded_scales++;
+	mu_run_parallel(arg, ctx, count, job, job_arg);
+}
+
+static void test_scale(fz_context *ctx, int level, int threads, int n, int alpha, int big)
+{
+	fz_pixmap *src, *ref, *out;
+	fz_irect clip, *clipp = NULL;
+	float x, y, w, h;
+	int sw, sh;
+
+	if (big)
+	{
+		sw = 300 + rnd() % 700;
+		sh = (1<<20) / (sw * n) + 1 + rnd() % 100;
+	}
+	else
+	{
+		sw = 1 + rnd() % 120;
+		sh = 1 + rnd() % 120;
+	}
+	src = random_pixmap(ctx, n, sw, sh, alpha);
+
+	/* Both up and down scales, sometimes flipped. */
+	w = rndf(1, sw * 2.5f);
+	h = rndf(1, sh * 2.5f);
+	if (rnd() & 1)
+		w = (int)w;
+	if (rnd() & 1)
+		h = (int)h;
+	x = (rnd() & 1) ? (int)rndf(-50, 50) : rndf(-50, 50);
+	y = (rnd() & 1) ? (int)rndf(-50, 50) : rndf(-50, 50);
+	if (rnd() % 4 == 0)
+	{
+		x += w;
+		w = -w;
+	}
+	if (rnd() % 4 == 0)
+	{
+		y += h;
+		h = -h;
+	}
+	if (rnd() & 1)
+	{
+		clip.x0 = (int)rndf(-50, 50 + sw);
+		clip.y0 = (int)rndf(-50, 50 + sh);
+		clip.x1 = clip.x0 + 1 + rnd() % (2 * sw + 1);
+		clip.y1 = clip.y0 + 1 + rnd() % (2 * sh + 1);
+		clipp = &clip;
+	}
+
+	fz_limit_simd_level(FZ_SIMD_NONE);
+	fz_tune_image_scale_threads(ctx, NULL, NULL, 0);
+	ref = fz_scale_pixmap(ctx, src, x, y, w, h, clipp);
+
+	fz_limit_simd_level(level);
+	fz_tune_image_scale_threads(ctx, threads > 1 ? count_parallel : NULL, NULL, threads);
+	out = fz_scale_pixmap(ctx, src, x, y, w, h, clipp);
+
+	CHECK(same_pixmap(out, ref));
+	if (!same_pixmap(out, ref))
+		fprintf(stderr, "scale: level=%d threads=%d n=%d alpha=%d src=%dx%d dst=[%g %g %g %g]\n",
+			level, threads, n, alpha, sw, sh, x, y, w, h);
+
+	fz_drop_pixmap(ctx, src);
+	fz_drop_pixmap(ctx, ref);
+	fz_drop_pixmap(ctx, out);
+}
+
+int main(int argc, char **argv)
+{
+	fz_locks_context *locks = mu_new_locks();
+	fz_context *ctx = fz_new_context(NULL, locks, FZ_STORE_DEFAULT);
+	int best = fz_simd_level();
+	int level, n, alpha, i;
+
+	/* Every component count the scaler has a kernel for, and one more. */
+	for (level = FZ_SIMD_NONE; level <= best; level++)
+		for (n = 1; n <= 6; n++)
+			for (alpha = 0; alpha <= 1; alpha++)
+				for (i = 0; i < ITERATIONS; i++)
+					test_scale(ctx, level, 1, n, alpha, 0);
+
+	/* Large scales, split over several threads. */
+	for (level = FZ_SIMD_NONE; level <= best; level++)
+		for (n = 1; n <= 4; n++)
+			for (i = 0; i < BANDED_ITERATIONS; i++)
+				test_scale(ctx, level, 2 + rnd() % 7, n, rnd() & 1, 1);
+	CHECK(banded_scales > 0);
+
+	fz_limit_simd_level(best);
+	fz_drop_context(ctx);
+	mu_drop_locks(locks);
+	return mu_test_result("scale-test");
+}
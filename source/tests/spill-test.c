@@ -0,0 +1,229 @@
+/*
+ * spill-test -- check that image tiles evicted from the store are
+ * spilled to disk, and read back from there intact.
+ *
+ * Images take turns in a store that only has room for one. After a
+ * tile has been evicted, the compressed data of its image is changed
+ * behind its back, so that a tile taken back from the queue, or read
+ * back from disk, can be told from one that has been decoded again.
+ * Spill files that cannot be written or read, or that hold a tile of
+ * the wrong size, must simply lead to the image being decoded again.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMG_W 64
+#define IMG_H 64
+#define TILE_SIZE (IMG_W * IMG_H * 3)
+
+static void fill(fz_buffer *buf, int seed)
+{
+	int i;
+	for (i = 0; i < TILE_SIZE; i++)
+		buf->data[i] = i * 13 + seed;
+}
+
+static fz_image *new_raw_image(fz_context *ctx, int seed)
+{
+	fz_compressed_buffer *cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+	cbuf->params.type = FZ_IMAGE_RAW;
+	cbuf->buffer = fz_new_buffer(ctx, TILE_SIZE);
+	cbuf->buffer->len = TILE_SIZE;
+	fill(cbuf->buffer, seed);
+	return fz_new_image_from_compressed_buffer(ctx, IMG_W, IMG_H, 8, fz_device_rgb(ctx),
+		72, 72, 0, 0, NULL, NULL, cbuf, NULL);
+}
+
+/* Does the image come out as it was made with the given seed? Getting
+ * the pixmap puts its tile in the store, and evicts the other image's. */
+static int check_image(fz_context *ctx, fz_image *image, int seed)
+{
+	fz_pixmap *pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+	int i, ok = pix->w == IMG_W && pix->h == IMG_H && pix->n == 3;
+
+	for (i = 0; ok && i < TILE_SIZE; i++)
+		ok = pix->samples[i] == (unsigned char)(i * 13 + seed);
+	fz_drop_pixmap(ctx, pix);
+	return ok;
+}
+
+static int count_files(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	int n = 0;
+
+	if (!d)
+		return -1;
+	while ((e = readdir(d)) != NULL)
+		if (e->d_name[0] != '.')
+			n++;
+	closedir(d);
+	return n;
+}
+
+static void truncate_files(const char *dir)
+{
+	char path[1100];
+	DIR *d = opendir(dir);
+	struct dirent *e;
+
+	if (!d)
+		return;
+	while ((e = readdir(d)) != NULL)
+	{
+		if (e->d_name[0] == '.')
+			continue;
+		fz_snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+		CHECK(truncate(path, 10) == 0);
+	}
+	closedir(d);
+}
+
+/* Overwrite the size recorded in each spill file with one that holds
+ * as many samples, but is twice as tall and half as wide. */
+static void reshape_files(const char *dir)
+{
+	static const unsigned char size[8] = { IMG_W / 2, 0, 0, 0, IMG_H * 2, 0, 0, 0 };
+	char path[1100];
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	FILE *f;
+
+	if (!d)
+		return;
+	while ((e = readdir(d)) != NULL)
+	{
+		if (e->d_name[0] == '.')
+			continue;
+		fz_snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+		f = fopen(path, "r+b");
+		CHECK(f != NULL);
+		if (!f)
+			continue;
+		CHECK(fseek(f, 16, SEEK_SET) == 0 && fwrite(size, 1, 8, f) == 8);
+		fclose(f);
+	}
+	closedir(d);
+}
+
+static void test_spill(fz_context *ctx, const char *dir)
+{
+	fz_image *a = new_raw_image(ctx, 1);
+	fz_image *b = new_raw_image(ctx, 2);
+	fz_image *c = new_raw_image(ctx, 6);
+	fz_buffer *a_data = fz_compressed_image_buffer(ctx, a)->buffer;
+	fz_buffer *b_data = fz_compressed_image_buffer(ctx, b)->buffer;
+
+	fz_set_image_spill(ctx, dir, 1 << 20);
+
+	/* Evicting a tile only queues it... */
+	CHECK(check_image(ctx, a, 1));
+	CHECK(check_image(ctx, b, 2));
+	CHECK(count_files(dir) == 0);
+
+	/* ...from where it is taken back, without being written or
+	 * decoded again, if it is wanted before the queue is flushed. */
+	fill(a_data, 3);
+	CHECK(check_image(ctx, a, 1));
+	CHECK(count_files(dir) == 0);
+
+	fz_flush_image_spill(ctx);
+	CHECK(count_files(dir) == 1);
+
+	/* A flushed tile is read back, rather than decoded again. */
+	fill(b_data, 4);
+	CHECK(check_image(ctx, b, 2));
+
+	/* The queue holds no more than the store, so queuing a second
+	 * tile writes the first. */
+	CHECK(check_image(ctx, c, 6));
+	CHECK(count_files(dir) == 2);
+
+	/* A spill file that has been damaged is forgotten. */
+	truncate_files(dir);
+	CHECK(check_image(ctx, a, 3));
+
+	/* So is one whose tile is not the size it should be. */
+	fz_set_image_spill(ctx, dir, 1 << 20);
+	CHECK(check_image(ctx, c, 6));
+	fz_flush_image_spill(ctx);
+	CHECK(count_files(dir) == 1);
+	reshape_files(dir);
+	fill(a_data, 8);
+	CHECK(check_image(ctx, a, 8));
+	CHECK(count_files(dir) == 0);
+
+	/* Spill files that cannot be written are not missed. */
+	fz_set_image_spill(ctx, "/nonexistent/spill-test", 1 << 20);
+	CHECK(check_image(ctx, b, 4));
+	fz_flush_image_spill(ctx);
+	fill(a_data, 9);
+	CHECK(check_image(ctx, a, 9));
+	CHECK(check_image(ctx, b, 4));
+
+	/* Tiles still waiting to be written are discarded along with the
+	 * files when spilling is turned off. */
+	fz_set_image_spill(ctx, dir, 1 << 20);
+	CHECK(check_image(ctx, a, 9));
+	CHECK(check_image(ctx, b, 4));
+	fz_set_image_spill(ctx, NULL, 0);
+	fz_flush_image_spill(ctx);
+	CHECK(count_files(dir) == 0);
+
+	fz_drop_image(ctx, a);
+	fz_drop_image(ctx, b);
+	fz_drop_image(ctx, c);
+	fz_empty_store(ctx);
+}
+
+static void quiet(void *user, const char *message)
+{
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "/tmp/spill-test-XXXXXX";
+	fz_context *ctx;
+	int base;
+
+	if (!mkdtemp(dir))
+	{
+		fprintf(stderr, "cannot create spill directory\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Room for one tile, but not two. */
+	ctx = fz_new_context(mu_test_alloc(), NULL, TILE_SIZE * 3 / 2);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+	fz_set_warning_callback(ctx, quiet, NULL);
+	fz_set_error_callback(ctx, quiet, NULL);
+
+	fz_try(ctx)
+	{
+		base = mu_test_live(ctx);
+		test_spill(ctx, dir);
+		CHECK(mu_test_live(ctx) == base);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	CHECK(mu_test_live_blocks == 0);
+	rmdir(dir);
+
+	return mu_test_result("spill-test");
+}
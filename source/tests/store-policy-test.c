@@ -0,0 +1,203 @@
+/*
+ * store-policy-test -- check which items each eviction policy keeps.
+ *
+ * Numbered items are stored, and then the store is made to evict some
+ * of them, either by storing more than it can hold or by shrinking it.
+ * Enough items are evicted at a time to need several passes over the
+ * store's lists.
+ */
+
+#include "mupdf/fitz.h"
+#include "mu-test.h"
+
+#define ITEMS 300
+#define ITEM_SIZE 100
+
+typedef struct
+{
+	fz_storable storable;
+	int id;
+} test_item;
+
+static int keys[ITEMS];
+static size_t costs[ITEMS];
+
+static void drop_test_item(fz_context *ctx, fz_storable *item)
+{
+	fz_free(ctx, item);
+}
+
+/* Keys are not hashed, so every item goes into the same shard, and the
+ * order of eviction is the policy's alone. */
+static int make_hash_key(fz_context *ctx, fz_store_hash *hash, void *key)
+{
+	return 0;
+}
+
+static void *keep_key(fz_context *ctx, void *key)
+{
+	return key;
+}
+
+static void drop_key(fz_context *ctx, void *key)
+{
+}
+
+static int cmp_key(fz_context *ctx, void *a, void *b)
+{
+	return *(int *)a != *(int *)b;
+}
+
+static void format_key(fz_context *ctx, char *buf, size_t size, void *key)
+{
+	fz_snprintf(buf, size, "(test item %d)", *(int *)key);
+}
+
+static size_t item_cost(fz_context *ctx, void *key, void *val, size_t size)
+{
+	return costs[*(int *)key];
+}
+
+static const fz_store_type test_store_type =
+{
+	"test_item",
+	make_hash_key,
+	keep_key,
+	drop_key,
+	cmp_key,
+	format_key,
+	NULL,
+	item_cost,
+	NULL
+};
+
+static void store(fz_context *ctx, int id)
+{
+	test_item *item = fz_malloc_struct(ctx, test_item);
+	FZ_INIT_STORABLE(item, 1, drop_test_item);
+	item->id = id;
+	fz_drop_storable(ctx, fz_store_item(ctx, &keys[id], item, ITEM_SIZE, &test_store_type));
+	fz_drop_storable(ctx, &item->storable);
+}
+
+static int find(fz_context *ctx, int id)
+{
+	test_item *item = fz_find_item(ctx, drop_test_item, &keys[id], &test_store_type);
+	int found = item && item->id == id;
+	fz_drop_storable(ctx, item ? &item->storable : NULL);
+	return found;
+}
+
+/* A store that is full keeps the items stored last. */
+static void test_lru(fz_context *ctx)
+{
+	int i;
+
+	fz_set_store_policy(ctx, FZ_STORE_LRU);
+	for (i = 0; i < ITEMS; i++)
+		store(ctx, i);
+	for (i = 0; i < ITEMS; i++)
+		CHECK(find(ctx, i) == (i >= ITEMS / 3));
+	fz_empty_store(ctx);
+}
+
+/* Items that are used twice survive a stream of items used once, which
+ * would flush them from an LRU store. */
+static void test_arc(fz_context *ctx)
+{
+	int i;
+
+	fz_set_store_policy(ctx, FZ_STORE_ARC);
+	for (i = 0; i < 20; i++)
+		store(ctx, i);
+	for (i = 0; i < 20; i++)
+		CHECK(find(ctx, i));
+	for (i = 20; i < ITEMS; i++)
+		store(ctx, i);
+	for (i = 0; i < 20; i++)
+		CHECK(find(ctx, i));
+
+	/* And a large eviction all in one go, which leaves the items used
+	 * once that were stored last. */
+	fz_shrink_store(ctx, 20);
+	for (i = 0; i < 20; i++)
+		CHECK(find(ctx, i));
+	for (i = 20; i < ITEMS; i++)
+		CHECK(find(ctx, i) == (i >= ITEMS - 20));
+	fz_empty_store(ctx);
+}
+
+/* Shrinking the store keeps the items that cost most to make again. */
+static void test_cost(fz_context *ctx)
+{
+	size_t lowest_kept = SIZE_MAX, highest_gone = 0;
+	int i, kept = 0;
+
+	fz_set_store_policy(ctx, FZ_STORE_COST);
+	for (i = 0; i < ITEMS; i++)
+	{
+		costs[i] = ITEM_SIZE * (1 + (i * 7919) % 1000);
+		store(ctx, i);
+	}
+	fz_shrink_store(ctx, 25);
+	for (i = 0; i < ITEMS; i++)
+	{
+		if (find(ctx, i))
+		{
+			kept++;
+			lowest_kept = fz_minz(lowest_kept, costs[i]);
+		}
+		else
+			highest_gone = fz_maxz(highest_gone, costs[i]);
+	}
+	CHECK(kept == ITEMS / 4);
+	CHECK(highest_gone <= lowest_kept);
+	fz_empty_store(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	int i;
+
+	for (i = 0; i < ITEMS; i++)
+		keys[i] = i;
+
+	/* Room for two thirds of the items. */
+	ctx = fz_new_context(NULL, NULL, ITEM_SIZE * ITEMS * 2 / 3);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		test_lru(ctx);
+		test_arc(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+	fz_drop_context(ctx);
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+		test_cost(ctx);
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+	fz_drop_context(ctx);
+
+	return mu_test_result("store-policy-test");
+}
@@ -0,0 +1,216 @@
+/*
+ * type3-cache-test -- check that the display lists kept for type 3
+ * glyphs that inherit the graphics state are not reused for another
+ * state.
+ *
+ * The first glyph fills a bar and shows a letter, without setting a
+ * colour or a text render mode of its own. It is shown three times on
+ * the first page: in blue, in red, and in red again with stroked text.
+ * Each must come out in its own colours, and the last with its letter
+ * stroked, even though the first two were already recorded.
+ *
+ * The second glyph fills a small square in its corner and shows two
+ * letters, which inherit the character spacing and text rise. It is shown plain, spaced out, and raised, on
+ * the second page, and each must be laid out accordingly.
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/pdf.h"
+#include "mu-test.h"
+
+#include <string.h>
+
+#define PAGE_W 360
+#define PAGE_H 120
+
+/* The objects of the file, each either a dictionary or a stream. */
+static const struct { const char *dict, *stream; } objects[] =
+{
+	{ "<< /Type /Catalog /Pages 2 0 R >>" },
+	{ "<< /Type /Pages /Kids [3 0 R 8 0 R] /Count 2 >>" },
+	{ "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 360 120] /Resources << /Font << /F1 5 0 R >> >> /Contents 4 0 R >>" },
+	{ NULL,
+		"0 1 0 RG\n"
+		"0 0 1 rg BT /F1 100 Tf 10 10 Td (a) Tj ET\n"
+		"1 0 0 rg BT /F1 100 Tf 130 10 Td (a) Tj ET\n"
+		"1 Tr BT /F1 100 Tf 250 10 Td (a) Tj ET\n" },
+	{ "<< /Type /Font /Subtype /Type3 /FontBBox [0 0 100 100] /FontMatrix [0.01 0 0 0.01 0 0]"
+		" /CharProcs << /a 6 0 R /b 9 0 R >> /Encoding << /Type /Encoding /Differences [97 /a /b] >>"
+		" /FirstChar 97 /LastChar 98 /Widths [100 100] /Resources << /Font << /F2 7 0 R >> >> >>" },
+	{ NULL, "100 0 d0 0 0 40 100 re f BT /F2 70 Tf 45 7 Td (H) Tj ET\n" },
+	{ "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>" },
+	{ "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 360 120] /Resources << /Font << /F1 5 0 R >> >> /Contents 10 0 R >>" },
+	{ NULL, "100 0 d0 90 90 10 10 re f BT /F2 40 Tf 0 10 Td (II) Tj ET\n" },
+	{ NULL,
+		"0 0 1 rg\n"
+		"BT /F1 100 Tf 10 10 Td (b) Tj ET\n"
+		"BT /F1 100 Tf 30 Tc 130 10 Td (b) Tj ET\n"
+		"BT /F1 100 Tf 0 Tc 15 Ts 250 10 Td (b) Tj ET\n" },
+};
+
+static void add_stream(fz_context *ctx, fz_buffer *buf, const char *data)
+{
+	fz_append_printf(ctx, buf, "<< /Length %d >>\nstream\n%s\nendstream", (int)strlen(data), data);
+}
+
+static fz_buffer *make_pdf(fz_context *ctx)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 2048);
+	int ofs[nelem(objects)];
+	int i, xref;
+
+	fz_append_string(ctx, buf, "%PDF-1.4\n");
+	for (i = 0; i < (int)nelem(objects); i++)
+	{
+		ofs[i] = (int)buf->len;
+		fz_append_printf(ctx, buf, "%d 0 obj\n", i + 1);
+		if (objects[i].stream)
+			add_stream(ctx, buf, objects[i].stream);
+		else
+			fz_append_string(ctx, buf, objects[i].dict);
+		fz_append_string(ctx, buf, "\nendobj\n");
+	}
+	xref = (int)buf->len;
+	fz_append_printf(ctx, buf, "xref\n0 %d\n0000000000 65535 f \n", (int)nelem(objects) + 1);
+	for (i = 0; i < (int)nelem(objects); i++)
+		fz_append_printf(ctx, buf, "%010d 00000 n \n", ofs[i]);
+	fz_append_printf(ctx, buf, "trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%d\n%%%%EOF\n", (int)nelem(objects) + 1, xref);
+	return buf;
+}
+
+/* Count the pixels in a rectangle of the page (in page space) that are
+ * mostly of one of the given colour's components. */
+static int count_color(fz_pixmap *pix, int x0, int y0, int x1, int y1, int c)
+{
+	int x, y, n = 0;
+
+	for (y = PAGE_H - y1; y < PAGE_H - y0; y++)
+	{
+		for (x = x0; x < x1; x++)
+		{
+			unsigned char *p = pix->samples + y * pix->stride + x * pix->n;
+			if (p[c] > p[(c + 1) % 3] + 100 && p[c] > p[(c + 2) % 3] + 100)
+				n++;
+		}
+	}
+	return n;
+}
+
+/* The bounds, in page space, of the pixels in a rectangle of the page
+ * that are mostly of one of the given colour's components. */
+static fz_irect color_bounds(fz_pixmap *pix, int x0, int y0, int x1, int y1, int c)
+{
+	fz_irect r = fz_empty_irect;
+	int x, y;
+
+	for (y = PAGE_H - y1; y < PAGE_H - y0; y++)
+	{
+		for (x = x0; x < x1; x++)
+		{
+			unsigned char *p = pix->samples + y * pix->stride + x * pix->n;
+			if (p[c] <= p[(c + 1) % 3] + 100 || p[c] <= p[(c + 2) % 3] + 100)
+				continue;
+			if (fz_is_empty_irect(r))
+				r = fz_make_irect(x, PAGE_H - y - 1, x + 1, PAGE_H - y);
+			r.x0 = fz_mini(r.x0, x);
+			r.x1 = fz_maxi(r.x1, x + 1);
+			r.y0 = fz_mini(r.y0, PAGE_H - y - 1);
+			r.y1 = fz_maxi(r.y1, PAGE_H - y);
+		}
+	}
+	return r;
+}
+
+static void test_colors(fz_context *ctx, pdf_document *doc)
+{
+	fz_page *page = fz_load_page(ctx, (fz_document *)doc, 0);
+	fz_pixmap *pix = fz_new_pixmap_from_page(ctx, page, fz_identity, fz_device_rgb(ctx), 0);
+	int area;
+
+	CHECK(pix->w == PAGE_W && pix->h == PAGE_H);
+
+	/* The bars, in the fill colour of each. */
+	area = 30 * 90;
+	CHECK(count_color(pix, 15, 15, 45, 105, 2) == area);
+	CHECK(count_color(pix, 135, 15, 165, 105, 0) == area);
+	CHECK(count_color(pix, 255, 15, 285, 105, 0) == area);
+
+	/* The letters, filled, filled, and stroked. */
+	CHECK(count_color(pix, 55, 10, 120, 70, 2) > 200);
+	CHECK(count_color(pix, 175, 10, 240, 70, 0) > 200);
+	CHECK(count_color(pix, 295, 10, 360, 70, 1) > 50);
+	CHECK(count_color(pix, 295, 10, 360, 70, 0) == 0);
+
+	fz_drop_pixmap(ctx, pix);
+	fz_drop_page(ctx, page);
+}
+
+static void test_text_state(fz_context *ctx, pdf_document *doc)
+{
+	fz_page *page = fz_load_page(ctx, (fz_document *)doc, 1);
+	fz_pixmap *pix = fz_new_pixmap_from_page(ctx, page, fz_identity, fz_device_rgb(ctx), 0);
+	fz_irect plain = color_bounds(pix, 0, 0, 120, 90, 2);
+	fz_irect spaced = color_bounds(pix, 120, 0, 240, 90, 2);
+	fz_irect raised = color_bounds(pix, 240, 0, 360, 90, 2);
+
+	/* Two letters on a line 10 units above the glyph's origin, below
+	 * the square. */
+	CHECK(!fz_is_empty_irect(plain));
+	CHECK(plain.x1 - 10 < 25 && plain.y0 < 25);
+
+	/* The second letter moved right by the character spacing. */
+	CHECK(spaced.x1 - 130 > 35 && spaced.y0 < 25);
+
+	/* The letters raised by the text rise, once for the glyph and
+	 * once more for the text inside it. */
+	CHECK(raised.x1 - 250 < 25 && raised.y0 > 45);
+	if (raised.y0 <= 45 || spaced.x1 - 130 <= 35)
+		fprintf(stderr, "type3-cache-test: letters at [%d %d %d %d], [%d %d %d %d], [%d %d %d %d]\n",
+			plain.x0, plain.y0, plain.x1, plain.y1,
+			spaced.x0, spaced.y0, spaced.x1, spaced.y1,
+			raised.x0, raised.y0, raised.x1, raised.y1);
+
+	fz_drop_pixmap(ctx, pix);
+	fz_drop_page(ctx, page);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	pdf_document *doc = NULL;
+	fz_buffer *buf = NULL;
+	fz_stream *stm = NULL;
+
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_var(doc);
+	fz_var(buf);
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		buf = make_pdf(ctx);
+		stm = fz_open_buffer(ctx, buf);
+		doc = pdf_open_document_with_stream(ctx, stm);
+		test_colors(ctx, doc);
+		test_text_state(ctx, doc);
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_document(ctx, doc);
+		fz_drop_stream(ctx, stm);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mu_test_failures++;
+	}
+
+	fz_drop_context(ctx);
+	return mu_test_result("type3-cache-test");
+}
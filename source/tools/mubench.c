@@ -0,0 +1,789 @@
+/*
+ * mubench -- measure the cost of the stages of processing documents
+ */
+
+#include "mupdf/fitz.h"
+
+#if FZ_ENABLE_PDF
+#include "mupdf/pdf.h" /* for saving */
+#endif
+
+#ifndef DISABLE_MUTHREADS
+#include "mupdf/helpers/mu-threads.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef _MSC_VER
+struct timeval;
+struct timezone;
+int gettimeofday(struct timeval *tv, struct timezone *tz);
+#else
+#include <sys/time.h>
+#endif
+
+enum
+{
+	PHASE_OPEN,
+	PHASE_LOAD,
+	PHASE_LIST,
+	PHASE_DRAW,
+	PHASE_TEXT,
+	PHASE_SAVE,
+	PHASE_COUNT
+};
+
+static const char *phase_name[PHASE_COUNT] =
+{
+	"open", "load", "list", "draw", "text", "save"
+};
+
+/* What one run of a file cost in one phase (summed over its pages). */
+typedef struct
+{
+	int used;
+	double wall;
+	double cpu;
+	size_t peak;
+	size_t allocs;
+	int64_t lookups;
+	int64_t hits;
+} phase_sample;
+
+/* The counters at the start of a phase. */
+typedef struct
+{
+	double wall;
+	double cpu;
+	size_t allocs;
+	int64_t lookups;
+	int64_t hits;
+} phase_mark;
+
+typedef struct
+{
+	size_t size;
+#if defined(_M_IA64) || defined(_M_AMD64)
+	size_t align;
+#endif
+} bench_header;
+
+typedef struct
+{
+	size_t current;
+	size_t peak;
+	size_t allocs;
+} bench_info;
+
+static bench_info meminfo;
+
+static fz_context *ctx;
+
+static const char *password = "";
+static float resolution = 72;
+static int repeat = 3;
+static int warmup = 1;
+static int blend = 0;
+static int refs = 0;
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"usage: mutool bench [options] file...\n"
+		"       mutool bench [options] -b [file...]\n"
+		"       mutool bench [options] -k [file...]\n"
+		"\t-p -\tpassword\n"
+		"\t-o -\toutput file for the report (default: stdout)\n"
+		"\t-r -\tresolution in dpi to draw at (default: 72)\n"
+		"\t-n -\tnumber of timed runs of each file (default: 3)\n"
+		"\t-w -\tnumber of untimed warmup runs of each file (default: 1)\n"
+		"\t-b\talso time drawing a transparency group in each blend mode\n"
+		"\t-k\talso time keeping and dropping shared objects on 1, 4, 16 and 64 threads\n"
+		"\n"
+		"Each run opens the file, then loads, interprets to a display list,\n"
+		"draws and extracts the text of every page, then (for PDF) saves it\n"
+		"to memory. The report is written as JSON.\n"
+		);
+	return 1;
+}
+
+static void *
+bench_malloc(void *arg, size_t size)
+{
+	bench_info *info = arg;
+	bench_header *p;
+	if (size == 0)
+		return NULL;
+	if (size > SIZE_MAX - sizeof(bench_header))
+		return NULL;
+	p = malloc(size + sizeof(bench_header));
+	if (p == NULL)
+		return NULL;
+	p[0].size = size;
+	info->current += size;
+	if (info->current > info->peak)
+		info->peak = info->current;
+	info->allocs++;
+	return &p[1];
+}
+
+static void
+bench_free(void *arg, void *p_)
+{
+	bench_info *info = arg;
+	bench_header *p = p_;
+	if (p == NULL)
+		return;
+	info->current -= p[-1].size;
+	free(&p[-1]);
+}
+
+static void *
+bench_realloc(void *arg, void *p_, size_t size)
+{
+	bench_info *info = arg;
+	bench_header *p = p_;
+	size_t oldsize;
+
+	if (size == 0)
+	{
+		bench_free(arg, p_);
+		return NULL;
+	}
+	if (p == NULL)
+		return bench_malloc(arg, size);
+	if (size > SIZE_MAX - sizeof(bench_header))
+		return NULL;
+	oldsize = p[-1].size;
+	p = realloc(&p[-1], size + sizeof(bench_header));
+	if (p == NULL)
+		return NULL;
+	info->current += size - oldsize;
+	if (info->current > info->peak)
+		info->peak = info->current;
+	p[0].size = size;
+	info->allocs++;
+	return &p[1];
+}
+
+static double wall_time(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static double cpu_time(void)
+{
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void store_counts(int64_t *lookups, int64_t *hits)
+{
+	fz_store_stats stats;
+	int i;
+
+	fz_get_store_stats(ctx, &stats);
+	*lookups = *hits = 0;
+	for (i = 0; i < stats.num_types; i++)
+	{
+		*lookups += stats.types[i].lookups;
+		*hits += stats.types[i].hits;
+	}
+}
+
+static void begin_phase(phase_mark *mark)
+{
+	meminfo.peak = meminfo.current;
+	mark->allocs = meminfo.allocs;
+	store_counts(&mark->lookups, &mark->hits);
+	mark->cpu = cpu_time();
+	mark->wall = wall_time();
+}
+
+static void end_phase(phase_mark *mark, phase_sample *sample)
+{
+	double wall = wall_time();
+	double cpu = cpu_time();
+	int64_t lookups, hits;
+
+	store_counts(&lookups, &hits);
+	sample->used = 1;
+	sample->wall += wall - mark->wall;
+	sample->cpu += cpu - mark->cpu;
+	sample->allocs += meminfo.allocs - mark->allocs;
+	sample->lookups += lookups - mark->lookups;
+	sample->hits += hits - mark->hits;
+	if (meminfo.peak > sample->peak)
+		sample->peak = meminfo.peak;
+}
+
+/* Put a file through every phase once. */
+static int run_file(const char *filename, phase_sample *samples)
+{
+	fz_document *doc = NULL;
+	fz_page *page = NULL;
+	fz_display_list *list = NULL;
+	fz_pixmap *pix = NULL;
+	fz_stext_page *text = NULL;
+	fz_matrix ctm = fz_scale(resolution / 72, resolution / 72);
+	phase_mark mark;
+	int i, n = 0;
+
+	fz_var(doc);
+	fz_var(page);
+	fz_var(list);
+	fz_var(pix);
+	fz_var(text);
+
+	memset(samples, 0, PHASE_COUNT * sizeof *samples);
+
+	/* Every run starts from the same (empty) store. */
+	fz_empty_store(ctx);
+
+	fz_try(ctx)
+	{
+		begin_phase(&mark);
+		doc = fz_open_document(ctx, filename);
+		if (fz_needs_password(ctx, doc))
+			if (!fz_authenticate_password(ctx, doc, password))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate password: %s", filename);
+		n = fz_count_pages(ctx, doc);
+		end_phase(&mark, &samples[PHASE_OPEN]);
+
+		for (i = 0; i < n; i++)
+		{
+			begin_phase(&mark);
+			page = fz_load_page(ctx, doc, i);
+			end_phase(&mark, &samples[PHASE_LOAD]);
+
+			begin_phase(&mark);
+			list = fz_new_display_list_from_page(ctx, page);
+			end_phase(&mark, &samples[PHASE_LIST]);
+
+			begin_phase(&mark);
+			pix = fz_new_pixmap_from_display_list(ctx, list, ctm, fz_device_rgb(ctx), 0);
+			fz_drop_pixmap(ctx, pix);
+			pix = NULL;
+			end_phase(&mark, &samples[PHASE_DRAW]);
+
+			begin_phase(&mark);
+			text = fz_new_stext_page_from_display_list(ctx, list, NULL);
+			fz_drop_stext_page(ctx, text);
+			text = NULL;
+			end_phase(&mark, &samples[PHASE_TEXT]);
+
+			fz_drop_display_list(ctx, list);
+			list = NULL;
+			fz_drop_page(ctx, page);
+			page = NULL;
+		}
+
+#if FZ_ENABLE_PDF
+		{
+			pdf_document *pdf = pdf_specifics(ctx, doc);
+			if (pdf)
+			{
+				pdf_write_options opts = pdf_default_write_options;
+				fz_buffer *buf;
+				fz_output *out;
+
+				fz_var(out);
+
+				begin_phase(&mark);
+				buf = fz_new_buffer(ctx, 8192);
+				out = NULL;
+				fz_try(ctx)
+				{
+					out = fz_new_output_with_buffer(ctx, buf);
+					pdf_write_document(ctx, pdf, out, &opts);
+					fz_close_output(ctx, out);
+				}
+				fz_always(ctx)
+				{
+					fz_drop_output(ctx, out);
+					fz_drop_buffer(ctx, buf);
+				}
+				fz_catch(ctx)
+					fz_rethrow(ctx);
+				end_phase(&mark, &samples[PHASE_SAVE]);
+			}
+		}
+#endif
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stext_page(ctx, text);
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_display_list(ctx, list);
+		fz_drop_page(ctx, page);
+		fz_drop_document(ctx, doc);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return n;
+}
+
+static int cmp_double(const void *a_, const void *b_)
+{
+	double a = *(const double *)a_;
+	double b = *(const double *)b_;
+	return (a > b) - (a < b);
+}
+
+static int cmp_size(const void *a_, const void *b_)
+{
+	size_t a = *(const size_t *)a_;
+	size_t b = *(const size_t *)b_;
+	return (a > b) - (a < b);
+}
+
+static void write_times(fz_output *out, const char *name, double *v, int n)
+{
+	qsort(v, n, sizeof *v, cmp_double);
+	fz_write_printf(ctx, out, "\t\t\t\t\t\"%s\": { \"min\": %.6f, \"median\": %.6f, \"max\": %.6f },\n",
+		name, v[0], v[n / 2], v[n - 1]);
+}
+
+static void write_phase(fz_output *out, int phase, phase_sample *runs, int n, int last)
+{
+	double *v = fz_malloc_array(ctx, n, double);
+	size_t *allocs = fz_malloc_array(ctx, n, size_t);
+	size_t peak = 0;
+	int64_t lookups = 0, hits = 0;
+	int i;
+
+	fz_try(ctx)
+	{
+		fz_write_printf(ctx, out, "\t\t\t\t%q: {\n", phase_name[phase]);
+
+		for (i = 0; i < n; i++)
+			v[i] = runs[i * PHASE_COUNT + phase].wall;
+		write_times(out, "wall", v, n);
+		for (i = 0; i < n; i++)
+			v[i] = runs[i * PHASE_COUNT + phase].cpu;
+		write_times(out, "cpu", v, n);
+
+		for (i = 0; i < n; i++)
+		{
+			phase_sample *s = &runs[i * PHASE_COUNT + phase];
+			allocs[i] = s->allocs;
+			if (s->peak > peak)
+				peak = s->peak;
+			lookups += s->lookups;
+			hits += s->hits;
+		}
+		qsort(allocs, n, sizeof *allocs, cmp_size);
+
+		fz_write_printf(ctx, out, "\t\t\t\t\t\"peak_memory\": %zu,\n", peak);
+		fz_write_printf(ctx, out, "\t\t\t\t\t\"allocations\": %zu,\n", allocs[n / 2]);
+		fz_write_printf(ctx, out, "\t\t\t\t\t\"store_lookups\": %ld,\n", lookups / n);
+		fz_write_printf(ctx, out, "\t\t\t\t\t\"store_hits\": %ld,\n", hits / n);
+		if (lookups > 0)
+			fz_write_printf(ctx, out, "\t\t\t\t\t\"store_hit_rate\": %.4f\n", (double)hits / lookups);
+		else
+			fz_write_printf(ctx, out, "\t\t\t\t\t\"store_hit_rate\": null\n");
+
+		fz_write_printf(ctx, out, "\t\t\t\t}%s\n", last ? "" : ",");
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, v);
+		fz_free(ctx, allocs);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void bench_file(fz_output *out, const char *filename, int last)
+{
+	phase_sample *runs = fz_malloc_array(ctx, repeat * PHASE_COUNT, phase_sample);
+	phase_sample scratch[PHASE_COUNT];
+	int i, n = 0, nphases, phase;
+
+	fz_write_printf(ctx, out, "\t\t{\n\t\t\t\"file\": %q,\n", filename);
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < warmup; i++)
+			run_file(filename, scratch);
+		for (i = 0; i < repeat; i++)
+			n = run_file(filename, &runs[i * PHASE_COUNT]);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, runs);
+		fz_write_printf(ctx, out, "\t\t\t\"error\": %q\n\t\t}%s\n", fz_caught_message(ctx), last ? "" : ",");
+		return;
+	}
+
+	fz_try(ctx)
+	{
+		fz_write_printf(ctx, out, "\t\t\t\"pages\": %d,\n", n);
+		fz_write_printf(ctx, out, "\t\t\t\"phases\": {\n");
+		nphases = 0;
+		for (phase = 0; phase < PHASE_COUNT; phase++)
+			if (runs[phase].used)
+				nphases++;
+		for (phase = 0; phase < PHASE_COUNT; phase++)
+			if (runs[phase].used)
+				write_phase(out, phase, runs, repeat, --nphases == 0);
+		fz_write_printf(ctx, out, "\t\t\t}\n\t\t}%s\n", last ? "" : ",");
+	}
+	fz_always(ctx)
+		fz_free(ctx, runs);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* The size of the pixmap, and the shapes drawn, in the blend benchmark. */
+#define BLEND_SIZE 512
+
+static const char *blend_group_name[3] = { "isolated", "non-isolated", "knockout" };
+
+static void fill_rect(fz_device *dev, fz_colorspace *cs, int x0, int y0, int x1, int y1, float c0, float c1, float alpha)
+{
+	float color[FZ_MAX_COLORS] = { c0, c1, 1 - c0, c0 * c1 };
+	fz_path *path = fz_new_path(ctx);
+	fz_try(ctx)
+	{
+		fz_rectto(ctx, path, x0, y0, x1, y1);
+		fz_fill_path(ctx, dev, path, 0, fz_identity, cs, color, alpha, fz_default_color_params);
+	}
+	fz_always(ctx)
+		fz_drop_path(ctx, path);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Draw a group of overlapping shapes over a partly transparent
+ * backdrop, and return how long the group took. */
+static double run_blend(fz_colorspace *cs, int group, int blendmode)
+{
+	fz_irect box = { 0, 0, BLEND_SIZE, BLEND_SIZE };
+	fz_rect area = { 0, 0, BLEND_SIZE, BLEND_SIZE };
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, cs, box, NULL, 1);
+	fz_device *dev = NULL;
+	const int q = BLEND_SIZE / 4;
+	double start = 0, end = 0;
+
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		fz_clear_pixmap(ctx, pix);
+		dev = fz_new_draw_device(ctx, fz_identity, pix);
+
+		fill_rect(dev, cs, 0, 0, 3 * q, 3 * q, 0.2f, 0.9f, 1);
+		fill_rect(dev, cs, q, q, 4 * q, 4 * q, 0.8f, 0.3f, 0.6f);
+
+		start = wall_time();
+		fz_begin_group(ctx, dev, area, NULL, group == 0, group == 2, blendmode, 0.9f);
+		fill_rect(dev, cs, q / 2, q / 2, 3 * q, 2 * q, 0.6f, 0.1f, 0.7f);
+		fill_rect(dev, cs, 2 * q, q, 4 * q, 4 * q, 0.1f, 0.5f, 1);
+		fill_rect(dev, cs, 0, 2 * q, 3 * q, 4 * q, 0.9f, 0.7f, 0.5f);
+		fz_end_group(ctx, dev);
+		end = wall_time();
+
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return end - start;
+}
+
+static void bench_blend(fz_output *out)
+{
+	fz_colorspace *cs[2] = { fz_device_rgb(ctx), fz_device_cmyk(ctx) };
+	double *v = fz_malloc_array(ctx, repeat, double);
+	int c, group, mode, i;
+
+	fz_try(ctx)
+	{
+		fz_write_printf(ctx, out, "\t\"blend\": [\n");
+		for (c = 0; c < 2; c++)
+		{
+			for (group = 0; group < 3; group++)
+			{
+				for (mode = 0; mode < 16; mode++)
+				{
+					/* Knockout groups have no blend mode of their own. */
+					if (group == 2 && mode > 0)
+						break;
+					for (i = 0; i < warmup; i++)
+						run_blend(cs[c], group, mode);
+					for (i = 0; i < repeat; i++)
+						v[i] = run_blend(cs[c], group, mode);
+					qsort(v, repeat, sizeof *v, cmp_double);
+					fz_write_printf(ctx, out, "\t\t{ \"colorspace\": %q, \"group\": %q, \"mode\": %q, \"wall\": { \"min\": %.6f, \"median\": %.6f, \"max\": %.6f } }%s\n",
+						fz_colorspace_name(ctx, cs[c]), blend_group_name[group], fz_blendmode_name(mode),
+						v[0], v[repeat / 2], v[repeat - 1],
+						(c == 1 && group == 2) ? "" : ",");
+				}
+			}
+		}
+		fz_write_printf(ctx, out, "\t],\n");
+	}
+	fz_always(ctx)
+		fz_free(ctx, v);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+#ifndef DISABLE_MUTHREADS
+
+/* The total number of keep/drop pairs made in one run of the reference
+ * counting benchmark. This is shared between the threads, so that every
+ * run does the same amount of work whatever the number of threads. */
+#define REFS_OPS (1 << 22)
+
+static const int refs_threads[] = { 1, 4, 16, 64 };
+
+typedef struct
+{
+	fz_context *ctx;
+	fz_buffer *buf;
+	fz_path *path;
+	int ops;
+	int quit;
+	mu_thread thread;
+	mu_semaphore start;
+	mu_semaphore stop;
+} refs_worker;
+
+/* Keep and drop objects that every other worker is also keeping and
+ * dropping, once each time the start semaphore is triggered. Buffers
+ * are counted with fz_keep_imp, paths with fz_keep_imp8. */
+static void refs_worker_main(void *arg)
+{
+	refs_worker *me = arg;
+	int i;
+
+	for (;;)
+	{
+		mu_wait_semaphore(&me->start);
+		if (me->quit)
+			break;
+		for (i = 0; i < me->ops; i++)
+		{
+			fz_drop_buffer(me->ctx, fz_keep_buffer(me->ctx, me->buf));
+			fz_drop_path(me->ctx, fz_keep_path(me->ctx, me->path));
+		}
+		mu_trigger_semaphore(&me->stop);
+	}
+}
+
+/* Run every worker once, and return how long it took. */
+static double run_refs(refs_worker *workers, int n)
+{
+	double start;
+	int i;
+
+	start = wall_time();
+	for (i = 0; i < n; i++)
+		mu_trigger_semaphore(&workers[i].start);
+	for (i = 0; i < n; i++)
+		mu_wait_semaphore(&workers[i].stop);
+	return wall_time() - start;
+}
+
+static void bench_refs_threads(fz_context *rctx, fz_output *out, int n, double *v, int last)
+{
+	refs_worker *workers;
+	fz_buffer *buf = NULL;
+	fz_path *path = NULL;
+	int i, started = 0;
+	int ops = (REFS_OPS / n) * n;
+
+	fz_var(buf);
+	fz_var(path);
+	fz_var(started);
+
+	workers = fz_calloc(ctx, n, sizeof *workers);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(rctx, 16);
+		path = fz_new_path(rctx);
+		fz_moveto(rctx, path, 0, 0);
+
+		for (i = 0; i < n; i++)
+		{
+			workers[i].ctx = fz_clone_context(rctx);
+			if (!workers[i].ctx)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot clone context");
+			workers[i].buf = buf;
+			workers[i].path = path;
+			workers[i].ops = REFS_OPS / n;
+			if (mu_create_semaphore(&workers[i].start) || mu_create_semaphore(&workers[i].stop))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot create semaphore");
+			if (mu_create_thread(&workers[i].thread, refs_worker_main, &workers[i]))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot create thread");
+			started++;
+		}
+
+		for (i = 0; i < warmup; i++)
+			run_refs(workers, n);
+		for (i = 0; i < repeat; i++)
+			v[i] = run_refs(workers, n);
+
+		qsort(v, repeat, sizeof *v, cmp_double);
+		fz_write_printf(ctx, out, "\t\t\t{ \"threads\": %d, \"operations\": %d, \"wall\": { \"min\": %.6f, \"median\": %.6f, \"max\": %.6f }, \"operations_per_second\": %.0f }%s\n",
+			n, ops, v[0], v[repeat / 2], v[repeat - 1],
+			ops / v[repeat / 2],
+			last ? "" : ",");
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < started; i++)
+		{
+			workers[i].quit = 1;
+			mu_trigger_semaphore(&workers[i].start);
+			mu_destroy_thread(&workers[i].thread);
+		}
+		for (i = 0; i < n; i++)
+		{
+			mu_destroy_semaphore(&workers[i].start);
+			mu_destroy_semaphore(&workers[i].stop);
+			fz_drop_context(workers[i].ctx);
+		}
+		fz_free(ctx, workers);
+		fz_drop_path(rctx, path);
+		fz_drop_buffer(rctx, buf);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void bench_refs(fz_output *out)
+{
+	fz_locks_context *locks;
+	fz_context *rctx;
+	double *v;
+	int i;
+
+	locks = mu_new_locks();
+	if (!locks)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot initialise mutexes");
+
+	/* The threads share their objects through a context of their own,
+	 * with real locks, and the standard (thread safe) allocator. */
+	rctx = fz_new_context(NULL, locks, FZ_STORE_DEFAULT);
+	if (!rctx)
+	{
+		mu_drop_locks(locks);
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot initialise context");
+	}
+
+	v = NULL;
+	fz_var(v);
+
+	fz_try(ctx)
+	{
+		v = fz_malloc_array(ctx, repeat, double);
+		fz_write_printf(ctx, out, "\t\"refs\": {\n");
+		fz_write_printf(ctx, out, "\t\t\"atomic\": %s,\n", FZ_ENABLE_ATOMIC_REFS ? "true" : "false");
+		fz_write_printf(ctx, out, "\t\t\"runs\": [\n");
+		for (i = 0; i < (int)nelem(refs_threads); i++)
+			bench_refs_threads(rctx, out, refs_threads[i], v, i == (int)nelem(refs_threads) - 1);
+		fz_write_printf(ctx, out, "\t\t]\n\t},\n");
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, v);
+		fz_drop_context(rctx);
+		mu_drop_locks(locks);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+#endif /* DISABLE_MUTHREADS */
+
+int mubench_main(int argc, char **argv)
+{
+	fz_alloc_context alloc_ctx = { &meminfo, bench_malloc, bench_realloc, bench_free };
+	const char *output = NULL;
+	fz_output *out = NULL;
+	int retval = EXIT_SUCCESS;
+	int i, c;
+
+	while ((c = fz_getopt(argc, argv, "p:o:r:n:w:bk")) != -1)
+	{
+		switch (c)
+		{
+		default: return usage();
+		case 'p': password = fz_optarg; break;
+		case 'o': output = fz_optarg; break;
+		case 'r': resolution = fz_atof(fz_optarg); break;
+		case 'n': repeat = atoi(fz_optarg); break;
+		case 'w': warmup = atoi(fz_optarg); break;
+		case 'b': blend = 1; break;
+		case 'k':
+#ifndef DISABLE_MUTHREADS
+			refs = 1; break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
+#endif
+		}
+	}
+
+	if ((fz_optind == argc && !blend && !refs) || repeat < 1 || warmup < 0 || resolution <= 0)
+		return usage();
+
+	ctx = fz_new_context(&alloc_ctx, NULL, FZ_STORE_DEFAULT);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot initialise context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		fz_register_document_handlers(ctx);
+
+		if (output)
+			out = fz_new_output_with_path(ctx, output, 0);
+		else
+			out = fz_stdout(ctx);
+
+		fz_write_printf(ctx, out, "{\n");
+		fz_write_printf(ctx, out, "\t\"version\": %q,\n", FZ_VERSION);
+		fz_write_printf(ctx, out, "\t\"resolution\": %g,\n", resolution);
+		fz_write_printf(ctx, out, "\t\"repeat\": %d,\n", repeat);
+		fz_write_printf(ctx, out, "\t\"warmup\": %d,\n", warmup);
+		if (blend)
+			bench_blend(out);
+#ifndef DISABLE_MUTHREADS
+		if (refs)
+			bench_refs(out);
+#endif
+		fz_write_printf(ctx, out, "\t\"files\": [\n");
+		for (i = fz_optind; i < argc; i++)
+			bench_file(out, argv[i], i == argc - 1);
+		fz_write_printf(ctx, out, "\t]\n}\n");
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		retval = EXIT_FAILURE;
+	}
+
+	fz_drop_context(ctx);
+	return retval;
+}
@@ -4,6 +4,11 @@
 
 #include "mupdf/fitz.h"
 
+#ifndef DISABLE_MUTHREADS
+#include "mupdf/helpers/mu-threads.h"
+#endif
+
+#include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -26,6 +31,55 @@ static fz_document *doc;
 static fz_document_writer *out;
 static int count;
 
+#ifndef DISABLE_MUTHREADS
+
+/*
+	Formats that produce a single file are written through a write-behind
+	output, so that rendering and disk I/O overlap. Those that produce a
+	file per page are left to open their own.
+*/
+static fz_document_writer *new_document_writer(void)
+{
+	fz_document_writer *wri;
+	fz_output *file;
+	const char *fmt;
+	int with_output;
+
+	if (!output)
+		return fz_new_document_writer(ctx, output, format, options);
+	fmt = fz_resolve_document_writer_format(ctx, output, format, &with_output);
+	if (!with_output)
+		return fz_new_document_writer(ctx, output, fmt, options);
+
+	file = mu_new_async_output(ctx, fz_new_output_with_path(ctx, output, 0), 0, 0);
+	fz_try(ctx)
+		wri = fz_new_document_writer_with_output(ctx, file, fmt, options);
+	fz_catch(ctx)
+	{
+		fz_drop_output(ctx, file);
+		fz_rethrow(ctx);
+	}
+	return wri;
+}
+
+static void fin_locks(fz_locks_context *locks)
+{
+	mu_drop_locks(locks);
+}
+
+#else
+
+static fz_document_writer *new_document_writer(void)
+{
+	return fz_new_document_writer(ctx, output, format, options);
+}
+
+static void fin_locks(fz_locks_context *locks)
+{
+}
+
+#endif
+
 static int usage(void)
 {
 	fprintf(stderr,
@@ -105,6 +159,7 @@ static void runrange(const char *range)
 
 int muconvert_main(int argc, char **argv)
 {
+	fz_locks_context *locks = NULL;
 	int i, c;
 	int retval = EXIT_SUCCESS;
 
@@ -131,11 +186,16 @@ int muconvert_main(int argc, char **argv)
 	if (fz_optind == argc || (!format && !output))
 		return usage();
 
+#ifndef DISABLE_MUTHREADS
+	locks = mu_new_locks();
+#endif
+
 	/* Create a context to hold the exception stack and various caches. */
-	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	ctx = fz_new_context(NULL, locks, FZ_STORE_UNLIMITED);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot create mupdf context\n");
+		fin_locks(locks);
 		return EXIT_FAILURE;
 	}
 
@@ -146,6 +206,7 @@ int muconvert_main(int argc, char **argv)
 	{
 		fprintf(stderr, "cannot register document handlers: %s\n", fz_caught_message(ctx));
 		fz_drop_context(ctx);
+		fin_locks(locks);
 		return EXIT_FAILURE;
 	}
 
@@ -162,11 +223,12 @@ int muconvert_main(int argc, char **argv)
 
 	/* Open the output document. */
 	fz_try(ctx)
-		out = fz_new_document_writer(ctx, output, format, options);
+		out = new_document_writer();
 	fz_catch(ctx)
 	{
 		fprintf(stderr, "cannot create document: %s\n", fz_caught_message(ctx));
 		fz_drop_context(ctx);
+		fin_locks(locks);
 		return EXIT_FAILURE;
 	}
 
@@ -195,9 +257,17 @@ int muconvert_main(int argc, char **argv)
 	fz_catch(ctx)
 		retval = EXIT_FAILURE;
 
-	fz_close_document_writer(ctx, out);
+	/* Closing the writer is what flushes the last of the output. */
+	fz_try(ctx)
+		fz_close_document_writer(ctx, out);
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "cannot close document: %s\n", fz_caught_message(ctx));
+		retval = EXIT_FAILURE;
+	}
 
 	fz_drop_document_writer(ctx, out);
 	fz_drop_context(ctx);
+	fin_locks(locks);
 	return retval;
 }
@@ -265,6 +265,17 @@ static fz_locks_context *init_mudraw_locks(void)
 
 #endif
 
+static fz_output *open_output(fz_context *ctx, const char *filename)
+{
+	fz_output *out = fz_new_output_with_path(ctx, filename, 0);
+#ifndef DISABLE_MUTHREADS
+	/* Let a background thread do the writing, so that we can get on
+	 * with rendering (and compressing) the next band or page. */
+	out = mu_new_async_output(ctx, out, 0, 0);
+#endif
+	return out;
+}
+
 typedef struct worker_t {
 	fz_context *ctx;
 	int num;
@@ -309,6 +320,7 @@ static float min_line_width = 0.0f;
 static int showfeatures = 0;
 static int showtime = 0;
 static int showmemory = 0;
+static int showstore = 0;
 static int showmd5 = 0;
 
 #if FZ_ENABLE_PDF
@@ -344,6 +356,9 @@ static int useaccel = 1;
 static char *filename;
 static int files = 0;
 static int num_workers = 0;
+#ifndef DISABLE_MUTHREADS
+static int num_scale_threads = 0;
+#endif
 static worker_t *workers;
 static fz_band_writer *bander = NULL;
 
@@ -408,6 +423,7 @@ static int usage(void)
 		"\t\tt - show timings\n"
 		"\t\tf - show page features\n"
 		"\t\t5 - show md5 checksum of rendered image\n"
+		"\t\ts - show store statistics at exit\n"
 		"\n"
 		"\t-R -\trotate clockwise (default: 0 degrees)\n"
 		"\t-r -\tresolution in dpi (default: 72)\n"
@@ -417,8 +433,10 @@ static int usage(void)
 		"\t-B -\tmaximum band_height (pXm, pcl, pclm, ocr.pdf, ps, psd and png output only)\n"
 #ifndef DISABLE_MUTHREADS
 		"\t-T -\tnumber of threads to use for rendering (banded mode only)\n"
+		"\t-Z -\tnumber of threads to use for scaling large images\n"
 #else
 		"\t-T -\tnumber of threads to use for rendering (disabled in this non-threading build)\n"
+		"\t-Z -\tnumber of threads to use for scaling large images (disabled in this non-threading build)\n"
 #endif
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
@@ -862,7 +880,7 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 			else
 			{
 				fz_format_output_path(ctx, buf, sizeof buf, output, pagenum);
-				outs = fz_new_output_with_path(ctx, buf, 0);
+				outs = open_output(ctx, buf);
 			}
 
 			dev = fz_new_svg_device(ctx, outs, tbounds.x1-tbounds.x0, tbounds.y1-tbounds.y0, FZ_SVG_TEXT_AS_PATH, 1);
@@ -1279,6 +1297,8 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 				fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
 			fz_run_page(ctx, page, dev, fz_identity, &cookie);
 			fz_close_device(ctx, dev);
+			if (band_height)
+				fz_index_display_list(ctx, list);
 		}
 		fz_always(ctx)
 		{
@@ -1340,7 +1360,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 			fz_drop_output(ctx, out);
 		}
 		fz_format_output_path(ctx, text_buffer, sizeof text_buffer, output, pagenum);
-		out = fz_new_output_with_path(ctx, text_buffer, 0);
+		out = open_output(ctx, text_buffer);
 	}
 
 	if (bgprint.active)
@@ -1816,7 +1836,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "qp:o:F:R:r:w:h:fB:c:e:G:Is:A:DiW:H:S:T:t:U:XLvPl:y:NO:am:")) != -1)
+	while ((c = fz_getopt(argc, argv, "qp:o:F:R:r:w:h:fB:c:e:G:Is:A:DiW:H:S:T:Z:t:U:XLvPl:y:NO:am:")) != -1)
 	{
 		switch (c)
 		{
@@ -1859,6 +1879,7 @@ int mudraw_main(int argc, char **argv)
 			if (strchr(fz_optarg, 'm')) ++showmemory;
 			if (strchr(fz_optarg, 'f')) ++showfeatures;
 			if (strchr(fz_optarg, '5')) ++showmd5;
+			if (strchr(fz_optarg, 's')) ++showstore;
 			break;
 
 		case 'A':
@@ -1883,6 +1904,13 @@ int mudraw_main(int argc, char **argv)
 #else
 			fprintf(stderr, "Threads not enabled in this build\n");
 			break;
+#endif
+		case 'Z':
+#ifndef DISABLE_MUTHREADS
+			num_scale_threads = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
 #endif
 		case 't':
 #ifndef OCR_DISABLED
@@ -1977,6 +2005,9 @@ int mudraw_main(int argc, char **argv)
 			fz_enable_icc(ctx);
 
 #ifndef DISABLE_MUTHREADS
+		if (num_scale_threads > 1)
+			fz_tune_image_scale_threads(ctx, mu_run_parallel, NULL, num_scale_threads);
+
 		if (bgprint.active)
 		{
 			int fail = 0;
@@ -2227,7 +2258,7 @@ int mudraw_main(int argc, char **argv)
 				if (has_percent_d(output))
 					output_file_per_page = 1;
 				else
-					out = fz_new_output_with_path(ctx, output, 0);
+					out = open_output(ctx, output);
 			}
 			else
 			{
@@ -2493,6 +2524,9 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	if (showstore)
+		fz_print_store_stats(ctx, fz_stderr(ctx));
+
 	fz_drop_context(ctx);
 
 #ifndef DISABLE_MUTHREADS
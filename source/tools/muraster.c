@@ -1063,6 +1063,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 			fz_run_page(ctx, page, list_dev, fz_identity, &cookie);
 #endif
 			fz_close_device(ctx, list_dev);
+			fz_index_display_list(ctx, list);
 		}
 		fz_always(ctx)
 		{
@@ -11,6 +11,7 @@
 #define main main_utf8
 #endif
 
+int mubench_main(int argc, char *argv[]);
 int muconvert_main(int argc, char *argv[]);
 int mudraw_main(int argc, char *argv[]);
 int mutrace_main(int argc, char *argv[]);
@@ -33,6 +34,7 @@ static struct {
 	char *name;
 	char *desc;
 } tools[] = {
+	{ mubench_main, "bench", "measure the cost of processing documents" },
 #if FZ_ENABLE_PDF
 	{ pdfclean_main, "clean", "rewrite pdf file" },
 #endif